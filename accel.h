@@ -0,0 +1,579 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+
+#include "bvh.h"
+#include "ray.h"
+#include "threads.h"
+#include "v3.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+// NOTE(mevex): Acceleration structures that can be picked at run time. They only see the bounds of the
+// primitives, like the BVH builders, and call back with the index of every primitive a ray may hit.
+// Unlike the BVH inside Mesh they don't reorder the primitives, a primitive can be in several cells.
+//
+// Uniform grids are best for many small primitives spread evenly, k-d trees for scenes with big empty
+// regions and long thin primitives (architecture), BVHs in most other cases. SelectAccelerator measures
+// them on a few rays of the actual scene instead of guessing.
+
+enum AccelKind
+{
+    Accel_BVH,
+    Accel_Grid,
+    Accel_KDTree,
+    Accel_Count,
+    // NOTE(mevex): Probe every kind and keep the fastest
+    Accel_Auto = Accel_Count,
+};
+
+inline const char *AccelKindName(AccelKind kind)
+{
+    const char *names[] = {"BVH", "Grid", "k-d tree", "Auto"};
+    return names[kind];
+}
+
+// NOTE(mevex): Callback through a plain function pointer, the backends are virtual so they can't take templates.
+// Same contract as the BVH: test the primitive and, on a hit, lower tMax to its distance and return true.
+struct PrimitiveIntersector
+{
+    bool (*func)(void *context, u32 primitive, f32 tMin, f32& tMax);
+    void *context;
+
+    inline bool operator()(u32 primitive, f32 tMin, f32& tMax)
+    {
+        return func(context, primitive, tMin, tMax);
+    }
+};
+
+template<typename F>
+inline PrimitiveIntersector MakeIntersector(F& f)
+{
+    PrimitiveIntersector result = {[](void *context, u32 primitive, f32 tMin, f32& tMax) { return (*(F *)context)(primitive, tMin, tMax); }, &f};
+    return result;
+}
+
+// NOTE(mevex): 1/d with the zero components replaced by a tiny value, 0*inf would give NaN in the slab tests
+inline v3 SafeInverse(v3 d)
+{
+    v3 result(1.0f / (Abs(d.x) < 1e-20f ? copysignf(1e-20f, d.x) : d.x),
+              1.0f / (Abs(d.y) < 1e-20f ? copysignf(1e-20f, d.y) : d.y),
+              1.0f / (Abs(d.z) < 1e-20f ? copysignf(1e-20f, d.z) : d.z));
+    return result;
+}
+
+// NOTE(mevex): Clips the ray to the box, false if it misses it
+inline bool ClipRay(const AABB& b, Ray& r, v3& invDir, f32& tEnter, f32& tExit)
+{
+    for(i32 axis = 0; axis < 3; axis++)
+    {
+        f32 t0 = (b.min.e[axis] - r.origin.e[axis]) * invDir.e[axis];
+        f32 t1 = (b.max.e[axis] - r.origin.e[axis]) * invDir.e[axis];
+        if(t0 > t1)
+            std::swap(t0, t1);
+        tEnter = Max(tEnter, t0);
+        tExit = Min(tExit, t1 * 1.0000004f);
+    }
+    return tEnter <= tExit;
+}
+
+class Accelerator
+{
+    public:
+
+    virtual ~Accelerator() {}
+    virtual AccelKind Kind() = 0;
+    virtual void Build(const vector<AABB>& primitiveBounds, WorkerPool *pool) = 0;
+    virtual bool Intersect(Ray& r, f32 tMin, f32& tMax, PrimitiveIntersector intersect) = 0;
+    virtual size_t MemorySize() = 0;
+};
+
+class BVHAccelerator : public Accelerator
+{
+    public:
+
+    BVH bvh;
+    // NOTE(mevex): The BVH wants the primitives in leaf order, this maps them back
+    vector<u32> order;
+
+    AccelKind Kind() override { return Accel_BVH; }
+
+    void Build(const vector<AABB>& primitiveBounds, WorkerPool *pool) override
+    {
+        bvh.Build(primitiveBounds, order, pool);
+    }
+
+    bool Intersect(Ray& r, f32 tMin, f32& tMax, PrimitiveIntersector intersect) override
+    {
+        bool result = bvh.Intersect(r, tMin, tMax, [&](u32 i, f32 t0, f32& t1) { return intersect(order[i], t0, t1); });
+        return result;
+    }
+
+    size_t MemorySize() override
+    {
+        size_t result = bvh.MemorySize() + order.capacity() * sizeof(u32);
+        return result;
+    }
+};
+
+// NOTE(mevex): Uniform grid walked with a 3D DDA (Amanatides & Woo). The resolution gives about
+// CellsPerPrimitive cells per primitive, with cells as close to cubes as the bounds allow.
+class GridAccelerator : public Accelerator
+{
+    public:
+
+    enum
+    {
+        CellsPerPrimitive = 2,
+        MaxResolution = 512,
+        MaxCells = 16 * 1024 * 1024,
+    };
+
+    AABB bounds;
+    i32 resolution[3];
+    v3 cellSize;
+    v3 invCellSize;
+    // NOTE(mevex): Primitives of cell c are cellPrimitives[cellStart[c] .. cellStart[c+1]]
+    vector<u32> cellStart;
+    vector<u32> cellPrimitives;
+
+    AccelKind Kind() override { return Accel_Grid; }
+
+    void Build(const vector<AABB>& primitiveBounds, WorkerPool *pool) override
+    {
+        u32 count = (u32)primitiveBounds.size();
+        bounds = AABB();
+        for(const AABB& b : primitiveBounds)
+            bounds.Grow(b);
+        cellStart.clear();
+        cellPrimitives.clear();
+        if(count == 0)
+            return;
+
+        // NOTE(mevex): Flat scenes still get a few cells along their thin axis
+        v3 extent = bounds.max - bounds.min;
+        f32 maxExtent = Max(Max(extent.x, extent.y), Max(extent.z, 1e-6f));
+        for(i32 axis = 0; axis < 3; axis++)
+            extent.e[axis] = Max(extent.e[axis], maxExtent * 1e-3f);
+        f32 cellsPerUnit = cbrtf((f32)CellsPerPrimitive * count / (extent.x * extent.y * extent.z));
+        u64 cellCount = 1;
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            resolution[axis] = Clamp((i32)(extent.e[axis] * cellsPerUnit), 1, (i32)MaxResolution);
+            cellCount *= resolution[axis];
+        }
+        while(cellCount > MaxCells)
+        {
+            cellCount = 1;
+            for(i32 axis = 0; axis < 3; axis++)
+            {
+                resolution[axis] = Max(resolution[axis] / 2, 1);
+                cellCount *= resolution[axis];
+            }
+        }
+
+        cellSize = v3(extent.x / resolution[0], extent.y / resolution[1], extent.z / resolution[2]);
+        invCellSize = v3(1.0f / cellSize.x, 1.0f / cellSize.y, 1.0f / cellSize.z);
+
+        // NOTE(mevex): Count, prefix sum, fill
+        cellStart.assign(cellCount + 1, 0);
+        for(u32 pass = 0; pass < 2; pass++)
+        {
+            if(pass == 1)
+            {
+                u32 sum = 0;
+                for(u64 c = 0; c <= cellCount; c++)
+                {
+                    u32 n = cellStart[c];
+                    cellStart[c] = sum;
+                    sum += n;
+                }
+                cellPrimitives.resize(sum);
+            }
+
+            for(u32 p = 0; p < count; p++)
+            {
+                i32 lo[3], hi[3];
+                CellRange(primitiveBounds[p], lo, hi);
+                for(i32 z = lo[2]; z <= hi[2]; z++)
+                    for(i32 y = lo[1]; y <= hi[1]; y++)
+                        for(i32 x = lo[0]; x <= hi[0]; x++)
+                        {
+                            u32 cell = CellIndex(x, y, z);
+                            if(pass == 0)
+                                cellStart[cell]++;
+                            else
+                                cellPrimitives[cellStart[cell]++] = p;
+                        }
+            }
+        }
+
+        // NOTE(mevex): The fill moved every start to the next cell, shift them back
+        for(u64 c = cellCount; c > 0; c--)
+            cellStart[c] = cellStart[c - 1];
+        cellStart[0] = 0;
+    }
+
+    bool Intersect(Ray& r, f32 tMin, f32& tMax, PrimitiveIntersector intersect) override
+    {
+        if(cellStart.empty())
+            return false;
+
+        v3 invDir = SafeInverse(r.direction);
+        f32 tEnter = tMin, tExit = tMax;
+        if(!ClipRay(bounds, r, invDir, tEnter, tExit))
+            return false;
+
+        i32 cell[3], step[3], end[3];
+        f32 tNext[3], tDelta[3];
+        p3 p = r.At(tEnter);
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            cell[axis] = Clamp((i32)((p.e[axis] - bounds.min.e[axis]) * invCellSize.e[axis]), 0, resolution[axis] - 1);
+            bool positive = r.direction.e[axis] >= 0;
+            step[axis] = positive ? 1 : -1;
+            end[axis] = positive ? resolution[axis] : -1;
+            f32 boundary = bounds.min.e[axis] + (cell[axis] + (positive ? 1 : 0)) * cellSize.e[axis];
+            tNext[axis] = (boundary - r.origin.e[axis]) * invDir.e[axis];
+            tDelta[axis] = cellSize.e[axis] * Abs(invDir.e[axis]);
+        }
+
+        bool result = false;
+        for(;;)
+        {
+            u32 c = CellIndex(cell[0], cell[1], cell[2]);
+            for(u32 i = cellStart[c]; i < cellStart[c + 1]; i++)
+            {
+                if(intersect(cellPrimitives[i], tMin, tMax))
+                    result = true;
+            }
+
+            i32 axis = (tNext[0] < tNext[1]) ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            // NOTE(mevex): A hit before the end of the cell can't be beaten by the cells after it
+            if(tNext[axis] > tMax)
+                break;
+            cell[axis] += step[axis];
+            if(cell[axis] == end[axis])
+                break;
+            tNext[axis] += tDelta[axis];
+        }
+
+        return result;
+    }
+
+    size_t MemorySize() override
+    {
+        size_t result = (cellStart.capacity() + cellPrimitives.capacity()) * sizeof(u32);
+        return result;
+    }
+
+    private:
+
+    inline u32 CellIndex(i32 x, i32 y, i32 z)
+    {
+        u32 result = ((u32)z * resolution[1] + (u32)y) * resolution[0] + (u32)x;
+        return result;
+    }
+
+    inline void CellRange(const AABB& b, i32 lo[3], i32 hi[3])
+    {
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            lo[axis] = Clamp((i32)((b.min.e[axis] - bounds.min.e[axis]) * invCellSize.e[axis]), 0, resolution[axis] - 1);
+            hi[axis] = Clamp((i32)((b.max.e[axis] - bounds.min.e[axis]) * invCellSize.e[axis]), 0, resolution[axis] - 1);
+        }
+    }
+};
+
+// NOTE(mevex): SAH k-d tree. Split planes are picked among BinCount candidates per axis, counting the
+// primitives on both sides from the bins their bounds start and end in. Primitives that straddle the
+// plane go to both children.
+class KDTreeAccelerator : public Accelerator
+{
+    public:
+
+    enum
+    {
+        BinCount = 32,
+        LeafSize = 4,
+        StackSize = 64,
+    };
+
+    struct KDNode
+    {
+        f32 split;
+        // NOTE(mevex): 0-2 for internal nodes, 3 for leaves
+        u32 axis;
+        // NOTE(mevex): Internal nodes: index of the left child, the right one follows it.
+        // Leaves: index of the first primitive in leafPrimitives.
+        u32 child;
+        u32 count;
+    };
+
+    AABB bounds;
+    vector<KDNode> nodes;
+    vector<u32> leafPrimitives;
+
+    AccelKind Kind() override { return Accel_KDTree; }
+
+    void Build(const vector<AABB>& primitiveBounds, WorkerPool *pool) override
+    {
+        u32 count = (u32)primitiveBounds.size();
+        nodes.clear();
+        leafPrimitives.clear();
+        bounds = AABB();
+        for(const AABB& b : primitiveBounds)
+            bounds.Grow(b);
+        if(count == 0)
+            return;
+
+        vector<u32> primitives(count);
+        for(u32 i = 0; i < count; i++)
+            primitives[i] = i;
+        i32 maxDepth = Min(8 + (i32)(1.3f * log2f((f32)count)), StackSize - 2);
+
+        nodes.resize(1);
+        Subdivide(primitiveBounds, 0, bounds, primitives, maxDepth);
+    }
+
+    bool Intersect(Ray& r, f32 tMin, f32& tMax, PrimitiveIntersector intersect) override
+    {
+        if(nodes.empty())
+            return false;
+
+        v3 invDir = SafeInverse(r.direction);
+        f32 tEnter = tMin, tExit = tMax;
+        if(!ClipRay(bounds, r, invDir, tEnter, tExit))
+            return false;
+
+        struct StackEntry
+        {
+            u32 node;
+            f32 tEnter;
+            f32 tExit;
+        };
+        StackEntry stack[StackSize];
+        i32 top = 0;
+        stack[top++] = {0, tEnter, tExit};
+
+        bool result = false;
+        while(top > 0)
+        {
+            StackEntry entry = stack[--top];
+            // NOTE(mevex): The stack goes near to far, once an entry starts after the closest hit they all do
+            if(entry.tEnter > tMax)
+                break;
+
+            KDNode *node = &nodes[entry.node];
+            f32 t0 = entry.tEnter, t1 = entry.tExit;
+            while(node->axis != 3)
+            {
+                u32 axis = node->axis;
+                f32 tSplit = (node->split - r.origin.e[axis]) * invDir.e[axis];
+                bool leftFirst = (r.origin.e[axis] < node->split) || (r.origin.e[axis] == node->split && r.direction.e[axis] <= 0);
+                u32 nearChild = leftFirst ? node->child : node->child + 1;
+                u32 farChild = leftFirst ? node->child + 1 : node->child;
+
+                if(tSplit > t1 || tSplit <= 0)
+                    node = &nodes[nearChild];
+                else if(tSplit < t0)
+                    node = &nodes[farChild];
+                else
+                {
+                    stack[top++] = {farChild, tSplit, t1};
+                    node = &nodes[nearChild];
+                    t1 = tSplit;
+                }
+            }
+
+            for(u32 i = node->child; i < node->child + node->count; i++)
+            {
+                if(intersect(leafPrimitives[i], tMin, tMax))
+                    result = true;
+            }
+        }
+
+        return result;
+    }
+
+    size_t MemorySize() override
+    {
+        size_t result = nodes.capacity() * sizeof(KDNode) + leafPrimitives.capacity() * sizeof(u32);
+        return result;
+    }
+
+    private:
+
+    void MakeLeaf(u32 nodeIndex, vector<u32>& primitives)
+    {
+        KDNode& node = nodes[nodeIndex];
+        node.axis = 3;
+        node.child = (u32)leafPrimitives.size();
+        node.count = (u32)primitives.size();
+        leafPrimitives.insert(leafPrimitives.end(), primitives.begin(), primitives.end());
+    }
+
+    void Subdivide(const vector<AABB>& primitiveBounds, u32 nodeIndex, AABB box, vector<u32>& primitives, i32 depth)
+    {
+        u32 count = (u32)primitives.size();
+        f32 area = box.Area();
+        if(count <= LeafSize || depth == 0 || area <= 0)
+        {
+            MakeLeaf(nodeIndex, primitives);
+            return;
+        }
+
+        // NOTE(mevex): Traversal step costs 1, a primitive test costs 1 too. Splits that cut off
+        // empty space get a small bonus.
+        f32 bestCost = (f32)count;
+        i32 bestAxis = -1;
+        f32 bestSplit = 0;
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            f32 boxMin = box.min.e[axis];
+            f32 width = (box.max.e[axis] - boxMin) / BinCount;
+            if(width <= 0)
+                continue;
+
+            u32 starts[BinCount] = {}, ends[BinCount] = {};
+            for(u32 p : primitives)
+            {
+                const AABB& b = primitiveBounds[p];
+                starts[Clamp((i32)((b.min.e[axis] - boxMin) / width), 0, BinCount - 1)]++;
+                ends[Clamp((i32)((b.max.e[axis] - boxMin) / width), 0, BinCount - 1)]++;
+            }
+
+            // NOTE(mevex): Plane k is the boundary before bin k, left has the primitives that start before
+            // it and right the ones that end after it
+            u32 leftCount = 0;
+            u32 rightCount = count;
+            for(i32 k = 1; k < BinCount; k++)
+            {
+                leftCount += starts[k - 1];
+                rightCount -= ends[k - 1];
+                f32 split = boxMin + k * width;
+                AABB leftBox = box, rightBox = box;
+                leftBox.max.e[axis] = split;
+                rightBox.min.e[axis] = split;
+                f32 cost = 1.0f + (leftBox.Area() * leftCount + rightBox.Area() * rightCount) / area;
+                if(leftCount == 0 || rightCount == 0)
+                    cost *= 0.8f;
+                if(cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = split;
+                }
+            }
+        }
+
+        if(bestAxis < 0)
+        {
+            MakeLeaf(nodeIndex, primitives);
+            return;
+        }
+
+        vector<u32> left, right;
+        for(u32 p : primitives)
+        {
+            const AABB& b = primitiveBounds[p];
+            bool inLeft = b.min.e[bestAxis] < bestSplit;
+            bool inRight = b.max.e[bestAxis] > bestSplit;
+            if(inLeft || !inRight)
+                left.push_back(p);
+            if(inRight)
+                right.push_back(p);
+        }
+        vector<u32>().swap(primitives);
+
+        u32 leftIndex = (u32)nodes.size();
+        nodes.resize(leftIndex + 2);
+        KDNode& node = nodes[nodeIndex];
+        node.axis = (u32)bestAxis;
+        node.split = bestSplit;
+        node.child = leftIndex;
+        node.count = 0;
+
+        AABB leftBox = box, rightBox = box;
+        leftBox.max.e[bestAxis] = bestSplit;
+        rightBox.min.e[bestAxis] = bestSplit;
+        Subdivide(primitiveBounds, leftIndex, leftBox, left, depth - 1);
+        Subdivide(primitiveBounds, leftIndex + 1, rightBox, right, depth - 1);
+    }
+};
+
+inline Accelerator *CreateAccelerator(AccelKind kind)
+{
+    switch(kind)
+    {
+        case Accel_Grid: return new GridAccelerator;
+        case Accel_KDTree: return new KDTreeAccelerator;
+        default: return new BVHAccelerator;
+    }
+}
+
+struct AcceleratorProbe
+{
+    f32 buildMs[Accel_Count];
+    f32 traceMs[Accel_Count];
+    u32 sampledPrimitives;
+};
+
+// NOTE(mevex): Builds every kind of accelerator over the primitives, or over a regular sample of them
+// when there are more than ProbeSampleSize, traces the probe rays through each one and returns the
+// kind that traced them the fastest. The rays should look like the ones of the render, primary rays
+// of the camera are a good choice. intersect(ray, i, tMin, tMax) is the callback of the backends
+// with the ray that is being traced.
+template<typename IntersectFunc>
+AccelKind SelectAccelerator(const vector<AABB>& primitiveBounds, vector<Ray>& probeRays, IntersectFunc intersect,
+                            WorkerPool *pool, AcceleratorProbe *probe = 0)
+{
+    const u32 ProbeSampleSize = 64 * 1024;
+    u32 count = (u32)primitiveBounds.size();
+    u32 stride = Max(count / ProbeSampleSize, 1u);
+
+    vector<AABB> sampleBounds;
+    vector<u32> sample;
+    for(u32 i = 0; i < count; i += stride)
+    {
+        sample.push_back(i);
+        sampleBounds.push_back(primitiveBounds[i]);
+    }
+    Ray *current = 0;
+    auto sampleIntersect = [&](u32 i, f32 t0, f32& t1) { return intersect(*current, sample[i], t0, t1); };
+    PrimitiveIntersector sampled = MakeIntersector(sampleIntersect);
+
+    AccelKind result = Accel_BVH;
+    f32 bestMs = INFINITY;
+    AcceleratorProbe local = {};
+    local.sampledPrimitives = (u32)sample.size();
+    for(i32 kind = 0; kind < Accel_Count; kind++)
+    {
+        std::unique_ptr<Accelerator> accel(CreateAccelerator((AccelKind)kind));
+        auto begin = std::chrono::high_resolution_clock::now();
+        accel->Build(sampleBounds, pool);
+        auto built = std::chrono::high_resolution_clock::now();
+        for(Ray& r : probeRays)
+        {
+            current = &r;
+            f32 tMax = INFINITY;
+            accel->Intersect(r, ZERO, tMax, sampled);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        local.buildMs[kind] = std::chrono::duration_cast<std::chrono::microseconds>(built - begin).count() / 1000.0f;
+        local.traceMs[kind] = std::chrono::duration_cast<std::chrono::microseconds>(end - built).count() / 1000.0f;
+        if(local.traceMs[kind] < bestMs)
+        {
+            bestMs = local.traceMs[kind];
+            result = (AccelKind)kind;
+        }
+    }
+
+    if(probe)
+        *probe = local;
+    return result;
+}
+
+#endif //ACCEL_H
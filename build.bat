@@ -4,9 +4,12 @@ set compilerFlags=-std:c++17 -EHsc -Ox -Zi -nologo -FC -WX -W4 -wd4100 -wd4189 -
 
 pushd ..\build
 
-cl %compilerFlags% ..\code\main.cpp  -link -opt:ref -incremental:no
+REM NOTE(mevex): raytracer.lib is the renderer library (see raytracer.h), main.exe is its command line front end
+cl %compilerFlags% -c ..\code\raytracer.cpp
+lib -nologo raytracer.obj -out:raytracer.lib
+cl %compilerFlags% ..\code\main.cpp -link -opt:ref -incremental:no raytracer.lib
 
 popd
 
 REM -Fe[name] is the compiler flag to rename the executable
-REM -Ox instead of -Od for the optimized build
\ No newline at end of file
+REM -Ox instead of -Od for the optimized build
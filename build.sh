@@ -0,0 +1,15 @@
+#!/bin/sh
+
+# NOTE(mevex): Linux build, same layout as build.bat: the sources live in code/ and everything is built in ../build.
+# raytracerd (the render daemon) and coordinator (distributed rendering) are Linux only.
+compilerFlags="-std=c++17 -O2 -g -msse4.1 -pthread -Wall -Wno-unused-variable -Wno-unused-but-set-variable -Wno-unknown-pragmas"
+
+codeDir=$(cd "$(dirname "$0")" && pwd)
+mkdir -p "$codeDir/../build"
+cd "$codeDir/../build" || exit 1
+
+g++ $compilerFlags -c "$codeDir/raytracer.cpp" -o raytracer.o || exit 1
+ar rcs libraytracer.a raytracer.o
+g++ $compilerFlags "$codeDir/main.cpp" -o main -L. -lraytracer || exit 1
+g++ $compilerFlags "$codeDir/raytracerd.cpp" -o raytracerd -L. -lraytracer || exit 1
+g++ $compilerFlags "$codeDir/coordinator.cpp" -o coordinator -L. -lraytracer || exit 1
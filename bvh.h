@@ -0,0 +1,1538 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "ray.h"
+#include "simd.h"
+#include "threads.h"
+#include "v3.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+// NOTE(mevex): Bounding volume hierarchy over any kind of primitive. The builder only sees the
+// bounds of the primitives and returns the order they must be stored in, so that every leaf is
+// a contiguous range. Traversal calls back for every primitive of the leaves the ray reaches.
+//
+// Two builders produce the binary tree, both split the work on a WorkerPool: binned SAH for
+// quality and LBVH (primitives sorted along a Morton curve) for speed on very big meshes.
+// The binary tree is then collapsed into a 4-wide tree whose
+// child bounds are quantized to 8 bits relative to the parent, so a node with all its children
+// fits in one cache line and one SSE slab test checks the ray against the four of them.
+//
+// The lazy mode builds almost nothing up front: a node is only split the first time a ray
+// enters it, so the build cost follows the part of the mesh that is actually seen.
+
+struct AABB
+{
+    v3 min = v3(INFINITY, INFINITY, INFINITY);
+    v3 max = v3(-INFINITY, -INFINITY, -INFINITY);
+
+    inline void Grow(const v3& p)
+    {
+        min = v3(Min(min.x, p.x), Min(min.y, p.y), Min(min.z, p.z));
+        max = v3(Max(max.x, p.x), Max(max.y, p.y), Max(max.z, p.z));
+    }
+
+    inline void Grow(const AABB& b)
+    {
+        min = v3(Min(min.x, b.min.x), Min(min.y, b.min.y), Min(min.z, b.min.z));
+        max = v3(Max(max.x, b.max.x), Max(max.y, b.max.y), Max(max.z, b.max.z));
+    }
+
+    inline f32 Area() const
+    {
+        v3 e = max - min;
+        if(e.x < 0 || e.y < 0 || e.z < 0)
+            return 0;
+        f32 result = 2.0f * (e.x*e.y + e.y*e.z + e.z*e.x);
+        return result;
+    }
+
+    inline v3 Center() const
+    {
+        v3 result = 0.5f * (min + max);
+        return result;
+    }
+};
+
+// NOTE(mevex): Spreads the 10 low bits of x so that there are two zero bits between each of them
+inline u32 ExpandBits(u32 x)
+{
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// NOTE(mevex): Rays that share their origin, like the camera rays of a block of pixels. The planes
+// go through the origin and bound the directions of every ray, inside is Dot(plane, d) >= 0.
+// A box is only kept if it is in front of every plane and nearer than the farthest hit of the packet,
+// which is conservative: some boxes outside the frustum near its corners are kept too.
+struct RayPacket
+{
+    enum
+    {
+        MaxSize = 64,
+    };
+
+    Ray rays[MaxSize];
+    v3 invDirs[MaxSize];
+    f32 tMax[MaxSize];
+    u32 count;
+
+    p3 origin;
+    v3 planes[4];
+    f32 invMaxLength;
+    // NOTE(mevex): Rough angle between neighbour rays, nodes that look smaller than a few of them
+    // are reached by too few rays to be worth tracing as a packet
+    f32 rayAngle;
+
+    // NOTE(mevex): corners are the directions of the four corners of the packet, in order around it
+    void SetFrustum(p3 packetOrigin, v3 corners[4], u32 raysAcross)
+    {
+        origin = packetOrigin;
+        v3 center = corners[0] + corners[1] + corners[2] + corners[3];
+        f32 maxLength = 0;
+        for(i32 i = 0; i < 4; i++)
+        {
+            v3 plane = Cross(corners[i], corners[(i + 1) % 4]);
+            planes[i] = (Dot(plane, center) < 0) ? -plane : plane;
+            maxLength = Max(maxLength, corners[i].Length());
+        }
+        invMaxLength = 1.0f / maxLength;
+        f32 cosine = Dot(corners[0], corners[2]) / (corners[0].Length() * corners[2].Length());
+        rayAngle = acosf(Clamp(cosine, -1.0f, 1.0f)) / (1.41421356f * Max(raysAcross, 1u));
+    }
+
+    // NOTE(mevex): Angle under which the box is seen from the origin, roughly
+    inline f32 AngleOf(const AABB& b) const
+    {
+        f32 distance = (b.Center() - origin).Length();
+        f32 size = (b.max - b.min).Length();
+        f32 result = (distance > size) ? size / distance : PI;
+        return result;
+    }
+
+    inline bool Overlaps(const AABB& b, f32 tMin, f32 packetTMax) const
+    {
+        for(i32 i = 0; i < 4; i++)
+        {
+            const v3& n = planes[i];
+            v3 corner(n.x >= 0 ? b.max.x : b.min.x, n.y >= 0 ? b.max.y : b.min.y, n.z >= 0 ? b.max.z : b.min.z);
+            if(Dot(n, corner - origin) < 0)
+                return false;
+        }
+
+        // NOTE(mevex): No ray of the packet is longer than 1/invMaxLength, so the box can't be
+        // reached before its distance from the origin times invMaxLength
+        v3 nearest(Clamp(origin.x, b.min.x, b.max.x), Clamp(origin.y, b.min.y, b.max.y), Clamp(origin.z, b.min.z, b.max.z));
+        f32 tNear = (nearest - origin).Length() * invMaxLength;
+        bool result = tNear <= packetTMax && packetTMax >= tMin;
+        return result;
+    }
+
+    inline f32 MaxT() const
+    {
+        f32 result = 0;
+        for(u32 i = 0; i < count; i++)
+            result = Max(result, tMax[i]);
+        return result;
+    }
+};
+
+// NOTE(mevex): Uncompressed binary node, 32 bytes
+struct BVHNode
+{
+    f32 minX, minY, minZ;
+    // NOTE(mevex): Internal nodes: index of the left child, the right one follows it.
+    // Leaves: index of the first primitive.
+    u32 leftFirst;
+    f32 maxX, maxY, maxZ;
+    // NOTE(mevex): Primitives in the leaf, 0 for internal nodes
+    u32 count;
+
+    inline AABB Bounds() const
+    {
+        AABB result;
+        result.min = v3(minX, minY, minZ);
+        result.max = v3(maxX, maxY, maxZ);
+        return result;
+    }
+
+    inline void SetBounds(const AABB& b)
+    {
+        minX = b.min.x; minY = b.min.y; minZ = b.min.z;
+        maxX = b.max.x; maxY = b.max.y; maxZ = b.max.z;
+    }
+};
+
+// NOTE(mevex): Compressed 4-wide node, one cache line. Child bounds along an axis are
+// origin + q * 2^exponent, with q rounded outwards so they always contain the real ones.
+struct alignas(64) BVH4Node
+{
+    f32 originX, originY, originZ;
+    i8 exponent[3];
+    u8 childCount;
+
+    u8 qMinX[4], qMinY[4], qMinZ[4];
+    u8 qMaxX[4], qMaxY[4], qMaxZ[4];
+
+    // NOTE(mevex): Internal children: index of the node. Leaves: index of the first primitive.
+    u32 child[4];
+    // NOTE(mevex): Primitives in the leaf, 0 for internal children
+    u8 primitiveCount[4];
+};
+
+// NOTE(mevex): Optional traversal counters, used to compare the trees
+struct BVHStats
+{
+    u64 rays;
+    u64 nodesVisited;
+    u64 primitivesTested;
+};
+
+enum BVHBuildMode
+{
+    BVHBuild_Auto,
+    BVHBuild_SAH,
+    BVHBuild_LBVH,
+    BVHBuild_Lazy,
+};
+
+struct BVHBuildStats
+{
+    BVHBuildMode mode;
+    f32 milliseconds;
+    // NOTE(mevex): Expected cost of a ray with traversal steps and primitive tests costing 1, lower is better
+    f32 sahCost;
+};
+
+class BVH
+{
+    public:
+
+    vector<BVHNode> nodes;
+    vector<BVH4Node> wideNodes;
+    BVHBuildStats buildStats = {};
+
+    // NOTE(mevex): Links used by Refit: parent of every binary node, leaf of every primitive,
+    // wide node that holds every binary node as a child and the binary node of every wide child
+    vector<u32> parents;
+    vector<u32> leafOf;
+    vector<u32> wideNodeOf;
+    vector<u32> wideChildren;
+
+    // NOTE(mevex): Leaves never hold more primitives than MaxLeafSize, it has to fit the u8 counts of
+    // the wide nodes. Nodes with more than ParallelSize primitives are split by several threads.
+    // Meshes with at least LBVHThreshold primitives use the LBVH builder in BVHBuild_Auto mode.
+    enum
+    {
+        MaxLeafSize = 8,
+        LBVHLeafSize = 4,
+        BinCount = 16,
+        StackSize = 128,
+        ParallelSize = 16 * 1024,
+        LBVHThreshold = 1024 * 1024,
+        LazySubtreeSize = 4 * 1024,
+        // NOTE(mevex): Packets go ray by ray below the nodes that look smaller than this many rays
+        SingleRayAngle = 8,
+        // NOTE(mevex): Rays walked at the same time by IntersectInterleaved
+        InFlightRays = 8,
+    };
+
+    static constexpr u32 NoNode = 0xFFFFFFFF;
+
+    inline bool Empty()
+    {
+        return nodes.empty();
+    }
+
+    // NOTE(mevex): Lazy trees only have the wide nodes, the refit links and the final node count once expanded
+    inline bool IsLazy()
+    {
+        return lazy != 0;
+    }
+
+    inline u32 NodeCount()
+    {
+        u32 result = lazy ? lazy->nodeCount.load() : (u32)nodes.size();
+        return result;
+    }
+
+    size_t MemorySize()
+    {
+        size_t result = nodes.capacity() * sizeof(BVHNode) + wideNodes.capacity() * sizeof(BVH4Node);
+        result += (parents.capacity() + leafOf.capacity() + wideNodeOf.capacity() + wideChildren.capacity()) * sizeof(u32);
+        if(lazy)
+            result += lazy->primitiveBounds.capacity() * (sizeof(AABB) + sizeof(v3) + sizeof(u32)) + nodes.size();
+        return result;
+    }
+
+    // NOTE(mevex): Builds both trees. order receives the index of the primitive that has to go in
+    // every position, the caller reorders its primitives accordingly before tracing rays.
+    // Without a pool everything runs on the calling thread. The tree doesn't depend on the number of threads.
+    //
+    // BVHBuild_Lazy only makes the root: order stays the identity, the tree keeps its own order
+    // and builds the rest during IntersectBinary. There is no wide tree and no Refit, a lazy tree
+    // is made again from scratch when its primitives move.
+    void Build(const vector<AABB>& primitiveBounds, vector<u32>& order, WorkerPool *pool = 0, BVHBuildMode mode = BVHBuild_Auto)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+        nodes.clear();
+        wideNodes.clear();
+        wideChildren.clear();
+        parents.clear();
+        leafOf.clear();
+        lazy.reset();
+
+        u32 count = (u32)primitiveBounds.size();
+        order.resize(count);
+        if(count == 0)
+            return;
+
+        if(mode == BVHBuild_Auto)
+            mode = (count >= LBVHThreshold) ? BVHBuild_LBVH : BVHBuild_SAH;
+
+        vector<v3> centers(count);
+        vector<u32> mortonCodes;
+        std::atomic<u32> nodeCount(1);
+        BuildContext context = {primitiveBounds, order, pool, centers, mortonCodes, nodeCount, NoNode};
+        ParallelChunks(pool, count, [&](u32 first, u32 last)
+        {
+            for(u32 i = first; i < last; i++)
+            {
+                order[i] = i;
+                centers[i] = primitiveBounds[i].Center();
+            }
+        });
+
+        // NOTE(mevex): A binary tree with at least one primitive per leaf never has more than 2n-1 nodes,
+        // allocating them up front lets the threads take new nodes with an atomic counter
+        nodes.resize(2 * count - 1);
+        if(mode == BVHBuild_Lazy)
+        {
+            BuildLazyRoot(context);
+            buildStats.mode = mode;
+            auto end = std::chrono::high_resolution_clock::now();
+            buildStats.milliseconds = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000.0f;
+            buildStats.sahCost = 0;
+            return;
+        }
+
+        if(mode == BVHBuild_LBVH)
+        {
+            SortMorton(context);
+            SubdivideMorton(context, 0, 0, count);
+        }
+        else
+            Subdivide(context, 0, 0, count);
+        nodes.resize(nodeCount);
+        nodes.shrink_to_fit();
+
+        BuildWide();
+
+        buildStats.mode = mode;
+        auto end = std::chrono::high_resolution_clock::now();
+        buildStats.milliseconds = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000.0f;
+        buildStats.sahCost = SAHCost();
+    }
+
+    // NOTE(mevex): Takes a binary tree made elsewhere, over primitives that are already in leaf order,
+    // and builds the wide tree from it
+    void Adopt(vector<BVHNode>& binaryNodes)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+        lazy.reset();
+        nodes.swap(binaryNodes);
+        BuildWide();
+
+        buildStats.mode = BVHBuild_SAH;
+        auto end = std::chrono::high_resolution_clock::now();
+        buildStats.milliseconds = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000.0f;
+        buildStats.sahCost = SAHCost();
+    }
+
+    f32 SAHCost()
+    {
+        if(nodes.empty() || lazy)
+            return 0;
+
+        f32 rootArea = nodes[0].Bounds().Area();
+        if(rootArea <= 0)
+            return (f32)nodes[0].count;
+
+        f32 result = 0;
+        for(BVHNode& node : nodes)
+            result += node.Bounds().Area() / rootArea * (node.count ? (f32)node.count : 1.0f);
+        return result;
+    }
+
+    // NOTE(mevex): Rebuilds the compressed tree from the binary one
+    void BuildWide()
+    {
+        wideNodes.clear();
+        wideChildren.clear();
+        if(nodes.empty())
+            return;
+        wideNodes.reserve(nodes.size() / 2 + 1);
+        wideNodeOf.assign(nodes.size(), NoNode);
+        Collapse(0);
+        BuildRefitLinks();
+    }
+
+    // NOTE(mevex): Marks the primitive in position i as moved, the next Refit updates its leaf and
+    // everything above it
+    inline void MarkDirty(u32 primitive)
+    {
+        if(lazy)
+            return;
+        u32 leaf = leafOf[primitive];
+        if(!nodeDirty[leaf])
+        {
+            nodeDirty[leaf] = 1;
+            dirtyNodes.push_back(leaf);
+        }
+    }
+
+    // NOTE(mevex): Refits the bounds of the nodes above the primitives marked dirty, in place, and
+    // re-encodes the wide nodes that hold them. The work is proportional to the number of nodes on
+    // the paths from the dirty leaves to the root. bounds(i) gives the new bounds of the primitive
+    // in position i. Returns the SAH cost of the refitted tree, the caller decides when the tree
+    // got bad enough to rebuild it.
+    template<typename BoundsFunc>
+    f32 Refit(BoundsFunc bounds)
+    {
+        // NOTE(mevex): Mark every ancestor once. Children always have a higher index than their
+        // parent, so going through the nodes from the highest index refits children first.
+        for(size_t i = 0; i < dirtyNodes.size(); i++)
+        {
+            u32 parent = parents[dirtyNodes[i]];
+            if(parent != NoNode && !nodeDirty[parent])
+            {
+                nodeDirty[parent] = 1;
+                dirtyNodes.push_back(parent);
+            }
+        }
+        std::sort(dirtyNodes.begin(), dirtyNodes.end(), [](u32 a, u32 b) { return a > b; });
+
+        vector<u32> dirtyWide;
+        for(u32 index : dirtyNodes)
+        {
+            BVHNode& node = nodes[index];
+            f32 oldArea = node.Bounds().Area() * (node.count ? (f32)node.count : 1.0f);
+
+            AABB b;
+            if(node.count)
+            {
+                for(u32 i = node.leftFirst; i < node.leftFirst + node.count; i++)
+                    b.Grow(bounds(i));
+            }
+            else
+            {
+                b = nodes[node.leftFirst].Bounds();
+                b.Grow(nodes[node.leftFirst + 1].Bounds());
+            }
+            node.SetBounds(b);
+            sahAreaSum += b.Area() * (node.count ? (f32)node.count : 1.0f) - oldArea;
+            nodeDirty[index] = 0;
+
+            u32 wide = wideNodeOf[index];
+            if(wide != NoNode && !wideDirty[wide])
+            {
+                wideDirty[wide] = 1;
+                dirtyWide.push_back(wide);
+            }
+        }
+        dirtyNodes.clear();
+
+        for(u32 wide : dirtyWide)
+        {
+            Quantize(wide);
+            wideDirty[wide] = 0;
+        }
+
+        f32 rootArea = nodes[0].Bounds().Area();
+        f32 result = (rootArea > 0) ? sahAreaSum / rootArea : (f32)nodes[0].count;
+        return result;
+    }
+
+    // NOTE(mevex): Closest hit through the compressed tree. intersect(i, tMin, tMax) tests the
+    // primitive in position i and, on a hit, returns true after lowering tMax to the distance of the hit.
+    template<typename IntersectFunc>
+    bool Intersect(Ray& r, f32 tMin, f32& tMax, IntersectFunc intersect, BVHStats *stats = 0)
+    {
+        if(wideNodes.empty())
+            return false;
+
+        // NOTE(mevex): A zero component would give 0*inf = NaN in the slab test
+        v3 d = r.direction;
+        v3 invDir(1.0f / (Abs(d.x) < 1e-20f ? copysignf(1e-20f, d.x) : d.x),
+                  1.0f / (Abs(d.y) < 1e-20f ? copysignf(1e-20f, d.y) : d.y),
+                  1.0f / (Abs(d.z) < 1e-20f ? copysignf(1e-20f, d.z) : d.z));
+        bool negX = invDir.x < 0;
+        bool negY = invDir.y < 0;
+        bool negZ = invDir.z < 0;
+
+        struct StackEntry
+        {
+            u32 index;
+            u32 count;
+            f32 t;
+        };
+        StackEntry stack[StackSize];
+        i32 top = 0;
+        stack[top++] = {0, 0, tMin};
+
+        if(stats)
+            stats->rays++;
+
+        bool result = false;
+        while(top > 0)
+        {
+            StackEntry entry = stack[--top];
+            if(entry.t > tMax)
+                continue;
+
+            if(entry.count)
+            {
+                for(u32 i = entry.index; i < entry.index + entry.count; i++)
+                {
+                    if(intersect(i, tMin, tMax))
+                        result = true;
+                }
+                if(stats)
+                    stats->primitivesTested += entry.count;
+                continue;
+            }
+
+            BVH4Node& node = wideNodes[entry.index];
+            if(stats)
+                stats->nodesVisited++;
+
+            wide_f32 tEntry, tExit;
+            SlabTest(node, r, invDir, negX, negY, negZ, tMin, tMax, tEntry, tExit);
+            u32 hitMask = WideFloatMoveMask(WideFloatNotGreater(tEntry, tExit)) & ((1 << node.childCount) - 1);
+            if(!hitMask)
+                continue;
+
+            // NOTE(mevex): Sort the children that were hit far to near, so the nearest is popped first
+            StackEntry hits[4];
+            i32 hitCount = 0;
+            for(i32 i = 0; i < 4; i++)
+            {
+                if(hitMask & (1 << i))
+                {
+                    StackEntry h = {node.child[i], node.primitiveCount[i], ExtractFloat(tEntry, i)};
+                    i32 j = hitCount++;
+                    while(j > 0 && hits[j-1].t < h.t)
+                    {
+                        hits[j] = hits[j-1];
+                        j--;
+                    }
+                    hits[j] = h;
+                }
+            }
+
+            for(i32 i = 0; i < hitCount; i++)
+                stack[top++] = hits[i];
+        }
+
+        return result;
+    }
+
+    // NOTE(mevex): Closest hits of a stream of unrelated rays through the compressed tree, the same as
+    // Intersect for every ray. InFlightRays rays are walked at the same time, each one step in turn: a step
+    // pops a node or a leaf, prefetches what the ray pops next and moves on to the next ray, so that
+    // the cache misses of a ray are paid while the others work instead of stalling the core.
+    // intersect(ray, i, tMin, tMax) works like in IntersectPacket and prefetch(first, count) is called
+    // with the primitives of a leaf before a ray tests them. Lazy trees are not supported.
+    template<typename IntersectFunc, typename PrefetchFunc>
+    void IntersectInterleaved(Ray *rays, u32 count, f32 tMin, f32 *tMax, IntersectFunc intersect, PrefetchFunc prefetch, BVHStats *stats = 0)
+    {
+        if(wideNodes.empty())
+            return;
+
+        struct StackEntry
+        {
+            u32 index;
+            u32 count;
+            f32 t;
+        };
+        // NOTE(mevex): Everything a ray needs to stop after any step and go on later
+        struct RayState
+        {
+            u32 ray;
+            bool negX, negY, negZ;
+            v3 invDir;
+            i32 top;
+            StackEntry stack[StackSize];
+        };
+        RayState states[InFlightRays];
+        u32 stateCount = 0;
+        u32 nextRay = 0;
+
+        auto prefetchTop = [&](RayState& state)
+        {
+            StackEntry& entry = state.stack[state.top - 1];
+            if(entry.count)
+                prefetch(entry.index, entry.count);
+            else
+                Prefetch(&wideNodes[entry.index]);
+        };
+
+        auto start = [&](RayState& state)
+        {
+            state.ray = nextRay++;
+            v3 d = rays[state.ray].direction;
+            state.invDir = v3(1.0f / (Abs(d.x) < 1e-20f ? copysignf(1e-20f, d.x) : d.x),
+                              1.0f / (Abs(d.y) < 1e-20f ? copysignf(1e-20f, d.y) : d.y),
+                              1.0f / (Abs(d.z) < 1e-20f ? copysignf(1e-20f, d.z) : d.z));
+            state.negX = state.invDir.x < 0;
+            state.negY = state.invDir.y < 0;
+            state.negZ = state.invDir.z < 0;
+            state.top = 0;
+            state.stack[state.top++] = {0, 0, tMin};
+            if(stats)
+                stats->rays++;
+        };
+
+        while(stateCount < InFlightRays && nextRay < count)
+            start(states[stateCount++]);
+
+        u32 current = 0;
+        while(stateCount > 0)
+        {
+            RayState& state = states[current];
+            if(state.top == 0)
+            {
+                // NOTE(mevex): The ray is done, the next one of the stream takes its place
+                if(nextRay < count)
+                    start(state);
+                else
+                {
+                    state = states[--stateCount];
+                    if(current == stateCount)
+                        current = 0;
+                    continue;
+                }
+            }
+
+            Ray& r = rays[state.ray];
+            f32& rayTMax = tMax[state.ray];
+            StackEntry entry = state.stack[--state.top];
+            if(entry.t <= rayTMax)
+            {
+                if(entry.count)
+                {
+                    for(u32 i = entry.index; i < entry.index + entry.count; i++)
+                        intersect(state.ray, i, tMin, rayTMax);
+                    if(stats)
+                        stats->primitivesTested += entry.count;
+                }
+                else
+                {
+                    BVH4Node& node = wideNodes[entry.index];
+                    if(stats)
+                        stats->nodesVisited++;
+
+                    wide_f32 tEntry, tExit;
+                    SlabTest(node, r, state.invDir, state.negX, state.negY, state.negZ, tMin, rayTMax, tEntry, tExit);
+                    u32 hitMask = WideFloatMoveMask(WideFloatNotGreater(tEntry, tExit)) & ((1 << node.childCount) - 1);
+
+                    // NOTE(mevex): Same order as Intersect, nearest child on top
+                    StackEntry hits[4];
+                    i32 hitCount = 0;
+                    for(i32 i = 0; i < 4; i++)
+                    {
+                        if(hitMask & (1 << i))
+                        {
+                            StackEntry h = {node.child[i], node.primitiveCount[i], ExtractFloat(tEntry, i)};
+                            i32 j = hitCount++;
+                            while(j > 0 && hits[j-1].t < h.t)
+                            {
+                                hits[j] = hits[j-1];
+                                j--;
+                            }
+                            hits[j] = h;
+                        }
+                    }
+                    for(i32 i = 0; i < hitCount; i++)
+                        state.stack[state.top++] = hits[i];
+                }
+            }
+
+            if(state.top > 0)
+                prefetchTop(state);
+            current = (current + 1 < stateCount) ? current + 1 : 0;
+        }
+    }
+
+    // NOTE(mevex): Same as Intersect through the uncompressed binary tree, kept to measure the difference.
+    // It is the only traversal of lazy trees, it splits the nodes it enters that were not split yet.
+    template<typename IntersectFunc>
+    bool IntersectBinary(Ray& r, f32 tMin, f32& tMax, IntersectFunc intersect, BVHStats *stats = 0)
+    {
+        if(nodes.empty())
+            return false;
+
+        v3 d = r.direction;
+        v3 invDir(1.0f / (Abs(d.x) < 1e-20f ? copysignf(1e-20f, d.x) : d.x),
+                  1.0f / (Abs(d.y) < 1e-20f ? copysignf(1e-20f, d.y) : d.y),
+                  1.0f / (Abs(d.z) < 1e-20f ? copysignf(1e-20f, d.z) : d.z));
+
+        struct StackEntry
+        {
+            u32 index;
+            f32 t;
+        };
+        StackEntry stack[StackSize];
+        i32 top = 0;
+
+        if(stats)
+            stats->rays++;
+
+        bool result = false;
+        f32 rootT = SlabTest(nodes[0], r, invDir, tMin, tMax);
+        if(rootT != INFINITY)
+            stack[top++] = {0, rootT};
+
+        while(top > 0)
+        {
+            StackEntry entry = stack[--top];
+            if(entry.t > tMax)
+                continue;
+
+            // NOTE(mevex): The acquire pairs with the release in Expand, once the node is seen expanded
+            // it and its children are complete
+            if(lazy && lazy->state[entry.index].load(std::memory_order_acquire) != Lazy_Expanded)
+                Expand(entry.index);
+
+            BVHNode& node = nodes[entry.index];
+            if(stats)
+                stats->nodesVisited++;
+
+            if(node.count)
+            {
+                for(u32 i = node.leftFirst; i < node.leftFirst + node.count; i++)
+                {
+                    if(intersect(lazy ? lazy->order[i] : i, tMin, tMax))
+                        result = true;
+                }
+                if(stats)
+                    stats->primitivesTested += node.count;
+                continue;
+            }
+
+            f32 tLeft = SlabTest(nodes[node.leftFirst], r, invDir, tMin, tMax);
+            f32 tRight = SlabTest(nodes[node.leftFirst + 1], r, invDir, tMin, tMax);
+            StackEntry near = {node.leftFirst, tLeft};
+            StackEntry far = {node.leftFirst + 1, tRight};
+            if(tRight < tLeft)
+            {
+                near = {node.leftFirst + 1, tRight};
+                far = {node.leftFirst, tLeft};
+            }
+            if(far.t != INFINITY)
+                stack[top++] = far;
+            if(near.t != INFINITY)
+                stack[top++] = near;
+        }
+
+        return result;
+    }
+
+    // NOTE(mevex): Closest hits of a packet of rays with a common origin through the binary tree.
+    // A node is skipped at once if it is outside the frustum of the packet, otherwise the rays before the
+    // first one that enters it are left out of its subtree, and the leaves only test the rays up to the
+    // last one that enters them. Subtrees that only a few rays reach are walked ray by ray.
+    // intersect(ray, i, tMin, tMax) works like in Intersect for ray number ray of the packet.
+    // Lazy trees are not supported, they go ray by ray through IntersectBinary.
+    template<typename IntersectFunc>
+    void IntersectPacket(RayPacket& packet, f32 tMin, IntersectFunc intersect, BVHStats *stats = 0)
+    {
+        if(nodes.empty() || lazy || !packet.count)
+            return;
+
+        struct StackEntry
+        {
+            u32 index;
+            u32 firstRay;
+        };
+        StackEntry stack[StackSize];
+        i32 top = 0;
+        stack[top++] = {0, 0};
+
+        f32 packetTMax = packet.MaxT();
+        if(stats)
+            stats->rays += packet.count;
+
+        while(top > 0)
+        {
+            StackEntry entry = stack[--top];
+            BVHNode& node = nodes[entry.index];
+            if(!packet.Overlaps(node.Bounds(), tMin, packetTMax))
+                continue;
+
+            u32 first = entry.firstRay;
+            while(first < packet.count && SlabTest(node, packet.rays[first], packet.invDirs[first], tMin, packet.tMax[first]) == INFINITY)
+                first++;
+            if(first == packet.count)
+                continue;
+            if(stats)
+                stats->nodesVisited++;
+
+            if(!node.count && packet.AngleOf(node.Bounds()) < SingleRayAngle * packet.rayAngle)
+            {
+                for(u32 ray = first; ray < packet.count; ray++)
+                {
+                    IntersectSubtree(entry.index, packet.rays[ray], packet.invDirs[ray], tMin, packet.tMax[ray],
+                                     [&](u32 i, f32 t0, f32& t1) { return intersect(ray, i, t0, t1); }, stats);
+                }
+                packetTMax = packet.MaxT();
+                continue;
+            }
+
+            if(node.count)
+            {
+                u32 last = packet.count - 1;
+                while(last > first && SlabTest(node, packet.rays[last], packet.invDirs[last], tMin, packet.tMax[last]) == INFINITY)
+                    last--;
+
+                for(u32 ray = first; ray <= last; ray++)
+                {
+                    f32& tMax = packet.tMax[ray];
+                    if(ray != first && ray != last && SlabTest(node, packet.rays[ray], packet.invDirs[ray], tMin, tMax) == INFINITY)
+                        continue;
+                    for(u32 i = node.leftFirst; i < node.leftFirst + node.count; i++)
+                        intersect(ray, i, tMin, tMax);
+                    if(stats)
+                        stats->primitivesTested += node.count;
+                }
+                packetTMax = packet.MaxT();
+                continue;
+            }
+
+            // NOTE(mevex): Nearest child on top of the stack
+            BVHNode& left = nodes[node.leftFirst];
+            BVHNode& right = nodes[node.leftFirst + 1];
+            v3 toLeft = left.Bounds().Center() - packet.origin;
+            v3 toRight = right.Bounds().Center() - packet.origin;
+            bool leftFirst = toLeft.LengthSquared() <= toRight.LengthSquared();
+            stack[top++] = {leftFirst ? node.leftFirst + 1 : node.leftFirst, first};
+            stack[top++] = {leftFirst ? node.leftFirst : node.leftFirst + 1, first};
+        }
+    }
+
+    // NOTE(mevex): IntersectBinary from the node root down, for the rays that leave a packet
+    template<typename IntersectFunc>
+    bool IntersectSubtree(u32 root, Ray& r, v3& invDir, f32 tMin, f32& tMax, IntersectFunc intersect, BVHStats *stats = 0)
+    {
+        struct StackEntry
+        {
+            u32 index;
+            f32 t;
+        };
+        StackEntry stack[StackSize];
+        i32 top = 0;
+
+        bool result = false;
+        f32 rootT = SlabTest(nodes[root], r, invDir, tMin, tMax);
+        if(rootT != INFINITY)
+            stack[top++] = {root, rootT};
+
+        while(top > 0)
+        {
+            StackEntry entry = stack[--top];
+            if(entry.t > tMax)
+                continue;
+
+            BVHNode& node = nodes[entry.index];
+            if(stats)
+                stats->nodesVisited++;
+
+            if(node.count)
+            {
+                for(u32 i = node.leftFirst; i < node.leftFirst + node.count; i++)
+                {
+                    if(intersect(i, tMin, tMax))
+                        result = true;
+                }
+                if(stats)
+                    stats->primitivesTested += node.count;
+                continue;
+            }
+
+            f32 tLeft = SlabTest(nodes[node.leftFirst], r, invDir, tMin, tMax);
+            f32 tRight = SlabTest(nodes[node.leftFirst + 1], r, invDir, tMin, tMax);
+            StackEntry near = {node.leftFirst, tLeft};
+            StackEntry far = {node.leftFirst + 1, tRight};
+            if(tRight < tLeft)
+            {
+                near = {node.leftFirst + 1, tRight};
+                far = {node.leftFirst, tLeft};
+            }
+            if(far.t != INFINITY)
+                stack[top++] = far;
+            if(near.t != INFINITY)
+                stack[top++] = near;
+        }
+
+        return result;
+    }
+
+    private:
+
+    vector<u32> dirtyNodes;
+    vector<u8> nodeDirty;
+    vector<u8> wideDirty;
+    // NOTE(mevex): Sum of area * cost of every node, the SAH cost without the division by the root area
+    f32 sahAreaSum = 0;
+
+    void BuildRefitLinks()
+    {
+        parents.assign(nodes.size(), NoNode);
+        u32 primitiveCount = 0;
+        for(BVHNode& node : nodes)
+            primitiveCount += node.count;
+        leafOf.assign(primitiveCount, NoNode);
+
+        sahAreaSum = 0;
+        for(u32 i = 0; i < nodes.size(); i++)
+        {
+            BVHNode& node = nodes[i];
+            sahAreaSum += node.Bounds().Area() * (node.count ? (f32)node.count : 1.0f);
+            if(node.count)
+            {
+                for(u32 p = node.leftFirst; p < node.leftFirst + node.count; p++)
+                    leafOf[p] = i;
+            }
+            else
+            {
+                parents[node.leftFirst] = i;
+                parents[node.leftFirst + 1] = i;
+            }
+        }
+
+        dirtyNodes.clear();
+        nodeDirty.assign(nodes.size(), 0);
+        wideDirty.assign(wideNodes.size(), 0);
+    }
+
+    struct BuildContext
+    {
+        const vector<AABB>& primitiveBounds;
+        vector<u32>& order;
+        WorkerPool *pool;
+        vector<v3>& centers;
+        vector<u32>& mortonCodes;
+        std::atomic<u32>& nodeCount;
+        // NOTE(mevex): Node whose bounds must not be written again, see Expand
+        u32 fixedBoundsNode;
+    };
+
+    enum LazyNodeState : u8
+    {
+        Lazy_NotExpanded,
+        Lazy_Expanding,
+        Lazy_Expanded,
+    };
+
+    // NOTE(mevex): What a lazy tree keeps to go on building. Nodes that are not expanded yet are leaves
+    // with all their primitives and their final bounds, only their leftFirst and count change when
+    // they are split. Their range of order is only touched by the thread that expands them.
+    struct LazyState
+    {
+        vector<AABB> primitiveBounds;
+        vector<v3> centers;
+        vector<u32> order;
+        vector<u32> mortonCodes;
+        std::atomic<u32> nodeCount;
+        std::unique_ptr<std::atomic<u8>[]> state;
+    };
+    std::unique_ptr<LazyState> lazy;
+
+    void BuildLazyRoot(BuildContext& context)
+    {
+        u32 count = (u32)context.primitiveBounds.size();
+        lazy.reset(new LazyState);
+        lazy->primitiveBounds = context.primitiveBounds;
+        lazy->centers.swap(context.centers);
+        lazy->order = context.order;
+        lazy->nodeCount = 1;
+        lazy->state.reset(new std::atomic<u8>[nodes.size()]);
+        lazy->state[0] = Lazy_NotExpanded;
+
+        u32 chunkCount = Max((count + ParallelSize - 1) / ParallelSize, 1u);
+        vector<AABB> chunkBounds(chunkCount);
+        ParallelChunks(context.pool, count, [&](u32 first, u32 last)
+        {
+            for(u32 i = first; i < last; i++)
+                chunkBounds[first / ParallelSize].Grow(lazy->primitiveBounds[i]);
+        });
+        AABB bounds;
+        for(AABB& b : chunkBounds)
+            bounds.Grow(b);
+        MakeLeaf(0, 0, count, bounds);
+    }
+
+    // NOTE(mevex): Splits a node of a lazy tree the first time a ray enters it. Big nodes are split
+    // in two and their children are left for later, small ones get their whole subtree at once so
+    // rays don't have to stop at every level. One thread claims the node, the others that reach it
+    // in the meantime wait for it; different nodes are expanded at the same time.
+    void Expand(u32 nodeIndex)
+    {
+        std::atomic<u8>& state = lazy->state[nodeIndex];
+        u8 expected = Lazy_NotExpanded;
+        if(!state.compare_exchange_strong(expected, Lazy_Expanding, std::memory_order_acquire))
+        {
+            while(state.load(std::memory_order_acquire) != Lazy_Expanded)
+                std::this_thread::yield();
+            return;
+        }
+
+        BuildContext context = {lazy->primitiveBounds, lazy->order, 0, lazy->centers, lazy->mortonCodes, lazy->nodeCount, nodeIndex};
+        u32 first = nodes[nodeIndex].leftFirst;
+        u32 count = nodes[nodeIndex].count;
+
+        if(count <= LazySubtreeSize)
+        {
+            Subdivide(context, nodeIndex, first, count);
+            MarkExpanded(nodes[nodeIndex]);
+        }
+        else
+        {
+            AABB bounds;
+            i32 axis = 0;
+            f32 position = 0;
+            u32 *begin = lazy->order.data() + first;
+            u32 *end = begin + count;
+            u32 *middle = begin + count / 2;
+            vector<v3>& centers = lazy->centers;
+            if(FindSplit(context, first, count, bounds, axis, position))
+                middle = std::partition(begin, end, [&](u32 p) { return centers[p].e[axis] < position; });
+            else
+            {
+                v3 e = bounds.max - bounds.min;
+                axis = (e.x > e.y && e.x > e.z) ? 0 : (e.y > e.z ? 1 : 2);
+                std::nth_element(begin, middle, end, [&](u32 a, u32 b) { return centers[a].e[axis] < centers[b].e[axis]; });
+            }
+
+            u32 leftCount = (u32)(middle - begin);
+            if(leftCount == 0 || leftCount == count)
+                leftCount = count / 2;
+
+            u32 leftIndex = lazy->nodeCount.fetch_add(2);
+            for(u32 side = 0; side < 2; side++)
+            {
+                u32 childFirst = side ? first + leftCount : first;
+                u32 childCount = side ? count - leftCount : leftCount;
+                AABB childBounds;
+                for(u32 i = childFirst; i < childFirst + childCount; i++)
+                    childBounds.Grow(lazy->primitiveBounds[lazy->order[i]]);
+                MakeLeaf(leftIndex + side, childFirst, childCount, childBounds);
+                lazy->state[leftIndex + side].store(Lazy_NotExpanded, std::memory_order_relaxed);
+            }
+
+            BVHNode& node = nodes[nodeIndex];
+            node.leftFirst = leftIndex;
+            node.count = 0;
+        }
+
+        state.store(Lazy_Expanded, std::memory_order_release);
+    }
+
+    // NOTE(mevex): Every node under an internal node made by Subdivide is complete
+    void MarkExpanded(BVHNode& node)
+    {
+        if(node.count)
+            return;
+        for(u32 i = node.leftFirst; i < node.leftFirst + 2; i++)
+        {
+            lazy->state[i].store(Lazy_Expanded, std::memory_order_relaxed);
+            MarkExpanded(nodes[i]);
+        }
+    }
+
+    struct Bins
+    {
+        AABB bounds[3][BinCount];
+        u32 counts[3][BinCount];
+    };
+
+    // NOTE(mevex): Calls func(first, last) on ranges of at most ParallelSize elements,
+    // on the pool if there is one and there is more than one range
+    template<typename Func>
+    void ParallelChunks(WorkerPool *pool, u32 count, Func func)
+    {
+        u32 chunkCount = (count + ParallelSize - 1) / ParallelSize;
+        if(!pool || chunkCount <= 1)
+        {
+            func(0, count);
+            return;
+        }
+
+        pool->ParallelFor((i32)chunkCount, [&](i32 chunk)
+        {
+            func((u32)chunk * ParallelSize, Min((u32)(chunk + 1) * ParallelSize, count));
+        });
+    }
+
+    // NOTE(mevex): Runs the two halves of a split at the same time if the node is big enough
+    template<typename Func>
+    void ParallelChildren(BuildContext& context, u32 count, Func func)
+    {
+        if(context.pool && count >= ParallelSize)
+            context.pool->ParallelFor(2, [&](i32 side) { func(side); });
+        else
+        {
+            func(0);
+            func(1);
+        }
+    }
+
+    // NOTE(mevex): Binned SAH split, every axis is tried. Returns false if keeping
+    // the leaf is cheaper than any split.
+    bool FindSplit(BuildContext& context, u32 first, u32 count, AABB& bounds, i32& bestAxis, f32& bestPosition)
+    {
+        const vector<AABB>& primitiveBounds = context.primitiveBounds;
+        vector<v3>& centers = context.centers;
+        vector<u32>& order = context.order;
+
+        // NOTE(mevex): Every chunk of primitives is binned on its own and the results are merged,
+        // min and max are exact so the result doesn't depend on how the work was split
+        u32 chunkCount = Max((count + ParallelSize - 1) / ParallelSize, 1u);
+        vector<AABB> chunkBounds(chunkCount), chunkCenters(chunkCount);
+        ParallelChunks(context.pool, count, [&](u32 begin, u32 end)
+        {
+            u32 chunk = begin / ParallelSize;
+            for(u32 i = first + begin; i < first + end; i++)
+            {
+                chunkBounds[chunk].Grow(primitiveBounds[order[i]]);
+                chunkCenters[chunk].Grow(centers[order[i]]);
+            }
+        });
+
+        AABB centerBounds;
+        for(u32 i = 0; i < chunkCount; i++)
+        {
+            bounds.Grow(chunkBounds[i]);
+            centerBounds.Grow(chunkCenters[i]);
+        }
+
+        if(count <= 2)
+            return false;
+
+        f32 scale[3];
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            f32 extent = centerBounds.max.e[axis] - centerBounds.min.e[axis];
+            scale[axis] = (extent > 0) ? BinCount / extent : 0;
+        }
+
+        vector<Bins> chunkBins(chunkCount);
+        ParallelChunks(context.pool, count, [&](u32 begin, u32 end)
+        {
+            Bins& bins = chunkBins[begin / ParallelSize];
+            memset(bins.counts, 0, sizeof(bins.counts));
+            for(u32 i = first + begin; i < first + end; i++)
+            {
+                u32 p = order[i];
+                for(i32 axis = 0; axis < 3; axis++)
+                {
+                    i32 bin = Min((i32)((centers[p].e[axis] - centerBounds.min.e[axis]) * scale[axis]), BinCount - 1);
+                    bins.bounds[axis][bin].Grow(primitiveBounds[p]);
+                    bins.counts[axis][bin]++;
+                }
+            }
+        });
+
+        Bins& total = chunkBins[0];
+        for(u32 chunk = 1; chunk < chunkCount; chunk++)
+        {
+            for(i32 axis = 0; axis < 3; axis++)
+            {
+                for(i32 bin = 0; bin < BinCount; bin++)
+                {
+                    total.bounds[axis][bin].Grow(chunkBins[chunk].bounds[axis][bin]);
+                    total.counts[axis][bin] += chunkBins[chunk].counts[axis][bin];
+                }
+            }
+        }
+
+        f32 bestCost = INFINITY;
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            if(scale[axis] == 0)
+                continue;
+
+            // NOTE(mevex): Sweep from both sides to get the cost of every plane between bins
+            f32 leftArea[BinCount - 1], rightArea[BinCount - 1];
+            u32 leftCount[BinCount - 1], rightCount[BinCount - 1];
+            AABB leftBox, rightBox;
+            u32 leftSum = 0, rightSum = 0;
+            for(i32 i = 0; i < BinCount - 1; i++)
+            {
+                leftSum += total.counts[axis][i];
+                leftCount[i] = leftSum;
+                leftBox.Grow(total.bounds[axis][i]);
+                leftArea[i] = leftBox.Area();
+
+                rightSum += total.counts[axis][BinCount - 1 - i];
+                rightCount[BinCount - 2 - i] = rightSum;
+                rightBox.Grow(total.bounds[axis][BinCount - 1 - i]);
+                rightArea[BinCount - 2 - i] = rightBox.Area();
+            }
+
+            for(i32 i = 0; i < BinCount - 1; i++)
+            {
+                if(leftCount[i] == 0 || rightCount[i] == 0)
+                    continue;
+                f32 cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+                if(cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestPosition = centerBounds.min.e[axis] + (i + 1) / scale[axis];
+                }
+            }
+        }
+
+        // NOTE(mevex): Traversal step and primitive test cost the same
+        f32 parentArea = bounds.Area();
+        f32 splitCost = 1.0f + (parentArea > 0 ? bestCost / parentArea : 0);
+        return bestCost != INFINITY && splitCost < (f32)count;
+    }
+
+    inline void MakeLeaf(u32 nodeIndex, u32 first, u32 count, const AABB& bounds, u32 fixedBoundsNode = NoNode)
+    {
+        BVHNode& node = nodes[nodeIndex];
+        if(nodeIndex != fixedBoundsNode)
+            node.SetBounds(bounds);
+        node.leftFirst = first;
+        node.count = count;
+    }
+
+    void Subdivide(BuildContext& context, u32 nodeIndex, u32 first, u32 count)
+    {
+        vector<v3>& centers = context.centers;
+        AABB bounds;
+        i32 axis = 0;
+        f32 position = 0;
+        u32 *begin = context.order.data() + first;
+        u32 *end = begin + count;
+        u32 *middle;
+
+        if(FindSplit(context, first, count, bounds, axis, position))
+        {
+            middle = std::partition(begin, end, [&](u32 p) { return centers[p].e[axis] < position; });
+        }
+        else if(count > MaxLeafSize)
+        {
+            // NOTE(mevex): SAH would keep the leaf but it is too big, split in the middle of the widest axis
+            v3 e = bounds.max - bounds.min;
+            axis = (e.x > e.y && e.x > e.z) ? 0 : (e.y > e.z ? 1 : 2);
+            middle = begin + count / 2;
+            std::nth_element(begin, middle, end, [&](u32 a, u32 b) { return centers[a].e[axis] < centers[b].e[axis]; });
+        }
+        else
+        {
+            MakeLeaf(nodeIndex, first, count, bounds, context.fixedBoundsNode);
+            return;
+        }
+
+        u32 leftCount = (u32)(middle - begin);
+        if(leftCount == 0 || leftCount == count)
+            leftCount = count / 2;
+
+        // NOTE(mevex): Other threads may be testing the bounds of the node Expand is splitting, they don't change
+        u32 leftIndex = context.nodeCount.fetch_add(2);
+        BVHNode& node = nodes[nodeIndex];
+        if(nodeIndex != context.fixedBoundsNode)
+            node.SetBounds(bounds);
+        node.leftFirst = leftIndex;
+        node.count = 0;
+
+        ParallelChildren(context, count, [&](i32 side)
+        {
+            if(side == 0)
+                Subdivide(context, leftIndex, first, leftCount);
+            else
+                Subdivide(context, leftIndex + 1, first + leftCount, count - leftCount);
+        });
+    }
+
+    // NOTE(mevex): Sorts order by the 30-bit Morton code of the primitive centers, least significant
+    // digit radix sort with 8-bit digits. Every chunk counts its digits on its own and then scatters
+    // to the offsets of the prefix sum, so the sort is stable however the chunks are scheduled.
+    void SortMorton(BuildContext& context)
+    {
+        vector<u32>& order = context.order;
+        vector<v3>& centers = context.centers;
+        u32 count = (u32)order.size();
+        u32 chunkCount = Max((count + ParallelSize - 1) / ParallelSize, 1u);
+
+        vector<AABB> chunkCenters(chunkCount);
+        ParallelChunks(context.pool, count, [&](u32 first, u32 last)
+        {
+            for(u32 i = first; i < last; i++)
+                chunkCenters[first / ParallelSize].Grow(centers[i]);
+        });
+        AABB centerBounds;
+        for(AABB& b : chunkCenters)
+            centerBounds.Grow(b);
+
+        v3 extent = centerBounds.max - centerBounds.min;
+        v3 scale(extent.x > 0 ? 1023.0f / extent.x : 0, extent.y > 0 ? 1023.0f / extent.y : 0, extent.z > 0 ? 1023.0f / extent.z : 0);
+
+        vector<u32>& keys = context.mortonCodes;
+        keys.resize(count);
+        ParallelChunks(context.pool, count, [&](u32 first, u32 last)
+        {
+            for(u32 i = first; i < last; i++)
+            {
+                v3 p = centers[i] - centerBounds.min;
+                u32 x = (u32)(p.x * scale.x), y = (u32)(p.y * scale.y), z = (u32)(p.z * scale.z);
+                keys[i] = (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+            }
+        });
+
+        vector<u32> tmpKeys(count), tmpValues(count);
+        vector<u32> offsets(chunkCount * 256);
+        for(u32 shift = 0; shift < 32; shift += 8)
+        {
+            std::fill(offsets.begin(), offsets.end(), 0);
+            ParallelChunks(context.pool, count, [&](u32 first, u32 last)
+            {
+                u32 *histogram = offsets.data() + (first / ParallelSize) * 256;
+                for(u32 i = first; i < last; i++)
+                    histogram[(keys[i] >> shift) & 0xFF]++;
+            });
+
+            u32 sum = 0;
+            for(u32 digit = 0; digit < 256; digit++)
+            {
+                for(u32 chunk = 0; chunk < chunkCount; chunk++)
+                {
+                    u32 c = offsets[chunk * 256 + digit];
+                    offsets[chunk * 256 + digit] = sum;
+                    sum += c;
+                }
+            }
+
+            ParallelChunks(context.pool, count, [&](u32 first, u32 last)
+            {
+                u32 *offset = offsets.data() + (first / ParallelSize) * 256;
+                for(u32 i = first; i < last; i++)
+                {
+                    u32 destination = offset[(keys[i] >> shift) & 0xFF]++;
+                    tmpKeys[destination] = keys[i];
+                    tmpValues[destination] = order[i];
+                }
+            });
+
+            keys.swap(tmpKeys);
+            order.swap(tmpValues);
+        }
+    }
+
+    // NOTE(mevex): LBVH: the primitives are sorted along the Morton curve, every node splits its
+    // range where the highest bit that differs between its first and last code flips
+    void SubdivideMorton(BuildContext& context, u32 nodeIndex, u32 first, u32 count)
+    {
+        if(count <= LBVHLeafSize)
+        {
+            AABB bounds;
+            for(u32 i = first; i < first + count; i++)
+                bounds.Grow(context.primitiveBounds[context.order[i]]);
+            MakeLeaf(nodeIndex, first, count, bounds);
+            return;
+        }
+
+        u32 *codes = context.mortonCodes.data();
+        u32 firstCode = codes[first];
+        u32 lastCode = codes[first + count - 1];
+        u32 leftCount = count / 2;
+        if(firstCode != lastCode)
+        {
+            u32 bit = 31;
+            while(!((firstCode ^ lastCode) & (1u << bit)))
+                bit--;
+            u32 *split = std::partition_point(codes + first, codes + first + count, [&](u32 code) { return !(code & (1u << bit)); });
+            leftCount = (u32)(split - (codes + first));
+        }
+
+        u32 leftIndex = context.nodeCount.fetch_add(2);
+        ParallelChildren(context, count, [&](i32 side)
+        {
+            if(side == 0)
+                SubdivideMorton(context, leftIndex, first, leftCount);
+            else
+                SubdivideMorton(context, leftIndex + 1, first + leftCount, count - leftCount);
+        });
+
+        AABB bounds = nodes[leftIndex].Bounds();
+        bounds.Grow(nodes[leftIndex + 1].Bounds());
+        BVHNode& node = nodes[nodeIndex];
+        node.SetBounds(bounds);
+        node.leftFirst = leftIndex;
+        node.count = 0;
+    }
+
+    // NOTE(mevex): Pulls up to four descendants of the binary node into one wide node, always
+    // opening the internal child with the largest surface area. Returns the wide node index.
+    u32 Collapse(u32 binaryIndex)
+    {
+        u32 children[4];
+        i32 childCount = 0;
+        BVHNode& binary = nodes[binaryIndex];
+        if(binary.count)
+            children[childCount++] = binaryIndex;
+        else
+        {
+            children[childCount++] = binary.leftFirst;
+            children[childCount++] = binary.leftFirst + 1;
+            while(childCount < 4)
+            {
+                i32 best = -1;
+                f32 bestArea = -1;
+                for(i32 i = 0; i < childCount; i++)
+                {
+                    BVHNode& c = nodes[children[i]];
+                    if(!c.count && c.Bounds().Area() > bestArea)
+                    {
+                        best = i;
+                        bestArea = c.Bounds().Area();
+                    }
+                }
+                if(best < 0)
+                    break;
+
+                u32 opened = children[best];
+                children[best] = nodes[opened].leftFirst;
+                children[childCount++] = nodes[opened].leftFirst + 1;
+            }
+        }
+
+        u32 wideIndex = (u32)wideNodes.size();
+        wideNodes.push_back({});
+        wideChildren.resize(wideNodes.size() * 4);
+        for(i32 i = 0; i < childCount; i++)
+        {
+            wideChildren[wideIndex * 4 + i] = children[i];
+            wideNodeOf[children[i]] = wideIndex;
+        }
+
+        BVH4Node node;
+        memset(&node, 0, sizeof(node));
+        node.childCount = (u8)childCount;
+        for(i32 i = 0; i < childCount; i++)
+        {
+            BVHNode& c = nodes[children[i]];
+            if(c.count)
+            {
+                node.child[i] = c.leftFirst;
+                node.primitiveCount[i] = (u8)c.count;
+            }
+            else
+                node.child[i] = Collapse(children[i]);
+        }
+
+        wideNodes[wideIndex] = node;
+        Quantize(wideIndex);
+        return wideIndex;
+    }
+
+    // NOTE(mevex): Encodes the bounds of the children of the wide node from the binary nodes they come from
+    void Quantize(u32 wideIndex)
+    {
+        BVH4Node& node = wideNodes[wideIndex];
+        u32 *children = wideChildren.data() + wideIndex * 4;
+
+        AABB bounds;
+        for(i32 i = 0; i < node.childCount; i++)
+            bounds.Grow(nodes[children[i]].Bounds());
+        node.originX = bounds.min.x;
+        node.originY = bounds.min.y;
+        node.originZ = bounds.min.z;
+
+        u8 *qMin[3] = {node.qMinX, node.qMinY, node.qMinZ};
+        u8 *qMax[3] = {node.qMaxX, node.qMaxY, node.qMaxZ};
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            // NOTE(mevex): Smallest power of two that covers the extent in 255 steps
+            f32 extent = bounds.max.e[axis] - bounds.min.e[axis];
+            i32 exponent = -100;
+            if(extent > 0)
+                frexpf(extent / 255.0f, &exponent);
+            node.exponent[axis] = (i8)exponent;
+            f32 scale = PowerOfTwo(exponent);
+            f32 origin = bounds.min.e[axis];
+
+            for(i32 i = 0; i < node.childCount; i++)
+            {
+                AABB child = nodes[children[i]].Bounds();
+                i32 lo = Clamp((i32)floorf((child.min.e[axis] - origin) / scale), 0, 255);
+                i32 hi = Clamp((i32)ceilf((child.max.e[axis] - origin) / scale), 0, 255);
+                while(lo > 0 && origin + lo * scale > child.min.e[axis])
+                    lo--;
+                while(hi < 255 && origin + hi * scale < child.max.e[axis])
+                    hi++;
+                qMin[axis][i] = (u8)lo;
+                qMax[axis][i] = (u8)hi;
+            }
+        }
+    }
+
+    // NOTE(mevex): 2^exponent straight from the float bits, the exponents stay in the normal range
+    inline f32 PowerOfTwo(i32 exponent)
+    {
+        u32 bits = (u32)(exponent + 127) << 23;
+        f32 result;
+        memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    // NOTE(mevex): Entry and exit distances of the ray for the four children. The near planes
+    // along an axis are the min ones if the ray goes in the positive direction, the max ones otherwise.
+    inline void SlabTest(BVH4Node& node, Ray& r, v3& invDir, bool negX, bool negY, bool negZ,
+                         f32 tMin, f32 tMax, wide_f32& tEntry, wide_f32& tExit)
+    {
+        wide_f32 scaleX = WideFloatSetAll(invDir.x * PowerOfTwo(node.exponent[0]));
+        wide_f32 scaleY = WideFloatSetAll(invDir.y * PowerOfTwo(node.exponent[1]));
+        wide_f32 scaleZ = WideFloatSetAll(invDir.z * PowerOfTwo(node.exponent[2]));
+        wide_f32 baseX = WideFloatSetAll((node.originX - r.origin.x) * invDir.x);
+        wide_f32 baseY = WideFloatSetAll((node.originY - r.origin.y) * invDir.y);
+        wide_f32 baseZ = WideFloatSetAll((node.originZ - r.origin.z) * invDir.z);
+
+        wide_f32 nearX = WideFloatAdd(baseX, WideFloatMultiply(WideConvertIntToFloat(WideIntLoadU8x4(negX ? node.qMaxX : node.qMinX)), scaleX));
+        wide_f32 nearY = WideFloatAdd(baseY, WideFloatMultiply(WideConvertIntToFloat(WideIntLoadU8x4(negY ? node.qMaxY : node.qMinY)), scaleY));
+        wide_f32 nearZ = WideFloatAdd(baseZ, WideFloatMultiply(WideConvertIntToFloat(WideIntLoadU8x4(negZ ? node.qMaxZ : node.qMinZ)), scaleZ));
+        wide_f32 farX = WideFloatAdd(baseX, WideFloatMultiply(WideConvertIntToFloat(WideIntLoadU8x4(negX ? node.qMinX : node.qMaxX)), scaleX));
+        wide_f32 farY = WideFloatAdd(baseY, WideFloatMultiply(WideConvertIntToFloat(WideIntLoadU8x4(negY ? node.qMinY : node.qMaxY)), scaleY));
+        wide_f32 farZ = WideFloatAdd(baseZ, WideFloatMultiply(WideConvertIntToFloat(WideIntLoadU8x4(negZ ? node.qMinZ : node.qMaxZ)), scaleZ));
+
+        // NOTE(mevex): The exit distance is pushed out a bit to make up for the rounding of the
+        // slab math, so rays grazing a box never miss it
+        tEntry = WideFloatMax(WideFloatMax(nearX, nearY), WideFloatMax(nearZ, WideFloatSetAll(tMin)));
+        tExit = WideFloatMin(WideFloatMin(farX, farY), WideFloatMin(farZ, WideFloatSetAll(tMax)));
+        tExit = WideFloatMultiply(tExit, WideFloatSetAll(1.0000004f));
+    }
+
+    // NOTE(mevex): Entry distance of the ray in the node, INFINITY if it misses
+    inline f32 SlabTest(BVHNode& node, Ray& r, v3& invDir, f32 tMin, f32 tMax)
+    {
+        f32 tx0 = (node.minX - r.origin.x) * invDir.x, tx1 = (node.maxX - r.origin.x) * invDir.x;
+        f32 ty0 = (node.minY - r.origin.y) * invDir.y, ty1 = (node.maxY - r.origin.y) * invDir.y;
+        f32 tz0 = (node.minZ - r.origin.z) * invDir.z, tz1 = (node.maxZ - r.origin.z) * invDir.z;
+        f32 tEntry = Max(Max(Min(tx0, tx1), Min(ty0, ty1)), Max(Min(tz0, tz1), tMin));
+        f32 tExit = Min(Min(Max(tx0, tx1), Max(ty0, ty1)), Min(Max(tz0, tz1), tMax)) * 1.0000004f;
+        f32 result = (tEntry <= tExit) ? tEntry : INFINITY;
+        return result;
+    }
+};
+
+#endif //BVH_H
@@ -0,0 +1,403 @@
+#ifndef CANVAS_H
+#define CANVAS_H
+
+#include "v3.h"
+#include "image.h"
+#include "threads.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// NOTE(mevex): One entry of the float accumulation buffer. The color is the
+// running sum of all the samples taken for the pixel, the average is computed
+// only when the canvas gets resolved to 8-bit.
+struct AccumPixel
+{
+    f32 r, g, b;
+    u32 samples;
+};
+
+#define CHECKPOINT_MAGIC 0x4B435452 // "RTCK"
+#define CHECKPOINT_VERSION 3
+
+// NOTE(mevex): What the accumulated samples depend on besides the size of the canvas. renderHash is a hash
+// of the scene and the camera, see RenderJob::CheckpointKey. A checkpoint is only resumed by a render
+// with the same key.
+struct CheckpointKey
+{
+    u32 samplesPerPixel;
+    u32 samplesPerPass;
+    u32 maxDepth;
+    u32 seed;
+    u64 renderHash;
+};
+
+struct CheckpointHeader
+{
+    u32 magic;
+    u32 version;
+    i32 width;
+    i32 height;
+    u32 passesDone;
+    u32 reserved;
+    CheckpointKey key;
+};
+
+class Canvas
+{
+    public:
+
+    void* memory;
+    i32 width;
+    i32 height;
+    i32 bytesPerPixel;
+    f32 ratio;
+
+    // NOTE(mevex): Same layout as memory (top row first)
+    AccumPixel *accum;
+
+    // NOTE(mevex): Accumulates only the odd passes of every pixel. Comparing it with
+    // the full buffer gives a cheap estimate of the remaining noise (Dammertz et al.)
+    AccumPixel *halfAccum;
+
+    // NOTE(mevex): Milliseconds spent in the last call to Write
+    f32 lastEncodeTime = 0;
+
+    Canvas(i32 w, i32 h, i32 bpp)
+    {
+        width = w;
+        height = h;
+        bytesPerPixel = bpp;
+        ratio = (f32)w / (f32)h;
+        memory = malloc(bpp * w * h);
+        accum = (AccumPixel *)calloc(w * h, sizeof(AccumPixel));
+        halfAccum = (AccumPixel *)calloc(w * h, sizeof(AccumPixel));
+    }
+
+    inline i32 PixelIndex(i32 x, i32 y)
+    {
+        i32 result = (height-y-1)*width + x;
+        return result;
+    }
+
+    void SetPixel(i32 x, i32 y, f32 red, f32 green, f32 blue)
+    {
+        // NOTE(mevex): Clamp before the gamma correction, otherwise values
+        // above 1 wrap around when they get truncated to 8 bits
+        red = Clamp(red, 0.0f, 1.0f);
+        green = Clamp(green, 0.0f, 1.0f);
+        blue = Clamp(blue, 0.0f, 1.0f);
+
+        u8 r,g,b;
+
+        r = (u8)(255.99f * sqrt(red));
+        g = (u8)(255.99f * sqrt(green));
+        b = (u8)(255.99f * sqrt(blue));
+
+        i32* pixel = (i32*)memory;
+        pixel += PixelIndex(x, y);
+        *pixel = 255<<24 | b << 16 | g << 8 | r;
+    }
+
+    void SetPixel(i32 x, i32 y, Color c)
+    {
+        SetPixel(x, y, c.r, c.g, c.b);
+    }
+
+    void SetPixel(i32 x, i32 y, Color c, int spp)
+    {
+        f32 scale = 1.0f / spp;
+        c *= scale;
+        SetPixel(x, y, c.r, c.g, c.b);
+    }
+
+    // NOTE(mevex): c is the sum of sampleCount samples
+    inline void AddSamples(i32 x, i32 y, Color c, u32 sampleCount, bool oddPass = false)
+    {
+        i32 index = PixelIndex(x, y);
+        AccumPixel *pixel = accum + index;
+        pixel->r += c.r;
+        pixel->g += c.g;
+        pixel->b += c.b;
+        pixel->samples += sampleCount;
+
+        if(oddPass)
+        {
+            pixel = halfAccum + index;
+            pixel->r += c.r;
+            pixel->g += c.g;
+            pixel->b += c.b;
+            pixel->samples += sampleCount;
+        }
+    }
+
+    // NOTE(mevex): Average relative difference between the full and the half buffer over
+    // the rectangle [minX, maxX)x[minY, maxY). Returns INFINITY if some pixel has no odd
+    // pass yet, since nothing is known about its noise.
+    f32 EstimateError(i32 minX, i32 minY, i32 maxX, i32 maxY)
+    {
+        f32 error = 0;
+        for(i32 y = minY; y < maxY; y++)
+        {
+            for(i32 x = minX; x < maxX; x++)
+            {
+                i32 index = PixelIndex(x, y);
+                if(!halfAccum[index].samples)
+                    return INFINITY;
+
+                AccumPixel *full = accum + index;
+                AccumPixel *half = halfAccum + index;
+                f32 fullScale = 1.0f / full->samples;
+                f32 halfScale = 1.0f / half->samples;
+                f32 difference = Abs(full->r*fullScale - half->r*halfScale) +
+                    Abs(full->g*fullScale - half->g*halfScale) +
+                    Abs(full->b*fullScale - half->b*halfScale);
+                f32 brightness = (full->r + full->g + full->b) * fullScale;
+                error += difference / sqrt(Max(brightness, 1e-3f));
+            }
+        }
+
+        i32 pixelCount = (maxX - minX) * (maxY - minY);
+        return pixelCount ? error / pixelCount : 0;
+    }
+
+    inline Color GetAverage(i32 index)
+    {
+        AccumPixel *pixel = accum + index;
+        Color result(0,0,0);
+        if(pixel->samples)
+        {
+            f32 scale = 1.0f / pixel->samples;
+            result = Color(pixel->r * scale, pixel->g * scale, pixel->b * scale);
+        }
+        return result;
+    }
+
+    void ClearAccumulation()
+    {
+        memset(accum, 0, width * height * sizeof(AccumPixel));
+        memset(halfAccum, 0, width * height * sizeof(AccumPixel));
+    }
+
+    // NOTE(mevex): Converts the accumulated samples of the rows [firstRow, lastRow) (memory
+    // order) into the 8-bit buffer. Four pixels at a time: every AccumPixel fits in one
+    // register, the sample count in the last lane gives the scale for the whole pixel.
+    void ResolveRows(i32 firstRow, i32 lastRow)
+    {
+        wide_f32 zero = WideFloatSetAll(0.0f);
+        wide_f32 one = WideFloatSetAll(1.0f);
+        wide_f32 maxValue = WideFloatSetAll(255.99f);
+        wide_i32 alphaMask = WideIntSetAll(0xFF000000);
+
+        for(i32 row = firstRow; row < lastRow; row++)
+        {
+            AccumPixel *src = accum + row * width;
+            u32 *dest = (u32 *)memory + row * width;
+
+            i32 x = 0;
+            for(; x + 4 <= width; x += 4)
+            {
+                wide_i32 channels[4];
+                for(int i = 0; i < 4; i++)
+                {
+                    wide_f32 pixel = WideFloatLoad((f32 *)(src + x + i));
+                    wide_f32 samples = WideConvertIntToFloat(WideCastFloatToInt(pixel));
+                    samples = WideFloatBroadcastLane(samples, 3);
+                    // NOTE(mevex): 1/0 gives inf, the mask turns it into 0 for pixels without samples
+                    wide_f32 scale = WideFloatAnd(WideFloatDivide(one, samples), WideFloatGreater(samples, zero));
+
+                    wide_f32 c = WideFloatMultiply(pixel, scale);
+                    c = WideFloatMin(WideFloatMax(c, zero), one);
+                    c = WideFloatMultiply(WideFloatSqrt(c), maxValue);
+                    channels[i] = WideTruncateFloatToInt(c);
+                }
+
+                wide_i32 packed = WideIntPackToU8(WideIntPackToI16(channels[0], channels[1]),
+                                                  WideIntPackToI16(channels[2], channels[3]));
+                WideIntStore(dest + x, WideIntOr(packed, alphaMask));
+            }
+
+            for(; x < width; x++)
+            {
+                SetPixel(x, height - row - 1, GetAverage(row * width + x));
+            }
+        }
+    }
+
+    // NOTE(mevex): Converts the accumulated samples into the 8-bit buffer
+    void Resolve(WorkerPool *pool = 0)
+    {
+        if(pool)
+        {
+            i32 rowsPerJob = 16;
+            i32 jobCount = (height + rowsPerJob - 1) / rowsPerJob;
+            pool->ParallelFor(jobCount, [&](i32 job)
+            {
+                ResolveRows(job * rowsPerJob, Min((job + 1) * rowsPerJob, height));
+            });
+        }
+        else
+            ResolveRows(0, height);
+    }
+
+    // NOTE(mevex): Resolves only the pixels in [minX, maxX)x[minY, maxY), used to show
+    // tiles while the rest of the image is still rendering
+    void ResolveRect(i32 minX, i32 minY, i32 maxX, i32 maxY)
+    {
+        for(i32 y = minY; y < maxY; y++)
+        {
+            for(i32 x = minX; x < maxX; x++)
+            {
+                SetPixel(x, y, GetAverage(PixelIndex(x, y)));
+            }
+        }
+    }
+
+    // NOTE(mevex): Writes the linear averages as packed RGB floats, top row first.
+    // The caller owns the returned memory.
+    f32 *ResolveHDR()
+    {
+        f32 *result = (f32 *)malloc(width * height * 3 * sizeof(f32));
+        for(i32 i = 0; i < width * height; i++)
+        {
+            Color c = GetAverage(i);
+            result[3*i + 0] = c.r;
+            result[3*i + 1] = c.g;
+            result[3*i + 2] = c.b;
+        }
+        return result;
+    }
+
+    // NOTE(mevex): The checkpoint is written to a temporary file first and then
+    // renamed, so a process killed while writing never leaves a broken checkpoint
+    bool SaveCheckpoint(const char *filename, u32 passesDone, CheckpointKey& key)
+    {
+        char tmpName[512];
+        snprintf(tmpName, sizeof(tmpName), "%s.tmp", filename);
+
+        FILE *file = fopen(tmpName, "wb");
+        if(!file)
+            return false;
+
+        CheckpointHeader header = {};
+        header.magic = CHECKPOINT_MAGIC;
+        header.version = CHECKPOINT_VERSION;
+        header.width = width;
+        header.height = height;
+        header.passesDone = passesDone;
+        header.key = key;
+
+        size_t pixelCount = (size_t)width * height;
+        bool result = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(accum, sizeof(AccumPixel), pixelCount, file) == pixelCount &&
+            fwrite(halfAccum, sizeof(AccumPixel), pixelCount, file) == pixelCount;
+        result = (fclose(file) == 0) && result;
+
+        if(result)
+        {
+            remove(filename);
+            result = rename(tmpName, filename) == 0;
+        }
+        else
+            remove(tmpName);
+
+        return result;
+    }
+
+    // NOTE(mevex): Returns false if there is no checkpoint or if it was made with a different
+    // key or canvas size, in that case the accumulation buffer is untouched
+    bool LoadCheckpoint(const char *filename, CheckpointKey& key, u32 &passesDone)
+    {
+        FILE *file = fopen(filename, "rb");
+        if(!file)
+            return false;
+
+        CheckpointHeader header = {};
+        bool result = fread(&header, sizeof(header), 1, file) == 1 &&
+            header.magic == CHECKPOINT_MAGIC && header.version == CHECKPOINT_VERSION &&
+            header.width == width && header.height == height &&
+            header.key.samplesPerPixel == key.samplesPerPixel && header.key.samplesPerPass == key.samplesPerPass &&
+            header.key.maxDepth == key.maxDepth && header.key.seed == key.seed && header.key.renderHash == key.renderHash;
+
+        if(result)
+        {
+            size_t pixelCount = (size_t)width * height;
+            AccumPixel *loaded = (AccumPixel *)malloc(2 * pixelCount * sizeof(AccumPixel));
+            result = fread(loaded, sizeof(AccumPixel), 2 * pixelCount, file) == 2 * pixelCount;
+            if(result)
+            {
+                memcpy(accum, loaded, pixelCount * sizeof(AccumPixel));
+                memcpy(halfAccum, loaded + pixelCount, pixelCount * sizeof(AccumPixel));
+                passesDone = header.passesDone;
+            }
+            free(loaded);
+        }
+
+        fclose(file);
+        return result;
+    }
+
+    // NOTE(mevex): The format is chosen by the extension of the filename: png, qoi, ppm
+    // and the HDR formats pfm and exr. Anything else falls back to stb_image_write.
+    // The 8-bit formats write the current content of memory, call Resolve first.
+    bool Write(const char *filename, WorkerPool *pool = 0)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+
+        const char *extension = strrchr(filename, '.');
+        extension = extension ? extension + 1 : "";
+
+        bool result = false;
+        vector<u8> encoded;
+        u8 *pixels = (u8 *)memory;
+        if(!strcmp(extension, "png"))
+        {
+            EncodePNG(encoded, width, height, pixels, pool);
+            result = WriteBuffer(filename, encoded);
+        }
+        else if(!strcmp(extension, "qoi"))
+        {
+            EncodeQOI(encoded, width, height, pixels);
+            result = WriteBuffer(filename, encoded);
+        }
+        else if(!strcmp(extension, "ppm"))
+        {
+            EncodePPM(encoded, width, height, pixels);
+            result = WriteBuffer(filename, encoded);
+        }
+        else if(!strcmp(extension, "pfm") || !strcmp(extension, "exr"))
+        {
+            f32 *hdr = ResolveHDR();
+            if(extension[0] == 'p')
+                result = WritePFM(filename, width, height, hdr);
+            else
+                result = WriteEXR(filename, width, height, hdr);
+            free(hdr);
+        }
+        else if(!strcmp(extension, "bmp"))
+            result = stbi_write_bmp(filename, width, height, bytesPerPixel, memory) != 0;
+        else if(!strcmp(extension, "tga"))
+            result = stbi_write_tga(filename, width, height, bytesPerPixel, memory) != 0;
+        else if(!strcmp(extension, "jpg"))
+            result = stbi_write_jpg(filename, width, height, bytesPerPixel, memory, 95) != 0;
+        else
+            printf("ERR: unknown image format %s\n", filename);
+
+        auto end = std::chrono::high_resolution_clock::now();
+        lastEncodeTime = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000.0f;
+        return result;
+    }
+
+    Canvas(const Canvas&) = delete;
+    Canvas& operator=(const Canvas&) = delete;
+
+    ~Canvas()
+    {
+        free(memory);
+        free(accum);
+        free(halfAccum);
+    }
+};
+
+#endif //CANVAS_H
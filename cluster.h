@@ -0,0 +1,400 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "bvh.h"
+#include "hittable.h"
+#include "material.h"
+#include <condition_variable>
+#include <list>
+#include <mutex>
+
+// NOTE(mevex): Out-of-core meshes. WriteClusterFile cuts a mesh into spatial clusters of a few
+// thousand triangles (subtrees of its BVH) and stores every cluster in its own page aligned block
+// of a file. ClusteredMesh maps that file and only keeps the cluster bounds, a BVH over them and
+// the materials resident. A cluster is read the first time a ray reaches it, kept in a cache and
+// evicted, least recently used first, once the cache goes over its memory budget.
+//
+// File layout: ClusterFileHeader, ClusterInfo table, material albedos (3 f32 each), then the clusters,
+// each starting on a ClusterPageSize boundary: the binary BVH nodes of the subtree followed by its
+// ClusterTriangles in mesh space, so reading a cluster doesn't have to build anything.
+
+#define CLUSTER_FILE_MAGIC "RTCLUST1"
+
+struct ClusterFileHeader
+{
+    char magic[8];
+    u32 clusterCount;
+    u32 materialCount;
+    u64 tableOffset;
+    u64 materialOffset;
+};
+
+struct ClusterInfo
+{
+    u64 offset;
+    u32 triangleCount;
+    u32 nodeCount;
+    f32 min[3];
+    f32 max[3];
+};
+
+struct ClusterTriangle
+{
+    f32 a[3], b[3], c[3];
+    // NOTE(mevex): NoMaterial for triangles without one
+    u32 material;
+};
+
+// NOTE(mevex): Read only mapping of a whole file, defined in raytracer.cpp
+class MappedFile
+{
+    public:
+
+    u8 *data = 0;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    bool Open(const char *filename);
+    void Close();
+    // NOTE(mevex): Lets the OS drop the pages of the range, they are read from the file again if touched
+    void Release(u64 offset, u64 bytes);
+
+    private:
+
+    intptr_t file = -1;
+    intptr_t mapping = 0;
+};
+
+struct ClusterCacheStats
+{
+    u64 loads;
+    u64 evictions;
+    // NOTE(mevex): Rays that found their cluster being read by another thread and waited for it
+    u64 waits;
+    size_t residentBytes;
+    size_t peakBytes;
+};
+
+class ClusteredMesh : public Hittable
+{
+    public:
+
+    enum
+    {
+        DefaultClusterSize = 4096,
+        ClusterPageSize = 4096,
+        NoMaterial = 0xFFFFFFFF,
+    };
+
+    p3 position;
+    Sphere boundingSphere;
+    vector<Lambertian> materials;
+    // NOTE(mevex): Used by triangles without a material
+    Lambertian defaultMaterial = Lambertian(Color(0.5f, 0.5f, 0.5f));
+
+    // NOTE(mevex): Triangles and BVHs of the resident clusters, the cache can go over it while
+    // every cluster in it is being used by a ray
+    size_t memoryBudget = (size_t)256 * 1024 * 1024;
+    ClusterCacheStats stats = {};
+
+    ClusteredMesh(p3 p) : position(p) {}
+    ClusteredMesh(const ClusteredMesh&) = delete;
+    ClusteredMesh& operator=(const ClusteredMesh&) = delete;
+
+    // NOTE(mevex): Maps the file and builds the BVH over the clusters, no triangle is read here
+    bool Open(const char *filename)
+    {
+        if(!file.Open(filename) || file.size < sizeof(ClusterFileHeader))
+            return false;
+
+        ClusterFileHeader header;
+        memcpy(&header, file.data, sizeof(header));
+        if(memcmp(header.magic, CLUSTER_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+           header.tableOffset + (u64)header.clusterCount * sizeof(ClusterInfo) > file.size ||
+           header.materialOffset + (u64)header.materialCount * 3 * sizeof(f32) > file.size)
+            return false;
+
+        f32 *albedos = (f32 *)(file.data + header.materialOffset);
+        materials.clear();
+        materials.reserve(header.materialCount);
+        for(u32 i = 0; i < header.materialCount; i++)
+            materials.push_back(Lambertian(Color(albedos[3*i], albedos[3*i + 1], albedos[3*i + 2])));
+
+        vector<Cluster> unordered(header.clusterCount);
+        vector<AABB> bounds(header.clusterCount);
+        AABB meshBounds;
+        ClusterInfo *table = (ClusterInfo *)(file.data + header.tableOffset);
+        for(u32 i = 0; i < header.clusterCount; i++)
+        {
+            ClusterInfo& info = table[i];
+            if(info.nodeCount == 0 || info.offset + (u64)info.nodeCount * sizeof(BVHNode) + (u64)info.triangleCount * sizeof(ClusterTriangle) > file.size)
+                return false;
+
+            Cluster& cluster = unordered[i];
+            cluster.offset = info.offset;
+            cluster.triangleCount = info.triangleCount;
+            cluster.nodeCount = info.nodeCount;
+            cluster.bounds.min = v3(info.min[0], info.min[1], info.min[2]) + position;
+            cluster.bounds.max = v3(info.max[0], info.max[1], info.max[2]) + position;
+            bounds[i] = cluster.bounds;
+            meshBounds.Grow(cluster.bounds);
+        }
+
+        vector<u32> order;
+        top.Build(bounds, order, 0, BVHBuild_SAH);
+        clusters.resize(header.clusterCount);
+        for(u32 i = 0; i < header.clusterCount; i++)
+            clusters[i] = unordered[order[i]];
+
+        boundingSphere = Sphere(meshBounds.Center(), (meshBounds.max - meshBounds.min).Length() * 0.5f * 1.0001f);
+        return header.clusterCount > 0;
+    }
+
+    bool Bounds(AABB& result) override
+    {
+        v3 r(boundingSphere.radius, boundingSphere.radius, boundingSphere.radius);
+        result.min = boundingSphere.center - r;
+        result.max = boundingSphere.center + r;
+        return true;
+    }
+
+    inline u32 ClusterCount()
+    {
+        return (u32)clusters.size();
+    }
+
+    // NOTE(mevex): Memory that stays allocated whatever the budget
+    size_t ResidentSize()
+    {
+        size_t result = sizeof(ClusteredMesh) + clusters.capacity() * sizeof(Cluster) + top.MemorySize() + materials.capacity() * sizeof(Lambertian);
+        return result;
+    }
+
+    bool Hit(Ray& r, f32 tMin, f32 tMax, HitRecord& rec) override
+    {
+        HitRecord tmpRec = {};
+        HitBatch(&r, &tMin, &tMax, &tmpRec, 1);
+        bool result = tmpRec.t != INFINITY;
+        if(result)
+            rec = tmpRec;
+        return result;
+    }
+
+    void Hit(Ray r[4], f32 tMin[4], f32 tMax[4], HitRecord rec[4]) override
+    {
+        ++HitCounter;
+        u64 cycleBegin = __rdtsc();
+
+        HitBatch(r, tMin, tMax, rec, 4);
+
+        u64 cycleEnd = __rdtsc();
+        HitCycles += cycleEnd - cycleBegin;
+    }
+
+    private:
+
+    struct ClusterData
+    {
+        vector<Triangle> triangles;
+        BVH bvh;
+        size_t bytes;
+    };
+
+    struct Cluster
+    {
+        AABB bounds;
+        u64 offset;
+        u32 triangleCount;
+        u32 nodeCount;
+        bool loading;
+        std::shared_ptr<ClusterData> data;
+        std::list<u32>::iterator lruEntry;
+    };
+
+    MappedFile file;
+    BVH top;
+    vector<Cluster> clusters;
+
+    std::mutex mutex;
+    std::condition_variable clusterLoaded;
+    // NOTE(mevex): Resident clusters, most recently used first
+    std::list<u32> lru;
+
+    // NOTE(mevex): Every ray goes through the clusters it crosses near to far. The rays are moved
+    // one cluster at a time and rays that are at the same cluster share one lookup (and one read),
+    // a ray stops as soon as its closest hit is nearer than the next cluster.
+    void HitBatch(Ray *r, f32 *tMin, f32 *tMax, HitRecord *rec, i32 rayCount)
+    {
+        struct Visit
+        {
+            u32 cluster;
+            f32 t;
+        };
+        local_persist thread_local vector<Visit> visits[4];
+        u32 next[4] = {};
+        Ray local[4];
+
+        for(i32 i = 0; i < rayCount; i++)
+        {
+            visits[i].clear();
+            if(!boundingSphere.SimpleHit(r[i], tMin[i], tMax[i]))
+                continue;
+
+            f32 tFar = tMax[i];
+            top.Intersect(r[i], tMin[i], tFar, [&](u32 c, f32 t0, f32& t1)
+            {
+                f32 t = EntryDistance(clusters[c].bounds, r[i], t0, t1);
+                if(t != INFINITY)
+                    visits[i].push_back({c, t});
+                return false;
+            });
+            std::sort(visits[i].begin(), visits[i].end(), [](const Visit& a, const Visit& b) { return a.t < b.t; });
+            local[i] = Ray(r[i].origin - position, r[i].direction);
+        }
+
+        for(;;)
+        {
+            i32 pending[4];
+            i32 pendingCount = 0;
+            for(i32 i = 0; i < rayCount; i++)
+            {
+                if(next[i] < visits[i].size() && visits[i][next[i]].t <= tMax[i])
+                    pending[pendingCount++] = i;
+            }
+            if(!pendingCount)
+                break;
+
+            for(i32 p = 0; p < pendingCount; p++)
+            {
+                i32 first = pending[p];
+                if(first < 0)
+                    continue;
+                u32 c = visits[first][next[first]].cluster;
+                std::shared_ptr<ClusterData> data = Acquire(c);
+
+                for(i32 q = p; q < pendingCount; q++)
+                {
+                    i32 i = pending[q];
+                    if(i < 0 || visits[i][next[i]].cluster != c)
+                        continue;
+
+                    HitRecord tmpRec = {};
+                    data->bvh.Intersect(local[i], tMin[i], tMax[i], [&](u32 t, f32 t0, f32& t1)
+                    {
+                        if(!data->triangles[t].Hit(local[i], t0, t1, tmpRec))
+                            return false;
+                        t1 = tmpRec.t;
+                        tmpRec.p += position;
+                        rec[i] = tmpRec;
+                        return true;
+                    });
+                    next[i]++;
+                    pending[q] = -1;
+                }
+            }
+        }
+    }
+
+    // NOTE(mevex): Returns the cluster, reading it if it isn't resident. Threads asking for a cluster
+    // that is being read wait for that read instead of repeating it.
+    std::shared_ptr<ClusterData> Acquire(u32 index)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        Cluster& cluster = clusters[index];
+        if(cluster.loading)
+        {
+            stats.waits++;
+            clusterLoaded.wait(lock, [&]() { return !cluster.loading; });
+        }
+
+        if(cluster.data)
+        {
+            lru.splice(lru.begin(), lru, cluster.lruEntry);
+            return cluster.data;
+        }
+
+        cluster.loading = true;
+        lock.unlock();
+        std::shared_ptr<ClusterData> data = Read(cluster);
+        lock.lock();
+
+        cluster.data = data;
+        cluster.loading = false;
+        lru.push_front(index);
+        cluster.lruEntry = lru.begin();
+        stats.loads++;
+        stats.residentBytes += data->bytes;
+        Evict();
+        stats.peakBytes = Max(stats.peakBytes, stats.residentBytes);
+        clusterLoaded.notify_all();
+        return data;
+    }
+
+    // NOTE(mevex): Clusters still used by a ray are skipped, they go when the next read comes
+    void Evict()
+    {
+        auto it = lru.end();
+        while(stats.residentBytes > memoryBudget && it != lru.begin())
+        {
+            --it;
+            Cluster& cluster = clusters[*it];
+            if(cluster.data.use_count() > 1)
+                continue;
+
+            stats.residentBytes -= cluster.data->bytes;
+            stats.evictions++;
+            cluster.data.reset();
+            it = lru.erase(it);
+        }
+    }
+
+    std::shared_ptr<ClusterData> Read(Cluster& cluster)
+    {
+        std::shared_ptr<ClusterData> result = std::make_shared<ClusterData>();
+        BVHNode *sourceNodes = (BVHNode *)(file.data + cluster.offset);
+        ClusterTriangle *source = (ClusterTriangle *)(sourceNodes + cluster.nodeCount);
+        result->triangles.reserve(cluster.triangleCount);
+        for(u32 i = 0; i < cluster.triangleCount; i++)
+        {
+            ClusterTriangle& t = source[i];
+            Material *material = (t.material < materials.size()) ? (Material *)&materials[t.material] : (Material *)&defaultMaterial;
+            result->triangles.push_back(Triangle(p3(t.a[0], t.a[1], t.a[2]), p3(t.b[0], t.b[1], t.b[2]), p3(t.c[0], t.c[1], t.c[2]), material));
+        }
+
+        vector<BVHNode> nodes(sourceNodes, sourceNodes + cluster.nodeCount);
+        result->bvh.Adopt(nodes);
+        file.Release(cluster.offset, (u64)cluster.nodeCount * sizeof(BVHNode) + (u64)cluster.triangleCount * sizeof(ClusterTriangle));
+
+        result->bytes = sizeof(ClusterData) + result->triangles.capacity() * sizeof(Triangle) + result->bvh.MemorySize();
+        return result;
+    }
+
+    // NOTE(mevex): Entry distance of the ray in the box, INFINITY if it misses
+    inline f32 EntryDistance(const AABB& b, Ray& r, f32 tMin, f32 tMax)
+    {
+        f32 tEntry = tMin;
+        f32 tExit = tMax;
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            f32 d = r.direction.e[axis];
+            f32 invD = 1.0f / (Abs(d) < 1e-20f ? copysignf(1e-20f, d) : d);
+            f32 t0 = (b.min.e[axis] - r.origin.e[axis]) * invD;
+            f32 t1 = (b.max.e[axis] - r.origin.e[axis]) * invD;
+            if(invD < 0)
+                std::swap(t0, t1);
+            tEntry = Max(tEntry, t0);
+            tExit = Min(tExit, t1);
+        }
+        f32 result = (tEntry <= tExit * 1.0000004f) ? tEntry : INFINITY;
+        return result;
+    }
+};
+
+// NOTE(mevex): Defined in raytracer.cpp. The mesh needs its BVH, the clusters are its subtrees.
+bool WriteClusterFile(Mesh& mesh, const char *filename, u32 clusterSize = ClusteredMesh::DefaultClusterSize);
+
+#endif //CLUSTER_H
@@ -0,0 +1,417 @@
+// NOTE(mevex): Distributed tile rendering (Linux only). The coordinator loads the scene, forks
+// the worker processes and hands them tiles over local sockets. Every worker renders all the
+// passes of a tile with RenderTilePasses and sends back the float accumulation of its pixels,
+// the coordinator copies it in its canvas. Since every tile is seeded on its own, the merged
+// image is bit-identical to the one of a single process render with the same settings.
+//
+// Usage: coordinator [-workers n] [-model file.obj] [-out file] [-spp n] [-depth n] [-seed n]
+//                    [-width n] [-height n] [-tile n] [-kill-worker i] [-slow-worker i]
+//
+// A worker that dies gets its tiles reassigned to the others. When all the tiles are handed
+// out, idle workers also take copies of the tiles that have been in flight much longer than the
+// average (a slow or hung worker), the first result that comes back wins. If no worker is left
+// the coordinator renders the remaining tiles itself.
+// -kill-worker and -slow-worker make a worker crash after its first tile or run several times
+// slower, to exercise those paths.
+
+#include "raytracer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// NOTE(mevex): Coordinator -> worker: one u32 tile index. Worker -> coordinator: this header
+// followed by the AccumPixels of the tile, bottom row first (canvas memory order).
+struct TileResultHeader
+{
+    u32 tileIndex;
+    u32 pixelCount;
+};
+
+enum TileState
+{
+    TileState_Pending,
+    TileState_InFlight,
+    TileState_Done,
+};
+
+struct WorkerProcess
+{
+    pid_t pid;
+    int socket;
+    bool alive;
+
+    // NOTE(mevex): Tiles sent and not answered yet, oldest first
+    vector<u32> inFlight;
+    vector<std::chrono::high_resolution_clock::time_point> sentAt;
+};
+
+global_variable const i32 TilesInFlightPerWorker = 2;
+
+bool ReadAll(int fd, void *data, size_t size)
+{
+    u8 *at = (u8 *)data;
+    while(size > 0)
+    {
+        ssize_t count = read(fd, at, size);
+        if(count <= 0)
+            return false;
+        at += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const void *data, size_t size)
+{
+    const u8 *at = (const u8 *)data;
+    while(size > 0)
+    {
+        ssize_t count = send(fd, at, size, MSG_NOSIGNAL);
+        if(count <= 0)
+            return false;
+        at += count;
+        size -= count;
+    }
+    return true;
+}
+
+void CopyTileAccum(Canvas& canvas, Tile& tile, AccumPixel *dest, bool toCanvas)
+{
+    i32 tileWidth = tile.maxX - tile.minX;
+    for(i32 y = tile.minY; y < tile.maxY; y++)
+    {
+        AccumPixel *row = canvas.accum + canvas.PixelIndex(tile.minX, y);
+        AccumPixel *packed = dest + (tile.maxY - 1 - y) * tileWidth;
+        if(toCanvas)
+            memcpy(row, packed, tileWidth * sizeof(AccumPixel));
+        else
+            memcpy(packed, row, tileWidth * sizeof(AccumPixel));
+    }
+}
+
+// NOTE(mevex): Runs in the forked process, the scene was loaded before the fork
+void WorkerMain(int fd, Scene& scene, Camera& camera, RenderSettings& settings, bool crashAfterFirst, bool slow)
+{
+    Canvas canvas(settings.width, settings.height, 4);
+    vector<Tile> tiles = MakeTiles(canvas, settings.tileSize);
+
+    u32 tileIndex;
+    while(ReadAll(fd, &tileIndex, sizeof(tileIndex)))
+    {
+        if(tileIndex >= tiles.size())
+            break;
+
+        Tile tile = tiles[tileIndex];
+        auto begin = std::chrono::high_resolution_clock::now();
+        RenderTilePasses(canvas, camera, scene, tile, settings);
+        if(slow)
+        {
+            auto elapsed = std::chrono::high_resolution_clock::now() - begin;
+            std::this_thread::sleep_for(elapsed * 4);
+        }
+
+        TileResultHeader header = {tileIndex, (u32)((tile.maxX - tile.minX) * (tile.maxY - tile.minY))};
+        vector<AccumPixel> pixels(header.pixelCount);
+        CopyTileAccum(canvas, tile, pixels.data(), false);
+        if(!WriteAll(fd, &header, sizeof(header)) || !WriteAll(fd, pixels.data(), pixels.size() * sizeof(AccumPixel)))
+            break;
+
+        if(crashAfterFirst)
+            _exit(3);
+    }
+    _exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modelFile = "../models/fox2.obj";
+    const char *outputFile = "../renders/render.png";
+    i32 workerCount = 4;
+    i32 killWorker = -1;
+    i32 slowWorker = -1;
+
+    RenderSettings settings;
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i], "-workers"))
+            workerCount = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-model"))
+            modelFile = argv[i+1];
+        else if(!strcmp(argv[i], "-out"))
+            outputFile = argv[i+1];
+        else if(!strcmp(argv[i], "-spp"))
+            settings.samplesPerPixel = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-depth"))
+            settings.maxDepth = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-seed"))
+            settings.seed = (u32)atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-width"))
+            settings.width = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-height"))
+            settings.height = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-tile"))
+            settings.tileSize = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-kill-worker"))
+            killWorker = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-slow-worker"))
+            slowWorker = atoi(argv[i+1]);
+        else
+            printf("WARN: unknown option %s\n", argv[i]);
+    }
+    workerCount = Max(workerCount, 1);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    Camera camera = DefaultCamera((f32)settings.width / (f32)settings.height);
+    Scene scene;
+    if(!BuildDefaultScene(scene, modelFile))
+        return 1;
+    // NOTE(mevex): Built on this thread, the pool would start threads before the fork
+    scene.Prepare();
+    fflush(stdout);
+
+    // NOTE(mevex): No threads exist yet in this process, so forking is safe
+    vector<WorkerProcess> workers(workerCount);
+    for(i32 i = 0; i < workerCount; i++)
+    {
+        int fds[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            printf("ERR: could not create the socket of worker %d\n", i);
+            return 1;
+        }
+
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            close(fds[0]);
+            for(i32 j = 0; j < i; j++)
+                close(workers[j].socket);
+            WorkerMain(fds[1], scene, camera, settings, i == killWorker, i == slowWorker);
+        }
+
+        close(fds[1]);
+        workers[i].pid = pid;
+        workers[i].socket = fds[0];
+        workers[i].alive = pid > 0;
+        if(pid < 0)
+            close(fds[0]);
+    }
+
+    printf("--- Rendering starts ---\n");
+    printf("Samples per pixel: %d Max depth: %d Workers: %d\n", settings.samplesPerPixel, settings.maxDepth, workerCount);
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    Canvas canvas(settings.width, settings.height, 4);
+    vector<Tile> tiles = MakeTiles(canvas, settings.tileSize);
+    vector<TileState> states(tiles.size(), TileState_Pending);
+    vector<u32> copies(tiles.size(), 0);
+    u32 tilesDone = 0;
+    u32 reassigned = 0;
+    u32 duplicated = 0;
+
+    // NOTE(mevex): Average wall time of a tile, from the moment it is sent to the result
+    f32 tileTimeSum = 0;
+    u32 tileTimeCount = 0;
+
+    auto elapsedMs = [](std::chrono::high_resolution_clock::time_point from)
+    {
+        auto now = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(now - from).count() / 1000.0f;
+    };
+
+    auto workerDied = [&](WorkerProcess& worker)
+    {
+        worker.alive = false;
+        close(worker.socket);
+        kill(worker.pid, SIGKILL);
+        waitpid(worker.pid, 0, 0);
+        for(u32 index : worker.inFlight)
+        {
+            copies[index]--;
+            if(states[index] != TileState_Done && copies[index] == 0)
+            {
+                states[index] = TileState_Pending;
+                reassigned++;
+            }
+        }
+        worker.inFlight.clear();
+        worker.sentAt.clear();
+        printf("WARN: worker %d is gone, its tiles go to the others\n", (int)(&worker - workers.data()));
+    };
+
+    auto sendTile = [&](WorkerProcess& worker, u32 index)
+    {
+        if(!WriteAll(worker.socket, &index, sizeof(index)))
+        {
+            workerDied(worker);
+            return;
+        }
+        states[index] = TileState_InFlight;
+        copies[index]++;
+        worker.inFlight.push_back(index);
+        worker.sentAt.push_back(std::chrono::high_resolution_clock::now());
+    };
+
+    // NOTE(mevex): A tile in flight on another worker for more than this many times
+    // the average tile time is given to an idle worker too
+    f32 slowFactor = 3.0f;
+
+    u32 nextPending = 0;
+    while(tilesDone < tiles.size())
+    {
+        // NOTE(mevex): Keep every worker busy, first with the tiles nobody has,
+        // then with copies of the tiles that are taking too long
+        for(WorkerProcess& worker : workers)
+        {
+            while(worker.alive && worker.inFlight.size() < TilesInFlightPerWorker)
+            {
+                while(nextPending < tiles.size() && states[nextPending] != TileState_Pending)
+                    nextPending++;
+                u32 index = nextPending;
+                if(index == tiles.size())
+                {
+                    for(u32 i = 0; i < tiles.size(); i++)
+                    {
+                        if(states[i] == TileState_Pending)
+                            index = i;
+                    }
+                }
+
+                if(index == tiles.size() && worker.inFlight.empty() && tileTimeCount > 0)
+                {
+                    f32 average = tileTimeSum / tileTimeCount;
+                    f32 slowest = 0;
+                    for(WorkerProcess& other : workers)
+                    {
+                        if(&other == &worker || !other.alive || other.inFlight.empty())
+                            continue;
+                        f32 elapsed = elapsedMs(other.sentAt[0]);
+                        if(copies[other.inFlight[0]] == 1 && elapsed > average * slowFactor && elapsed > slowest)
+                        {
+                            slowest = elapsed;
+                            index = other.inFlight[0];
+                        }
+                    }
+                    if(index != tiles.size())
+                        duplicated++;
+                }
+
+                if(index == tiles.size())
+                    break;
+                sendTile(worker, index);
+            }
+        }
+
+        vector<pollfd> fds;
+        vector<WorkerProcess *> polled;
+        for(WorkerProcess& worker : workers)
+        {
+            if(worker.alive && !worker.inFlight.empty())
+            {
+                fds.push_back({worker.socket, POLLIN, 0});
+                polled.push_back(&worker);
+            }
+        }
+
+        if(fds.empty())
+        {
+            // NOTE(mevex): Every worker is gone, finish the render here
+            printf("WARN: no workers left, rendering the remaining tiles in the coordinator\n");
+            for(u32 i = 0; i < tiles.size(); i++)
+            {
+                if(states[i] != TileState_Done)
+                {
+                    RenderTilePasses(canvas, camera, scene, tiles[i], settings);
+                    states[i] = TileState_Done;
+                    tilesDone++;
+                }
+            }
+            break;
+        }
+
+        // NOTE(mevex): Wake up now and then to check for slow tiles
+        if(poll(fds.data(), fds.size(), 100) < 0)
+            continue;
+
+        for(size_t i = 0; i < fds.size(); i++)
+        {
+            WorkerProcess& worker = *polled[i];
+            if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            TileResultHeader header;
+            vector<AccumPixel> pixels;
+            bool valid = ReadAll(worker.socket, &header, sizeof(header)) && header.tileIndex < tiles.size();
+            if(valid)
+            {
+                Tile& tile = tiles[header.tileIndex];
+                valid = header.pixelCount == (u32)((tile.maxX - tile.minX) * (tile.maxY - tile.minY));
+            }
+            if(valid)
+            {
+                pixels.resize(header.pixelCount);
+                valid = ReadAll(worker.socket, pixels.data(), pixels.size() * sizeof(AccumPixel));
+            }
+            if(!valid)
+            {
+                workerDied(worker);
+                continue;
+            }
+
+            for(size_t j = 0; j < worker.inFlight.size(); j++)
+            {
+                if(worker.inFlight[j] == header.tileIndex)
+                {
+                    tileTimeSum += elapsedMs(worker.sentAt[j]);
+                    tileTimeCount++;
+                    copies[header.tileIndex]--;
+                    worker.inFlight.erase(worker.inFlight.begin() + j);
+                    worker.sentAt.erase(worker.sentAt.begin() + j);
+                    break;
+                }
+            }
+
+            if(states[header.tileIndex] != TileState_Done)
+            {
+                CopyTileAccum(canvas, tiles[header.tileIndex], pixels.data(), true);
+                states[header.tileIndex] = TileState_Done;
+                tilesDone++;
+                if(tilesDone % 16 == 0)
+                    printf("\rTiles rendered: %u/%zu", tilesDone, tiles.size());
+            }
+        }
+    }
+
+    // NOTE(mevex): Workers still busy with a copy of a tile are not needed anymore
+    for(WorkerProcess& worker : workers)
+    {
+        if(worker.alive)
+        {
+            close(worker.socket);
+            kill(worker.pid, SIGKILL);
+            waitpid(worker.pid, 0, 0);
+        }
+    }
+
+    f32 renderTimeMs = elapsedMs(begin);
+
+    WorkerPool pool;
+    canvas.Resolve(&pool);
+    if(canvas.Write(outputFile, &pool))
+        printf("\nWrote %s, encode time: %.2fms", outputFile, canvas.lastEncodeTime);
+    else
+        printf("\nERR: could not write %s", outputFile);
+
+    printf("\nRendering time: %ims\n", (int)renderTimeMs);
+    printf("Tiles: %zu Reassigned: %u Duplicated: %u\n", tiles.size(), reassigned, duplicated);
+
+    return 0;
+}
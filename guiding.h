@@ -0,0 +1,401 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "v3.h"
+#include <atomic>
+#include <memory>
+
+// NOTE(mevex): Online path guiding. The renderer learns, while it renders the first passes, from which
+// directions the light reaches every part of the scene, and then sends part of the bounces of the
+// diffuse hits there instead of only around the normal.
+//
+// The light is kept in a spatial-directional tree: a binary tree cuts the scene in boxes and every
+// leaf has a quadtree over the sphere of directions (mapped to the unit square keeping the areas, see
+// DirectionToSquare) whose nodes know how much light came from their part of it. The renders sample
+// the quadtrees built from the passes before and at the same time record their own paths in a second
+// set of sums with the layout of the next quadtrees. Refine, between passes, turns what was recorded
+// into the quadtrees to sample, cuts the boxes that got many samples and the directions that got
+// much of the light, and merges the others.
+
+// NOTE(mevex): u is cos theta around z, v is phi. Equal areas on the square are equal solid angles,
+// the density over the square is 4 PI times the one over the sphere.
+inline void DirectionToSquare(v3 direction, f32& u, f32& v)
+{
+    f32 cosTheta = Clamp(direction.z, -1.0f, 1.0f);
+    f32 phi = atan2f(direction.y, direction.x);
+    if(phi < 0)
+        phi += 2.0f * PI;
+    u = Clamp(0.5f * (cosTheta + 1.0f), 0.0f, 0.99999994f);
+    v = Clamp(phi * (1.0f / (2.0f * PI)), 0.0f, 0.99999994f);
+}
+
+inline v3 SquareToDirection(f32 u, f32 v)
+{
+    f32 cosTheta = 2.0f * u - 1.0f;
+    f32 sinTheta = sqrtf(Max(1.0f - cosTheta * cosTheta, 0.0f));
+    f32 phi = 2.0f * PI * v;
+    v3 result(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+    return result;
+}
+
+// NOTE(mevex): Quadtree over the unit square of directions, every node has the light of its four
+// quadrants (x then y, the lower halves first). child 0 means the quadrant is not cut any further.
+class DirectionalTree
+{
+    public:
+
+    struct Node
+    {
+        f32 sum[4];
+        u32 child[4];
+    };
+
+    vector<Node> nodes;
+
+    DirectionalTree()
+    {
+        nodes.push_back(Node{});
+    }
+
+    // NOTE(mevex): Quadrant of the node the point falls in, u and v become the position inside it
+    static inline u32 Quadrant(f32& u, f32& v)
+    {
+        u32 qx = (u >= 0.5f) ? 1 : 0;
+        u32 qy = (v >= 0.5f) ? 1 : 0;
+        u = 2.0f * u - (f32)qx;
+        v = 2.0f * v - (f32)qy;
+        return qx + 2 * qy;
+    }
+
+    // NOTE(mevex): Density over the unit square, uniform under the nodes that got no light
+    f32 Pdf(f32 u, f32 v)
+    {
+        f32 result = 1.0f;
+        u32 index = 0;
+        for(;;)
+        {
+            Node& node = nodes[index];
+            f32 total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+            if(total <= 0)
+                return result;
+
+            u32 q = Quadrant(u, v);
+            result *= 4.0f * node.sum[q] / total;
+            if(!node.child[q] || result == 0)
+                return result;
+            index = node.child[q];
+        }
+    }
+
+    void Sample(f32& u, f32& v)
+    {
+        f32 originU = 0, originV = 0, size = 1.0f;
+        u32 index = 0;
+        for(;;)
+        {
+            Node& node = nodes[index];
+            f32 total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+            if(total <= 0)
+                break;
+
+            f32 r = RandomFloat() * total;
+            u32 q = 0;
+            while(q < 3 && r >= node.sum[q])
+            {
+                r -= node.sum[q];
+                q++;
+            }
+            // NOTE(mevex): Rounding can pick an empty last quadrant, Pdf would say it can't be sampled
+            while(q > 0 && node.sum[q] <= 0)
+                q--;
+
+            size *= 0.5f;
+            originU += (q & 1) ? size : 0;
+            originV += (q & 2) ? size : 0;
+            if(!node.child[q])
+                break;
+            index = node.child[q];
+        }
+        u = originU + RandomFloat() * size;
+        v = originV + RandomFloat() * size;
+    }
+
+    // NOTE(mevex): Tree with the light of source where the quadrants with more than minLight are cut
+    // in four, down to maxDepth levels, and the others are not cut at all. The sums are those of source,
+    // split evenly where source wasn't cut as deep.
+    static DirectionalTree Refined(DirectionalTree& source, f32 minLight, u32 maxDepth)
+    {
+        DirectionalTree result;
+        result.AddRefined(source, 0, source.nodes[0].sum, 0, 1, minLight, maxDepth);
+        return result;
+    }
+
+    private:
+
+    enum { NoNode = 0xFFFFFFFF };
+
+    void AddRefined(DirectionalTree& source, u32 sourceIndex, f32 *sums, u32 index, u32 depth, f32 minLight, u32 maxDepth)
+    {
+        for(u32 q = 0; q < 4; q++)
+            nodes[index].sum[q] = sums[q];
+
+        for(u32 q = 0; q < 4; q++)
+        {
+            if(sums[q] <= minLight || depth >= maxDepth)
+                continue;
+
+            u32 sourceChild = (sourceIndex != NoNode && source.nodes[sourceIndex].child[q]) ? source.nodes[sourceIndex].child[q] : NoNode;
+            f32 childSums[4];
+            for(u32 c = 0; c < 4; c++)
+                childSums[c] = (sourceChild != NoNode) ? source.nodes[sourceChild].sum[c] : 0.25f * sums[q];
+
+            u32 child = (u32)nodes.size();
+            nodes.push_back(Node{});
+            nodes[index].child[q] = child;
+            AddRefined(source, sourceChild, childSums, child, depth + 1, minLight, maxDepth);
+        }
+    }
+};
+
+class GuidingTree
+{
+    public:
+
+    // NOTE(mevex): Refine cuts a box once it got SplitSamples * sqrt(2^iteration) samples, a direction
+    // once it got MinLightFraction of the light of its box. Recorded samples are clamped to MaxRecord and
+    // summed in fixed point, FixedOne is 1.0, so that the sums don't depend on the order of the threads.
+    enum
+    {
+        SplitSamples = 4000,
+        MaxSpatialDepth = 24,
+        MaxDirectionalDepth = 16,
+        FixedOne = 1 << 16,
+        NoLeaf = 0xFFFFFFFF,
+    };
+    static constexpr f32 MinLightFraction = 0.01f;
+    static constexpr f32 MaxRecord = 1024.0f;
+
+    // NOTE(mevex): Share of the diffuse bounces that follow the learned light once there is some
+    f32 fraction = 0.5f;
+    bool trained = false;
+    bool learning = false;
+    u32 iteration = 0;
+
+    GuidingTree() = default;
+    GuidingTree(const GuidingTree&) = delete;
+    GuidingTree& operator=(const GuidingTree&) = delete;
+
+    // NOTE(mevex): Forgets everything and starts learning over the box. Must not run while rendering.
+    void Reset(AABB bounds, f32 newFraction)
+    {
+        if(!(bounds.min.x <= bounds.max.x))
+            bounds = {v3(-1, -1, -1), v3(1, 1, 1)};
+
+        nodes.clear();
+        leaves.clear();
+        SpatialNode root = {};
+        root.box = bounds;
+        nodes.push_back(root);
+        leaves.emplace_back(new Leaf());
+        leaves[0]->StartRecording();
+
+        fraction = newFraction;
+        trained = false;
+        learning = true;
+        iteration = 0;
+    }
+
+    inline size_t MemorySize()
+    {
+        size_t result = nodes.capacity() * sizeof(SpatialNode);
+        for(auto& leaf : leaves)
+            result += sizeof(Leaf) + (leaf->sampling.nodes.capacity() + leaf->building.nodes.capacity() * 2) * sizeof(DirectionalTree::Node);
+        return result;
+    }
+
+    u32 FindLeaf(p3 p)
+    {
+        if(nodes.empty())
+            return NoLeaf;
+
+        u32 index = 0;
+        while(nodes[index].child)
+        {
+            SpatialNode& node = nodes[index];
+            index = node.child + ((p.e[node.axis] >= node.split) ? 1 : 0);
+        }
+        return nodes[index].leaf;
+    }
+
+    // NOTE(mevex): Picks the bounce of a diffuse hit: with probability fraction from the light learned
+    // around it, otherwise from a cosine lobe around the normal. The lobe is not the one of the materials:
+    // v3::RandomUnitVector only returns vectors of the positive octant, there is no density for what they
+    // sample. Returns what the attenuation of the material is multiplied by, the density of the lobe over
+    // the density of the mix, 0 if the direction goes under the surface. u, v and pdf are for Record.
+    f32 GuideBounce(u32 leaf, v3 normal, v3& direction, f32& u, f32& v, f32& pdf)
+    {
+        DirectionalTree& tree = leaves[leaf]->sampling;
+        normal = Unit(normal);
+        if(trained && RandomFloat() < fraction)
+        {
+            tree.Sample(u, v);
+            direction = SquareToDirection(u, v);
+        }
+        else
+        {
+            // NOTE(mevex): The square maps to the sphere keeping the areas, a random point of it is a
+            // uniformly random direction
+            direction = normal + SquareToDirection(RandomFloat(), RandomFloat());
+            direction = direction.NearZero() ? normal : Unit(direction);
+            DirectionToSquare(direction, u, v);
+        }
+
+        f32 cosine = Dot(direction, normal);
+        if(cosine <= 0)
+        {
+            pdf = 0;
+            return 0;
+        }
+
+        f32 lobePdf = cosine * (1.0f / PI);
+        pdf = lobePdf;
+        if(trained)
+            pdf = fraction * tree.Pdf(u, v) * (1.0f / (4.0f * PI)) + (1.0f - fraction) * lobePdf;
+        f32 result = lobePdf / pdf;
+        return result;
+    }
+
+    // NOTE(mevex): light came from the direction u, v of a hit in leaf, sampled with density pdf
+    void Record(u32 leaf, f32 u, f32 v, f32 light, f32 pdf)
+    {
+        Leaf& l = *leaves[leaf];
+        u64 value = (u64)(Min(light / pdf, (f32)MaxRecord) * FixedOne);
+        u32 index = 0;
+        for(;;)
+        {
+            u32 q = DirectionalTree::Quadrant(u, v);
+            l.recorded[4 * index + q].fetch_add(value, std::memory_order_relaxed);
+            index = l.building.nodes[index].child[q];
+            if(!index)
+                break;
+        }
+        l.samples.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // NOTE(mevex): Call after every pass that recorded. The recorded light becomes the one sampled
+    // and, if keepLearning, the next passes record in trees refined after it. Must not run while rendering.
+    void Refine(bool keepLearning)
+    {
+        for(auto& leaf : leaves)
+        {
+            DirectionalTree& tree = leaf->building;
+            u64 total = 0;
+            for(u32 i = 0; i < 4; i++)
+                total += leaf->recorded[i].load(std::memory_order_relaxed);
+            // NOTE(mevex): A box no path reached keeps what it had
+            if(!total)
+                continue;
+
+            for(size_t node = 0; node < tree.nodes.size(); node++)
+            {
+                for(u32 q = 0; q < 4; q++)
+                    tree.nodes[node].sum[q] = (f32)leaf->recorded[4 * node + q].load(std::memory_order_relaxed) * (1.0f / FixedOne);
+            }
+            leaf->sampling = tree;
+        }
+        trained = true;
+
+        // NOTE(mevex): The new boxes go at the end of the nodes and get checked again with half the samples
+        u32 splitSamples = (u32)(SplitSamples * sqrtf((f32)(1u << Min(iteration, 20u))));
+        for(size_t index = 0; index < nodes.size(); index++)
+        {
+            if(nodes[index].child || nodes[index].depth >= MaxSpatialDepth)
+                continue;
+            Leaf& leaf = *leaves[nodes[index].leaf];
+            u32 samples = leaf.samples.load(std::memory_order_relaxed);
+            if(samples <= splitSamples)
+                continue;
+
+            SpatialNode node = nodes[index];
+            v3 extent = node.box.max - node.box.min;
+            u32 axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+            f32 split = 0.5f * (node.box.min.e[axis] + node.box.max.e[axis]);
+
+            Leaf *other = new Leaf();
+            other->sampling = leaf.sampling;
+            other->building = leaf.building;
+            other->samples = samples / 2;
+            leaf.samples = samples / 2;
+            leaves.emplace_back(other);
+
+            SpatialNode low = {}, high = {};
+            low.box = high.box = node.box;
+            low.box.max.e[axis] = split;
+            high.box.min.e[axis] = split;
+            low.depth = high.depth = node.depth + 1;
+            low.leaf = node.leaf;
+            high.leaf = (u32)leaves.size() - 1;
+
+            nodes[index].child = (u32)nodes.size();
+            nodes[index].axis = axis;
+            nodes[index].split = split;
+            nodes.push_back(low);
+            nodes.push_back(high);
+        }
+
+        learning = keepLearning;
+        iteration++;
+        for(auto& leaf : leaves)
+        {
+            if(learning)
+            {
+                f32 total = 0;
+                for(u32 q = 0; q < 4; q++)
+                    total += leaf->sampling.nodes[0].sum[q];
+                leaf->building = DirectionalTree::Refined(leaf->sampling, total * MinLightFraction, MaxDirectionalDepth);
+                leaf->StartRecording();
+            }
+            else
+            {
+                leaf->building = DirectionalTree();
+                leaf->recorded.reset();
+            }
+        }
+    }
+
+    private:
+
+    struct SpatialNode
+    {
+        AABB box;
+        f32 split;
+        // NOTE(mevex): First of the two children, 0 for the leaves
+        u32 child;
+        u32 leaf;
+        u32 axis;
+        u32 depth;
+    };
+
+    struct Leaf
+    {
+        DirectionalTree sampling;
+        DirectionalTree building;
+        // NOTE(mevex): Four sums for every node of building
+        std::unique_ptr<std::atomic<u64>[]> recorded;
+        std::atomic<u32> samples;
+
+        void StartRecording()
+        {
+            size_t count = 4 * building.nodes.size();
+            recorded.reset(new std::atomic<u64>[count]);
+            for(size_t i = 0; i < count; i++)
+                recorded[i].store(0, std::memory_order_relaxed);
+            samples.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    vector<SpatialNode> nodes;
+    vector<std::unique_ptr<Leaf>> leaves;
+};
+
+#endif //GUIDING_H
@@ -1,13 +1,63 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include "accel.h"
+#include "bvh.h"
 #include "ray.h"
 #include "simd.h"
 #include "v3.h"
+#include <cstring>
+#include <unordered_map>
 
 class Material;
 class Lambertian;
 
+// NOTE(mevex): 64-bit FNV-1a over 32-bit words of what a scene is made of, see Scene::HashContent.
+// Objects only add where their materials are: the contents of the materials are added by the scene,
+// once each, in the order they were first seen, so the hash doesn't depend on where they live in memory.
+struct ContentHash
+{
+    u64 value = 0xCBF29CE484222325ULL;
+    vector<Material *> materials;
+    std::unordered_map<Material *, u32> materialIndex;
+
+    inline void Add(u32 word)
+    {
+        value = (value ^ word) * 0x100000001B3ULL;
+    }
+
+    inline void Add(u64 word)
+    {
+        Add((u32)word);
+        Add((u32)(word >> 32));
+    }
+
+    inline void Add(f32 f)
+    {
+        u32 word;
+        memcpy(&word, &f, sizeof(word));
+        Add(word);
+    }
+
+    inline void Add(v3 v)
+    {
+        Add(v.x);
+        Add(v.y);
+        Add(v.z);
+    }
+
+    inline void AddMaterial(Material *material)
+    {
+        auto found = materialIndex.find(material);
+        if(found == materialIndex.end())
+        {
+            found = materialIndex.emplace(material, (u32)materials.size()).first;
+            materials.push_back(material);
+        }
+        Add(found->second);
+    }
+};
+
 struct HitRecord
 {
     p3 p;
@@ -35,8 +85,16 @@ struct HitRecord
 class Hittable
 {
     public:
+    virtual ~Hittable() {}
     virtual bool Hit(Ray& r, f32 tMin, f32 tMax, HitRecord& rec) = 0;
     virtual void Hit(Ray r[4], f32 tMin[4], f32 tMax[4], HitRecord rec[4]) = 0;
+
+    // NOTE(mevex): Box around the object, used by the scene accelerator. Unbounded objects return false
+    // and are tested by every ray.
+    virtual bool Bounds(AABB& result) { return false; }
+
+    // NOTE(mevex): Adds everything that changes what the object looks like, false if it can't tell
+    virtual bool HashContent(ContentHash& hash) { return false; }
 };
 
 class Sphere : public Hittable
@@ -48,6 +106,21 @@ class Sphere : public Hittable
     Material *material;
     
     Sphere(p3 cen = {0,0,0}, f32 r = 0, Material *m = 0) : center(cen), radius(r), material(m) {}
+
+    bool Bounds(AABB& result) override
+    {
+        result.min = center - v3(radius, radius, radius);
+        result.max = center + v3(radius, radius, radius);
+        return true;
+    }
+
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add(center);
+        hash.Add(radius);
+        hash.AddMaterial(material);
+        return true;
+    }
     
     bool Hit(Ray& r, f32 tMin, f32 tMax, HitRecord& rec) override
     {
@@ -84,78 +157,35 @@ class Sphere : public Hittable
         ++HitCounter;
         u64 cycleBegin = __rdtsc();
 
-        // v3 co = r.origin - center;
-        wide_f32 rayOriginX = WideFloatSetIndividual(r[3].origin.x, r[2].origin.x, r[1].origin.x, r[0].origin.x);
-        wide_f32 rayOriginY = WideFloatSetIndividual(r[3].origin.y, r[2].origin.y, r[1].origin.y, r[0].origin.y);
-        wide_f32 rayOriginZ = WideFloatSetIndividual(r[3].origin.z, r[2].origin.z, r[1].origin.z, r[0].origin.z);
-        wide_f32 centerX = WideFloatSetAll(center.x);
-        wide_f32 centerY = WideFloatSetAll(center.y);
-        wide_f32 centerZ = WideFloatSetAll(center.z);
-
-        wide_f32 coX = WideFloatSubtract(rayOriginX, centerX);
-        wide_f32 coY = WideFloatSubtract(rayOriginY, centerY);
-        wide_f32 coZ = WideFloatSubtract(rayOriginZ, centerZ);
-
-        // f32 a = r.direction.LengthSquared();
-        wide_f32 rayDirectionX = WideFloatSetIndividual(r[3].direction.x, r[2].direction.x, r[1].direction.x, r[0].direction.x);
-        wide_f32 rayDirectionY = WideFloatSetIndividual(r[3].direction.y, r[2].direction.y, r[1].direction.y, r[0].direction.y);
-        wide_f32 rayDirectionZ = WideFloatSetIndividual(r[3].direction.z, r[2].direction.z, r[1].direction.z, r[0].direction.z);
+        // NOTE(mevex): The steps of the single ray Hit, one ray per lane
+        v3x4 origin = v3x4::Gather(r[0].origin, r[1].origin, r[2].origin, r[3].origin);
+        v3x4 direction = v3x4::Gather(r[0].direction, r[1].direction, r[2].direction, r[3].direction);
+        v3x4 co = origin - v3x4(center);
+        wide_f32 a = Dot(direction, direction);
+        wide_f32 halfB = Dot(co, direction);
+        wide_f32 c = WideFloatSubtract(Dot(co, co), WideFloatSetAll(radius*radius));
 
-        wide_f32 a = WideFloatAdd(WideFloatSquare(rayDirectionX), WideFloatAdd(WideFloatSquare(rayDirectionY), WideFloatSquare(rayDirectionZ)));
-        a = WideFloatAdd(WideFloatMultiply(rayDirectionX, rayDirectionX), WideFloatAdd(WideFloatMultiply(rayDirectionY, rayDirectionY), WideFloatMultiply(rayDirectionZ, rayDirectionZ)));
-
-        // f32 halfB = Dot(co, r.direction);
-        wide_f32 halfB = WideFloatAdd(WideFloatMultiply(coX, rayDirectionX), WideFloatAdd(WideFloatMultiply(coY, rayDirectionY), WideFloatMultiply(coZ, rayDirectionZ)));
-
-        // f32 c = co.LengthSquared() - radius*radius;
-        wide_f32 radiusSquared = WideFloatSetAll(radius*radius);
-        wide_f32 coLengthSquared = WideFloatAdd(WideFloatSquare(coX), WideFloatAdd(WideFloatSquare(coY), WideFloatSquare(coZ)));
-
-        wide_f32 c = WideFloatSubtract(coLengthSquared, radiusSquared);
-
-        //f32 discriminant = halfBSquared - aTimesC;
         wide_f32 discriminant = WideFloatSubtract(WideFloatSquare(halfB), WideFloatMultiply(a, c));
-
-        // if discriminant is not greater than 0 return false
-        // if all the results are false, stop the execution here
-        wide_f32 zero = WideFloatSetAll(0.0f);
-        wide_i32 wideResults = WideCastFloatToInt(WideFloatGreater(discriminant, zero));
-        wide_i32 onesMask = WideIntSetAll(0xFFFFFFFF);
-        if (WideIntTestAllZeros(onesMask, wideResults))
-        {
+        wide_f32 wideResults = WideFloatNotLess(discriminant, WideFloatSetAll(0.0f));
+        if(!WideFloatMoveMask(wideResults))
             return;
-        }
 
         // NOTE(mevex): Find the nearest root that lies in the acceptable range
-        // f32 sqrtDis = sqrt(discriminant);
         wide_f32 sqrtDis = WideFloatSqrt(discriminant);
-
-        // f32 root = (-halfB - sqrtDis) / a;
-        wide_f32 halfBNegated = WideFloatSubtract(zero, halfB);
-        wide_f32 root = WideFloatDivide(WideFloatSubtract(halfBNegated, sqrtDis), a);
-
-        // NOTE(mevex): check that the root is between the min-max range
-        wide_f32 wideTMin = WideFloatSetIndividual(tMin[3], tMin[2], tMin[1], tMin[0]); 
-        wide_f32 wideTMax = WideFloatSetIndividual(tMax[3], tMax[2], tMax[1], tMax[0]); 
-        wide_i32 rootLessThanTMax = WideCastFloatToInt(WideFloatLess(root, wideTMax));
-        wide_i32 rootGreaterThanTMin = WideCastFloatToInt(WideFloatGreater(root, wideTMin));
-        wideResults = WideIntAnd(wideResults, WideIntAnd(rootLessThanTMax, rootGreaterThanTMin));
-        if (WideIntTestAllZeros(onesMask, wideResults))
-        {
+        wide_f32 root = WideFloatDivide(WideFloatSubtract(WideFloatNegate(halfB), sqrtDis), a);
+        wide_f32 wideTMin = WideFloatLoad(tMin);
+        wide_f32 wideTMax = WideFloatLoad(tMax);
+        wideResults = WideFloatAnd(wideResults, WideFloatAnd(WideFloatNotLess(root, wideTMin), WideFloatNotGreater(root, wideTMax)));
+        u32 hits = WideFloatMoveMask(wideResults);
+        if(!hits)
             return;
-        }
-
-        // TODO(mevex): simd this once the function takes simd arguments
-        // rec.p = r.At(root) = origin + t*direction;
-        wide_f32 recPX = WideFloatAdd(rayOriginX , WideFloatMultiply(root, rayDirectionX));
-        wide_f32 recPY = WideFloatAdd(rayOriginY , WideFloatMultiply(root, rayDirectionY));
-        wide_f32 recPZ = WideFloatAdd(rayOriginZ , WideFloatMultiply(root, rayDirectionZ));
 
+        v3x4 p = origin + direction * root;
         for(int i = 0; i < 4; ++i)
         {
-            if (ExtractInt(wideResults, i))
+            if(hits & (1 << i))
             {
-                rec[i].p = v3(ExtractFloat(recPX, i), ExtractFloat(recPY, i), ExtractFloat(recPZ, i));
+                rec[i].p = p.Lane(i);
                 rec[i].t = ExtractFloat(root, i);
                 v3 outNormal = (rec[i].p - center) / radius;
                 rec[i].SetFaceNormal(r[i], outNormal);
@@ -189,6 +219,14 @@ class Plane : public Hittable
     
     Plane(p3 p, v3 n, Material *m = 0) : point(p), normal(n), material(m) {}
 
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add(point);
+        hash.Add(normal);
+        hash.AddMaterial(material);
+        return true;
+    }
+
     bool Hit(Ray& r, f32 tMin, f32 tMax, HitRecord& rec) override
     {
         f32 denom = Dot(r.direction, normal);
@@ -214,60 +252,30 @@ class Plane : public Hittable
         ++HitCounter;
         u64 cycleBegin = __rdtsc();
 
-        // f32 denom = Dot(r.direction, normal);
-        wide_f32 rayDirectionX = WideFloatSetIndividual(r[3].direction.x, r[2].direction.x, r[1].direction.x, r[0].direction.x);
-        wide_f32 rayDirectionY = WideFloatSetIndividual(r[3].direction.y, r[2].direction.y, r[1].direction.y, r[0].direction.y);
-        wide_f32 rayDirectionZ = WideFloatSetIndividual(r[3].direction.z, r[2].direction.z, r[1].direction.z, r[0].direction.z);
-        wide_f32 normalX = WideFloatSetAll(normal.x);
-        wide_f32 normalY = WideFloatSetAll(normal.y);
-        wide_f32 normalZ = WideFloatSetAll(normal.z);
-        
-        wide_f32 denom = WideFloatAdd(WideFloatMultiply(rayDirectionX, normalX), WideFloatAdd(WideFloatMultiply(rayDirectionY, normalY), WideFloatMultiply(rayDirectionZ, normalZ)));
-
-        wide_f32 zero = WideFloatSetAll(ZERO);
-        wide_f32 zeroNegated = WideFloatSubtract(WideFloatSetAll(0.0f), zero);
-        wide_i32 onesMask = WideIntSetAll(0xFFFFFFFF);
-
-        //if not(denom < -ZERO || denom > ZERO)
-        wide_i32 wideResults = WideIntOr(WideCastFloatToInt(WideFloatLess(denom, zeroNegated)), WideCastFloatToInt(WideFloatGreater(denom, zero)));
-        if (WideIntTestAllZeros(onesMask, wideResults))
-        {
+        // NOTE(mevex): The steps of the single ray Hit, one ray per lane
+        v3x4 origin = v3x4::Gather(r[0].origin, r[1].origin, r[2].origin, r[3].origin);
+        v3x4 direction = v3x4::Gather(r[0].direction, r[1].direction, r[2].direction, r[3].direction);
+        v3x4 wideNormal(normal);
+        wide_f32 denom = Dot(direction, wideNormal);
+        wide_f32 wideResults = WideFloatGreater(WideFloatAbs(denom), WideFloatSetAll(ZERO));
+        if(!WideFloatMoveMask(wideResults))
             return;
-        }
-        
-        // f32 num = Dot((point - r.origin), normal);
-        wide_f32 pointX = WideFloatSetAll(point.x);
-        wide_f32 pointY = WideFloatSetAll(point.y);
-        wide_f32 pointZ = WideFloatSetAll(point.z);
-        wide_f32 rayOriginX = WideFloatSetIndividual(r[3].origin.x, r[2].origin.x, r[1].origin.x, r[0].origin.x);
-        wide_f32 rayOriginY = WideFloatSetIndividual(r[3].origin.y, r[2].origin.y, r[1].origin.y, r[0].origin.y);
-        wide_f32 rayOriginZ = WideFloatSetIndividual(r[3].origin.z, r[2].origin.z, r[1].origin.z, r[0].origin.z);
-        wide_f32 pointMinusRayOriginX = WideFloatSubtract(pointX, rayOriginX);
-        wide_f32 pointMinusRayOriginY = WideFloatSubtract(pointY, rayOriginY);
-        wide_f32 pointMinusRayOriginZ = WideFloatSubtract(pointZ, rayOriginZ);
-        wide_f32 num = WideFloatAdd(WideFloatMultiply(pointMinusRayOriginX, normalX), WideFloatAdd(WideFloatMultiply(pointMinusRayOriginY, normalY), WideFloatMultiply(pointMinusRayOriginZ, normalZ)));
-
-        // f32 t = num / denom;
+
+        wide_f32 num = Dot(v3x4(point) - origin, wideNormal);
         wide_f32 t = WideFloatDivide(num, denom);
-        
-        // if(t > tMin && t < tMax)
-        wide_f32 wideTMin = WideFloatSetIndividual(tMin[3], tMin[2], tMin[1], tMin[0]); 
-        wide_f32 wideTMax = WideFloatSetIndividual(tMax[3], tMax[2], tMax[1], tMax[0]); 
-        wideResults = WideIntAnd(wideResults, WideIntAnd(WideCastFloatToInt(WideFloatGreater(t, wideTMin)), WideCastFloatToInt(WideFloatLess(t, wideTMax))));
-        if (WideIntTestAllZeros(onesMask, wideResults))
-        {
+        wide_f32 wideTMin = WideFloatLoad(tMin);
+        wide_f32 wideTMax = WideFloatLoad(tMax);
+        wideResults = WideFloatAnd(wideResults, WideFloatAnd(WideFloatNotLess(t, wideTMin), WideFloatNotGreater(t, wideTMax)));
+        u32 hits = WideFloatMoveMask(wideResults);
+        if(!hits)
             return;
-        }
-
 
-        wide_f32 rayAtTX = WideFloatAdd(rayOriginX , WideFloatMultiply(t, rayDirectionX));
-        wide_f32 rayAtTY = WideFloatAdd(rayOriginY , WideFloatMultiply(t, rayDirectionY));
-        wide_f32 rayAtTZ = WideFloatAdd(rayOriginZ , WideFloatMultiply(t, rayDirectionZ));
+        v3x4 p = origin + direction * t;
         for(int i = 0; i < 4; ++i)
         {
-            if (ExtractInt(wideResults, i))
+            if(hits & (1 << i))
             {
-                rec[i].p = v3(ExtractFloat(rayAtTX, i), ExtractFloat(rayAtTY, i), ExtractFloat(rayAtTZ, i));
+                rec[i].p = p.Lane(i);
                 rec[i].t = ExtractFloat(t, i);
                 rec[i].SetFaceNormal(r[i], normal);
                 rec[i].material = material;
@@ -303,6 +311,15 @@ class Triangle : public Hittable
         bc = c-b;
         ca = a-c;
     }
+
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add(a);
+        hash.Add(b);
+        hash.Add(c);
+        hash.AddMaterial(material);
+        return true;
+    }
     
     bool Hit(Ray& r, f32 tMin, f32 tMax, HitRecord& rec) override
     {
@@ -344,98 +361,42 @@ class Triangle : public Hittable
         ++HitCounter;
         u64 cycleBegin = __rdtsc();
 
-        // NOTE(mevex): we know for sure that the origin is the same for every ray
-        // v3 T = r.origin - a;
-        v3 T = r[0].origin - a;
-        wide_f32 TX = WideFloatSetAll(T.x);
-        wide_f32 TY = WideFloatSetAll(T.y);
-        wide_f32 TZ = WideFloatSetAll(T.z);
-
-        v3 P0 = Cross(r[0].direction, edge2);
-        v3 P1 = Cross(r[1].direction, edge2);
-        v3 P2 = Cross(r[2].direction, edge2);
-        v3 P3 = Cross(r[3].direction, edge2);
-        wide_f32 PX = WideFloatSetIndividual(P3.x, P2.x, P1.x, P0.x);
-        wide_f32 PY = WideFloatSetIndividual(P3.y, P2.y, P1.y, P0.y);
-        wide_f32 PZ = WideFloatSetIndividual(P3.z, P2.z, P1.z, P0.z);
+        // NOTE(mevex): The steps of the single ray Hit (MOLLER TRUMBORE), one ray per lane
+        v3x4 origin = v3x4::Gather(r[0].origin, r[1].origin, r[2].origin, r[3].origin);
+        v3x4 direction = v3x4::Gather(r[0].direction, r[1].direction, r[2].direction, r[3].direction);
+        v3x4 T = origin - v3x4(a);
+        v3x4 P = Cross(direction, v3x4(edge2));
+        v3x4 Q = Cross(T, v3x4(edge1));
 
-        v3 Q = Cross(T, edge1);
-        wide_f32 QX = WideFloatSetAll(Q.x);
-        wide_f32 QY = WideFloatSetAll(Q.y);
-        wide_f32 QZ = WideFloatSetAll(Q.z);
-        wide_f32 edge1X = WideFloatSetAll(edge1.x);
-        wide_f32 edge1Y = WideFloatSetAll(edge1.y);
-        wide_f32 edge1Z = WideFloatSetAll(edge1.z);
-
-        // f32 determinant = Dot(P, edge1);
-        wide_f32 determinant = WideFloatAdd(WideFloatMultiply(PX, edge1X), WideFloatAdd(WideFloatMultiply(PY, edge1Y), WideFloatMultiply(PZ, edge1Z)));
-        
-        wide_f32 zero = WideFloatSetAll(ZERO);
-        wide_f32 zeroNegated = WideFloatSubtract(WideFloatSetAll(0.0f), zero);
-        wide_i32 onesMask = WideIntSetAll(0xFFFFFFFF);
-
-        //if not(determinant < -ZERO || determinant > ZERO)
-        wide_i32 wideResults = WideIntOr(WideCastFloatToInt(WideFloatLess(determinant, zeroNegated)), WideCastFloatToInt(WideFloatGreater(determinant, zero)));
-        if (WideIntTestAllZeros(onesMask, wideResults))
-        {
+        wide_f32 determinant = Dot(P, v3x4(edge1));
+        wide_f32 wideResults = WideFloatGreater(WideFloatAbs(determinant), WideFloatSetAll(ZERO));
+        if(!WideFloatMoveMask(wideResults))
             return;
-        }
 
-        // f32 inverseDet = 1.0f / determinant;
         wide_f32 inverseDet = WideFloatDivide(WideFloatSetAll(1.0f), determinant);
-        
-        // f32 u = Dot(P, T) * inverseDet;
-        wide_f32 DotPT = WideFloatAdd(WideFloatMultiply(PX, TX), WideFloatAdd(WideFloatMultiply(PY, TY), WideFloatMultiply(PZ, TZ)));
-        wide_f32 wideU = WideFloatMultiply(DotPT, inverseDet);
-        
-        // f32 v = Dot(Q, r.direction) * inverseDet;
-        wide_f32 rayDirectionX = WideFloatSetIndividual(r[3].direction.x, r[2].direction.x, r[1].direction.x, r[0].direction.x);
-        wide_f32 rayDirectionY = WideFloatSetIndividual(r[3].direction.y, r[2].direction.y, r[1].direction.y, r[0].direction.y);
-        wide_f32 rayDirectionZ = WideFloatSetIndividual(r[3].direction.z, r[2].direction.z, r[1].direction.z, r[0].direction.z);
-        wide_f32 DotQDir = WideFloatAdd(WideFloatMultiply(QX, rayDirectionX), WideFloatAdd(WideFloatMultiply(QY, rayDirectionY), WideFloatMultiply(QZ, rayDirectionZ)));
-        wide_f32 wideV = WideFloatMultiply(DotQDir, inverseDet);
-
-        // if not(u > 0 && v > 0 && u+v < 1)
-        wide_f32 trueZero = WideFloatSetAll(0.0f);
-        wide_i32 uGreaterThanZero = WideCastFloatToInt(WideFloatGreater(wideU, trueZero));
-        wide_i32 vGreaterThanZero = WideCastFloatToInt(WideFloatGreater(wideV, trueZero));
-        wide_i32 uPlusVLessThanOne = WideCastFloatToInt(WideFloatLess(WideFloatAdd(wideU, wideV), WideFloatSetAll(1.0f)));
-        wideResults = WideIntAnd(wideResults, WideIntAnd(uPlusVLessThanOne, WideIntAnd(uGreaterThanZero, vGreaterThanZero)));
-        if (WideIntTestAllZeros(onesMask, wideResults))
-        {
-            return;
-        }
-        
-        // f32 t = Dot(Q, edge2) * inverseDet;
-        wide_f32 edge2X = WideFloatSetAll(edge2.x);
-        wide_f32 edge2Y = WideFloatSetAll(edge2.y);
-        wide_f32 edge2Z = WideFloatSetAll(edge2.z);
-        wide_f32 dotQEdge2 = WideFloatAdd(WideFloatMultiply(QX, edge2X), WideFloatAdd(WideFloatMultiply(QY, edge2Y), WideFloatMultiply(QZ, edge2Z)));
-        wide_f32 t = WideFloatMultiply(dotQEdge2, inverseDet);
-
-        // if not(t > tMin && t < tMax)
-        wide_f32 wideTMin = WideFloatSetIndividual(tMin[3], tMin[2], tMin[1], tMin[0]); 
-        wide_f32 wideTMax = WideFloatSetIndividual(tMax[3], tMax[2], tMax[1], tMax[0]); 
-        wideResults = WideIntAnd(wideResults, WideIntAnd(WideCastFloatToInt(WideFloatGreater(t, wideTMin)), WideCastFloatToInt(WideFloatLess(t, wideTMax))));
-        if (WideIntTestAllZeros(onesMask, wideResults))
-        {
+        wide_f32 wideU = WideFloatMultiply(Dot(P, T), inverseDet);
+        wide_f32 wideV = WideFloatMultiply(Dot(Q, direction), inverseDet);
+        wide_f32 zero = WideFloatSetAll(0.0f);
+        wide_f32 inside = WideFloatAnd(WideFloatAnd(WideFloatNotLess(wideU, zero), WideFloatNotLess(wideV, zero)),
+                                       WideFloatNotGreater(WideFloatAdd(wideU, wideV), WideFloatSetAll(1.0f)));
+        wideResults = WideFloatAnd(wideResults, inside);
+        if(!WideFloatMoveMask(wideResults))
             return;
-        }
 
-        // TODO(mevex): simd this once the function takes simd arguments
-        // rec.p = r.At(t);
-        wide_f32 rayOriginX = WideFloatSetIndividual(r[3].origin.x, r[2].origin.x, r[1].origin.x, r[0].origin.x);
-        wide_f32 rayOriginY = WideFloatSetIndividual(r[3].origin.y, r[2].origin.y, r[1].origin.y, r[0].origin.y);
-        wide_f32 rayOriginZ = WideFloatSetIndividual(r[3].origin.z, r[2].origin.z, r[1].origin.z, r[0].origin.z);
-        wide_f32 rayAtTX = WideFloatAdd(rayOriginX , WideFloatMultiply(t, rayDirectionX));
-        wide_f32 rayAtTY = WideFloatAdd(rayOriginY , WideFloatMultiply(t, rayDirectionY));
-        wide_f32 rayAtTZ = WideFloatAdd(rayOriginZ , WideFloatMultiply(t, rayDirectionZ));
+        wide_f32 t = WideFloatMultiply(Dot(Q, v3x4(edge2)), inverseDet);
+        wide_f32 wideTMin = WideFloatLoad(tMin);
+        wide_f32 wideTMax = WideFloatLoad(tMax);
+        wideResults = WideFloatAnd(wideResults, WideFloatAnd(WideFloatNotLess(t, wideTMin), WideFloatNotGreater(t, wideTMax)));
+        u32 hits = WideFloatMoveMask(wideResults);
+        if(!hits)
+            return;
 
+        v3x4 p = origin + direction * t;
         for(int i = 0; i < 4; ++i)
         {
-            if (ExtractInt(wideResults, i))
+            if(hits & (1 << i))
             {
-                rec[i].p = v3(ExtractFloat(rayAtTX, i), ExtractFloat(rayAtTY, i), ExtractFloat(rayAtTZ, i));
+                rec[i].p = p.Lane(i);
                 rec[i].t = ExtractFloat(t, i);
                 rec[i].SetFaceNormal(r[i], normal);
                 rec[i].SetBarycentrics(ExtractFloat(wideU, i), ExtractFloat(wideV, i));
@@ -457,11 +418,63 @@ class Mesh : public Hittable
     
     vector<Lambertian> materials;
     vector<Triangle> triangles;
+    BVH bvh;
+    // NOTE(mevex): Used by Scene::Prepare and by Update when it rebuilds. BVHBuild_Lazy gets the first
+    // pixels out sooner on big meshes that are only partly visible.
+    BVHBuildMode buildMode = BVHBuild_Auto;
+    // NOTE(mevex): Anything but Accel_BVH traces the triangles through accel instead of bvh, Accel_Auto
+    // picks the kind with a probe (see BuildAccelerator). The BVH is the only one that can be refitted.
+    AccelKind accelKind = Accel_BVH;
+    std::unique_ptr<Accelerator> accel;
+
+    // NOTE(mevex): Where the mesh was moved to from position, see Move. The triangles are not touched,
+    // the rays are moved the other way instead.
+    v3 translation;
+
+    // NOTE(mevex): Update rebuilds the BVH when refitting made its SAH cost grow past this factor of the built one
+    f32 rebuildThreshold = 1.5f;
+
+    // NOTE(mevex): The BVH reorders the triangles, these map the order they were added in to their
+    // position in triangles and back
+    vector<u32> slotOf;
+    vector<u32> originalOf;
+    bool pendingUpdate = false;
     
     Mesh(p3 p, p3 relSpherePos, f32 sphereRadius) : position(p)
     {
         boundingSphere = Sphere(relSpherePos + position, sphereRadius);
     }
+
+    // NOTE(mevex): The bounding sphere has to be computed with ComputeBoundingSphere once all the triangles are added
+    Mesh(p3 p) : position(p) {}
+
+    // NOTE(mevex): Sphere centered on the bounding box of the triangles, not the smallest one but close enough
+    void ComputeBoundingSphere()
+    {
+        if(triangles.empty())
+            return;
+
+        p3 minP = triangles[0].a;
+        p3 maxP = triangles[0].a;
+        for(Triangle& t : triangles)
+        {
+            for(p3 *vertex : {&t.a, &t.b, &t.c})
+            {
+                minP = v3(Min(minP.x, vertex->x), Min(minP.y, vertex->y), Min(minP.z, vertex->z));
+                maxP = v3(Max(maxP.x, vertex->x), Max(maxP.y, vertex->y), Max(maxP.z, vertex->z));
+            }
+        }
+
+        p3 center = 0.5f * (minP + maxP);
+        f32 radiusSquared = 0;
+        for(Triangle& t : triangles)
+        {
+            for(p3 *vertex : {&t.a, &t.b, &t.c})
+                radiusSquared = Max(radiusSquared, (*vertex - center).LengthSquared());
+        }
+
+        boundingSphere = Sphere(center, sqrt(radiusSquared) * 1.0001f);
+    }
     
     void AddTriangle(Triangle t)
     {
@@ -476,57 +489,337 @@ class Mesh : public Hittable
         materials.push_back(m);
     }
     
+    // NOTE(mevex): Builds the BVH and reorders the triangles so that every leaf is a contiguous range
+    void BuildBVH(WorkerPool *pool = 0, BVHBuildMode mode = BVHBuild_Auto)
+    {
+        u32 count = (u32)triangles.size();
+        vector<AABB> bounds(count);
+        for(u32 i = 0; i < count; i++)
+            bounds[i] = TriangleBounds(i);
+
+        vector<u32> order;
+        bvh.Build(bounds, order, pool, mode);
+
+        if(originalOf.size() != count)
+        {
+            originalOf.resize(count);
+            for(u32 i = 0; i < count; i++)
+                originalOf[i] = i;
+        }
+
+        vector<Triangle> sorted;
+        vector<u32> sortedOriginal(count);
+        sorted.reserve(count);
+        slotOf.resize(count);
+        for(u32 i = 0; i < count; i++)
+        {
+            sorted.push_back(triangles[order[i]]);
+            sortedOriginal[i] = originalOf[order[i]];
+            slotOf[sortedOriginal[i]] = i;
+        }
+        triangles.swap(sorted);
+        originalOf.swap(sortedOriginal);
+        pendingUpdate = false;
+    }
+
+    // NOTE(mevex): Builds what accelKind asks for. Accel_Auto tries every kind on probeRays (in the
+    // space of the scene) and keeps the fastest, without rays it keeps the BVH.
+    void BuildAccelerator(WorkerPool *pool, vector<Ray> *probeRays = 0)
+    {
+        AccelKind kind = accelKind;
+        u32 count = (u32)triangles.size();
+        vector<AABB> bounds(count);
+        for(u32 i = 0; i < count; i++)
+            bounds[i] = TriangleBounds(i);
+
+        if(kind == Accel_Auto)
+        {
+            kind = Accel_BVH;
+            if(probeRays && !probeRays->empty())
+            {
+                vector<Ray> local;
+                for(Ray& r : *probeRays)
+                    local.push_back(Ray(r.origin - translation, r.direction));
+
+                AcceleratorProbe probe = {};
+                kind = SelectAccelerator(bounds, local, [&](Ray& r, u32 i, f32 t0, f32& t1)
+                {
+                    HitRecord tmpRec = {};
+                    if(!triangles[i].Hit(r, t0, t1, tmpRec))
+                        return false;
+                    t1 = tmpRec.t;
+                    return true;
+                }, pool, &probe);
+                printf("Accelerator probe (%u triangles, %u sampled): BVH %.2f/%.2fms, grid %.2f/%.2fms, k-d tree %.2f/%.2fms (build/trace) -> %s\n",
+                       count, probe.sampledPrimitives, probe.buildMs[0], probe.traceMs[0], probe.buildMs[1], probe.traceMs[1],
+                       probe.buildMs[2], probe.traceMs[2], AccelKindName(kind));
+            }
+            accelKind = kind;
+        }
+
+        if(kind == Accel_BVH)
+        {
+            accel.reset();
+            BuildBVH(pool, buildMode);
+            return;
+        }
+
+        accel.reset(CreateAccelerator(kind));
+        accel->Build(bounds, pool);
+        pendingUpdate = false;
+    }
+
+    bool Bounds(AABB& result) override
+    {
+        v3 r(boundingSphere.radius, boundingSphere.radius, boundingSphere.radius);
+        result.min = boundingSphere.center - r + translation;
+        result.max = boundingSphere.center + r + translation;
+        return true;
+    }
+
+    // NOTE(mevex): The triangles go in the order they were added, the BVH order can change between builds.
+    // The kind of accelerator is part of it too: rays that hit two triangles at the same distance keep
+    // the one the structure tests first.
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add((u32)triangles.size());
+        for(u32 i = 0; i < triangles.size(); i++)
+        {
+            if(!GetTriangle(i).HashContent(hash))
+                return false;
+        }
+        hash.Add(translation);
+        hash.Add((u32)(accel ? accel->Kind() : Accel_BVH));
+        return true;
+    }
+
+    inline AABB TriangleBounds(u32 slot)
+    {
+        AABB result;
+        result.Grow(triangles[slot].a);
+        result.Grow(triangles[slot].b);
+        result.Grow(triangles[slot].c);
+        return result;
+    }
+
+    // NOTE(mevex): Triangle number index in the order they were added
+    inline Triangle& GetTriangle(u32 index)
+    {
+        Triangle& result = triangles[slotOf.empty() ? index : slotOf[index]];
+        return result;
+    }
+
+    // NOTE(mevex): Moves the vertices of the triangle number index (in the order they were added),
+    // relative to position like AddTriangle. The BVH is refitted by the next Update.
+    void SetTriangle(u32 index, p3 a, p3 b, p3 c)
+    {
+        u32 slot = slotOf.empty() ? index : slotOf[index];
+        triangles[slot] = Triangle(a + position, b + position, c + position, triangles[slot].material);
+        if(accel)
+            pendingUpdate = true;
+        else if(!bvh.Empty())
+        {
+            bvh.MarkDirty(slot);
+            pendingUpdate = true;
+        }
+    }
+
+    // NOTE(mevex): Moves the whole mesh, it costs nothing whatever the size of the mesh
+    inline void Move(p3 newPosition)
+    {
+        translation = newPosition - position;
+    }
+
+    // NOTE(mevex): Applies the SetTriangle calls since the last update: the BVH nodes above the moved
+    // triangles are refitted, or the whole BVH is rebuilt if that made it too slow to trace.
+    // Returns true if it was rebuilt. Must not run while the mesh is being rendered.
+    bool Update(WorkerPool *pool = 0)
+    {
+        if(!pendingUpdate)
+            return false;
+
+        if(accel)
+        {
+            BuildAccelerator(pool);
+            ComputeBoundingSphere();
+            return true;
+        }
+
+        // NOTE(mevex): Lazy trees can't be refitted, making a new one is cheap anyway
+        bool rebuilt = false;
+        if(bvh.IsLazy() || bvh.Refit([&](u32 slot) { return TriangleBounds(slot); }) > bvh.buildStats.sahCost * rebuildThreshold)
+        {
+            BuildBVH(pool, buildMode);
+            rebuilt = true;
+        }
+        pendingUpdate = false;
+
+        // NOTE(mevex): Looser than ComputeBoundingSphere but it doesn't need to go through all the triangles
+        AABB bounds = bvh.nodes[0].Bounds();
+        boundingSphere = Sphere(bounds.Center(), (bounds.max - bounds.min).Length() * 0.5f * 1.0001f);
+        return rebuilt;
+    }
+
     bool Hit(Ray& r, f32 tMin, f32 tMax, HitRecord& rec) override
     {
         bool result = false;
         f32 closestT = tMax;
         HitRecord tmpRec = {};
+        Ray local(r.origin - translation, r.direction);
         
-        if(!boundingSphere.SimpleHit(r, tMin, closestT))
+        if(!boundingSphere.SimpleHit(local, tMin, closestT))
             return false;
-        
-        for(Triangle t : triangles)
+
+        auto intersect = [&](u32 i, f32 t0, f32& t1)
         {
-            if(t.Hit(r, tMin, closestT, tmpRec))
+            if(!triangles[i].Hit(local, t0, t1, tmpRec))
+                return false;
+            t1 = tmpRec.t;
+            rec = tmpRec;
+            return true;
+        };
+
+        if(accel)
+            result = accel->Intersect(local, tMin, closestT, MakeIntersector(intersect));
+        else if(bvh.IsLazy())
+            result = bvh.IntersectBinary(local, tMin, closestT, intersect);
+        else if(!bvh.Empty())
+            result = bvh.Intersect(local, tMin, closestT, intersect);
+        else
+        {
+            for(Triangle& t : triangles)
             {
-                result = true;
-                closestT = tmpRec.t;
-                rec = tmpRec;
+                if(t.Hit(local, tMin, closestT, tmpRec))
+                {
+                    result = true;
+                    closestT = tmpRec.t;
+                    rec = tmpRec;
+                }
             }
         }
-        
+
+        if(result)
+            rec.p += translation;
         return result;
     }
 
+    // NOTE(mevex): The rays of the packet don't share the origin after the first bounce, so
+    // every ray walks the BVH on its own
     void Hit(Ray r[4], f32 tMin[4], f32 tMax[4], HitRecord rec[4])
     {
-        // Chek if the bounding sphere is ever hit by any ray
-        bool shouldTest = false;
-        for (i32 i = 0; i < 4; i++)
+        ++HitCounter;
+        u64 cycleBegin = __rdtsc();
+
+        for(i32 i = 0; i < 4; i++)
         {
-            if(boundingSphere.SimpleHit(r[i], tMin[i], tMax[i]))
+            HitRecord tempRec = {};
+            if(Hit(r[i], tMin[i], tMax[i], tempRec) && tempRec.t < rec[i].t)
             {
-                shouldTest = true;
-                break;
+                tMax[i] = tempRec.t;
+                rec[i] = tempRec;
             }
         }
 
-        if (shouldTest)
+        u64 cycleEnd = __rdtsc();
+        HitCycles += cycleEnd - cycleBegin;
+    }
+
+    // NOTE(mevex): Camera rays share the origin, the packet is culled as a whole through the binary
+    // BVH (see BVH::IntersectPacket). recs and packet.tMax are only changed by nearer hits.
+    void HitPacket(RayPacket& packet, f32 tMin, HitRecord *recs)
+    {
+        ++HitCounter;
+        u64 cycleBegin = __rdtsc();
+
+        if(accel || bvh.IsLazy() || bvh.Empty())
         {
-            for(Triangle t : triangles)
+            for(u32 i = 0; i < packet.count; i++)
             {
-                HitRecord tempRec[4] = {};
-                t.Hit(r, tMin, tMax, tempRec);
-                for (i32 i = 0; i < 4; i++)
+                HitRecord tempRec = {};
+                if(Hit(packet.rays[i], tMin, packet.tMax[i], tempRec) && tempRec.t < recs[i].t)
                 {
-                    if (tempRec[i].t != INFINITY && tempRec[i].t < rec[i].t)
-                    {
-                        tMax[i] = tempRec[i].t;
-                        rec[i] = tempRec[i];
-                    }
+                    packet.tMax[i] = tempRec.t;
+                    recs[i] = tempRec;
                 }
             }
         }
+        else
+        {
+            // NOTE(mevex): The packet in mesh space, moving the origin moves the frustum with it
+            local_persist thread_local RayPacket local;
+            local = packet;
+            local.origin = packet.origin - translation;
+            for(u32 i = 0; i < packet.count; i++)
+                local.rays[i].origin = packet.rays[i].origin - translation;
+
+            HitRecord tmpRec = {};
+            bvh.IntersectPacket(local, tMin, [&](u32 ray, u32 i, f32 t0, f32& t1)
+            {
+                if(!triangles[i].Hit(local.rays[ray], t0, t1, tmpRec))
+                    return false;
+                t1 = tmpRec.t;
+                recs[ray] = tmpRec;
+                recs[ray].p += translation;
+                return true;
+            });
+
+            for(u32 i = 0; i < packet.count; i++)
+                packet.tMax[i] = local.tMax[i];
+        }
+
+        u64 cycleEnd = __rdtsc();
+        HitCycles += cycleEnd - cycleBegin;
+    }
+
+    // NOTE(mevex): Closest hits of a stream of unrelated rays, walked through the BVH several at a time
+    // so that their cache misses overlap (see BVH::IntersectInterleaved). recs and tMax are only changed
+    // by nearer hits.
+    void HitStream(Ray *rays, u32 count, f32 tMin, f32 *tMax, HitRecord *recs)
+    {
+        ++HitCounter;
+        u64 cycleBegin = __rdtsc();
+
+        if(accel || bvh.IsLazy() || bvh.Empty())
+        {
+            for(u32 i = 0; i < count; i++)
+            {
+                HitRecord tempRec = {};
+                if(Hit(rays[i], tMin, tMax[i], tempRec) && tempRec.t < recs[i].t)
+                {
+                    tMax[i] = tempRec.t;
+                    recs[i] = tempRec;
+                }
+            }
+        }
+        else
+        {
+            local_persist thread_local vector<Ray> local;
+            local.resize(count);
+            for(u32 i = 0; i < count; i++)
+                local[i] = Ray(rays[i].origin - translation, rays[i].direction);
+
+            HitRecord tmpRec = {};
+            auto intersect = [&](u32 ray, u32 i, f32 t0, f32& t1)
+            {
+                if(!triangles[i].Hit(local[ray], t0, t1, tmpRec))
+                    return false;
+                t1 = tmpRec.t;
+                recs[ray] = tmpRec;
+                recs[ray].p += translation;
+                return true;
+            };
+            auto prefetch = [&](u32 first, u32 primitiveCount)
+            {
+                u8 *begin = (u8 *)(triangles.data() + first);
+                u8 *end = (u8 *)(triangles.data() + first + primitiveCount);
+                for(u8 *line = begin; line < end; line += 64)
+                    Prefetch(line);
+            };
+            bvh.IntersectInterleaved(local.data(), count, tMin, tMax, intersect, prefetch);
+        }
+
+        u64 cycleEnd = __rdtsc();
+        HitCycles += cycleEnd - cycleBegin;
     }
 };
 
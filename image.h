@@ -0,0 +1,590 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+// NOTE(mevex): Image writers that are not covered by stb_image_write.
+// The HDR writers take packed RGB floats, the LDR encoders take packed
+// 8-bit RGBA. Rows are always passed top row first.
+
+#include <cstdio>
+#include <cstring>
+#include "threads.h"
+
+// NOTE(mevex): Portable Float Map, the simplest HDR format around.
+// Rows are stored bottom to top and a negative scale means little endian.
+inline bool WritePFM(const char *filename, i32 width, i32 height, f32 *rgb)
+{
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+        return false;
+
+    fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+    bool result = true;
+    for(i32 y = height-1; y >= 0 && result; y--)
+    {
+        f32 *row = rgb + (size_t)y * width * 3;
+        result = fwrite(row, sizeof(f32), width * 3, file) == (size_t)(width * 3);
+    }
+
+    result = (fclose(file) == 0) && result;
+    return result;
+}
+
+inline void ExrWriteAttribute(FILE *file, const char *name, const char *type, i32 size, const void *value)
+{
+    fwrite(name, 1, strlen(name) + 1, file);
+    fwrite(type, 1, strlen(type) + 1, file);
+    fwrite(&size, sizeof(i32), 1, file);
+    fwrite(value, 1, size, file);
+}
+
+// NOTE(mevex): Minimal OpenEXR writer: single part, scanline, no compression,
+// 32-bit float channels. Every scanline is its own chunk.
+inline bool WriteEXR(const char *filename, i32 width, i32 height, f32 *rgb)
+{
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+        return false;
+
+    u8 magic[8] = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+    fwrite(magic, 1, sizeof(magic), file);
+
+    // NOTE(mevex): Channels must be sorted by name
+    u8 channels[55] = {};
+    const char *channelNames[] = {"B", "G", "R"};
+    u8 *at = channels;
+    for(int i = 0; i < 3; i++)
+    {
+        i32 pixelType = 2; // FLOAT
+        i32 sampling = 1;
+        *at++ = (u8)channelNames[i][0];
+        *at++ = 0;
+        memcpy(at, &pixelType, 4); at += 4;
+        at += 4; // pLinear + reserved
+        memcpy(at, &sampling, 4); at += 4;
+        memcpy(at, &sampling, 4); at += 4;
+    }
+    *at++ = 0;
+
+    i32 window[4] = {0, 0, width-1, height-1};
+    u8 zero = 0;
+    f32 one = 1.0f;
+    f32 center[2] = {0, 0};
+
+    ExrWriteAttribute(file, "channels", "chlist", sizeof(channels), channels);
+    ExrWriteAttribute(file, "compression", "compression", 1, &zero);
+    ExrWriteAttribute(file, "dataWindow", "box2i", sizeof(window), window);
+    ExrWriteAttribute(file, "displayWindow", "box2i", sizeof(window), window);
+    ExrWriteAttribute(file, "lineOrder", "lineOrder", 1, &zero);
+    ExrWriteAttribute(file, "pixelAspectRatio", "float", 4, &one);
+    ExrWriteAttribute(file, "screenWindowCenter", "v2f", sizeof(center), center);
+    ExrWriteAttribute(file, "screenWindowWidth", "float", 4, &one);
+    fwrite(&zero, 1, 1, file);
+
+    i32 lineSize = width * 3 * sizeof(f32);
+    u64 offset = (u64)ftell(file) + (u64)height * sizeof(u64);
+    for(i32 y = 0; y < height; y++)
+    {
+        fwrite(&offset, sizeof(u64), 1, file);
+        offset += 2 * sizeof(i32) + lineSize;
+    }
+
+    f32 *line = (f32 *)malloc(lineSize);
+    bool result = true;
+    for(i32 y = 0; y < height && result; y++)
+    {
+        f32 *row = rgb + (size_t)y * width * 3;
+        for(i32 x = 0; x < width; x++)
+        {
+            line[x] = row[3*x + 2];
+            line[width + x] = row[3*x + 1];
+            line[2*width + x] = row[3*x + 0];
+        }
+
+        fwrite(&y, sizeof(i32), 1, file);
+        fwrite(&lineSize, sizeof(i32), 1, file);
+        result = fwrite(line, 1, lineSize, file) == (size_t)lineSize;
+    }
+    free(line);
+
+    result = (fclose(file) == 0) && result;
+    return result;
+}
+
+inline bool WriteBuffer(const char *filename, vector<u8>& buffer)
+{
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+        return false;
+
+    bool result = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    result = (fclose(file) == 0) && result;
+    return result;
+}
+
+inline void PushU32BigEndian(vector<u8>& out, u32 value)
+{
+    out.push_back((u8)(value >> 24));
+    out.push_back((u8)(value >> 16));
+    out.push_back((u8)(value >> 8));
+    out.push_back((u8)value);
+}
+
+// NOTE(mevex): Binary PPM (P6), alpha is dropped
+inline void EncodePPM(vector<u8>& out, i32 width, i32 height, u8 *rgba)
+{
+    char header[64];
+    i32 headerSize = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+    out.resize(headerSize + (size_t)width * height * 3);
+    memcpy(out.data(), header, headerSize);
+
+    u8 *dest = out.data() + headerSize;
+    for(size_t i = 0; i < (size_t)width * height; i++)
+    {
+        *dest++ = rgba[4*i + 0];
+        *dest++ = rgba[4*i + 1];
+        *dest++ = rgba[4*i + 2];
+    }
+}
+
+// NOTE(mevex): The Quite OK Image format, see qoiformat.org for the specification
+inline void EncodeQOI(vector<u8>& out, i32 width, i32 height, u8 *rgba)
+{
+    out.clear();
+    out.reserve(14 + (size_t)width * height * 5 / 2 + 8);
+
+    out.push_back('q'); out.push_back('o'); out.push_back('i'); out.push_back('f');
+    PushU32BigEndian(out, width);
+    PushU32BigEndian(out, height);
+    out.push_back(4); // channels
+    out.push_back(0); // sRGB with linear alpha
+
+    u32 index[64] = {};
+    u32 previous = 0xFF000000;
+    i32 run = 0;
+    size_t pixelCount = (size_t)width * height;
+
+    for(size_t i = 0; i < pixelCount; i++)
+    {
+        u32 pixel;
+        memcpy(&pixel, rgba + 4*i, 4);
+
+        if(pixel == previous)
+        {
+            run++;
+            if(run == 62 || i == pixelCount - 1)
+            {
+                out.push_back((u8)(0xC0 | (run - 1)));
+                run = 0;
+            }
+            continue;
+        }
+
+        if(run > 0)
+        {
+            out.push_back((u8)(0xC0 | (run - 1)));
+            run = 0;
+        }
+
+        u8 r = (u8)pixel, g = (u8)(pixel >> 8), b = (u8)(pixel >> 16), a = (u8)(pixel >> 24);
+        u8 pr = (u8)previous, pg = (u8)(previous >> 8), pb = (u8)(previous >> 16), pa = (u8)(previous >> 24);
+
+        i32 hash = (r*3 + g*5 + b*7 + a*11) % 64;
+        if(index[hash] == pixel)
+        {
+            out.push_back((u8)hash);
+        }
+        else
+        {
+            index[hash] = pixel;
+
+            if(a == pa)
+            {
+                i8 dr = (i8)(r - pr);
+                i8 dg = (i8)(g - pg);
+                i8 db = (i8)(b - pb);
+                i8 drg = (i8)(dr - dg);
+                i8 dbg = (i8)(db - dg);
+
+                if(dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+                {
+                    out.push_back((u8)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                }
+                else if(drg > -9 && drg < 8 && dg > -33 && dg < 32 && dbg > -9 && dbg < 8)
+                {
+                    out.push_back((u8)(0x80 | (dg + 32)));
+                    out.push_back((u8)((drg + 8) << 4 | (dbg + 8)));
+                }
+                else
+                {
+                    out.push_back(0xFE);
+                    out.push_back(r); out.push_back(g); out.push_back(b);
+                }
+            }
+            else
+            {
+                out.push_back(0xFF);
+                out.push_back(r); out.push_back(g); out.push_back(b); out.push_back(a);
+            }
+        }
+
+        previous = pixel;
+    }
+
+    for(int i = 0; i < 7; i++)
+        out.push_back(0);
+    out.push_back(1);
+}
+
+// NOTE(mevex): PNG encoder
+// The filtered image is split in blocks of rows that are compressed in parallel.
+// Every block is a self contained deflate block (the LZ77 window restarts with
+// the block) terminated by an empty stored block, the same trick zlib uses for
+// Z_SYNC_FLUSH, so the blocks can simply be concatenated into one zlib stream.
+// The compressor is a hash chain LZ77 with the fixed huffman codes, the same
+// approach stb_image_write uses.
+
+struct DeflateWriter
+{
+    vector<u8> *out;
+    u32 bitBuffer;
+    i32 bitCount;
+
+    inline void AddBits(u32 code, i32 codeBits)
+    {
+        bitBuffer |= code << bitCount;
+        bitCount += codeBits;
+        while(bitCount >= 8)
+        {
+            out->push_back((u8)bitBuffer);
+            bitBuffer >>= 8;
+            bitCount -= 8;
+        }
+    }
+
+    inline void AddHuffman(u32 code, i32 codeBits)
+    {
+        // NOTE(mevex): Huffman codes are stored most significant bit first
+        u32 reversed = 0;
+        for(i32 i = 0; i < codeBits; i++)
+        {
+            reversed = (reversed << 1) | (code & 1);
+            code >>= 1;
+        }
+        AddBits(reversed, codeBits);
+    }
+
+    inline void AddSymbol(u32 n)
+    {
+        if(n <= 143)
+            AddHuffman(0x30 + n, 8);
+        else if(n <= 255)
+            AddHuffman(0x190 + n - 144, 9);
+        else if(n <= 279)
+            AddHuffman(n - 256, 7);
+        else
+            AddHuffman(0xC0 + n - 280, 8);
+    }
+
+    inline void PadToByte()
+    {
+        if(bitCount > 0)
+            AddBits(0, 8 - bitCount);
+    }
+};
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+inline u32 DeflateHash(u8 *data)
+{
+    u32 hash = data[0] | (data[1] << 8) | (data[2] << 16);
+    hash *= 2654435761u;
+    return hash >> (32 - DEFLATE_HASH_BITS);
+}
+
+inline void DeflateBlock(vector<u8>& out, u8 *data, i32 length, bool isFinal, i32 maxChainLength = 32)
+{
+    static const u16 lengthBase[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+    static const u8 lengthExtra[] = { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+    static const u16 distBase[] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32769 };
+    static const u8 distExtra[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+    DeflateWriter writer = {&out, 0, 0};
+    writer.AddBits(isFinal ? 1 : 0, 1); // BFINAL
+    writer.AddBits(1, 2);               // BTYPE = 1 -- fixed huffman
+
+    vector<i32> head(1 << DEFLATE_HASH_BITS, -1);
+    vector<i32> previous(Max(length, 1));
+
+    i32 i = 0;
+    while(i < length - DEFLATE_MIN_MATCH)
+    {
+        u32 hash = DeflateHash(data + i);
+        i32 bestLength = DEFLATE_MIN_MATCH - 1;
+        i32 bestDistance = 0;
+        i32 maxLength = Min(length - i, DEFLATE_MAX_MATCH);
+
+        i32 chain = maxChainLength;
+        for(i32 candidate = head[hash]; candidate >= 0 && i - candidate < DEFLATE_WINDOW && chain--; candidate = previous[candidate])
+        {
+            if(data[candidate + bestLength] != data[i + bestLength])
+                continue;
+
+            i32 matchLength = 0;
+            while(matchLength < maxLength && data[candidate + matchLength] == data[i + matchLength])
+                matchLength++;
+
+            if(matchLength > bestLength)
+            {
+                bestLength = matchLength;
+                bestDistance = i - candidate;
+                if(matchLength == maxLength)
+                    break;
+            }
+        }
+
+        previous[i] = head[hash];
+        head[hash] = i;
+
+        if(bestLength >= DEFLATE_MIN_MATCH)
+        {
+            i32 j;
+            for(j = 0; bestLength > lengthBase[j+1]-1; ++j);
+            writer.AddSymbol(j + 257);
+            if(lengthExtra[j])
+                writer.AddBits(bestLength - lengthBase[j], lengthExtra[j]);
+
+            for(j = 0; bestDistance > distBase[j+1]-1; ++j);
+            writer.AddHuffman(j, 5);
+            if(distExtra[j])
+                writer.AddBits(bestDistance - distBase[j], distExtra[j]);
+
+            // NOTE(mevex): Insert the skipped positions so later matches can find them
+            i32 end = Min(i + bestLength, length - DEFLATE_MIN_MATCH);
+            for(i32 k = i + 1; k < end; k++)
+            {
+                u32 h = DeflateHash(data + k);
+                previous[k] = head[h];
+                head[h] = k;
+            }
+            i += bestLength;
+        }
+        else
+        {
+            writer.AddSymbol(data[i]);
+            i++;
+        }
+    }
+
+    for(; i < length; i++)
+        writer.AddSymbol(data[i]);
+
+    writer.AddSymbol(256); // end of block
+
+    if(!isFinal)
+    {
+        // NOTE(mevex): Empty stored block, realigns the stream to a byte boundary
+        writer.AddBits(0, 3);
+        writer.PadToByte();
+        writer.AddBits(0x0000, 16);
+        writer.AddBits(0xFFFF, 16);
+    }
+    writer.PadToByte();
+}
+
+#define ADLER_BASE 65521
+
+inline u32 Adler32(u8 *data, size_t length)
+{
+    u32 s1 = 1, s2 = 0;
+    while(length > 0)
+    {
+        size_t blockLength = Min(length, (size_t)5552);
+        for(size_t i = 0; i < blockLength; i++)
+        {
+            s1 += data[i];
+            s2 += s1;
+        }
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+        data += blockLength;
+        length -= blockLength;
+    }
+    return (s2 << 16) | s1;
+}
+
+// NOTE(mevex): Checksum of the concatenation of two buffers given their checksums, from zlib
+inline u32 Adler32Combine(u32 adler1, u32 adler2, size_t length2)
+{
+    u32 remainder = (u32)(length2 % ADLER_BASE);
+    u32 sum1 = adler1 & 0xFFFF;
+    u32 sum2 = (remainder * sum1) % ADLER_BASE;
+    sum1 += (adler2 & 0xFFFF) + ADLER_BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - remainder;
+    if(sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if(sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if(sum2 >= ((u32)ADLER_BASE << 1)) sum2 -= ((u32)ADLER_BASE << 1);
+    if(sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+    return (sum2 << 16) | sum1;
+}
+
+inline u32 Crc32(u8 *data, size_t length, u32 crc = 0)
+{
+    struct CrcTable
+    {
+        u32 entries[256];
+        CrcTable()
+        {
+            for(u32 n = 0; n < 256; n++)
+            {
+                u32 c = n;
+                for(int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                entries[n] = c;
+            }
+        }
+    };
+    local_persist const CrcTable crcTable;
+    const u32 *table = crcTable.entries;
+
+    crc = ~crc;
+    for(size_t i = 0; i < length; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline u8 Paeth(i32 a, i32 b, i32 c)
+{
+    i32 p = a + b - c, pa = Abs(p-a), pb = Abs(p-b), pc = Abs(p-c);
+    if(pa <= pb && pa <= pc) return (u8)a;
+    if(pb <= pc) return (u8)b;
+    return (u8)c;
+}
+
+// NOTE(mevex): Writes the filter byte and the filtered row to dest. Like stb, every
+// filter is tried and the one with the lowest sum of absolute values wins.
+inline void FilterPNGRow(u8 *dest, u8 *row, u8 *above, i32 rowBytes, i32 n)
+{
+    local_persist thread_local vector<u8> candidate;
+    candidate.resize(rowBytes);
+
+    i32 bestFilter = 0;
+    i32 bestScore = 0x7FFFFFFF;
+    for(i32 filter = 0; filter < 5; filter++)
+    {
+        i32 score = 0;
+        for(i32 i = 0; i < rowBytes; i++)
+        {
+            i32 left = (i >= n) ? row[i-n] : 0;
+            i32 up = above ? above[i] : 0;
+            i32 upLeft = (above && i >= n) ? above[i-n] : 0;
+
+            u8 value = row[i];
+            switch(filter)
+            {
+                case 1: value = (u8)(row[i] - left); break;
+                case 2: value = (u8)(row[i] - up); break;
+                case 3: value = (u8)(row[i] - ((left + up) >> 1)); break;
+                case 4: value = (u8)(row[i] - Paeth(left, up, upLeft)); break;
+            }
+            candidate[i] = value;
+            score += Abs((i8)value);
+        }
+
+        if(score < bestScore)
+        {
+            bestScore = score;
+            bestFilter = filter;
+            dest[0] = (u8)filter;
+            memcpy(dest + 1, candidate.data(), rowBytes);
+        }
+    }
+}
+
+inline void PushPNGChunk(vector<u8>& out, const char *tag, u8 *data, u32 length)
+{
+    PushU32BigEndian(out, length);
+    size_t crcStart = out.size();
+    out.insert(out.end(), tag, tag + 4);
+    if(length)
+        out.insert(out.end(), data, data + length);
+    PushU32BigEndian(out, Crc32(out.data() + crcStart, length + 4));
+}
+
+inline void EncodePNG(vector<u8>& out, i32 width, i32 height, u8 *rgba, WorkerPool *pool = 0)
+{
+    i32 n = 4;
+    i32 rowBytes = width * n;
+    i32 filteredRowBytes = rowBytes + 1;
+
+    i32 threadCount = pool ? pool->ThreadCount() : 1;
+    i32 rowsPerBlock = Max(16, height / (threadCount * 4));
+    i32 blockCount = (height + rowsPerBlock - 1) / rowsPerBlock;
+
+    vector<u8> filtered((size_t)filteredRowBytes * height);
+    vector<vector<u8>> compressed(blockCount);
+    vector<u32> checksums(blockCount);
+
+    auto encodeBlock = [&](i32 block)
+    {
+        i32 firstRow = block * rowsPerBlock;
+        i32 lastRow = Min(firstRow + rowsPerBlock, height);
+        u8 *blockData = filtered.data() + (size_t)firstRow * filteredRowBytes;
+        for(i32 y = firstRow; y < lastRow; y++)
+        {
+            u8 *row = rgba + (size_t)y * rowBytes;
+            u8 *above = y ? row - rowBytes : 0;
+            FilterPNGRow(filtered.data() + (size_t)y * filteredRowBytes, row, above, rowBytes, n);
+        }
+
+        i32 blockLength = (lastRow - firstRow) * filteredRowBytes;
+        compressed[block].reserve(blockLength / 2);
+        DeflateBlock(compressed[block], blockData, blockLength, block == blockCount - 1);
+        checksums[block] = Adler32(blockData, blockLength);
+    };
+
+    if(pool)
+        pool->ParallelFor(blockCount, encodeBlock);
+    else
+        for(i32 block = 0; block < blockCount; block++)
+            encodeBlock(block);
+
+    vector<u8> zlib;
+    size_t zlibSize = 6;
+    for(auto& c : compressed)
+        zlibSize += c.size();
+    zlib.reserve(zlibSize);
+
+    zlib.push_back(0x78); // DEFLATE 32K window
+    zlib.push_back(0x5E); // FLEVEL = 1
+    u32 adler = 1;
+    for(i32 block = 0; block < blockCount; block++)
+    {
+        zlib.insert(zlib.end(), compressed[block].begin(), compressed[block].end());
+        i32 rows = Min(rowsPerBlock, height - block * rowsPerBlock);
+        adler = Adler32Combine(adler, checksums[block], (size_t)rows * filteredRowBytes);
+    }
+    PushU32BigEndian(zlib, adler);
+
+    u8 signature[8] = { 137,80,78,71,13,10,26,10 };
+    out.clear();
+    out.reserve(zlib.size() + 64);
+    out.insert(out.end(), signature, signature + 8);
+
+    u8 header[13];
+    header[0] = (u8)(width >> 24); header[1] = (u8)(width >> 16); header[2] = (u8)(width >> 8); header[3] = (u8)width;
+    header[4] = (u8)(height >> 24); header[5] = (u8)(height >> 16); header[6] = (u8)(height >> 8); header[7] = (u8)height;
+    header[8] = 8;  // bit depth
+    header[9] = 6;  // RGBA
+    header[10] = 0; // compression
+    header[11] = 0; // filter
+    header[12] = 0; // interlace
+    PushPNGChunk(out, "IHDR", header, 13);
+    PushPNGChunk(out, "IDAT", zlib.data(), (u32)zlib.size());
+    PushPNGChunk(out, "IEND", 0, 0);
+}
+
+#endif //IMAGE_H
@@ -7,7 +7,8 @@
 enum LightType
 {
     AMBIENT,
-    POINT
+    POINT,
+    OTHER_LIGHT
 };
 
 // TODO(mevex): Implement colors for lights
@@ -16,8 +17,12 @@ class Light
 {
     public:
     
-    enum LightType type;
+    enum LightType type = OTHER_LIGHT;
+    virtual ~Light() {}
     virtual f32 ComputeLightning(v3 normal, p3 hitPoint) = 0;
+
+    // NOTE(mevex): Adds everything that changes what the light adds, false if it can't tell
+    virtual bool HashContent(ContentHash& hash) { return false; }
 };
 
 class PointLight : public Light
@@ -31,6 +36,14 @@ class PointLight : public Light
     {
         type = POINT;
     }
+
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add((u32)type);
+        hash.Add(position);
+        hash.Add(intensity);
+        return true;
+    }
     
     f32 ComputeLightning(v3 normal, p3 hitPoint)
     {
@@ -55,6 +68,13 @@ class AmbientLight : public Light
     {
         type = AMBIENT;
     }
+
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add((u32)type);
+        hash.Add(intensity);
+        return true;
+    }
     
     inline f32 ComputeLightning(v3 normal, p3 hitPoint)
     {
@@ -62,4 +82,161 @@ class AmbientLight : public Light
     }
 };
 
+// NOTE(mevex): Point light picked by LightTree::Sample, weight is one over the probability of picking it
+struct LightSample
+{
+    u32 light;
+    f32 weight;
+};
+
+// NOTE(mevex): Binary BVH over the point lights of the scene. Every node keeps the box and the total
+// intensity of its lights, which give a cheap estimate of what they can add at a point. Sampling
+// walks down from the root picking a child in proportion to its estimate, so a point mostly gets
+// the lights that face it the most and the cost only grows with the depth of the tree.
+class LightTree
+{
+    public:
+
+    struct Node
+    {
+        // NOTE(mevex): Sphere around the box of the lights
+        p3 center;
+        f32 radius;
+        f32 intensity;
+        // NOTE(mevex): Internal nodes: index of the left child, the right one follows it.
+        // Leaves: index of the light in lights.
+        u32 leftLight;
+        bool leaf;
+    };
+
+    vector<Node> nodes;
+    // NOTE(mevex): Index in Scene::lights of every light of the tree
+    vector<u32> lights;
+
+    inline bool Empty()
+    {
+        return nodes.empty();
+    }
+
+    // NOTE(mevex): indices are the positions of the point lights in sceneLights
+    void Build(vector<Light *>& sceneLights, vector<u32>& indices)
+    {
+        nodes.clear();
+        lights = indices;
+        if(lights.empty())
+            return;
+
+        nodes.reserve(2 * lights.size());
+        nodes.push_back({});
+        Subdivide(sceneLights, 0, 0, (u32)lights.size());
+    }
+
+    // NOTE(mevex): Picks a light with one random number per level, returns false if no light of the
+    // tree can light the point (all of them behind the surface)
+    bool Sample(v3 normal, p3 hitPoint, LightSample& result)
+    {
+        if(nodes.empty())
+            return false;
+
+        f32 probability = 1.0f;
+        u32 index = 0;
+        normal = Unit(normal);
+        while(!nodes[index].leaf)
+        {
+            u32 left = nodes[index].leftLight;
+            f32 leftImportance = Importance(nodes[left], normal, hitPoint);
+            f32 rightImportance = Importance(nodes[left + 1], normal, hitPoint);
+            f32 total = leftImportance + rightImportance;
+            if(total <= 0)
+                return false;
+
+            f32 leftProbability = leftImportance / total;
+            if(RandomFloat() < leftProbability)
+            {
+                index = left;
+                probability *= leftProbability;
+            }
+            else
+            {
+                index = left + 1;
+                probability *= 1.0f - leftProbability;
+            }
+        }
+
+        if(probability <= 0 || Importance(nodes[index], normal, hitPoint) <= 0)
+            return false;
+        result.light = lights[nodes[index].leftLight];
+        result.weight = 1.0f / probability;
+        return true;
+    }
+
+    private:
+
+    // NOTE(mevex): Point lights don't fall off with the distance here (see PointLight::ComputeLightning),
+    // a light adds its intensity times the cosine with the normal. The estimate of a node is its intensity
+    // times the largest cosine towards its sphere: the angle to the center minus the half angle the
+    // sphere covers. It is zero only if the whole sphere is behind the surface, and exactly the
+    // contribution of a single light. normal has to be a unit vector.
+    inline f32 Importance(Node& node, v3 normal, p3 hitPoint)
+    {
+        v3 toCenter = node.center - hitPoint;
+        f32 distanceSquared = toCenter.LengthSquared();
+        if(distanceSquared <= node.radius * node.radius)
+            return node.intensity;
+
+        f32 distance = sqrtf(distanceSquared);
+        f32 cosine = Dot(normal, toCenter) / distance;
+        f32 sinHalfAngle = node.radius / distance;
+        f32 cosHalfAngle = sqrtf(1.0f - sinHalfAngle * sinHalfAngle);
+        f32 maxCosine = 1.0f;
+        if(cosine < cosHalfAngle)
+            maxCosine = cosine * cosHalfAngle + sqrtf(Max(1.0f - cosine * cosine, 0.0f)) * sinHalfAngle;
+        if(maxCosine < 0)
+            return 0;
+
+        // NOTE(mevex): Grazing lights still get a chance, a zero estimate would never pick them
+        f32 result = node.intensity * Max(maxCosine, 1e-4f);
+        return result;
+    }
+
+    // NOTE(mevex): Median split on the longest axis of the box of the lights, a tree for a few thousand
+    // lights doesn't need more
+    void Subdivide(vector<Light *>& sceneLights, u32 nodeIndex, u32 first, u32 count)
+    {
+        Node node = {};
+        AABB bounds;
+        for(u32 i = first; i < first + count; i++)
+        {
+            PointLight *light = (PointLight *)sceneLights[lights[i]];
+            bounds.Grow(light->position);
+            node.intensity += Abs(light->intensity);
+        }
+        node.center = bounds.Center();
+        node.radius = 0.5f * (bounds.max - bounds.min).Length() * 1.0001f;
+
+        if(count == 1)
+        {
+            node.leaf = true;
+            node.leftLight = first;
+            nodes[nodeIndex] = node;
+            return;
+        }
+
+        v3 extent = bounds.max - bounds.min;
+        i32 axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+        u32 half = count / 2;
+        std::nth_element(lights.begin() + first, lights.begin() + first + half, lights.begin() + first + count, [&](u32 a, u32 b)
+        {
+            return ((PointLight *)sceneLights[a])->position.e[axis] < ((PointLight *)sceneLights[b])->position.e[axis];
+        });
+
+        node.leftLight = (u32)nodes.size();
+        nodes[nodeIndex] = node;
+        nodes.push_back({});
+        nodes.push_back({});
+        Subdivide(sceneLights, node.leftLight, first, half);
+        Subdivide(sceneLights, node.leftLight + 1, first + half, count - half);
+    }
+};
+
 #endif //LIGHT_H
@@ -1,289 +1,448 @@
-unsigned long long GetRayColorCycles = 0;
-unsigned long long HitCycles = 0;
-unsigned long long ScatterCycles = 0;
-
-unsigned long long GetRayColorCounter = 0;
-unsigned long long HitCounter = 0;
-unsigned long long ScatterCounter = 0;
-
-#include <intrin.h>
+#include "raytracer.h"
 #include <cstdio>
-#include "main.h"
-#include <chrono>
+#include <cstring>
+
+// NOTE(mevex): Command line front end of the renderer library.
+// Usage: main [-model file.obj] [-out file] [-spp n] [-depth n] [-budget ms] [-seed n] [-bvh-report 1] [-frames n]
+//             [-bvh auto|sah|lbvh|lazy] [-write-clusters file.clusters] [-cluster-mb n]
+//             [-accel auto|bvh|grid|kdtree] [-spheres n] [-soa 0|1] [-packets 0|1]
+//             [-sort-rays 0|1] [-ray-sort-report 1] [-interleave 0|1] [-interleave-report 1]
+//             [-lights n] [-light-samples n] [-radiance-cache 0|1] [-radiance-cache-mb n]
+//             [-guiding 0|1] [-guiding-passes n] [-guiding-fraction f] [-roof 1]
+//             [-raster 0|1] [-raster-report 1] [-views n] [-frame-turn degrees] [-temporal n]
+//             [-tile-cache directory] [-tile-cache-mb n] [-kernels 0|1] [-math-report 1]
+//             [-checkpoint-report 1]
+// A .clusters file given as the model is streamed from disk, -write-clusters makes one from the model.
 
-#define RUN_FAST 1
-Color GetRayColorFast(Ray rays[4], Scene& scene, int depth, Color falseAmbientColor)
+// NOTE(mevex): "dir/render.png" -> "dir/render_0003.png"
+std::string FrameFileName(const char *filename, i32 frame)
 {
-    ++GetRayColorCounter;
-    u64 cycleBegin = __rdtsc();
-    // TODO(mevex): Move false ambient color and ray calculation here
+    std::string result = filename;
+    size_t dot = result.find_last_of('.');
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04d", frame);
+    result.insert((dot == std::string::npos) ? result.size() : dot, suffix);
+    return result;
+}
 
-    if(depth <= 0)
+// NOTE(mevex): Renders a short animation of the default scene: the sphere and the model move and a
+// part of the model ripples, so every frame refits the model BVH instead of rebuilding the scene.
+// turnPerFrame turns the default camera around the model every frame. With temporalSamples every
+// frame also takes up to that many samples of the previous one (see TemporalHistory).
+void RenderAnimation(Renderer& renderer, Scene& scene, Camera& camera, RenderSettings& settings, const char *outputFile, i32 frameCount,
+                     f32 turnPerFrame, i32 temporalSamples)
+{
+    Sphere *sphere = 0;
+    Mesh *mesh = 0;
+    for(Hittable *obj : scene.objects)
     {
-        return falseAmbientColor;
+        if(!sphere)
+            sphere = dynamic_cast<Sphere *>(obj);
+        if(!mesh)
+            mesh = dynamic_cast<Mesh *>(obj);
     }
 
-    Color attenuations[4] = {falseAmbientColor, falseAmbientColor, falseAmbientColor, falseAmbientColor};
-    while (depth)
-    { 
-        HitRecord recs[4] = {};
-        f32 closestTs[4] = {INFINITY, INFINITY, INFINITY, INFINITY};
-        f32 tMin[4] = {ZERO, ZERO, ZERO, ZERO};
+    // NOTE(mevex): Original vertices of the rippling triangles, relative to the mesh position
+    scene.Prepare(&renderer.pool);
+    u32 rippleCount = mesh ? (u32)mesh->triangles.size() / 8 : 0;
+    vector<Triangle> rest;
+    for(u32 i = 0; i < rippleCount; i++)
+    {
+        Triangle& t = mesh->GetTriangle(i);
+        rest.push_back(Triangle(t.a - mesh->position, t.b - mesh->position, t.c - mesh->position, t.material));
+    }
+    p3 sphereStart = sphere ? sphere->center : p3();
+    p3 meshStart = mesh ? mesh->position : p3();
 
-        for (auto &obj : scene.objects)
+    settings.intermediateOutputFile = 0;
+    settings.checkpointFile = 0;
+    TemporalHistory history;
+    history.maxSamples = temporalSamples;
+    u32 seed = settings.seed;
+    for(i32 frame = 0; frame < frameCount; frame++)
+    {
+        // NOTE(mevex): The same seed every frame would take the same samples the history already has
+        if(temporalSamples > 0)
+            settings.seed = seed + frame;
+        f32 time = (f32)frame / (f32)Max(frameCount, 1);
+        auto begin = std::chrono::high_resolution_clock::now();
+        if(sphere)
+            sphere->center = sphereStart + v3(0, 1.5f * sinf(2.0f * PI * time), 0);
+        if(mesh)
         {
-            HitRecord tempRecs[4] = {};
-            // obj->Hit(rays[0], ZERO, INFINITY, tempRec[0]);
-            obj->Hit(rays, tMin, closestTs, tempRecs);
-            for (int i = 0; i < 4; ++i)
+            mesh->Move(meshStart + v3(time * 2.0f, 0, 0));
+            for(u32 i = 0; i < rippleCount; i++)
             {
-                if (tempRecs[i].t != INFINITY && tempRecs[i].t < recs[i].t)
-                {
-                	closestTs[i] = tempRecs[i].t;
-                    recs[i] = tempRecs[i];
-                }
+                Triangle& t = rest[i];
+                v3 offset = (0.1f * sinf(2.0f * PI * time + t.a.y)) * Unit(t.normal);
+                mesh->SetTriangle(i, t.a + offset, t.b + offset, t.c + offset);
             }
         }
+        u32 rebuilt = scene.Update(&renderer.pool);
+        auto end = std::chrono::high_resolution_clock::now();
+        f32 updateMs = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000.0f;
 
-        for(int i = 0; i < 4; ++i)
+        Camera frameCamera = (turnPerFrame != 0) ? DefaultCamera((f32)settings.width / (f32)settings.height, turnPerFrame * frame) : camera;
+        std::unique_ptr<RenderJob> job = renderer.Render(scene, frameCamera, settings);
+        u32 reused = 0;
+        if(temporalSamples > 0)
         {
-            if (recs[i].t != INFINITY) {
-                // NOTE(mevex): If the light intensity exceeds 1 we get an overexposed color
-                f32 lightIntensity = Min(scene.GetLightIntensity(recs[i].normal, recs[i].p), 1.0f);
-
-                Color newAttenuation;
-                if (recs[i].material->Scatter(rays[i], recs[i], newAttenuation, rays[i]))
-                {
-                    attenuations[i] = attenuations[i] * lightIntensity * newAttenuation;
-                }
-                else
-                {
-                    attenuations[i] = attenuations[i] * lightIntensity * newAttenuation;
-                    // NOTE(mevex): this is a bit of a hack to avoid testing this again
-                    recs[i].t = 0.0f;
-                }
-            }
-            else
-            {
-                break;
-            }
+            history.Capture(scene, frameCamera, settings.width, settings.height, &renderer.pool);
+            reused = history.Reuse(job->canvas, &renderer.pool);
+            history.Store(job->canvas, frameCamera);
         }
-        --depth;
+        job->canvas.Resolve(&renderer.pool);
+        std::string filename = FrameFileName(outputFile, frame);
+        job->canvas.Write(filename.c_str(), &renderer.pool);
+        printf("Frame %d: update %.2fms (%u triangles moved, %s), render %ims, wrote %s", frame, updateMs, rippleCount,
+               rebuilt ? "rebuilt" : "refitted", (int)job->renderTimeMs, filename.c_str());
+        if(temporalSamples > 0)
+            printf(", history reused by %.1f%% of the pixels", 100.0f * reused / ((f32)settings.width * settings.height));
+        printf("\n");
     }
+}
 
-    u64 cycleEnd = __rdtsc();
-    GetRayColorCycles += cycleEnd - cycleBegin;
+// NOTE(mevex): Renders the scene from viewCount cameras turning around the model in one job (see
+// MultiViewJob), the scene is loaded and prepared once. One image per view.
+void RenderTurntable(Renderer& renderer, Scene& scene, RenderSettings& settings, const char *outputFile, i32 viewCount)
+{
+    vector<Camera> cameras;
+    for(i32 view = 0; view < viewCount; view++)
+        cameras.push_back(DefaultCamera((f32)settings.width / (f32)settings.height, 360.0f * view / viewCount));
 
-    return attenuations[0] + attenuations[1] + attenuations[2] + attenuations[3];
+    std::unique_ptr<MultiViewJob> job = renderer.RenderViews(scene, cameras, settings);
+    for(i32 view = 0; view < viewCount; view++)
+    {
+        Canvas& canvas = job->views[view]->canvas;
+        canvas.Resolve(&renderer.pool);
+        std::string filename = FrameFileName(outputFile, view);
+        if(canvas.Write(filename.c_str(), &renderer.pool))
+            printf("Wrote %s\n", filename.c_str());
+        else
+            printf("ERR: could not write %s\n", filename.c_str());
+    }
+    printf("Views: %d, rendering time: %ims\n", viewCount, (int)job->renderTimeMs);
 }
 
-Color GetRayColor(Ray& r, Scene& scene, int depth)
+// NOTE(mevex): Small spheres spread over the ground, the same ones for a given count,
+// used to try the scene accelerators on something bigger than the default scene
+void AddSphereField(Scene& scene, i32 count)
 {
-    ++GetRayColorCounter;
-    u64 cycleBegin = __rdtsc();
-
-    // NOTE(mevex): Background/ambient light hack
-    v3 unitDir = Unit(r.direction);
-    f32 t = 0.5f*(unitDir.y + 1.0f);
-    Color falseAmbientColor = Lerp(Color(0.6f, 0.6f, 0.6f), Color(0.5f, 0.7f, 1.0f), t);
-    
-    if(depth <= 0)
-        return falseAmbientColor;
-    
-    HitRecord rec;
-    bool hitResult = scene.Hit(r, ZERO, INFINITY, rec);
-    
-    if(hitResult)
+    Lambertian *material = scene.Create<Lambertian>(Color(0.7f, 0.3f, 0.3f));
+    i32 side = (i32)ceilf(sqrtf((f32)count));
+    for(i32 i = 0; i < count; i++)
     {
-        // NOTE(mevex): If the light intensity exceeds 1 we get an overexposed color
-        f32 lightIntensity = Min(scene.GetLightIntensity(rec.normal, rec.p), 1.0f);
-        
-        Ray scattered;
-        Color attenuation;
-        if(rec.material->Scatter(r, rec, attenuation, scattered))
-            return attenuation * lightIntensity * GetRayColor(scattered, scene, depth-1);
-        else
-            return attenuation * lightIntensity;
+        f32 jx = (HashCombine(i, 1) >> 8) * (1.0f / 16777216.0f);
+        f32 jz = (HashCombine(i, 2) >> 8) * (1.0f / 16777216.0f);
+        f32 x = -10.0f + 20.0f * ((i % side) + jx) / side;
+        f32 z = -12.0f + 20.0f * ((i / side) + jz) / side;
+        f32 radius = 0.1f + 0.2f * jx * jz;
+        scene.Create<Sphere>(p3(x, -0.5f + radius, z), radius, material);
+    }
+}
+
+// NOTE(mevex): Many-light test: count dim point lights scattered above the default scene,
+// together about as bright as its main light
+void AddLightRig(Scene& scene, i32 count)
+{
+    for(i32 i = 0; i < count; i++)
+    {
+        f32 x = (HashCombine(i, 3) >> 8) * (1.0f / 16777216.0f);
+        f32 y = (HashCombine(i, 4) >> 8) * (1.0f / 16777216.0f);
+        f32 z = (HashCombine(i, 5) >> 8) * (1.0f / 16777216.0f);
+        scene.Create<PointLight>(p3(-12.0f + 24.0f * x, 1.0f + 9.0f * y, -14.0f + 24.0f * z), 0.5f / count);
     }
-    
-    u64 cycleEnd = __rdtsc();
-    GetRayColorCycles += cycleEnd - cycleBegin;
+}
+
+// NOTE(mevex): Path guiding test: a wide roof over the default scene with a skylight right under the
+// main light, so the light and most of the sky only come in through it
+void AddRoof(Scene& scene)
+{
+    Mesh *roof = scene.Create<Mesh>(p3(0, 9.0f, 0));
+    Lambertian material(Color(0.8f, 0.8f, 0.8f));
+    roof->AddMaterial(material);
+    Material *m = &roof->materials[0];
 
-    return falseAmbientColor;
+    f32 size = 30.0f;
+    f32 holeMinX = -2.5f, holeMaxX = 1.5f, holeMinZ = 2.5f, holeMaxZ = 6.5f;
+    f32 panels[4][4] = {{-size, holeMinX, -size, size}, {holeMaxX, size, -size, size},
+                        {holeMinX, holeMaxX, -size, holeMinZ}, {holeMinX, holeMaxX, holeMaxZ, size}};
+    for(auto& panel : panels)
+    {
+        p3 a(panel[0], 0, panel[2]), b(panel[1], 0, panel[2]), c(panel[1], 0, panel[3]), d(panel[0], 0, panel[3]);
+        roof->AddTriangle(Triangle(a, b, c, m));
+        roof->AddTriangle(Triangle(a, c, d, m));
+    }
+    roof->ComputeBoundingSphere();
 }
 
-bool LoadObj(Mesh& mesh, const char* filename, const char* basepath = NULL, bool triangulate = true)
+int main(int argc, char **argv)
 {
-    printf("Loading %s\n", filename);
-    
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    
-    auto t1 = std::chrono::high_resolution_clock::now();
-    std::string warn;
-    std::string err;
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename, basepath, triangulate);
-    
-    // TODO(mevex): Take care of this strings stuff
-    if (!warn.empty()) {
-        printf("WARN: %s\n", warn.c_str());
+    const char *modelFile = "../models/fox2.obj";
+    // NOTE(mevex): The output format is chosen by the extension (png, qoi, ppm, pfm, exr, ...)
+    const char *outputFile = "../renders/render.png";
+    const char *hdrOutputFile = "../renders/render.exr";
+    bool bvhReport = false;
+    bool raySortReport = false;
+    bool interleaveReport = false;
+    bool rasterReport = false;
+    bool mathReport = false;
+    bool checkpointReport = false;
+    i32 frameCount = 0;
+    i32 viewCount = 0;
+    f32 frameTurn = 0;
+    i32 temporalSamples = 0;
+    BVHBuildMode bvhMode = BVHBuild_Auto;
+    const char *clusterFile = 0;
+    size_t clusterBudget = 0;
+    // NOTE(mevex): Without -accel the meshes keep their refittable BVH and only the scene probes
+    const char *accelName = 0;
+    i32 sphereCount = 0;
+    bool packShapes = true;
+    i32 lightCount = 0;
+    bool roof = false;
+    i32 lightSamples = -1;
+
+    // NOTE(mevex): Progressive rendering: the image is refined one pass at a time,
+    // an intermediate png is written after every pass and the accumulation buffer
+    // is checkpointed to disk so that an interrupted render can be resumed
+    RenderSettings settings;
+    settings.samplesPerPixel = 8;
+    settings.maxDepth = 4;
+    settings.samplesPerPass = 4;
+    settings.intermediateOutputFile = outputFile;
+    settings.checkpointFile = "../renders/render.ckpt";
+
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i], "-model"))
+            modelFile = argv[i+1];
+        else if(!strcmp(argv[i], "-out"))
+            outputFile = settings.intermediateOutputFile = argv[i+1];
+        else if(!strcmp(argv[i], "-spp"))
+            settings.samplesPerPixel = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-depth"))
+            settings.maxDepth = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-budget"))
+            settings.timeBudgetMs = (f32)atof(argv[i+1]);
+        else if(!strcmp(argv[i], "-seed"))
+            settings.seed = (u32)atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-bvh-report"))
+            bvhReport = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-frames"))
+            frameCount = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-write-clusters"))
+            clusterFile = argv[i+1];
+        else if(!strcmp(argv[i], "-cluster-mb"))
+            clusterBudget = (size_t)atoi(argv[i+1]) * 1024 * 1024;
+        else if(!strcmp(argv[i], "-spheres"))
+            sphereCount = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-packets"))
+            settings.primaryPackets = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-sort-rays"))
+            settings.sortRays = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-ray-sort-report"))
+            raySortReport = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-interleave"))
+            settings.interleaveRays = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-interleave-report"))
+            interleaveReport = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-raster"))
+            settings.rasterPrimary = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-frame-turn"))
+            frameTurn = (f32)atof(argv[i+1]);
+        else if(!strcmp(argv[i], "-temporal"))
+            temporalSamples = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-views"))
+            viewCount = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-kernels"))
+            settings.specializedKernels = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-tile-cache"))
+            settings.tileCacheDirectory = argv[i+1];
+        else if(!strcmp(argv[i], "-tile-cache-mb"))
+            settings.tileCacheMB = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-math-report"))
+            mathReport = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-checkpoint-report"))
+            checkpointReport = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-raster-report"))
+            rasterReport = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-lights"))
+            lightCount = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-light-samples"))
+            lightSamples = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-guiding"))
+            settings.pathGuiding = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-guiding-fraction"))
+            settings.guidingFraction = (f32)atof(argv[i+1]);
+        else if(!strcmp(argv[i], "-guiding-passes"))
+            settings.guidingPasses = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-roof"))
+            roof = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-radiance-cache"))
+            settings.radianceCache = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-radiance-cache-mb"))
+            settings.radianceCacheMB = atoi(argv[i+1]);
+        else if(!strcmp(argv[i], "-soa"))
+            packShapes = atoi(argv[i+1]) != 0;
+        else if(!strcmp(argv[i], "-accel"))
+            accelName = argv[i+1];
+        else if(!strcmp(argv[i], "-bvh"))
+        {
+            const char *mode = argv[i+1];
+            bvhMode = !strcmp(mode, "sah") ? BVHBuild_SAH : !strcmp(mode, "lbvh") ? BVHBuild_LBVH : !strcmp(mode, "lazy") ? BVHBuild_Lazy : BVHBuild_Auto;
+        }
+        else
+            printf("WARN: unknown option %s\n", argv[i]);
+    }
+
+    Renderer renderer;
+    Camera camera = DefaultCamera((f32)settings.width / (f32)settings.height);
+    Scene scene;
+    BuildDefaultScene(scene, modelFile);
+    AddSphereField(scene, sphereCount);
+    AddLightRig(scene, lightCount);
+    if(roof)
+        AddRoof(scene);
+    if(lightSamples >= 0)
+        scene.lightSamples = (u32)lightSamples;
+    AccelKind accelKind = !accelName ? Accel_Auto : !strcmp(accelName, "bvh") ? Accel_BVH : !strcmp(accelName, "grid") ? Accel_Grid :
+                          !strcmp(accelName, "kdtree") ? Accel_KDTree : Accel_Auto;
+    scene.accelKind = accelKind;
+    scene.packShapes = packShapes;
+    for(Hittable *obj : scene.objects)
+    {
+        Mesh *mesh = dynamic_cast<Mesh *>(obj);
+        ClusteredMesh *clustered = dynamic_cast<ClusteredMesh *>(obj);
+        if(mesh)
+        {
+            mesh->buildMode = bvhMode;
+            if(accelName)
+                mesh->accelKind = accelKind;
+        }
+        if(mesh && clusterFile)
+        {
+            bool written = WriteClusterFile(*mesh, clusterFile);
+            printf("%s %s\n", written ? "Wrote" : "ERR: could not write", clusterFile);
+            return written ? 0 : 1;
+        }
+        if(clustered && clusterBudget)
+            clustered->memoryBudget = clusterBudget;
     }
-    
-    if (!err.empty()) {
-        printf("ERR: %s\n", err.c_str());
+
+    if(bvhReport)
+    {
+        ReportAccelerationStructures(scene, camera, settings.width, settings.height, &renderer.pool);
+        return 0;
     }
-    
-    if (!ret) {
-        printf("Failed to load/parse .obj.\n");
-        return false;
+
+    if(interleaveReport)
+    {
+        ReportInterleavedTraversal(scene, camera, settings.width, settings.height, &renderer.pool);
+        return 0;
     }
-    
-    for(tinyobj::material_t m : materials)
+
+    if(rasterReport)
     {
-        Color albedo(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
-        Lambertian mat(albedo);
-        mesh.AddMaterial(mat);
+        ReportPrimaryRaster(scene, camera, settings.width, settings.height, &renderer.pool);
+        return 0;
     }
-    
-    // NOTE(mevex): This routine works only if the mesh has been triangulated
-    int facesCount = (int)shapes[0].mesh.num_face_vertices.size();
-    tinyobj::index_t *indexPtr = &shapes[0].mesh.indices[0];
-    int *materialIndex = &shapes[0].mesh.material_ids[0];
-    for(int i = 0; i < facesCount; i++)
+
+    if(mathReport)
     {
-        v3 a(attrib.vertices[3 * indexPtr->vertex_index], attrib.vertices[3 * indexPtr->vertex_index + 1], attrib.vertices[3 * indexPtr->vertex_index + 2]);
-        indexPtr += 1;
-        v3 b(attrib.vertices[3 * indexPtr->vertex_index], attrib.vertices[3 * indexPtr->vertex_index + 1], attrib.vertices[3 * indexPtr->vertex_index + 2]);
-        indexPtr += 1;
-        v3 c(attrib.vertices[3 * indexPtr->vertex_index], attrib.vertices[3 * indexPtr->vertex_index + 1], attrib.vertices[3 * indexPtr->vertex_index + 2]);
-        indexPtr += 1;
-        
-        Lambertian *m = &mesh.materials[materialIndex[i]];
-        
-        Triangle t(a, b, c, m);
-        mesh.AddTriangle(t);
+        ReportVectorMath(scene, camera, settings.width, settings.height);
+        return 0;
+    }
+
+    if(checkpointReport)
+    {
+        ReportCheckpointResume(renderer, scene, camera, settings, "../renders/checkpoint_report.ckpt");
+        return 0;
+    }
+
+    if(raySortReport)
+    {
+        ReportRaySorting(renderer, scene, camera, settings);
+        return 0;
+    }
+
+    if(frameCount > 0)
+    {
+        RenderAnimation(renderer, scene, camera, settings, outputFile, frameCount, frameTurn, temporalSamples);
+        return 0;
+    }
+
+    if(viewCount > 0)
+    {
+        RenderTurntable(renderer, scene, settings, outputFile, viewCount);
+        return 0;
     }
-    
-    auto t2 = std::chrono::high_resolution_clock::now();
-    auto d = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
-    printf("OBJ loading time: %ims\n", (int)(d.count()));
-    
-    //getchar();
-    return true;
-}
 
-int main()
-{
-    srand ((u32)time(NULL));
-    
-    int samplePerPixel = 8;
-    int maxDepth = 4;
-    
-    Canvas canvas(1280, 720, 4);
-    //Camera camera(p3(3,9,12), p3(0.5f,3.7f,0), v3(0,1,0), 55, canvas.ratio);
-    Camera camera(p3(0,5,12), p3(1,4,-1), v3(0,1,0), 50, canvas.ratio);
-    Scene scene;
-    
-    // NOTE(mevex): Scene creation
-    // NOTE(mevex): Materials
-    Lambertian ground(Color(0.8f, 0.8f, 0.0f));
-    Lambertian center(Color(0.7f, 0.3f, 0.3f));
-    Metal left(Color(0.8f, 0.8f, 0.8f), 0.3f);
-    Metal right(Color(0.05f, 0.6f, 0.73f), 0.0f);
-    VertexColor tri(Color(1,0,0), Color(0,1,0), Color(0,0,1));
-    
-    // NOTE(mevex): Objects
-    Plane p1(p3(0,-0.5f,0), v3(0,1,0), &ground);//-4.1139f
-    Sphere s2(p3(-5 ,1.5f, 1), 2.0f, &right);//-3.6139f
-    //Sphere s3(p3(-1,0,-1), 0.5f, &left);
-    //Sphere s4(p3(1,0,-1), 0.5f, &right);
-    //Triangle t5(p3(-1,1,-2), p3(1,1,-2), p3(0,2,-1), &tri);
-    
-    Mesh fox(p3(0,3.65f,0), p3(-0.8f, 0, 0), 7.4f); // r = 7.4f
-    LoadObj(fox, "../models/fox2.obj", "../models/", true);
-    
-    // NOTE(mevex): Lights
-    PointLight l1(p3(-0.5f,10,5), 0.7f);
-    AmbientLight l2(0.3f);
-    
-    scene.Add(&p1);
-    scene.Add(&s2);
-    //scene.Add(&s3);
-    //scene.Add(&s4);
-    scene.Add(&fox);
-    scene.Add(&l1);
-    scene.Add(&l2);
-    
     printf("--- Rendering starts ---\n");
-    printf("Samples per pixel: %d Max depth: %d\n", samplePerPixel, maxDepth);
-    auto timerStart = std::chrono::high_resolution_clock::now();
-    auto cyclesStart = __rdtsc();
+    if(settings.timeBudgetMs > 0)
+        printf("Time budget: %.0fms Max depth: %d Threads: %d\n", settings.timeBudgetMs, settings.maxDepth, renderer.pool.ThreadCount());
+    else
+        printf("Samples per pixel: %d Max depth: %d Threads: %d\n", settings.samplesPerPixel, settings.maxDepth, renderer.pool.ThreadCount());
 
-    for(int y = canvas.height-1; y >= 0; y--)
+    // NOTE(mevex): Time to first pixel, from before the scene is prepared to the first finished tile pass
+    auto start = std::chrono::high_resolution_clock::now();
+    std::atomic<f32> firstTileMs(0);
+    u64 cyclesStart = __rdtsc();
+    std::unique_ptr<RenderJob> job = renderer.RenderAsync(scene, camera, settings, [&](RenderJob& job, Tile& tile)
     {
-#if RUN_FAST
-        f32 v = ((f32)y) / (f32)(canvas.height - 1);
-#endif
-        for(int x = 0; x < canvas.width; x++)
-        {
-            Color c(0,0,0);
-
-#if RUN_FAST
-            f32 u = ((f32)x) / (f32)(canvas.width - 1);
-            Ray nonRandomizedRay = camera.GetRay(u, v);
-            // NOTE(mevex): Background/ambient light hack
-            v3 unitDir = Unit(nonRandomizedRay.direction);
-            f32 t = 0.5f * (unitDir.y + 1.0f);
-            Color falseAmbientColor = Lerp(Color(0.6f, 0.6f, 0.6f), Color(0.5f, 0.7f, 1.0f), t);
-#endif
-
-#if RUN_FAST
-            for(int sampleIndex = 0; sampleIndex < samplePerPixel; sampleIndex += 4)
-            {
-                Ray randomizedRays [4] = {};
-                // TODO(mevex): make this loop work properly
-                for (int i = 0; i < 4; ++i)
-                {
-                    u = ((f32)x + RandomFloat()) / (f32)(canvas.width - 1);
-                    v = ((f32)y + RandomFloat()) / (f32)(canvas.height - 1);
-                    randomizedRays[i] = camera.GetRay(u, v);
-                }
-
-                c += GetRayColorFast(randomizedRays, scene, maxDepth, falseAmbientColor);
-            }
-            // TODO(mevex): This is a temporary hack
-            canvas.SetPixel(x, y, c, (samplePerPixel % 4 == 0) ? samplePerPixel : (samplePerPixel / 4 + 1)*4);
-#else
-            for(int i = 0; i < samplePerPixel; i++)
-            {
-                f32 u = ((f32)x + RandomFloat()) / (f32)(canvas.width - 1);
-                f32 v = ((f32)y + RandomFloat()) / (f32)(canvas.height - 1);
+        // NOTE(mevex): Progress only, printing from several threads at once is fine here. The tiles
+        // loaded from the tile cache come before any pass is rendered, they are counted at the end.
+        u32 rendered = job.tilePassesRendered;
+        if(rendered == 0)
+            return;
+        if(firstTileMs == 0)
+            firstTileMs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 1000.0f;
+        if(rendered % 16 == 0)
+            printf("\rTile passes rendered: %u", rendered);
+    });
+    job->Wait();
+    u64 cyclesFinish = __rdtsc();
 
-                Ray randomizedRay = camera.GetRay(u, v);
-                c += GetRayColor(randomizedRay, scene, maxDepth);
-            }
-            canvas.SetPixel(x, y, c, samplePerPixel);
-#endif
+    Canvas& canvas = job->canvas;
+
+    // NOTE(mevex): Pixel order: AABBGGRR
+    canvas.Resolve(&renderer.pool);
+    for(const char *filename : {outputFile, hdrOutputFile})
+    {
+        if(canvas.Write(filename, &renderer.pool))
+            printf("\nWrote %s, encode time: %.2fms", filename, canvas.lastEncodeTime);
+        else
+            printf("\nERR: could not write %s", filename);
+    }
+
+    u64 pixelCount = (u64)canvas.width * canvas.height;
+    printf("\nRendering time: %ims\n", (int)job->renderTimeMs);
+    if(firstTileMs > 0)
+        printf("Time to first tile pass: %.2fms\n", (f32)firstTileMs);
+    if(settings.tileCacheDirectory)
+        printf("Tiles from the cache: %u/%u\n", job->tilesFromCache, (u32)job->tiles.size());
+    for(Hittable *obj : scene.objects)
+    {
+        Mesh *mesh = dynamic_cast<Mesh *>(obj);
+        if(mesh && mesh->bvh.IsLazy())
+            printf("Lazy BVH: %u nodes built for %zu triangles\n", mesh->bvh.NodeCount(), mesh->triangles.size());
+
+        ClusteredMesh *clustered = dynamic_cast<ClusteredMesh *>(obj);
+        if(clustered)
+        {
+            ClusterCacheStats& stats = clustered->stats;
+            printf("Clusters: %u, loads: %llu, evictions: %llu, waits: %llu, resident: %.1fMB (peak %.1fMB, budget %.1fMB)\n",
+                   clustered->ClusterCount(), (unsigned long long)stats.loads, (unsigned long long)stats.evictions, (unsigned long long)stats.waits,
+                   stats.residentBytes / 1048576.0f, stats.peakBytes / 1048576.0f, clustered->memoryBudget / 1048576.0f);
         }
-        auto cyclesFinish = __rdtsc();
-        printf("\rProgress: %i%%, lines remaining %i/%i, avg cycles per pixels: %llu", (int)((f32)(canvas.height-y)/(f32)canvas.height*100.99f), y, canvas.height, (u64)(cyclesFinish - cyclesStart)/(canvas.width*(canvas.height-y)));
     }
-    
-    auto timerFinish = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(timerFinish - timerStart);
-    auto avgCount = std::chrono::duration_cast<std::chrono::nanoseconds>(timerFinish - timerStart).count() / (canvas.width * canvas.height);
-    
-    // NOTE(mevex): Pixel order: AABBGGRR
-    auto res = stbi_write_png("../renders/render.png", canvas.width, canvas.height, canvas.bytesPerPixel, canvas.memory, 0);
-    
-    printf("\nRendering time: %ims\n", (int)(duration.count()));
-    printf("Average pixel time: %ins\n", (int)avgCount);
-
-    printf("GetRay Count:    %llu,  AVG Cycles: %llu \n", GetRayColorCounter, GetRayColorCycles / GetRayColorCounter);
-    printf("Hit Count:    %llu,  AVG Cycles: %llu \n", HitCounter, HitCycles / HitCounter);
-    printf("Scatter Count:    %llu,  AVG Cycles: %llu \n", ScatterCounter, ScatterCycles / ScatterCounter);
-    
-    getchar();
+    printf("Average pixel time: %ins\n", (int)(job->renderTimeMs * 1000000.0f / pixelCount));
+    printf("Average cycles per pixel: %llu\n", (unsigned long long)((cyclesFinish - cyclesStart) / pixelCount));
+
+    PerfCounters counters = GetPerfCounters();
+    printf("GetRay Count:    %llu,  AVG Cycles: %llu \n", (unsigned long long)counters.getRayColorCount, (unsigned long long)(counters.getRayColorCycles / Max(counters.getRayColorCount, 1)));
+    printf("Hit Count:    %llu,  AVG Cycles: %llu \n", (unsigned long long)counters.hitCount, (unsigned long long)(counters.hitCycles / Max(counters.hitCount, 1)));
+    printf("Scatter Count:    %llu,  AVG Cycles: %llu \n", (unsigned long long)counters.scatterCount, (unsigned long long)(counters.scatterCycles / Max(counters.scatterCount, 1)));
+
     return 0;
-}
\ No newline at end of file
+}
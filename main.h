@@ -43,11 +43,47 @@ inline f32 DegreesToRadians(f32 degrees)
     return result;
 }
 
-#include <time.h>
+// NOTE(mevex): Integer hash (lowbias32), used to derive seeds
+inline u32 HashU32(u32 x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+inline u32 HashCombine(u32 seed, u32 value)
+{
+    u32 result = HashU32(seed ^ (value + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+    return result;
+}
+
+// NOTE(mevex): xorshift32 with one state per thread, so tiles can be rendered in parallel.
+// The renderer reseeds it at the start of every tile pass, which makes the image
+// independent of the thread (or process) that renders a tile.
+inline thread_local u32 RandomState = 0x9e3779b9U;
+
+inline void SeedRandom(u32 seed)
+{
+    RandomState = HashU32(seed) | 1;
+}
+
+inline u32 RandomU32()
+{
+    u32 x = RandomState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    RandomState = x;
+    return x;
+}
+
 inline f32 RandomFloat()
 {
     // Returns a random real number in [0,1)
-    f32 result = rand() / (RAND_MAX + 1.0f);
+    f32 result = (RandomU32() >> 8) * (1.0f / 16777216.0f);
     return result;
 }
 
@@ -61,73 +97,43 @@ inline f32 RandomFloat(f32 min, f32 max)
 #include <vector>
 using std::vector;
 
+#include <memory>
+#include <string>
+
+// NOTE(mevex): Profiling counters, one copy per thread. They are defined in raytracer.cpp,
+// the renderer adds them to the global totals (see GetPerfCounters) after every tile.
+extern thread_local unsigned long long GetRayColorCycles;
+extern thread_local unsigned long long HitCycles;
+extern thread_local unsigned long long ScatterCycles;
+
+extern thread_local unsigned long long GetRayColorCounter;
+extern thread_local unsigned long long HitCounter;
+extern thread_local unsigned long long ScatterCounter;
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
 #include "simd.h"
+#include "threads.h"
 
 #include "v3.h"
 #include "ray.h"
 #include "hittable.h"
+#include "shapes.h"
 #include "material.h"
+#include "cluster.h"
 #include "light.h"
+#include "radiance.h"
+#include "guiding.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "external/stb_image_write.h"
-
-#define TINYOBJLOADER_IMPLEMENTATION
 #include "external/tiny_obj_loader.h"
 
-class Canvas
-{
-    public:
-    
-    void* memory;
-    i32 width;
-    i32 height;
-    i32 bytesPerPixel;
-    f32 ratio;
-    
-    Canvas(i32 w, i32 h, i32 bpp)
-    {
-        width = w;
-        height = h;
-        bytesPerPixel = bpp;
-        ratio = (f32)w / (f32)h;
-        memory = malloc(bpp * w * h);
-    }
-    
-    void SetPixel(i32 x, i32 y, f32 red, f32 green, f32 blue)
-    {
-        u8 r,g,b;
-        
-        r = (u8)(255.99f * sqrt(red));
-        g = (u8)(255.99f * sqrt(green));
-        b = (u8)(255.99f * sqrt(blue));
-        
-        red = Min(red, 255);
-        green = Min(green, 255);
-        blue = Min(blue, 255);
-        
-        i32* pixel = (i32*)memory;
-        pixel += (height-y-1)*width + x;
-        *pixel = 255<<24 | b << 16 | g << 8 | r;
-    }
-    
-    void SetPixel(i32 x, i32 y, Color c)
-    {
-        SetPixel(x, y, c.r, c.g, c.b);
-    }
-    
-    void SetPixel(i32 x, i32 y, Color c, int spp)
-    {
-        f32 scale = 1.0f / spp;
-        c *= scale;
-        SetPixel(x, y, c.r, c.g, c.b);
-    }
-    
-    ~Canvas()
-    {
-        // NOTE(mevex): no need to free the memory since the canvas will be destroyed only when the program closes
-    }
-};
+#include "image.h"
+#include "canvas.h"
 
 class Camera
 {
@@ -163,23 +169,563 @@ class Camera
     }
 };
 
+// NOTE(mevex): What the render kernels have to handle, found by Scene::Prepare. The kernels are
+// instantiated for a few masks (see ShadeWave in raytracer.cpp) and a render picks the smallest one that
+// covers its scene: a kernel only calls the materials and lights of its mask directly, without a virtual
+// call, and leaves out the branches of the features it doesn't have. The radiance cache and path
+// guiding are settings of the render rather than of the scene, the renderer adds them.
+// There are no flags for the kinds of objects: the spheres and planes are traced from their lists and
+// the meshes through their own BVHs without virtual calls already (see Scene::Hit), what is left is one
+// virtual Hit per ray for each of the few other objects, not worth a kernel per mix of them.
+enum SceneFeature
+{
+    Feature_Lambertian = 1 << 0,
+    Feature_Metal = 1 << 1,
+    Feature_VertexColor = 1 << 2,
+    // NOTE(mevex): Materials and lights of other types, only the generic kernel has them
+    Feature_OtherMaterials = 1 << 3,
+    Feature_AmbientLights = 1 << 4,
+    Feature_PointLights = 1 << 5,
+    Feature_OtherLights = 1 << 6,
+    Feature_RadianceCache = 1 << 7,
+    Feature_PathGuiding = 1 << 8,
+    Feature_All = (1 << 9) - 1,
+};
+
+inline u32 MaterialFeature(Material *material)
+{
+    if(!material)
+        return 0;
+    u32 result = (material->type == LAMBERTIAN) ? Feature_Lambertian : (material->type == METAL) ? Feature_Metal :
+                 (material->type == VERTEX_COLOR) ? Feature_VertexColor : Feature_OtherMaterials;
+    return result;
+}
+
+// NOTE(mevex): Defined in raytracer.cpp
+bool LoadObj(Mesh& mesh, const char* filename, const char* basepath = NULL, bool triangulate = true);
+
 struct Scene
 {
     vector<Hittable *> objects;
     vector<Light *> lights;
     int ambientLightIndex;
+
+    // NOTE(mevex): Everything created through the scene builder functions below is
+    // owned by the scene and lives as long as the scene does. Objects added with Add
+    // are owned by the caller.
+    vector<std::unique_ptr<Hittable>> ownedObjects;
+    vector<std::unique_ptr<Light>> ownedLights;
+    vector<std::unique_ptr<Material>> ownedMaterials;
+
+    // NOTE(mevex): Set by Prepare, the renderer prepares the scene only once and
+    // reuses it for every following render
+    bool prepared = false;
+
+    // NOTE(mevex): Accelerator over the bounded objects and the sphere blocks, only built when there are
+    // at least AccelThreshold of them, below that testing them all is as fast. Accel_Auto probes every kind.
+    enum
+    {
+        AccelThreshold = 16,
+        ProbeWidth = 48,
+        ProbeHeight = 27,
+        ManyLightThreshold = 8,
+    };
+
+    // NOTE(mevex): Shadow rays end a bit before the light, the light itself is not an obstacle
+    static constexpr f32 ShadowRayEnd = 0.999f;
+    AccelKind accelKind = Accel_Auto;
+    std::unique_ptr<Accelerator> accel;
+    vector<Hittable *> bounded;
+    vector<Hittable *> unbounded;
+    vector<AABB> accelBounds;
+
+    // NOTE(mevex): With packShapes the spheres and planes are traced from the structure of arrays
+    // lists (see shapes.h), everything else is in others. Both are made by Prepare.
+    bool packShapes = true;
+    SphereList spheres;
+    PlaneList planes;
+    vector<Hittable *> others;
+
+    // NOTE(mevex): Meshes that trace camera ray packets on their own (see HitPacket), made by Prepare
+    vector<Mesh *> packetMeshes;
+
+    // NOTE(mevex): Box of the bounded objects, kept by Prepare and Update
+    AABB bounds;
+
+    // NOTE(mevex): Up to ManyLightThreshold point lights every hit casts a shadow ray to all of them.
+    // With more, lightSamples of them are picked through lightTree in proportion to how much they can
+    // add, so the cost stays the same however many lights there are. lightSamples 0 always uses all
+    // the lights. Prepare rebuilds the tree when lights are added.
+    u32 lightSamples = 2;
+    LightTree lightTree;
+    vector<u32> pointLights;
+    vector<u32> otherLights;
+    // NOTE(mevex): Position and intensity of every point light when the tree was built
+    vector<f32> pointLightValues;
+
+    // NOTE(mevex): SceneFeature flags of the materials of the objects and of the lights, kept by Prepare
+    u32 features = Feature_All;
+    u32 materialFeatures = Feature_All;
+
+
+    Scene() = default;
+    Scene(const Scene&) = delete;
+    Scene& operator=(const Scene&) = delete;
     
     inline void Add(Hittable *obj)
     {
         objects.push_back(obj);
+        prepared = false;
     }
     
     inline void Add(Light *l)
     {
         lights.push_back(l);
     }
+
+    // NOTE(mevex): Scene builder, e.g. scene.Create<Sphere>(center, radius, material)
+    template<typename T, typename... Args>
+    T *Create(Args... args)
+    {
+        T *result = new T(args...);
+        Own(result);
+        return result;
+    }
+
+    // NOTE(mevex): Loads a triangulated OBJ file, the materials are looked for next to it.
+    // Returns 0 if the file can't be loaded.
+    Mesh *LoadMesh(const char *filename, p3 position)
+    {
+        std::string basepath = filename;
+        size_t slash = basepath.find_last_of("/\\");
+        basepath = (slash == std::string::npos) ? "" : basepath.substr(0, slash + 1);
+
+        Mesh *mesh = new Mesh(position);
+        if(!LoadObj(*mesh, filename, basepath.c_str(), true))
+        {
+            delete mesh;
+            return 0;
+        }
+
+        mesh->ComputeBoundingSphere();
+        Own(mesh);
+        return mesh;
+    }
+
+    // NOTE(mevex): Opens a file made by WriteClusterFile, the triangles are read while rendering.
+    // Returns 0 if the file can't be opened.
+    ClusteredMesh *LoadClusteredMesh(const char *filename, p3 position)
+    {
+        ClusteredMesh *mesh = new ClusteredMesh(position);
+        if(!mesh->Open(filename))
+        {
+            printf("ERR: could not open cluster file %s\n", filename);
+            delete mesh;
+            return 0;
+        }
+
+        Own(mesh);
+        return mesh;
+    }
+
+    // NOTE(mevex): Rough number of bytes used by what the scene owns, used to budget scene caches
+    size_t MemorySize()
+    {
+        size_t result = sizeof(Scene);
+        for(auto& obj : ownedObjects)
+        {
+            Mesh *mesh = dynamic_cast<Mesh *>(obj.get());
+            ClusteredMesh *clustered = dynamic_cast<ClusteredMesh *>(obj.get());
+            if(mesh)
+                result += sizeof(Mesh) + mesh->triangles.capacity() * sizeof(Triangle) + mesh->materials.capacity() * sizeof(Lambertian) + mesh->bvh.MemorySize() +
+                          (mesh->accel ? mesh->accel->MemorySize() : 0);
+            else if(clustered)
+                result += clustered->ResidentSize() + clustered->memoryBudget;
+            else
+                result += sizeof(Sphere);
+        }
+        result += (ownedLights.size() + ownedMaterials.size()) * sizeof(Metal);
+        if(accel)
+            result += accel->MemorySize() + accelBounds.capacity() * sizeof(AABB);
+        result += spheres.MemorySize() + planes.MemorySize();
+        return result;
+    }
+
+    // NOTE(mevex): Hash of everything that changes the image of the scene: the objects and lights in
+    // order, the materials they use and the settings of the tracing. Call it after Prepare, it includes
+    // the accelerators that were picked. False if an object, material or light can't be hashed
+    // (see Hittable::HashContent), the scene has no stable identity then.
+    bool HashContent(u64& result)
+    {
+        ContentHash hash;
+        hash.Add((u32)objects.size());
+        for(Hittable *obj : objects)
+        {
+            if(!obj->HashContent(hash))
+                return false;
+        }
+        for(u32 i = 0; i < hash.materials.size(); i++)
+        {
+            Material *material = hash.materials[i];
+            if(material)
+            {
+                if(!material->HashContent(hash))
+                    return false;
+            }
+            else
+                hash.Add(0u);
+        }
+        hash.Add((u32)lights.size());
+        for(Light *light : lights)
+        {
+            if(!light->HashContent(hash))
+                return false;
+        }
+        hash.Add(lightSamples);
+        hash.Add((u32)packShapes);
+        hash.Add((u32)(accel ? accel->Kind() : Accel_Count));
+        result = hash.value;
+        return true;
+    }
+
+    // NOTE(mevex): Builds everything the renderer needs before tracing rays, on the pool if given.
+    // Called by the renderer, once the scene is prepared it only applies the changes made since (see Update).
+    // The camera, if given, is used to pick the accelerators with a probe render.
+    void Prepare(WorkerPool *pool = 0, Camera *camera = 0)
+    {
+        BuildLightTree();
+        if(prepared)
+        {
+            if(Changed())
+                Update(pool);
+            u32 current = materialFeatures | LightFeatures();
+            if(features != current)
+                features = current;
+            return;
+        }
+
+        vector<Ray> probeRays;
+        for(Hittable *obj : objects)
+        {
+            Mesh *mesh = dynamic_cast<Mesh *>(obj);
+            if(mesh && mesh->accelKind != Accel_BVH && !mesh->accel && mesh->bvh.Empty())
+            {
+                if(probeRays.empty())
+                    MakeProbeRays(camera, probeRays);
+                mesh->BuildAccelerator(pool, &probeRays);
+                printf("Mesh accelerator: %s\n", AccelKindName(mesh->accelKind));
+            }
+
+            if(mesh && !mesh->accel && mesh->bvh.Empty())
+            {
+                mesh->BuildBVH(pool, mesh->buildMode);
+                BVHBuildStats& stats = mesh->bvh.buildStats;
+                if(stats.mode == BVHBuild_Lazy)
+                    printf("BVH build time (lazy): %.2fms, the nodes are split as rays reach them\n", stats.milliseconds);
+                else
+                    printf("BVH build time (%s): %.2fms, %u nodes, SAH cost: %.2f\n", stats.mode == BVHBuild_LBVH ? "LBVH" : "SAH",
+                           stats.milliseconds, mesh->bvh.NodeCount(), stats.sahCost);
+            }
+        }
+
+        BuildShapes();
+        ComputeBounds(bounds);
+        if(probeRays.empty() && accelKind == Accel_Auto)
+            MakeProbeRays(camera, probeRays);
+        BuildAccelerator(pool, probeRays);
+        materialFeatures = MaterialFeatures();
+        features = materialFeatures | LightFeatures();
+        prepared = true;
+    }
+
+    // NOTE(mevex): Clustered meshes only use Lambertians, objects of other types could use anything
+    u32 MaterialFeatures()
+    {
+        u32 result = 0;
+        for(Hittable *obj : objects)
+        {
+            if(Sphere *sphere = dynamic_cast<Sphere *>(obj))
+                result |= MaterialFeature(sphere->material);
+            else if(Plane *plane = dynamic_cast<Plane *>(obj))
+                result |= MaterialFeature(plane->material);
+            else if(Triangle *triangle = dynamic_cast<Triangle *>(obj))
+                result |= MaterialFeature(triangle->material);
+            else if(Mesh *mesh = dynamic_cast<Mesh *>(obj))
+            {
+                Material *last = 0;
+                for(Triangle& t : mesh->triangles)
+                {
+                    if(t.material != last)
+                        result |= MaterialFeature(t.material);
+                    last = t.material;
+                }
+            }
+            else if(dynamic_cast<ClusteredMesh *>(obj))
+                result |= Feature_Lambertian;
+            else
+                result |= Feature_OtherMaterials;
+        }
+        return result;
+    }
+
+    u32 LightFeatures()
+    {
+        u32 result = 0;
+        for(Light *light : lights)
+            result |= (light->type == POINT) ? Feature_PointLights : (light->type == AMBIENT) ? Feature_AmbientLights : Feature_OtherLights;
+        return result;
+    }
+
+    // NOTE(mevex): The split is made aside and the scene only written when the lights changed, the other
+    // renders of a prepared scene keep reading it meanwhile. The tree is also rebuilt when a point light
+    // moved or changed intensity, its boxes and powers are the ones of the lights when it was built.
+    void BuildLightTree()
+    {
+        vector<u32> currentPoint;
+        vector<u32> currentOther;
+        vector<f32> currentValues;
+        for(u32 i = 0; i < (u32)lights.size(); i++)
+        {
+            if(lights[i]->type == POINT)
+            {
+                PointLight *light = (PointLight *)lights[i];
+                currentPoint.push_back(i);
+                currentValues.insert(currentValues.end(), {light->position.x, light->position.y, light->position.z, light->intensity});
+            }
+            else
+                currentOther.push_back(i);
+        }
+        bool useTree = lightSamples > 0 && currentPoint.size() > ManyLightThreshold;
+        if(currentPoint == pointLights && currentOther == otherLights && currentValues == pointLightValues && useTree != lightTree.Empty())
+            return;
+
+        pointLights.swap(currentPoint);
+        otherLights.swap(currentOther);
+        pointLightValues.swap(currentValues);
+        lightTree.nodes.clear();
+        if(useTree)
+            lightTree.Build(lights, pointLights);
+    }
+
+    // NOTE(mevex): Moves the spheres and planes to their lists, the other objects go in others
+    void BuildShapes()
+    {
+        vector<Sphere *> sphereObjects;
+        vector<Plane *> planeObjects;
+        others.clear();
+        packetMeshes.clear();
+        for(Hittable *obj : objects)
+        {
+            Mesh *mesh = dynamic_cast<Mesh *>(obj);
+            if(mesh && !mesh->accel && !mesh->bvh.IsLazy())
+                packetMeshes.push_back(mesh);
+
+            Sphere *sphere = packShapes ? dynamic_cast<Sphere *>(obj) : 0;
+            Plane *plane = packShapes ? dynamic_cast<Plane *>(obj) : 0;
+            if(sphere)
+                sphereObjects.push_back(sphere);
+            else if(plane)
+                planeObjects.push_back(plane);
+            else
+                others.push_back(obj);
+        }
+        spheres.Build(sphereObjects);
+        planes.Build(planeObjects);
+    }
+
+    // NOTE(mevex): Splits the other objects in bounded and unbounded ones and builds the accelerator over the
+    // bounded ones and the sphere blocks if there are enough of them. Auto is resolved with the probe rays
+    // once, later builds keep the kind it picked.
+    void BuildAccelerator(WorkerPool *pool, vector<Ray>& probeRays)
+    {
+        bounded.clear();
+        unbounded.clear();
+        for(Hittable *obj : others)
+        {
+            AABB b;
+            if(obj->Bounds(b))
+                bounded.push_back(obj);
+            else
+                unbounded.push_back(obj);
+        }
+        GatherAccelBounds(accelBounds);
+
+        accel.reset();
+        if(accelBounds.size() < AccelThreshold)
+            return;
+
+        AccelKind kind = accelKind;
+        if(kind == Accel_Auto)
+        {
+            AcceleratorProbe probe = {};
+            kind = SelectAccelerator(accelBounds, probeRays, [&](Ray& r, u32 i, f32 t0, f32& t1)
+            {
+                HitRecord tmpRec = {};
+                return HitAccelPrimitive(i, r, t0, t1, tmpRec, false);
+            }, pool, &probe);
+            printf("Scene accelerator probe (%zu objects, %u sampled): BVH %.2f/%.2fms, grid %.2f/%.2fms, k-d tree %.2f/%.2fms (build/trace) -> %s\n",
+                   accelBounds.size(), probe.sampledPrimitives, probe.buildMs[0], probe.traceMs[0], probe.buildMs[1], probe.traceMs[1],
+                   probe.buildMs[2], probe.traceMs[2], AccelKindName(kind));
+            accelKind = kind;
+        }
+
+        accel.reset(CreateAccelerator(kind));
+        accel->Build(accelBounds, pool);
+    }
+
+    // NOTE(mevex): Boxes of the accelerator primitives: the bounded objects followed by the sphere blocks
+    void GatherAccelBounds(vector<AABB>& result)
+    {
+        result.clear();
+        for(Hittable *obj : bounded)
+        {
+            AABB b;
+            obj->Bounds(b);
+            result.push_back(b);
+        }
+        result.insert(result.end(), spheres.blockBounds.begin(), spheres.blockBounds.end());
+    }
+
+    // NOTE(mevex): Hit test of accelerator primitive i, t1 is lowered to the hit
+    inline bool HitAccelPrimitive(u32 i, Ray& r, f32 t0, f32& t1, HitRecord& rec, bool frontOnly, Hittable **object = 0)
+    {
+        if(i < bounded.size())
+        {
+            if(!bounded[i]->Hit(r, t0, t1, rec) || (frontOnly && !rec.frontFace))
+                return false;
+            t1 = rec.t;
+            if(object)
+                *object = bounded[i];
+            return true;
+        }
+
+        u32 sphere = spheres.IntersectBlock(i - (u32)bounded.size(), r, t0, t1, false);
+        if(sphere == SphereList::NoHit)
+            return false;
+        spheres.SetRecord(sphere, r, t1, rec);
+        if(object)
+            *object = spheres.source[sphere];
+        return true;
+    }
+
+    void ComputeBounds(AABB& result)
+    {
+        result = AABB();
+        for(Hittable *obj : objects)
+        {
+            AABB b;
+            if(obj->Bounds(b))
+                result.Grow(b);
+        }
+    }
+
+    // NOTE(mevex): Primary rays of the camera on a coarse grid, or rays from around the scene towards
+    // random points inside it when there is no camera
+    void MakeProbeRays(Camera *camera, vector<Ray>& rays)
+    {
+        rays.clear();
+        if(camera)
+        {
+            for(i32 y = 0; y < ProbeHeight; y++)
+                for(i32 x = 0; x < ProbeWidth; x++)
+                    rays.push_back(camera->GetRay((x + 0.5f) / ProbeWidth, (y + 0.5f) / ProbeHeight));
+            return;
+        }
+
+        AABB sceneBounds;
+        ComputeBounds(sceneBounds);
+        if(sceneBounds.min.x > sceneBounds.max.x)
+            return;
+
+        v3 extent = sceneBounds.max - sceneBounds.min;
+        p3 center = sceneBounds.Center();
+        f32 radius = extent.Length();
+        auto hashFloat = [](u32 i, u32 k) { return (HashCombine(i, k) >> 8) * (1.0f / 16777216.0f); };
+        for(u32 i = 0; i < ProbeWidth * ProbeHeight; i++)
+        {
+            v3 direction = Unit(v3(hashFloat(i, 0) - 0.5f, hashFloat(i, 1) - 0.5f, hashFloat(i, 2) - 0.5f));
+            p3 origin = center + radius * direction;
+            p3 target = sceneBounds.min + v3(hashFloat(i, 3) * extent.x, hashFloat(i, 4) * extent.y, hashFloat(i, 5) * extent.z);
+            rays.push_back(Ray(origin, target - origin));
+        }
+    }
+
+    // NOTE(mevex): Animation between frames: spheres can be moved by changing their center, meshes
+    // with Mesh::Move (free) and Mesh::SetTriangle. This refits the BVHs of the meshes whose
+    // triangles changed, the cost depends on how many of them changed. Returns the number of
+    // BVHs that had to be rebuilt instead.
+    u32 Update(WorkerPool *pool = 0)
+    {
+        u32 result = 0;
+        for(Hittable *obj : objects)
+        {
+            Mesh *mesh = dynamic_cast<Mesh *>(obj);
+            if(mesh && mesh->pendingUpdate && mesh->Update(pool))
+                result++;
+        }
+
+        // NOTE(mevex): Only the shapes that moved are copied again, the accelerator is only rebuilt if a box changed
+        spheres.Refresh();
+        planes.Refresh();
+        ComputeBounds(bounds);
+        if(accel && AccelBoundsChanged())
+        {
+            vector<Ray> noRays;
+            BuildAccelerator(pool, noRays);
+        }
+        return result;
+    }
+
+    // NOTE(mevex): True if Update has something to do: a mesh with changed triangles or an object that
+    // moved. It only reads the scene, so Prepare can check a scene other renders are tracing.
+    bool Changed()
+    {
+        for(Hittable *obj : objects)
+        {
+            Mesh *mesh = dynamic_cast<Mesh *>(obj);
+            if(mesh && mesh->pendingUpdate)
+                return true;
+        }
+        if(spheres.Changed() || planes.Changed())
+            return true;
+
+        AABB current;
+        ComputeBounds(current);
+        bool result = memcmp(&current, &bounds, sizeof(AABB)) != 0 || (accel && AccelBoundsChanged());
+        return result;
+    }
+
+    bool AccelBoundsChanged()
+    {
+        vector<AABB> current;
+        GatherAccelBounds(current);
+        bool result = current.size() != accelBounds.size() || memcmp(current.data(), accelBounds.data(), current.size() * sizeof(AABB)) != 0;
+        return result;
+    }
+    
+    private:
+
+    inline void Own(Hittable *obj)
+    {
+        ownedObjects.emplace_back(obj);
+        Add(obj);
+    }
+
+    inline void Own(Light *l)
+    {
+        ownedLights.emplace_back(l);
+        Add(l);
+    }
+
+    inline void Own(Material *m)
+    {
+        ownedMaterials.emplace_back(m);
+    }
+
+    public:
     
-    bool Hit(Ray& r, f32 tMin, f32 tMax, HitRecord& rec)
+    // NOTE(mevex): object, if given, is set to the object of the scene that was hit
+    bool Hit(Ray& r, f32 tMin, f32 tMax, HitRecord& rec, Hittable **object = 0)
     {
         ++HitCounter;
         u64 cycleBegin = __rdtsc();
@@ -187,14 +733,34 @@ struct Scene
         bool result = false;
         f32 closestT = tMax;
         HitRecord tmpRec = {};
+
+        if(!accel && spheres.Hit(r, tMin, closestT, rec, object))
+            result = true;
+        if(planes.Hit(r, tMin, closestT, rec, true, object))
+            result = true;
+
+        if(accel)
+        {
+            auto intersect = [&](u32 i, f32 t0, f32& t1)
+            {
+                if(!HitAccelPrimitive(i, r, t0, t1, tmpRec, true, object))
+                    return false;
+                rec = tmpRec;
+                return true;
+            };
+            if(accel->Intersect(r, tMin, closestT, MakeIntersector(intersect)))
+                result = true;
+        }
         
-        for(auto& obj : objects)
+        for(auto& obj : accel ? unbounded : others)
         {
             if(obj->Hit(r, tMin, closestT, tmpRec) && tmpRec.frontFace)
             {
                 result = true;
                 closestT = tmpRec.t;
                 rec = tmpRec;
+                if(object)
+                    *object = obj;
             }
         }
         
@@ -203,10 +769,141 @@ struct Scene
         return result;
     }
     
+    inline bool IsPacketMesh(Hittable *obj)
+    {
+        for(Mesh *mesh : packetMeshes)
+        {
+            if(mesh == obj)
+                return true;
+        }
+        return false;
+    }
+
+    // NOTE(mevex): Closest hits of a packet of camera rays, recs and packet.tMax have to start at INFINITY.
+    // The packet meshes cull the whole packet at once, the rest of the scene is traced four rays at a time.
+    void HitPacket(RayPacket& packet, f32 tMin, HitRecord *recs)
+    {
+        for(Mesh *mesh : packetMeshes)
+            mesh->HitPacket(packet, tMin, recs);
+        HitOthers(packet.rays, packet.count, tMin, packet.tMax, recs);
+    }
+
+    // NOTE(mevex): Closest hits of unrelated rays, recs and tMax have to start at INFINITY. The packet
+    // meshes interleave the rays (see Mesh::HitStream), the rest of the scene is traced four rays at a time.
+    void HitStream(Ray *rays, u32 count, f32 tMin, f32 *tMax, HitRecord *recs)
+    {
+        for(Mesh *mesh : packetMeshes)
+            mesh->HitStream(rays, count, tMin, tMax, recs);
+        HitOthers(rays, count, tMin, tMax, recs);
+    }
+
+    // NOTE(mevex): Everything but the packet meshes, four rays at a time
+    void HitOthers(Ray *rays, u32 count, f32 tMin, f32 *tMax, HitRecord *recs)
+    {
+        for(u32 i = 0; i < count; i += 4)
+        {
+            f32 tMins[4] = {tMin, tMin, tMin, tMin};
+            if(i + 4 <= count)
+            {
+                Hit(rays + i, tMins, tMax + i, recs + i, true);
+                continue;
+            }
+
+            // NOTE(mevex): The last rays are padded with copies of the last one
+            Ray tailRays[4];
+            f32 closestTs[4];
+            HitRecord tailRecs[4];
+            for(u32 j = 0; j < 4; j++)
+            {
+                u32 source = Min(i + j, count - 1);
+                tailRays[j] = rays[source];
+                closestTs[j] = tMax[source];
+                tailRecs[j] = recs[source];
+            }
+            Hit(tailRays, tMins, closestTs, tailRecs, true);
+            for(u32 j = 0; i + j < count; j++)
+            {
+                tMax[i + j] = closestTs[j];
+                recs[i + j] = tailRecs[j];
+            }
+        }
+    }
+
+    // NOTE(mevex): Closest hits of the four rays of a packet, recs and closestTs have to start at INFINITY.
+    // skipPacketMeshes leaves out the meshes HitPacket has already traced.
+    void Hit(Ray rays[4], f32 tMin[4], f32 closestTs[4], HitRecord recs[4], bool skipPacketMeshes = false)
+    {
+        if(spheres.Count() || planes.Count())
+        {
+            for(i32 i = 0; i < 4; i++)
+            {
+                if(!accel)
+                    spheres.Hit(rays[i], tMin[i], closestTs[i], recs[i]);
+                planes.Hit(rays[i], tMin[i], closestTs[i], recs[i], false);
+            }
+        }
+
+        for(auto &obj : accel ? unbounded : others)
+        {
+            if(skipPacketMeshes && IsPacketMesh(obj))
+                continue;
+            HitRecord tempRecs[4] = {};
+            obj->Hit(rays, tMin, closestTs, tempRecs);
+            for(int i = 0; i < 4; ++i)
+            {
+                if(tempRecs[i].t != INFINITY && tempRecs[i].t < recs[i].t)
+                {
+                    closestTs[i] = tempRecs[i].t;
+                    recs[i] = tempRecs[i];
+                }
+            }
+        }
+
+        if(!accel)
+            return;
+
+        for(i32 i = 0; i < 4; i++)
+        {
+            HitRecord tmpRec = {};
+            auto intersect = [&](u32 o, f32 t0, f32& t1)
+            {
+                if(skipPacketMeshes && o < bounded.size() && IsPacketMesh(bounded[o]))
+                    return false;
+                if(!HitAccelPrimitive(o, rays[i], t0, t1, tmpRec, false))
+                    return false;
+                recs[i] = tmpRec;
+                return true;
+            };
+            accel->Intersect(rays[i], tMin[i], closestTs[i], MakeIntersector(intersect));
+        }
+    }
+    
     bool Hit(Ray& r, f32 tMin, f32 tMax)
     {
+        f32 shapeTMax = tMax;
+        if((!accel && spheres.Intersect(r, tMin, shapeTMax, true) != SphereList::NoHit) ||
+           planes.Intersect(r, tMin, shapeTMax, true, false) != PlaneList::NoHit)
+            return true;
+
         HitRecord dummyRec = {};
-        for(auto& obj : objects)
+        if(accel)
+        {
+            // NOTE(mevex): Any hit will do, lowering tMax to tMin stops the traversal
+            bool result = false;
+            auto intersect = [&](u32 i, f32 t0, f32& t1)
+            {
+                if(!HitAccelPrimitive(i, r, t0, t1, dummyRec, false))
+                    return false;
+                result = true;
+                t1 = t0;
+                return true;
+            };
+            accel->Intersect(r, tMin, tMax, MakeIntersector(intersect));
+            if(result)
+                return true;
+        }
+
+        for(auto& obj : accel ? unbounded : others)
         {
             if(obj->Hit(r, tMin, tMax, dummyRec))
             {
@@ -217,29 +914,93 @@ struct Scene
         return false;
     }
     
-    f32 GetLightIntensity(v3 normal, p3 hitPoint)
+    // NOTE(mevex): Shadow ray of a point light, from the hit point to the light at t = 1.
+    // False if the light is behind the surface.
+    inline bool ShadowRay(PointLight *light, v3 normal, p3 hitPoint, Ray& result)
+    {
+        result = Ray(hitPoint, light->position - hitPoint);
+        return Dot(normal, result.direction) >= 0;
+    }
+
+    // NOTE(mevex): Most samples SampleLights can return
+    inline u32 MaxLightSamples()
+    {
+        u32 result = lightTree.Empty() ? (u32)pointLights.size() : lightSamples;
+        return result;
+    }
+
+    // NOTE(mevex): Point lights whose shadow ray has to be traced for the hit, at most MaxLightSamples.
+    // The lights behind the surface are left out.
+    u32 SampleLights(v3 normal, p3 hitPoint, LightSample *samples)
+    {
+        u32 count = 0;
+        if(lightTree.Empty())
+        {
+            for(u32 i : pointLights)
+            {
+                if(Dot(normal, ((PointLight *)lights[i])->position - hitPoint) >= 0)
+                    samples[count++] = {i, 1.0f};
+            }
+            return count;
+        }
+
+        for(u32 i = 0; i < lightSamples; i++)
+        {
+            if(lightTree.Sample(normal, hitPoint, samples[count]))
+            {
+                samples[count].weight /= (f32)lightSamples;
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // NOTE(mevex): Like GetLightIntensity, with the shadow rays of the samples traced already:
+    // visible has an entry per sample. Features (see SceneFeature) says which types of lights there are,
+    // the ones of a known type are called without a virtual call.
+    template<u32 Features = Feature_All>
+    f32 GetLightIntensity(v3 normal, p3 hitPoint, LightSample *samples, u32 sampleCount, const u8 *visible)
     {
         f32 intensity = 0;
-        
-        for(auto l : lights)
+
+        if constexpr((Features & Feature_OtherLights) != 0)
+        {
+            for(u32 i : otherLights)
+                intensity += lights[i]->ComputeLightning(normal, hitPoint);
+        }
+        else if constexpr((Features & Feature_AmbientLights) != 0)
         {
-            if(l->type == POINT)
+            for(u32 i : otherLights)
+                intensity += ((AmbientLight *)lights[i])->AmbientLight::ComputeLightning(normal, hitPoint);
+        }
+        if constexpr((Features & Feature_PointLights) != 0)
+        {
+            for(u32 i = 0; i < sampleCount; i++)
             {
-                PointLight *light = (PointLight *)l;
-                Ray lightRay(hitPoint, light->position);
-                
-                if(Dot(normal, (lightRay.direction - lightRay.origin)) >= 0)
-                {
-                    if(!Hit(lightRay, ZERO, 1.001f))
-                        intensity += l->ComputeLightning(normal, hitPoint);
-                }
+                if(visible[i])
+                    intensity += samples[i].weight * ((PointLight *)lights[samples[i].light])->PointLight::ComputeLightning(normal, hitPoint);
             }
-            else
-                intensity += l->ComputeLightning(normal, hitPoint);
         }
-        
+
         return intensity;
     }
+
+    f32 GetLightIntensity(v3 normal, p3 hitPoint)
+    {
+        local_persist thread_local vector<LightSample> samples;
+        local_persist thread_local vector<u8> visible;
+        samples.resize(MaxLightSamples());
+        u32 count = SampleLights(normal, hitPoint, samples.data());
+        visible.resize(count);
+        for(u32 i = 0; i < count; i++)
+        {
+            Ray lightRay;
+            ShadowRay((PointLight *)lights[samples[i].light], normal, hitPoint, lightRay);
+            visible[i] = !Hit(lightRay, ZERO, ShadowRayEnd);
+        }
+        
+        return GetLightIntensity(normal, hitPoint, samples.data(), count, visible.data());
+    }
 };
 
 #endif //MAIN_H
@@ -5,10 +5,30 @@
 #include "v3.h"
 #include "hittable.h"
 
+// NOTE(mevex): Lets the specialized render kernels call Scatter without a virtual call, see SceneFeature.
+// Materials made outside this file keep OTHER_MATERIAL.
+enum MaterialType
+{
+    LAMBERTIAN,
+    METAL,
+    VERTEX_COLOR,
+    OTHER_MATERIAL
+};
+
 class Material
 {
     public:
+
+    enum MaterialType type = OTHER_MATERIAL;
+    virtual ~Material() {}
     virtual bool Scatter(Ray& rIn, HitRecord& rec, Color& attenuation, Ray& scattered) = 0;
+
+    // NOTE(mevex): Diffuse materials scatter the same way whatever the incoming ray, what follows
+    // their hits can come from the radiance cache
+    virtual bool IsDiffuse() { return false; }
+
+    // NOTE(mevex): Adds everything that changes how the material scatters, false if it can't tell
+    virtual bool HashContent(ContentHash& hash) { return false; }
 };
 
 class Lambertian : public Material
@@ -17,7 +37,19 @@ class Lambertian : public Material
     
     Color albedo;
     
-    Lambertian(Color a) : albedo(a) {}
+    Lambertian(Color a) : albedo(a)
+    {
+        type = LAMBERTIAN;
+    }
+
+    bool IsDiffuse() override { return true; }
+
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add(1u);
+        hash.Add(albedo);
+        return true;
+    }
     
     bool Scatter(Ray& rIn, HitRecord& rec, Color& attenuation, Ray& scattered) override
     {
@@ -29,7 +61,7 @@ class Lambertian : public Material
         if(scatterDirection.NearZero())
             scatterDirection = rec.normal;
         
-        scattered = {rec.p, Unit(scatterDirection)};
+        scattered = {rec.p, UnitFast(scatterDirection)};
         attenuation = albedo;
 
         u64 cycleEnd = __rdtsc();
@@ -45,7 +77,18 @@ class Metal : public Material
     Color albedo;
     f32 fuzz;
     
-    Metal(Color a, f32 f) : albedo(a), fuzz(Min(f, 1.0f)) {}
+    Metal(Color a, f32 f) : albedo(a), fuzz(Min(f, 1.0f))
+    {
+        type = METAL;
+    }
+
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add(2u);
+        hash.Add(albedo);
+        hash.Add(fuzz);
+        return true;
+    }
     
     bool Scatter(Ray& rIn, HitRecord& rec, Color& attenuation, Ray& scattered) override
     {
@@ -72,7 +115,21 @@ class VertexColor : public Material
     
     Color a,b,c;
     
-    VertexColor(Color c1, Color c2, Color c3) : a(c1), b(c2), c(c3) {}
+    VertexColor(Color c1, Color c2, Color c3) : a(c1), b(c2), c(c3)
+    {
+        type = VERTEX_COLOR;
+    }
+
+    bool IsDiffuse() override { return true; }
+
+    bool HashContent(ContentHash& hash) override
+    {
+        hash.Add(3u);
+        hash.Add(a);
+        hash.Add(b);
+        hash.Add(c);
+        return true;
+    }
     
     bool Scatter(Ray& rIn, HitRecord& rec, Color& attenuation, Ray& scattered) override
     {
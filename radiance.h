@@ -0,0 +1,165 @@
+#ifndef RADIANCE_H
+#define RADIANCE_H
+
+#include "v3.h"
+#include <atomic>
+#include <memory>
+
+// NOTE(mevex): World space cache of what the rest of a path adds after a diffuse hit, the color the
+// attenuation gets multiplied by once the bounces that follow are done. Indirect light changes slowly
+// along a surface, so the paths that hit a cell the cache already knows well stop there and take its
+// average instead of bouncing on.
+//
+// The cells are keyed by position (a grid of cellSize), the main axis of the normal and the number of
+// bounces left, and live in a fixed size open addressing hash table: the memory never grows and a cell
+// that finds no free slot near its hash is simply not cached. Adding samples and looking cells up are
+// lock free, the sums are fixed point so that they can be added with one atomic add each.
+class RadianceCache
+{
+    public:
+
+    // NOTE(mevex): A cell answers lookups once it has MinSamples and stops taking samples at MaxSamples.
+    // FixedOne is 1.0 in the fixed point sums, the samples are clamped to 1.
+    enum
+    {
+        MaxProbes = 8,
+        MinSamples = 16,
+        MaxSamples = 1024,
+        FixedOne = 1 << 20,
+    };
+
+    static constexpr u64 NoKey = 0;
+
+    struct Entry
+    {
+        std::atomic<u64> key;
+        std::atomic<u32> count;
+        std::atomic<u32> sum[3];
+    };
+
+    f32 cellSize = 0;
+
+    RadianceCache() = default;
+    RadianceCache(const RadianceCache&) = delete;
+    RadianceCache& operator=(const RadianceCache&) = delete;
+
+    inline bool Empty()
+    {
+        return entryCount == 0;
+    }
+
+    inline size_t MemorySize()
+    {
+        size_t result = entryCount * sizeof(Entry);
+        return result;
+    }
+
+    // NOTE(mevex): Makes room for as many cells as fit in bytes (a power of two of them), the memory is
+    // only allocated again if that changed. Clear has to follow. Must not run while rendering.
+    void Configure(size_t bytes, f32 newCellSize)
+    {
+        size_t count = 1;
+        while(count * 2 * sizeof(Entry) <= bytes)
+            count *= 2;
+
+        if(count != entryCount)
+        {
+            entries.reset(new Entry[count]);
+            entryCount = count;
+        }
+        cellSize = newCellSize;
+    }
+
+    // NOTE(mevex): Forgets every cell. Must not run while rendering.
+    void Clear()
+    {
+        for(size_t i = 0; i < entryCount; i++)
+        {
+            entries[i].key.store(NoKey, std::memory_order_relaxed);
+            entries[i].count.store(0, std::memory_order_relaxed);
+            for(u32 c = 0; c < 3; c++)
+                entries[i].sum[c].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // NOTE(mevex): 18 bits per cell coordinate, the main axis of the normal and its sign, 4 bits of bounces left
+    inline u64 Key(p3 p, v3 normal, u32 bouncesLeft)
+    {
+        f32 invCellSize = 1.0f / cellSize;
+        u64 x = (u64)(i64)floorf(p.x * invCellSize) & 0x3FFFF;
+        u64 y = (u64)(i64)floorf(p.y * invCellSize) & 0x3FFFF;
+        u64 z = (u64)(i64)floorf(p.z * invCellSize) & 0x3FFFF;
+        v3 a(Abs(normal.x), Abs(normal.y), Abs(normal.z));
+        u32 axis = (a.x > a.y && a.x > a.z) ? 0 : (a.y > a.z) ? 1 : 2;
+        u64 side = 2 * axis + (normal.e[axis] < 0 ? 1 : 0);
+        u64 result = (x << 43) | (y << 25) | (z << 7) | (side << 4) | Min(bouncesLeft, 15u);
+        // NOTE(mevex): Keeps NoKey free
+        result += 1;
+        return result;
+    }
+
+    // NOTE(mevex): Average of the cell, false if it has too few samples (or isn't cached at all)
+    bool Lookup(u64 key, Color& result)
+    {
+        Entry *entry = Find(key, false);
+        if(!entry)
+            return false;
+
+        // NOTE(mevex): The count and the sums are read apart, a sample added in between only moves
+        // the average by a fraction of a sample
+        u32 count = entry->count.load(std::memory_order_relaxed);
+        if(count < MinSamples)
+            return false;
+
+        f32 scale = 1.0f / ((f32)count * FixedOne);
+        result = Color(entry->sum[0].load(std::memory_order_relaxed) * scale,
+                       entry->sum[1].load(std::memory_order_relaxed) * scale,
+                       entry->sum[2].load(std::memory_order_relaxed) * scale);
+        return true;
+    }
+
+    void Add(u64 key, Color sample)
+    {
+        Entry *entry = Find(key, true);
+        if(!entry || entry->count.load(std::memory_order_relaxed) >= MaxSamples)
+            return;
+
+        // NOTE(mevex): Threads racing past the MaxSamples check add a few samples more, the sums
+        // have room for 4096 of them
+        for(u32 c = 0; c < 3; c++)
+            entry->sum[c].fetch_add((u32)(Clamp(sample.e[c], 0.0f, 1.0f) * FixedOne), std::memory_order_relaxed);
+        entry->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    private:
+
+    std::unique_ptr<Entry[]> entries;
+    size_t entryCount = 0;
+
+    // NOTE(mevex): Linear probing from the hash of the key, a free slot is claimed with a compare exchange
+    Entry *Find(u64 key, bool insert)
+    {
+        if(!entryCount)
+            return 0;
+
+        u64 hash = key * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+        size_t mask = entryCount - 1;
+        for(u32 probe = 0; probe < MaxProbes; probe++)
+        {
+            Entry *entry = &entries[(hash + probe) & mask];
+            u64 current = entry->key.load(std::memory_order_relaxed);
+            if(current == key)
+                return entry;
+            if(current != NoKey)
+                continue;
+            if(!insert)
+                return 0;
+            if(entry->key.compare_exchange_strong(current, key, std::memory_order_relaxed) || current == key)
+                return entry;
+        }
+        return 0;
+    }
+};
+
+#endif //RADIANCE_H
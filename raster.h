@@ -0,0 +1,357 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "main.h"
+
+// NOTE(mevex): Visibility buffer for the camera rays: the triangles of the meshes are projected once
+// per render and sorted in bins of BinSize x BinSize pixels, then every tile finds for each of its
+// jittered samples the nearest triangle covering it, testing the four samples of a pixel at once.
+// Only the id of the triangle is kept, the hit itself comes from the same ray triangle test tracing
+// uses, so the first hits are the ones of the traced camera rays.
+//
+// Everything is done in the viewport coordinates Camera::GetRay takes (u, v): a camera ray at depth
+// z along the view direction has travelled t = z, since its direction is 1 long along that axis.
+// 1/z is a plane over the viewport, so the depth test needs no division.
+class VisibilityBuffer
+{
+    public:
+
+    static constexpr i32 BinSize = 16;
+
+    enum
+    {
+        TrianglesPerChunk = 4096,
+        NoTriangle = 0xFFFFFFFF,
+        // NOTE(mevex): The sample has to be traced, see Raster
+        Ambiguous = 0xFFFFFFFE,
+    };
+
+    // NOTE(mevex): Samples closer than EdgeEpsilon (viewport units) to an edge of a triangle that could
+    // be in front, or with two triangles less than DepthEpsilon apart, are left to tracing: the raster
+    // and the ray triangle test could disagree on them. Triangles nearer than NearDepth make their whole
+    // mesh traced, projecting them would lose too much precision.
+    static constexpr f32 EdgeEpsilon = 1e-5f;
+    static constexpr f32 DepthEpsilon = 1e-4f;
+    static constexpr f32 NearDepth = 1e-3f;
+
+    struct RasterTriangle
+    {
+        // NOTE(mevex): a u + b v + c, the edges give the distance from them (positive inside),
+        // the depth plane gives 1/z
+        f32 edgeA[3], edgeB[3], edgeC[3];
+        f32 depthA, depthB, depthC;
+        u32 mesh;
+        u32 triangle;
+        // NOTE(mevex): Pixels that can have a sample in it, inclusive
+        i32 minX, minY, maxX, maxY;
+    };
+
+    // NOTE(mevex): Meshes that are rastered, the other packet meshes have to be traced
+    vector<Mesh *> meshes;
+    vector<Mesh *> tracedMeshes;
+    vector<RasterTriangle> triangles;
+    // NOTE(mevex): Triangles of bin b: binTriangles[binStart[b]] to binTriangles[binStart[b+1]]
+    vector<u32> binStart;
+    vector<u32> binTriangles;
+    i32 width = 0, height = 0;
+    i32 binsX = 0, binsY = 0;
+    f32 buildMs = 0;
+
+    // NOTE(mevex): Projects and bins the triangles of the packet meshes of the prepared scene, as seen
+    // by camera on an image of width x height pixels
+    void Build(Scene& scene, Camera& camera, i32 newWidth, i32 newHeight, WorkerPool *pool)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+        width = newWidth;
+        height = newHeight;
+        binsX = (width + BinSize - 1) / BinSize;
+        binsY = (height + BinSize - 1) / BinSize;
+        built = camera;
+        position = camera.position;
+        horizontal = camera.vpHorizontal * (1.0f / camera.vpHorizontal.LengthSquared());
+        vertical = camera.vpVertical * (1.0f / camera.vpVertical.LengthSquared());
+        forward = camera.vpLowerLeftCorner + 0.5f * camera.vpHorizontal + 0.5f * camera.vpVertical - camera.position;
+
+        struct Chunk
+        {
+            u32 mesh;
+            u32 first;
+            u32 count;
+            u32 output;
+            bool tooNear;
+            // NOTE(mevex): (bin, triangle) pairs
+            vector<u32> pairs;
+        };
+        vector<Mesh *> candidates;
+        vector<Chunk> chunks;
+        u32 triangleCount = 0;
+        for(Mesh *mesh : scene.packetMeshes)
+        {
+            u32 count = (u32)mesh->triangles.size();
+            for(u32 first = 0; first < count; first += TrianglesPerChunk)
+            {
+                Chunk chunk = {(u32)candidates.size(), first, Min((u32)TrianglesPerChunk, count - first), triangleCount, false};
+                triangleCount += chunk.count;
+                chunks.push_back(chunk);
+            }
+            candidates.push_back(mesh);
+        }
+
+        triangles.resize(triangleCount);
+        auto setupChunk = [&](i32 c)
+        {
+            Chunk& chunk = chunks[c];
+            Mesh *mesh = candidates[chunk.mesh];
+            for(u32 i = 0; i < chunk.count; i++)
+            {
+                RasterTriangle& result = triangles[chunk.output + i];
+                result.mesh = chunk.mesh;
+                result.triangle = chunk.first + i;
+                if(chunk.tooNear)
+                    continue;
+                u32 visible = Setup(mesh->triangles[chunk.first + i], mesh->translation, result);
+                if(visible == Setup_TooNear)
+                    chunk.tooNear = true;
+                if(visible != Setup_Visible)
+                    continue;
+
+                for(i32 by = result.minY / BinSize; by <= result.maxY / BinSize; by++)
+                {
+                    for(i32 bx = result.minX / BinSize; bx <= result.maxX / BinSize; bx++)
+                    {
+                        chunk.pairs.push_back((u32)(by * binsX + bx));
+                        chunk.pairs.push_back(chunk.output + i);
+                    }
+                }
+            }
+        };
+        if(pool)
+            pool->ParallelFor((i32)chunks.size(), setupChunk);
+        else
+        {
+            for(i32 c = 0; c < (i32)chunks.size(); c++)
+                setupChunk(c);
+        }
+
+        // NOTE(mevex): Counting sort of the pairs by bin, in chunk order so the bins are always the same
+        vector<u8> rastered(candidates.size(), 1);
+        for(Chunk& chunk : chunks)
+        {
+            if(chunk.tooNear)
+                rastered[chunk.mesh] = 0;
+        }
+        meshes.clear();
+        tracedMeshes.clear();
+        for(u32 m = 0; m < candidates.size(); m++)
+            (rastered[m] ? meshes : tracedMeshes).push_back(candidates[m]);
+        // NOTE(mevex): RasterTriangle::mesh indexes meshes
+        vector<u32> meshIndex(candidates.size());
+        for(u32 m = 0, next = 0; m < candidates.size(); m++)
+            meshIndex[m] = rastered[m] ? next++ : 0;
+        for(RasterTriangle& t : triangles)
+            t.mesh = meshIndex[t.mesh];
+
+        u32 binCount = (u32)(binsX * binsY);
+        binStart.assign(binCount + 1, 0);
+        for(Chunk& chunk : chunks)
+        {
+            if(!rastered[chunk.mesh])
+                continue;
+            for(size_t i = 0; i < chunk.pairs.size(); i += 2)
+                binStart[chunk.pairs[i] + 1]++;
+        }
+        for(u32 b = 0; b < binCount; b++)
+            binStart[b + 1] += binStart[b];
+        binTriangles.resize(binStart[binCount]);
+        vector<u32> next(binStart.begin(), binStart.end() - 1);
+        for(Chunk& chunk : chunks)
+        {
+            if(!rastered[chunk.mesh])
+                continue;
+            for(size_t i = 0; i < chunk.pairs.size(); i += 2)
+                binTriangles[next[chunk.pairs[i]]++] = chunk.pairs[i + 1];
+        }
+
+        buildMs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - begin).count() / 1000.0f;
+    }
+
+    // NOTE(mevex): The buffer can only answer for the camera and the size it was built for
+    bool Matches(Camera& camera, i32 w, i32 h)
+    {
+        bool result = width == w && height == h && Same(camera.position, built.position) &&
+                      Same(camera.vpHorizontal, built.vpHorizontal) && Same(camera.vpVertical, built.vpVertical) &&
+                      Same(camera.vpLowerLeftCorner, built.vpLowerLeftCorner);
+        return result;
+    }
+
+    // NOTE(mevex): Nearest rastered triangle of every sample of the pixels [minX, maxX)x[minY, maxY).
+    // The four samples of pixel (x, y) start at slots[(y - minY) * (maxX - minX) + x - minX] in
+    // sampleU and sampleV (the viewport coordinates of their rays). ids gets an index in triangles,
+    // NoTriangle if no rastered triangle covers the sample or Ambiguous if it has to be traced.
+    void Raster(i32 minX, i32 minY, i32 maxX, i32 maxY, u32 *slots, f32 *sampleU, f32 *sampleV, u32 sampleCount, u32 *ids)
+    {
+        // NOTE(mevex): 1/z of the nearest triangle surely covering each sample and the highest 1/z of
+        // the others that could cover it, 0 is nothing
+        local_persist thread_local vector<f32> nearest;
+        local_persist thread_local vector<f32> runnerUp;
+        nearest.assign(sampleCount, 0);
+        runnerUp.assign(sampleCount, 0);
+        for(u32 s = 0; s < sampleCount; s++)
+            ids[s] = NoTriangle;
+
+        i32 tileWidth = maxX - minX;
+        wide_f32 inner = WideFloatSetAll(EdgeEpsilon);
+        wide_f32 outer = WideFloatSetAll(-EdgeEpsilon);
+        for(i32 by = minY / BinSize; by <= (maxY - 1) / BinSize; by++)
+        {
+            for(i32 bx = minX / BinSize; bx <= (maxX - 1) / BinSize; bx++)
+            {
+                u32 bin = (u32)(by * binsX + bx);
+                i32 binMinX = Max(bx * BinSize, minX), binMaxX = Min((bx + 1) * BinSize, maxX);
+                i32 binMinY = Max(by * BinSize, minY), binMaxY = Min((by + 1) * BinSize, maxY);
+                for(u32 k = binStart[bin]; k < binStart[bin + 1]; k++)
+                {
+                    u32 index = binTriangles[k];
+                    RasterTriangle& t = triangles[index];
+                    i32 x0 = Max(t.minX, binMinX), x1 = Min(t.maxX + 1, binMaxX);
+                    i32 y0 = Max(t.minY, binMinY), y1 = Min(t.maxY + 1, binMaxY);
+                    if(x0 >= x1 || y0 >= y1)
+                        continue;
+
+                    wide_f32 a0 = WideFloatSetAll(t.edgeA[0]), b0 = WideFloatSetAll(t.edgeB[0]), c0 = WideFloatSetAll(t.edgeC[0]);
+                    wide_f32 a1 = WideFloatSetAll(t.edgeA[1]), b1 = WideFloatSetAll(t.edgeB[1]), c1 = WideFloatSetAll(t.edgeC[1]);
+                    wide_f32 a2 = WideFloatSetAll(t.edgeA[2]), b2 = WideFloatSetAll(t.edgeB[2]), c2 = WideFloatSetAll(t.edgeC[2]);
+                    wide_f32 da = WideFloatSetAll(t.depthA), db = WideFloatSetAll(t.depthB), dc = WideFloatSetAll(t.depthC);
+                    wide_i32 id = WideIntSetAll((i32)index);
+                    for(i32 y = y0; y < y1; y++)
+                    {
+                        for(i32 x = x0; x < x1; x++)
+                        {
+                            u32 slot = slots[(y - minY) * tileWidth + x - minX];
+                            wide_f32 u = WideFloatLoad(sampleU + slot);
+                            wide_f32 v = WideFloatLoad(sampleV + slot);
+                            wide_f32 e0 = WideFloatAdd(WideFloatAdd(WideFloatMultiply(a0, u), WideFloatMultiply(b0, v)), c0);
+                            wide_f32 e1 = WideFloatAdd(WideFloatAdd(WideFloatMultiply(a1, u), WideFloatMultiply(b1, v)), c1);
+                            wide_f32 e2 = WideFloatAdd(WideFloatAdd(WideFloatMultiply(a2, u), WideFloatMultiply(b2, v)), c2);
+                            wide_f32 edgeMin = WideFloatMin(WideFloatMin(e0, e1), e2);
+                            wide_f32 covered = WideFloatNotLess(edgeMin, outer);
+                            if(!WideFloatMoveMask(covered))
+                                continue;
+
+                            // NOTE(mevex): A sure hit nearer than the nearest one takes its place and pushes
+                            // it to runnerUp, everything else that could cover the sample only goes in runnerUp
+                            wide_f32 sure = WideFloatNotLess(edgeMin, inner);
+                            wide_f32 depth = WideFloatAdd(WideFloatAdd(WideFloatMultiply(da, u), WideFloatMultiply(db, v)), dc);
+                            wide_f32 best = WideFloatLoad(nearest.data() + slot);
+                            wide_f32 second = WideFloatLoad(runnerUp.data() + slot);
+                            wide_f32 wins = WideFloatAnd(sure, WideFloatGreater(depth, best));
+                            wide_f32 pushed = WideFloatSelect(wins, best, depth);
+                            WideFloatStore(runnerUp.data() + slot, WideFloatSelect(covered, WideFloatMax(second, pushed), second));
+                            WideFloatStore(nearest.data() + slot, WideFloatSelect(wins, depth, best));
+                            wide_i32 ids4 = WideIntLoad(ids + slot);
+                            WideIntStore(ids + slot, WideIntSelect(wins, id, ids4));
+                        }
+                    }
+                }
+            }
+        }
+
+        for(u32 s = 0; s < sampleCount; s++)
+        {
+            if(runnerUp[s] > 0 && runnerUp[s] >= nearest[s] * (1.0f - DepthEpsilon))
+                ids[s] = Ambiguous;
+        }
+    }
+
+    private:
+
+    enum
+    {
+        Setup_Visible,
+        Setup_Culled,
+        Setup_TooNear,
+    };
+
+    Camera built = Camera(p3(0, 0, 0), v3(0, 0, -1), v3(0, 1, 0), 90, 1);
+    p3 position;
+    v3 forward;
+    // NOTE(mevex): vpHorizontal and vpVertical over their squared length, the dot products with them
+    // give the viewport coordinates
+    v3 horizontal;
+    v3 vertical;
+
+    inline bool Same(v3 a, v3 b)
+    {
+        bool result = a.x == b.x && a.y == b.y && a.z == b.z;
+        return result;
+    }
+
+    // NOTE(mevex): In double, small triangles lose the edge and depth planes in float: their constants
+    // are differences of products of the vertex coordinates, much bigger than the result
+    u32 Setup(Triangle& triangle, v3 translation, RasterTriangle& result)
+    {
+        p3 vertices[3] = {triangle.a + translation, triangle.b + translation, triangle.c + translation};
+        auto dot = [](v3 q, v3 axis) { return (f64)q.x * axis.x + (f64)q.y * axis.y + (f64)q.z * axis.z; };
+        f64 u[3], v[3], w[3];
+        u32 behind = 0;
+        for(u32 i = 0; i < 3; i++)
+        {
+            v3 q = vertices[i] - position;
+            f64 z = dot(q, forward);
+            if(z <= 0)
+                behind++;
+            else if(z < NearDepth)
+                return Setup_TooNear;
+            w[i] = 1.0 / z;
+            u[i] = dot(q, horizontal) * w[i] + 0.5;
+            v[i] = dot(q, vertical) * w[i] + 0.5;
+        }
+        if(behind == 3)
+            return Setup_Culled;
+        if(behind)
+            return Setup_TooNear;
+
+        f64 area = (u[1] - u[0]) * (v[2] - v[0]) - (u[2] - u[0]) * (v[1] - v[0]);
+        if(area == 0)
+            return Setup_Culled;
+
+        // NOTE(mevex): Edge i is the one in front of vertex i, over the area it is its barycentric coordinate
+        f64 sign = (area > 0) ? 1.0 : -1.0;
+        f64 depth[3] = {};
+        for(u32 i = 0; i < 3; i++)
+        {
+            u32 j = (i + 1) % 3, k = (i + 2) % 3;
+            f64 a = (v[j] - v[k]) * sign;
+            f64 b = (u[k] - u[j]) * sign;
+            f64 c = (u[j] * v[k] - u[k] * v[j]) * sign;
+            f64 weight = w[i] / Abs(area);
+            depth[0] += a * weight;
+            depth[1] += b * weight;
+            depth[2] += c * weight;
+
+            f64 invLength = 1.0 / sqrt(a * a + b * b);
+            result.edgeA[i] = (f32)(a * invLength);
+            result.edgeB[i] = (f32)(b * invLength);
+            result.edgeC[i] = (f32)(c * invLength);
+        }
+        result.depthA = (f32)depth[0];
+        result.depthB = (f32)depth[1];
+        result.depthC = (f32)depth[2];
+
+        // NOTE(mevex): Sample u of pixel x goes from x / (width - 1) to (x + 1) / (width - 1), the min
+        // side takes a pixel more because x + jitter can round up to x + 1
+        f32 scaleX = (f32)(width - 1), scaleY = (f32)(height - 1);
+        f32 minU = (f32)Min(Min(u[0], u[1]), u[2]) - EdgeEpsilon, maxU = (f32)Max(Max(u[0], u[1]), u[2]) + EdgeEpsilon;
+        f32 minV = (f32)Min(Min(v[0], v[1]), v[2]) - EdgeEpsilon, maxV = (f32)Max(Max(v[0], v[1]), v[2]) + EdgeEpsilon;
+        if(maxU < 0 || maxV < 0 || minU * scaleX >= (f32)width || minV * scaleY >= (f32)height)
+            return Setup_Culled;
+
+        result.minX = (i32)Max(floorf(minU * scaleX) - 1.0f, 0.0f);
+        result.minY = (i32)Max(floorf(minV * scaleY) - 1.0f, 0.0f);
+        result.maxX = (i32)Min(floorf(maxU * scaleX), (f32)(width - 1));
+        result.maxY = (i32)Min(floorf(maxV * scaleY), (f32)(height - 1));
+        return Setup_Visible;
+    }
+};
+
+#endif //RASTER_H
@@ -0,0 +1,2072 @@
+#include "raytracer.h"
+#include <algorithm>
+#include <cstdio>
+#include <chrono>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "external/stb_image_write.h"
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "external/tiny_obj_loader.h"
+
+thread_local unsigned long long GetRayColorCycles = 0;
+thread_local unsigned long long HitCycles = 0;
+thread_local unsigned long long ScatterCycles = 0;
+
+thread_local unsigned long long GetRayColorCounter = 0;
+thread_local unsigned long long HitCounter = 0;
+thread_local unsigned long long ScatterCounter = 0;
+
+thread_local unsigned long long SecondaryRayCounter = 0;
+thread_local unsigned long long SecondaryRayNanoseconds = 0;
+thread_local unsigned long long SecondaryCacheMisses = 0;
+
+global_variable std::atomic<u64> TotalGetRayColorCycles(0);
+global_variable std::atomic<u64> TotalHitCycles(0);
+global_variable std::atomic<u64> TotalScatterCycles(0);
+global_variable std::atomic<u64> TotalGetRayColorCounter(0);
+global_variable std::atomic<u64> TotalHitCounter(0);
+global_variable std::atomic<u64> TotalScatterCounter(0);
+global_variable std::atomic<u64> TotalSecondaryRayCounter(0);
+global_variable std::atomic<u64> TotalSecondaryRayNanoseconds(0);
+global_variable std::atomic<u64> TotalSecondaryCacheMisses(0);
+global_variable std::atomic<bool> CacheMissesCounted(false);
+
+// NOTE(mevex): Moves the counters of the calling thread into the totals
+void FlushPerfCounters()
+{
+    TotalGetRayColorCycles += GetRayColorCycles;
+    TotalHitCycles += HitCycles;
+    TotalScatterCycles += ScatterCycles;
+    TotalGetRayColorCounter += GetRayColorCounter;
+    TotalHitCounter += HitCounter;
+    TotalScatterCounter += ScatterCounter;
+    TotalSecondaryRayCounter += SecondaryRayCounter;
+    TotalSecondaryRayNanoseconds += SecondaryRayNanoseconds;
+    TotalSecondaryCacheMisses += SecondaryCacheMisses;
+
+    GetRayColorCycles = HitCycles = ScatterCycles = 0;
+    GetRayColorCounter = HitCounter = ScatterCounter = 0;
+    SecondaryRayCounter = SecondaryRayNanoseconds = SecondaryCacheMisses = 0;
+}
+
+PerfCounters GetPerfCounters()
+{
+    FlushPerfCounters();
+
+    PerfCounters result = {};
+    result.getRayColorCycles = TotalGetRayColorCycles;
+    result.hitCycles = TotalHitCycles;
+    result.scatterCycles = TotalScatterCycles;
+    result.getRayColorCount = TotalGetRayColorCounter;
+    result.hitCount = TotalHitCounter;
+    result.scatterCount = TotalScatterCounter;
+    result.secondaryRays = TotalSecondaryRayCounter;
+    result.secondaryNanoseconds = TotalSecondaryRayNanoseconds;
+    result.secondaryCacheMisses = TotalSecondaryCacheMisses;
+    result.cacheMissesCounted = CacheMissesCounted;
+    return result;
+}
+
+#define RUN_FAST 1
+
+Color GetRayColor(Ray& r, Scene& scene, int depth)
+{
+    ++GetRayColorCounter;
+    u64 cycleBegin = __rdtsc();
+
+    // NOTE(mevex): Background/ambient light hack
+    v3 unitDir = Unit(r.direction);
+    f32 t = 0.5f*(unitDir.y + 1.0f);
+    Color falseAmbientColor = Lerp(Color(0.6f, 0.6f, 0.6f), Color(0.5f, 0.7f, 1.0f), t);
+    
+    if(depth <= 0)
+        return falseAmbientColor;
+    
+    HitRecord rec;
+    bool hitResult = scene.Hit(r, ZERO, INFINITY, rec);
+    
+    if(hitResult)
+    {
+        // NOTE(mevex): If the light intensity exceeds 1 we get an overexposed color
+        f32 lightIntensity = Min(scene.GetLightIntensity(rec.normal, rec.p), 1.0f);
+        
+        Ray scattered;
+        Color attenuation;
+        if(rec.material->Scatter(r, rec, attenuation, scattered))
+            return attenuation * lightIntensity * GetRayColor(scattered, scene, depth-1);
+        else
+            return attenuation * lightIntensity;
+    }
+    
+    u64 cycleEnd = __rdtsc();
+    GetRayColorCycles += cycleEnd - cycleBegin;
+
+    return falseAmbientColor;
+}
+
+bool LoadObj(Mesh& mesh, const char* filename, const char* basepath, bool triangulate)
+{
+    printf("Loading %s\n", filename);
+    
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::string warn;
+    std::string err;
+    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename, basepath, triangulate);
+    
+    // TODO(mevex): Take care of this strings stuff
+    if (!warn.empty()) {
+        printf("WARN: %s\n", warn.c_str());
+    }
+    
+    if (!err.empty()) {
+        printf("ERR: %s\n", err.c_str());
+    }
+    
+    if (!ret) {
+        printf("Failed to load/parse .obj.\n");
+        return false;
+    }
+    
+    for(tinyobj::material_t m : materials)
+    {
+        Color albedo(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
+        Lambertian mat(albedo);
+        mesh.AddMaterial(mat);
+    }
+    
+    // NOTE(mevex): This routine works only if the mesh has been triangulated
+    int facesCount = (int)shapes[0].mesh.num_face_vertices.size();
+    tinyobj::index_t *indexPtr = &shapes[0].mesh.indices[0];
+    int *materialIndex = &shapes[0].mesh.material_ids[0];
+    for(int i = 0; i < facesCount; i++)
+    {
+        v3 a(attrib.vertices[3 * indexPtr->vertex_index], attrib.vertices[3 * indexPtr->vertex_index + 1], attrib.vertices[3 * indexPtr->vertex_index + 2]);
+        indexPtr += 1;
+        v3 b(attrib.vertices[3 * indexPtr->vertex_index], attrib.vertices[3 * indexPtr->vertex_index + 1], attrib.vertices[3 * indexPtr->vertex_index + 2]);
+        indexPtr += 1;
+        v3 c(attrib.vertices[3 * indexPtr->vertex_index], attrib.vertices[3 * indexPtr->vertex_index + 1], attrib.vertices[3 * indexPtr->vertex_index + 2]);
+        indexPtr += 1;
+        
+        Lambertian *m = &mesh.materials[materialIndex[i]];
+        
+        Triangle t(a, b, c, m);
+        mesh.AddTriangle(t);
+    }
+    
+    auto t2 = std::chrono::high_resolution_clock::now();
+    auto d = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
+    printf("OBJ loading time: %ims\n", (int)(d.count()));
+    
+    //getchar();
+    return true;
+}
+
+vector<Tile> MakeTiles(Canvas& canvas, i32 tileSize)
+{
+    vector<Tile> result;
+    for(i32 y = canvas.height; y > 0; y -= tileSize)
+    {
+        for(i32 x = 0; x < canvas.width; x += tileSize)
+        {
+            Tile tile = {};
+            tile.minX = x;
+            tile.maxX = Min(x + tileSize, canvas.width);
+            tile.minY = Max(y - tileSize, 0);
+            tile.maxY = y;
+            tile.index = (u32)result.size();
+            tile.error = INFINITY;
+            result.push_back(tile);
+        }
+    }
+    return result;
+}
+
+#define PACKET_SIZE 8
+
+// NOTE(mevex): Paths of a tile traced together bounce after bounce. Every pixel has a group of 4 paths,
+// path 4*pixel + i, and the pixels are in the order of their PACKET_SIZE x PACKET_SIZE blocks.
+// Only the first active paths of a group are alive: once a path misses, it and the ones after it
+// in the group stop, and their attenuation is what the pixel gets.
+struct GuidedBounce
+{
+    u32 leaf;
+    f32 u, v;
+    f32 pdf;
+};
+
+struct TileWave
+{
+    vector<i32> pixelX, pixelY;
+    vector<Color> ambient;
+    vector<Color> colors;
+    vector<u8> active;
+    // NOTE(mevex): Paths that took what follows from the radiance cache, they are done even if active
+    vector<u8> finished;
+
+    vector<Ray> rays;
+    vector<HitRecord> hits;
+    vector<Color> attenuations;
+
+    // NOTE(mevex): Paths or shadow rays to trace, with their sort keys
+    vector<u32> batch;
+    vector<u64> keys;
+    vector<u64> sortedKeys;
+
+    // NOTE(mevex): The rays of batch side by side, for Scene::HitStream
+    vector<Ray> streamRays;
+    vector<f32> streamTMax;
+    vector<HitRecord> streamHits;
+
+    // NOTE(mevex): Scene::MaxLightSamples slots per path for the lights it samples, visible is 0
+    // where the shadow ray found the light hidden
+    vector<LightSample> lightSamples;
+    vector<u32> lightSampleCounts;
+    vector<u8> visible;
+    vector<Ray> shadowRays;
+    vector<u32> shadowSlots;
+
+    // NOTE(mevex): maxDepth entries per path with what every hit multiplied the attenuation by, the
+    // radiance cache cell of the hit, if it goes in the cache, and the guided bounce of the hit, if
+    // it is recorded (see RecordPaths)
+    vector<Color> factors;
+    vector<u64> cacheKeys;
+    vector<GuidedBounce> guidedBounces;
+    vector<u8> lengths;
+
+    // NOTE(mevex): Viewport coordinates of the camera rays, the first path of every pixel of the tile
+    // and the triangle the visibility buffer found for each path (see TraceCameraRays)
+    vector<f32> sampleU, sampleV;
+    vector<u32> pixelSlots;
+    vector<u32> triangleIds;
+};
+
+// NOTE(mevex): Sort key of a ray: the octant of its direction, the Morton code of the cell of its origin
+// in a 32^3 grid over the scene bounds and the Morton code of its direction inside the octant. Rays with
+// close keys start close and go the same way, so they mostly go through the same nodes and primitives.
+// NOTE(mevex): Finer origin cells first did worse, the diffuse bounces of close pixels start close
+// already and it is the direction that spreads them.
+inline u64 RayKey(Ray& r, AABB& bounds, v3& scale)
+{
+    v3 p = r.origin - bounds.min;
+    u32 x = (u32)Clamp(p.x * scale.x, 0.0f, 31.0f);
+    u32 y = (u32)Clamp(p.y * scale.y, 0.0f, 31.0f);
+    u32 z = (u32)Clamp(p.z * scale.z, 0.0f, 31.0f);
+    v3 d = Unit(r.direction);
+    u32 dx = (u32)Min(Abs(d.x) * 32.0f, 31.0f);
+    u32 dy = (u32)Min(Abs(d.y) * 32.0f, 31.0f);
+    u32 dz = (u32)Min(Abs(d.z) * 32.0f, 31.0f);
+    u64 octant = (r.direction.x < 0 ? 1 : 0) | (r.direction.y < 0 ? 2 : 0) | (r.direction.z < 0 ? 4 : 0);
+    u64 cell = (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+    u64 direction = (ExpandBits(dx) << 2) | (ExpandBits(dy) << 1) | ExpandBits(dz);
+    u64 result = (octant << 30) | (cell << 15) | direction;
+    return result;
+}
+
+// NOTE(mevex): Reorders batch, the indices of rays, by RayKey. The keys are radix sorted, 11 bits per pass,
+// std::sort cost more than the traversal saved.
+shared_function void SortRays(Scene& scene, vector<Ray>& rays, vector<u32>& batch, vector<u64>& keys, vector<u64>& sortedKeys)
+{
+    // NOTE(mevex): Without bounded objects only the octants order the rays
+    AABB bounds = scene.bounds;
+    if(bounds.min.x > bounds.max.x)
+        bounds.min = bounds.max = v3(0, 0, 0);
+    v3 extent = bounds.max - bounds.min;
+    v3 scale(extent.x > 0 ? 32.0f / extent.x : 0, extent.y > 0 ? 32.0f / extent.y : 0, extent.z > 0 ? 32.0f / extent.z : 0);
+
+    // NOTE(mevex): 33 bits of key and 24 of index, a tile never has that many rays
+    keys.resize(batch.size());
+    for(size_t i = 0; i < batch.size(); i++)
+        keys[i] = (RayKey(rays[batch[i]], bounds, scale) << 24) | batch[i];
+    sortedKeys.resize(batch.size());
+    for(u32 shift = 24; shift < 57; shift += 11)
+    {
+        u32 offsets[2048] = {};
+        for(u64 key : keys)
+            offsets[(key >> shift) & 2047]++;
+        u32 sum = 0;
+        for(u32& offset : offsets)
+        {
+            u32 count = offset;
+            offset = sum;
+            sum += count;
+        }
+        for(u64 key : keys)
+            sortedKeys[offsets[(key >> shift) & 2047]++] = key;
+        keys.swap(sortedKeys);
+    }
+    for(size_t i = 0; i < batch.size(); i++)
+        batch[i] = (u32)(keys[i] & 0xFFFFFF);
+}
+
+// NOTE(mevex): Linux perf events count the cache misses of the calling thread for the measurement mode,
+// elsewhere or where they are not allowed ReadCacheMisses returns false
+shared_function bool ReadCacheMisses(u64& misses)
+{
+#ifdef __linux__
+    local_persist thread_local int fd = -2;
+    if(fd == -2)
+    {
+        perf_event_attr attr = {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if(fd >= 0 && read(fd, &misses, sizeof(misses)) == sizeof(misses))
+    {
+        CacheMissesCounted = true;
+        return true;
+    }
+#endif
+    return false;
+}
+
+// NOTE(mevex): Adds the time and the cache misses of its scope to the secondary ray counters
+struct SecondaryTimer
+{
+    std::chrono::high_resolution_clock::time_point begin;
+    u64 missesBegin;
+    bool measure;
+
+    SecondaryTimer(bool measureMisses) : measure(measureMisses)
+    {
+        if(!measure || !ReadCacheMisses(missesBegin))
+            measure = false;
+        begin = std::chrono::high_resolution_clock::now();
+    }
+
+    ~SecondaryTimer()
+    {
+        SecondaryRayNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - begin).count();
+        u64 missesEnd;
+        if(measure && ReadCacheMisses(missesEnd))
+            SecondaryCacheMisses += missesEnd - missesBegin;
+    }
+};
+
+// NOTE(mevex): TraceClosest traces the rays of the paths in wave.batch, TraceShadows the shadow rays,
+// sorted if asked. The order only changes the speed, the hits are the same.
+shared_function void TraceClosest(Scene& scene, TileWave& wave, RenderSettings& settings)
+{
+    SecondaryTimer timer(settings.measureRays);
+    vector<u32>& batch = wave.batch;
+    if(settings.sortRays)
+        SortRays(scene, wave.rays, batch, wave.keys, wave.sortedKeys);
+    SecondaryRayCounter += batch.size();
+
+    if(settings.interleaveRays)
+    {
+        u32 count = (u32)batch.size();
+        wave.streamRays.resize(count);
+        wave.streamTMax.assign(count, INFINITY);
+        wave.streamHits.assign(count, HitRecord());
+        for(u32 i = 0; i < count; i++)
+            wave.streamRays[i] = wave.rays[batch[i]];
+        scene.HitStream(wave.streamRays.data(), count, ZERO, wave.streamTMax.data(), wave.streamHits.data());
+        for(u32 i = 0; i < count; i++)
+            wave.hits[batch[i]] = wave.streamHits[i];
+        return;
+    }
+
+    for(size_t i = 0; i < batch.size(); i += 4)
+    {
+        // NOTE(mevex): The last rays are padded with copies of the last one
+        Ray rays[4];
+        HitRecord recs[4];
+        f32 closestTs[4] = {INFINITY, INFINITY, INFINITY, INFINITY};
+        f32 tMin[4] = {ZERO, ZERO, ZERO, ZERO};
+        for(size_t j = 0; j < 4; j++)
+            rays[j] = wave.rays[batch[Min(i + j, batch.size() - 1)]];
+        scene.Hit(rays, tMin, closestTs, recs);
+        for(size_t j = 0; j < 4 && i + j < batch.size(); j++)
+            wave.hits[batch[i + j]] = recs[j];
+    }
+}
+
+shared_function void TraceShadows(Scene& scene, TileWave& wave, RenderSettings& settings)
+{
+    SecondaryTimer timer(settings.measureRays);
+    vector<u32>& batch = wave.batch;
+    batch.resize(wave.shadowRays.size());
+    for(u32 i = 0; i < (u32)batch.size(); i++)
+        batch[i] = i;
+    if(settings.sortRays)
+        SortRays(scene, wave.shadowRays, batch, wave.keys, wave.sortedKeys);
+    SecondaryRayCounter += batch.size();
+
+    for(u32 i : batch)
+    {
+        if(scene.Hit(wave.shadowRays[i], ZERO, Scene::ShadowRayEnd))
+            wave.visible[wave.shadowSlots[i]] = 0;
+    }
+}
+
+// NOTE(mevex): Every hit of a path that goes in the radiance cache or in the guiding tree gets the
+// product of the factors of the hits after it: what the path would have taken from the cache there,
+// the light that came from the direction of its bounce
+shared_function void RecordPaths(RadianceCache *cache, GuidingTree *guiding, TileWave& wave, i32 maxDepth)
+{
+    u32 pathCount = (u32)wave.lengths.size();
+    for(u32 path = 0; path < pathCount; path++)
+    {
+        Color following(1, 1, 1);
+        for(i32 k = wave.lengths[path] - 1; k >= 0; k--)
+        {
+            u32 slot = path * maxDepth + k;
+            if(cache && wave.cacheKeys[slot] != RadianceCache::NoKey)
+                cache->Add(wave.cacheKeys[slot], following);
+            GuidedBounce& bounce = wave.guidedBounces[slot];
+            if(guiding && bounce.leaf != GuidingTree::NoLeaf)
+                guiding->Record(bounce.leaf, bounce.u, bounce.v, (following.x + following.y + following.z) * (1.0f / 3.0f), bounce.pdf);
+            following = following * wave.factors[slot];
+        }
+    }
+}
+
+// NOTE(mevex): Scatter of the material of the hit, the types in Features (see SceneFeature) are called
+// directly and the others through the virtual call. The type is checked even when Features has a single
+// one: a prepared scene keeps the material mask of its first Prepare, and a material swapped in since
+// (a sphere turned to Metal) is not in it. The generic kernel only makes the virtual call.
+template<u32 Features>
+inline bool ScatterHit(Ray& rIn, HitRecord& rec, Color& attenuation, Ray& scattered)
+{
+    Material *material = rec.material;
+    if constexpr((Features & Feature_OtherMaterials) == 0)
+    {
+        if constexpr((Features & Feature_Lambertian) != 0)
+        {
+            if(material->type == LAMBERTIAN)
+                return ((Lambertian *)material)->Lambertian::Scatter(rIn, rec, attenuation, scattered);
+        }
+        if constexpr((Features & Feature_Metal) != 0)
+        {
+            if(material->type == METAL)
+                return ((Metal *)material)->Metal::Scatter(rIn, rec, attenuation, scattered);
+        }
+        if constexpr((Features & Feature_VertexColor) != 0)
+        {
+            if(material->type == VERTEX_COLOR)
+                return ((VertexColor *)material)->VertexColor::Scatter(rIn, rec, attenuation, scattered);
+        }
+    }
+    return material->Scatter(rIn, rec, attenuation, scattered);
+}
+
+// NOTE(mevex): Bounces of the paths of the wave, the camera rays and their hits are in wave.rays and
+// wave.hits. Every pixel gets the sum of the attenuations of its 4 paths.
+// Features are the SceneFeature flags the kernel handles, see ShadeWaveKernel.
+template<u32 Features>
+shared_function void ShadeWave(Scene& scene, TileWave& wave, RenderSettings& settings, RadianceCache *radiance, GuidingTree *guidingTree)
+{
+    u64 cycleBegin = __rdtsc();
+
+    // NOTE(mevex): The GetRay counters count paths, so their average stays the cycles a path takes
+    u32 pixelCount = (u32)wave.pixelX.size();
+    u32 pathCount = pixelCount * 4;
+    GetRayColorCounter += pathCount;
+    u32 slotCount = scene.MaxLightSamples();
+    i32 maxDepth = settings.maxDepth;
+    if(maxDepth <= 0)
+    {
+        for(u32 p = 0; p < pixelCount; p++)
+            wave.colors[p] += wave.ambient[p];
+        return;
+    }
+
+    RadianceCache *cache = (Features & Feature_RadianceCache) ? radiance : 0;
+    GuidingTree *guiding = (Features & Feature_PathGuiding) ? guidingTree : 0;
+    wave.attenuations.resize(pathCount);
+    wave.active.assign(pixelCount, 4);
+    wave.finished.assign(pathCount, 0);
+    wave.lengths.assign(pathCount, 0);
+    wave.factors.resize(pathCount * maxDepth);
+    wave.cacheKeys.resize(pathCount * maxDepth);
+    wave.guidedBounces.resize(pathCount * maxDepth);
+    for(u32 path = 0; path < pathCount; path++)
+        wave.attenuations[path] = wave.ambient[path / 4];
+
+    for(i32 depth = maxDepth; depth > 0; depth--)
+    {
+        if(depth != maxDepth)
+        {
+            wave.batch.clear();
+            for(u32 p = 0; p < pixelCount; p++)
+            {
+                for(u32 i = 0; i < wave.active[p]; i++)
+                {
+                    if(!wave.finished[4 * p + i])
+                        wave.batch.push_back(4 * p + i);
+                }
+            }
+            TraceClosest(scene, wave, settings);
+        }
+
+        // NOTE(mevex): The shadow rays of the paths that go on
+        wave.shadowRays.clear();
+        wave.shadowSlots.clear();
+        wave.lightSamples.resize(pathCount * slotCount);
+        wave.lightSampleCounts.assign(pathCount, 0);
+        wave.visible.assign(pathCount * slotCount, 1);
+        for(u32 p = 0; p < pixelCount; p++)
+        {
+            for(u32 i = 0; i < wave.active[p]; i++)
+            {
+                u32 path = 4 * p + i;
+                HitRecord& rec = wave.hits[path];
+                if(wave.finished[path])
+                    continue;
+                if(rec.t == INFINITY)
+                {
+                    // NOTE(mevex): Guiding changes how likely a path is to miss, the paths of the pixel
+                    // can't depend on each other anymore
+                    if(guiding)
+                    {
+                        wave.finished[path] = 1;
+                        continue;
+                    }
+                    wave.active[p] = (u8)i;
+                    break;
+                }
+
+                LightSample *samples = wave.lightSamples.data() + path * slotCount;
+                u32 sampleCount = scene.SampleLights(rec.normal, rec.p, samples);
+                wave.lightSampleCounts[path] = sampleCount;
+                for(u32 l = 0; l < sampleCount; l++)
+                {
+                    Ray lightRay;
+                    scene.ShadowRay((PointLight *)scene.lights[samples[l].light], rec.normal, rec.p, lightRay);
+                    wave.shadowRays.push_back(lightRay);
+                    wave.shadowSlots.push_back(path * slotCount + l);
+                }
+            }
+        }
+        TraceShadows(scene, wave, settings);
+
+        for(u32 p = 0; p < pixelCount; p++)
+        {
+            for(u32 i = 0; i < wave.active[p]; i++)
+            {
+                u32 path = 4 * p + i;
+                HitRecord& rec = wave.hits[path];
+                if(wave.finished[path])
+                    continue;
+
+                // NOTE(mevex): If the light intensity exceeds 1 we get an overexposed color
+                f32 lightIntensity = Min(scene.GetLightIntensity<Features>(rec.normal, rec.p, wave.lightSamples.data() + path * slotCount,
+                                                                           wave.lightSampleCounts[path], wave.visible.data() + path * slotCount), 1.0f);
+                Color newAttenuation;
+                ScatterHit<Features>(wave.rays[path], rec, newAttenuation, wave.rays[path]);
+
+                // NOTE(mevex): The camera hits are never cached, the cells would show in the image.
+                // Neither are the last bounces, nothing follows them.
+                u64 key = RadianceCache::NoKey;
+                Color cached;
+                bool fromCache = false;
+                if(cache && depth != maxDepth && depth > 1 && rec.material->IsDiffuse())
+                {
+                    key = cache->Key(rec.p, rec.normal, depth - 1);
+                    if(cache->Lookup(key, cached))
+                    {
+                        key = RadianceCache::NoKey;
+                        fromCache = true;
+                        wave.finished[path] = 1;
+                    }
+                }
+
+                // NOTE(mevex): The bounces of the last hits are never traced, guiding them would only add noise
+                GuidedBounce bounce = {GuidingTree::NoLeaf};
+                if(guiding && depth > 1 && !fromCache && rec.material->IsDiffuse())
+                {
+                    u32 leaf = guiding->FindLeaf(rec.p);
+                    f32 weight = guiding->GuideBounce(leaf, rec.normal, wave.rays[path].direction, bounce.u, bounce.v, bounce.pdf);
+                    newAttenuation = newAttenuation * weight;
+                    if(weight == 0)
+                        wave.finished[path] = 1;
+                    else if(guiding->learning)
+                        bounce.leaf = leaf;
+                }
+
+                Color factor = lightIntensity * newAttenuation;
+                if(fromCache)
+                    factor = factor * cached;
+
+                u32 slot = path * maxDepth + wave.lengths[path]++;
+                wave.factors[slot] = factor;
+                wave.cacheKeys[slot] = key;
+                wave.guidedBounces[slot] = bounce;
+                wave.attenuations[path] = wave.attenuations[path] * lightIntensity * newAttenuation;
+                if(fromCache)
+                    wave.attenuations[path] = wave.attenuations[path] * cached;
+            }
+        }
+    }
+
+    if(cache || (guiding && guiding->learning))
+        RecordPaths(cache, guiding, wave, maxDepth);
+
+    for(u32 p = 0; p < pixelCount; p++)
+    {
+        Color* a = &wave.attenuations[4 * p];
+        wave.colors[p] += a[0] + a[1] + a[2] + a[3];
+    }
+
+    u64 cycleEnd = __rdtsc();
+    GetRayColorCycles += cycleEnd - cycleBegin;
+}
+
+typedef void (*ShadeWaveFunction)(Scene& scene, TileWave& wave, RenderSettings& settings, RadianceCache *radiance, GuidingTree *guidingTree);
+
+// NOTE(mevex): The smallest instantiation of ShadeWave that covers the features of the scene and of the
+// render: meshes alone, meshes and metals (the default scene) or everything.
+shared_function ShadeWaveFunction ShadeWaveKernel(Scene& scene, RenderSettings& settings)
+{
+    constexpr u32 Meshes = Feature_Lambertian | Feature_AmbientLights | Feature_PointLights;
+    constexpr u32 MeshesAndMetals = Meshes | Feature_Metal;
+
+    u32 features = scene.features;
+    if(settings.radianceCache)
+        features |= Feature_RadianceCache;
+    if(settings.pathGuiding)
+        features |= Feature_PathGuiding;
+    if(!settings.specializedKernels)
+        features = Feature_All;
+
+    if((features & ~Meshes) == 0)
+        return ShadeWave<Meshes>;
+    if((features & ~MeshesAndMetals) == 0)
+        return ShadeWave<MeshesAndMetals>;
+    return ShadeWave<Feature_All>;
+}
+
+// NOTE(mevex): First hits of the camera rays the visibility buffer gave: a triangle it is sure of only
+// has to be hit again by the ray to get the record, the ambiguous paths trace the rastered meshes.
+// The packet meshes that were not rastered and the rest of the scene are traced for every path.
+shared_function void ResolveCameraHits(Scene& scene, TileWave& wave, VisibilityBuffer& visibility)
+{
+    u32 pathCount = (u32)wave.rays.size();
+    wave.streamTMax.assign(pathCount, INFINITY);
+    for(u32 path = 0; path < pathCount; path++)
+    {
+        Ray& r = wave.rays[path];
+        HitRecord& rec = wave.hits[path];
+        u32 id = wave.triangleIds[path];
+        if(id == VisibilityBuffer::NoTriangle)
+            continue;
+
+        if(id != VisibilityBuffer::Ambiguous)
+        {
+            VisibilityBuffer::RasterTriangle& t = visibility.triangles[id];
+            Mesh *mesh = visibility.meshes[t.mesh];
+            Ray local(r.origin - mesh->translation, r.direction);
+            HitRecord tmpRec = {};
+            if(mesh->triangles[t.triangle].Hit(local, ZERO, INFINITY, tmpRec))
+            {
+                tmpRec.p += mesh->translation;
+                rec = tmpRec;
+                wave.streamTMax[path] = tmpRec.t;
+                continue;
+            }
+        }
+
+        for(Mesh *mesh : visibility.meshes)
+        {
+            HitRecord tmpRec = {};
+            if(mesh->Hit(r, ZERO, wave.streamTMax[path], tmpRec) && tmpRec.t < rec.t)
+            {
+                wave.streamTMax[path] = tmpRec.t;
+                rec = tmpRec;
+            }
+        }
+    }
+
+    for(Mesh *mesh : visibility.tracedMeshes)
+        mesh->HitStream(wave.rays.data(), pathCount, ZERO, wave.streamTMax.data(), wave.hits.data());
+    scene.HitOthers(wave.rays.data(), pathCount, ZERO, wave.streamTMax.data(), wave.hits.data());
+}
+
+// NOTE(mevex): Makes the camera rays of the next 4 samples of every pixel of the tile and finds their
+// first hits. With packets the rays of a PACKET_SIZE x PACKET_SIZE block of pixels are traced together,
+// sample k of every pixel of the block in packet k. With a visibility buffer they are not traced at all
+// but looked up in it (see ResolveCameraHits). The random numbers are taken in the same order either way.
+// With maxDepth 0 the rays are only made.
+shared_function void TraceCameraRays(Camera& camera, Scene& scene, Tile& tile, TileWave& wave, i32 width, i32 height,
+                                     RenderSettings& settings, VisibilityBuffer *visibility)
+{
+    local_persist thread_local RayPacket cameraPacket;
+    f32 invWidth = 1.0f / (f32)(width - 1);
+    f32 invHeight = 1.0f / (f32)(height - 1);
+    bool trace = settings.maxDepth > 0;
+    bool packets = trace && settings.primaryPackets && !visibility;
+    u32 pixelCount = (u32)wave.pixelX.size();
+    wave.rays.resize(pixelCount * 4);
+    wave.hits.resize(pixelCount * 4);
+    wave.sampleU.resize(pixelCount * 4);
+    wave.sampleV.resize(pixelCount * 4);
+
+    u32 blockFirst = 0;
+    for(int blockY = tile.maxY; blockY > tile.minY; blockY -= PACKET_SIZE)
+    {
+        for(int blockX = tile.minX; blockX < tile.maxX; blockX += PACKET_SIZE)
+        {
+            int minX = blockX, maxX = Min(blockX + PACKET_SIZE, tile.maxX);
+            int minY = Max(blockY - PACKET_SIZE, tile.minY), maxY = blockY;
+            u32 blockCount = (u32)((maxX - minX) * (maxY - minY));
+            for(u32 p = blockFirst; p < blockFirst + blockCount; p++)
+            {
+                for(int i = 0; i < 4; ++i)
+                {
+                    f32 u = ((f32)wave.pixelX[p] + RandomFloat()) * invWidth;
+                    f32 v = ((f32)wave.pixelY[p] + RandomFloat()) * invHeight;
+                    wave.sampleU[4 * p + i] = u;
+                    wave.sampleV[4 * p + i] = v;
+                    wave.rays[4 * p + i] = camera.GetRay(u, v);
+                    wave.hits[4 * p + i] = HitRecord();
+                }
+            }
+
+            // NOTE(mevex): The jittered rays of a pixel never leave it, so the corners of the block bound them all
+            v3 corners[4] = {camera.GetRay(minX * invWidth, minY * invHeight).direction, camera.GetRay(maxX * invWidth, minY * invHeight).direction,
+                             camera.GetRay(maxX * invWidth, maxY * invHeight).direction, camera.GetRay(minX * invWidth, maxY * invHeight).direction};
+            for(int i = 0; packets && i < 4; ++i)
+            {
+                RayPacket& packet = cameraPacket;
+                packet.count = blockCount;
+                packet.SetFrustum(camera.position, corners, (u32)(maxX - minX));
+                for(u32 p = 0; p < blockCount; p++)
+                {
+                    packet.rays[p] = wave.rays[4 * (blockFirst + p) + i];
+                    packet.invDirs[p] = SafeInverse(packet.rays[p].direction);
+                    packet.tMax[p] = INFINITY;
+                }
+                HitRecord recs[RayPacket::MaxSize];
+                scene.HitPacket(packet, ZERO, recs);
+                for(u32 p = 0; p < blockCount; p++)
+                    wave.hits[4 * (blockFirst + p) + i] = recs[p];
+            }
+            blockFirst += blockCount;
+        }
+    }
+
+    if(!trace)
+        return;
+
+    if(visibility)
+    {
+        i32 tileWidth = tile.maxX - tile.minX;
+        wave.pixelSlots.resize(tileWidth * (tile.maxY - tile.minY));
+        for(u32 p = 0; p < pixelCount; p++)
+            wave.pixelSlots[(wave.pixelY[p] - tile.minY) * tileWidth + wave.pixelX[p] - tile.minX] = 4 * p;
+        wave.triangleIds.resize(pixelCount * 4);
+        visibility->Raster(tile.minX, tile.minY, tile.maxX, tile.maxY, wave.pixelSlots.data(),
+                           wave.sampleU.data(), wave.sampleV.data(), pixelCount * 4, wave.triangleIds.data());
+        ResolveCameraHits(scene, wave, *visibility);
+    }
+    else if(!packets)
+    {
+        // NOTE(mevex): Camera rays are coherent already, they are never sorted
+        RenderSettings unsorted = settings;
+        unsorted.sortRays = false;
+        unsorted.measureRays = false;
+        wave.batch.resize(pixelCount * 4);
+        for(u32 path = 0; path < pixelCount * 4; path++)
+            wave.batch[path] = path;
+        u64 counted = SecondaryRayCounter;
+        u64 nanoseconds = SecondaryRayNanoseconds;
+        TraceClosest(scene, wave, unsorted);
+        SecondaryRayCounter = counted;
+        SecondaryRayNanoseconds = nanoseconds;
+    }
+}
+
+// NOTE(mevex): Puts the pixels of the tile in the wave in the order of their PACKET_SIZE x PACKET_SIZE
+// blocks, with the ambient light of each
+shared_function void StartTileWave(Camera& camera, Tile& tile, TileWave& wave, i32 width, i32 height)
+{
+    f32 invWidth = 1.0f / (f32)(width - 1);
+    f32 invHeight = 1.0f / (f32)(height - 1);
+    wave.pixelX.clear();
+    wave.pixelY.clear();
+    wave.ambient.clear();
+    for(int blockY = tile.maxY; blockY > tile.minY; blockY -= PACKET_SIZE)
+    {
+        for(int blockX = tile.minX; blockX < tile.maxX; blockX += PACKET_SIZE)
+        {
+            for(int y = blockY-1; y >= Max(blockY - PACKET_SIZE, tile.minY); y--)
+            {
+                for(int x = blockX; x < Min(blockX + PACKET_SIZE, tile.maxX); x++)
+                {
+                    // NOTE(mevex): Background/ambient light hack
+                    Ray nonRandomizedRay = camera.GetRay(x * invWidth, y * invHeight);
+                    v3 unitDir = Unit(nonRandomizedRay.direction);
+                    f32 t = 0.5f * (unitDir.y + 1.0f);
+                    wave.pixelX.push_back(x);
+                    wave.pixelY.push_back(y);
+                    wave.ambient.push_back(Lerp(Color(0.6f, 0.6f, 0.6f), Color(0.5f, 0.7f, 1.0f), t));
+                }
+            }
+        }
+    }
+}
+
+// NOTE(mevex): Renders samplesPerPass samples for every pixel of the tile and adds them to the
+// canvas accumulation buffer. Every other pass also goes in the half buffer for the error estimate.
+// The camera rays of the whole tile are made and traced first (see TraceCameraRays), then their
+// bounces are traced together (see ShadeWave). visibility, if not null, must match the camera.
+// radiance and guidingTree are the ones of the job with settings.radianceCache and settings.pathGuiding,
+// 0 renders without them.
+void RenderTile(Canvas& canvas, Camera& camera, Scene& scene, Tile& tile, int samplesPerPass, RenderSettings& settings,
+                VisibilityBuffer *visibility = 0, RadianceCache *radiance = 0, GuidingTree *guidingTree = 0)
+{
+    bool oddPass = (tile.passes % 2) == 1;
+#if RUN_FAST
+    local_persist thread_local TileWave wave;
+    StartTileWave(camera, tile, wave, canvas.width, canvas.height);
+
+    u32 pixelCount = (u32)wave.pixelX.size();
+    wave.colors.assign(pixelCount, Color(0,0,0));
+    ShadeWaveFunction shadeWave = ShadeWaveKernel(scene, settings);
+    int sampleCount = 0;
+    for(int sampleIndex = 0; sampleIndex < samplesPerPass; sampleIndex += 4)
+    {
+        TraceCameraRays(camera, scene, tile, wave, canvas.width, canvas.height, settings, visibility);
+        shadeWave(scene, wave, settings, radiance, guidingTree);
+        sampleCount += 4;
+    }
+
+    for(u32 p = 0; p < pixelCount; p++)
+        canvas.AddSamples(wave.pixelX[p], wave.pixelY[p], wave.colors[p], sampleCount, oddPass);
+#else
+    int maxDepth = settings.maxDepth;
+    for(int y = tile.maxY-1; y >= tile.minY; y--)
+    {
+        for(int x = tile.minX; x < tile.maxX; x++)
+        {
+            Color c(0,0,0);
+            for(int i = 0; i < samplesPerPass; i++)
+            {
+                f32 u = ((f32)x + RandomFloat()) / (f32)(canvas.width - 1);
+                f32 v = ((f32)y + RandomFloat()) / (f32)(canvas.height - 1);
+
+                Ray randomizedRay = camera.GetRay(u, v);
+                c += GetRayColor(randomizedRay, scene, maxDepth);
+            }
+            canvas.AddSamples(x, y, c, samplesPerPass, oddPass);
+        }
+    }
+#endif
+
+    tile.passes++;
+}
+
+typedef std::chrono::high_resolution_clock::time_point time_point;
+
+inline f32 MillisecondsBetween(time_point begin, time_point end)
+{
+    f32 result = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000.0f;
+    return result;
+}
+
+RenderJob::RenderJob(Scene& scene, Camera& camera, RenderSettings& settings, TileCallback onTile, WorkerPool& pool)
+    : settings(settings), camera(camera), canvas(settings.width, settings.height, 4),
+      cancelled(false), done(false), tilePassesRendered(0), scene(scene), onTile(onTile), pool(pool)
+{
+    tiles = MakeTiles(canvas, settings.tileSize);
+    passCount = PassCount(settings);
+}
+
+RenderJob::~RenderJob()
+{
+    Cancel();
+    Wait();
+}
+
+void RenderJob::Start()
+{
+    driver = std::thread([this] { Run(); });
+}
+
+void RenderJob::Cancel()
+{
+    cancelled = true;
+}
+
+void RenderJob::Wait()
+{
+    if(driver.joinable())
+        driver.join();
+}
+
+bool RenderJob::IsDone()
+{
+    return done;
+}
+
+inline void SeedTilePass(RenderSettings& settings, Tile& tile)
+{
+    SeedRandom(HashCombine(HashCombine(settings.seed, tile.index), tile.passes));
+}
+
+u32 PassCount(RenderSettings& settings)
+{
+    u32 result = (settings.samplesPerPixel + settings.samplesPerPass - 1) / settings.samplesPerPass;
+    return result;
+}
+
+u32 GuidingPassCount(RenderSettings& settings)
+{
+    u32 result = (settings.guidingPasses > 0) ? (u32)settings.guidingPasses : Max(PassCount(settings) / 3, 1u);
+    return result;
+}
+
+void RenderTilePasses(Canvas& canvas, Camera& camera, Scene& scene, Tile& tile, RenderSettings& settings)
+{
+    for(u32 pass = tile.passes; pass < PassCount(settings); pass++)
+    {
+        i32 passSamples = Min(settings.samplesPerPass, settings.samplesPerPixel - (i32)pass*settings.samplesPerPass);
+        SeedTilePass(settings, tile);
+        RenderTile(canvas, camera, scene, tile, passSamples, settings);
+    }
+    FlushPerfCounters();
+}
+
+void RenderJob::RenderTileTask(Tile& tile, i32 samples)
+{
+    if(cancelled)
+        return;
+
+    SeedTilePass(settings, tile);
+    RenderTile(canvas, camera, scene, tile, samples, settings, settings.rasterPrimary ? &visibility : 0, radiance, guidingTree);
+    FlushPerfCounters();
+
+    ++tilePassesRendered;
+    if(onTile)
+        onTile(*this, tile);
+}
+
+void RenderJob::RenderTiles(vector<Tile *>& selection, i32 samples)
+{
+    pool.ParallelFor((i32)selection.size(), [&](i32 i)
+    {
+        RenderTileTask(*selection[i], samples);
+    }, settings.priority);
+}
+
+// NOTE(mevex): Sizes the radiance cache of a job for the scene and empties it, before the job renders
+shared_function void StartRadianceCache(RadianceCache& cache, Scene& scene, RenderSettings& settings)
+{
+    v3 extent = scene.bounds.max - scene.bounds.min;
+    f32 cellSize = settings.radianceCacheCellSize;
+    if(cellSize <= 0)
+        cellSize = (scene.bounds.min.x <= scene.bounds.max.x) ? Max(Max(extent.x, extent.y), extent.z) / 64.0f : 0.1f;
+    cache.Configure((size_t)settings.radianceCacheMB * 1024 * 1024, cellSize);
+    cache.Clear();
+}
+
+void RenderJob::Run()
+{
+    time_point begin = std::chrono::high_resolution_clock::now();
+    if(settings.radianceCache)
+    {
+        StartRadianceCache(radianceCache, scene, settings);
+        radiance = &radianceCache;
+    }
+    if(settings.pathGuiding)
+    {
+        guiding.Reset(scene.bounds, settings.guidingFraction);
+        guidingTree = &guiding;
+    }
+    if(settings.rasterPrimary)
+        visibility.Build(scene, camera, canvas.width, canvas.height, &pool);
+
+    if(settings.timeBudgetMs > 0)
+        RunTimeBudgeted();
+    else
+        RunPasses();
+
+    renderTimeMs = MillisecondsBetween(begin, std::chrono::high_resolution_clock::now());
+    done = true;
+}
+
+// NOTE(mevex): Everything the samples of a tile depend on besides the scene. The other settings either
+// leave the image the same (packets, raster, ray sorting, interleaving, kernels) or disable the tile cache.
+// The scene goes in as a whole: the bounces and shadow rays of a tile can reach any object, so there is
+// no part of the scene a tile could be keyed on alone.
+u64 RenderJob::TileKey(u64 sceneHash, Tile& tile)
+{
+    ContentHash hash;
+    hash.Add((u32)TileCache::Version);
+    hash.Add(sceneHash);
+    hash.Add(camera.position);
+    hash.Add(camera.vpHorizontal);
+    hash.Add(camera.vpVertical);
+    hash.Add(camera.vpLowerLeftCorner);
+    hash.Add((u32)canvas.width);
+    hash.Add((u32)canvas.height);
+    hash.Add((u32)settings.samplesPerPixel);
+    hash.Add((u32)settings.samplesPerPass);
+    hash.Add((u32)settings.maxDepth);
+    hash.Add(settings.seed);
+    hash.Add(tile.index);
+    hash.Add((u32)tile.minX);
+    hash.Add((u32)tile.minY);
+    hash.Add((u32)tile.maxX);
+    hash.Add((u32)tile.maxY);
+    return hash.value;
+}
+
+// NOTE(mevex): The settings the samples depend on and a hash of the scene and the camera, false if the
+// scene can't be hashed (see Scene::HashContent). Call it after the scene is prepared.
+bool RenderJob::MakeCheckpointKey(CheckpointKey& result)
+{
+    u64 sceneHash = 0;
+    if(!scene.HashContent(sceneHash))
+        return false;
+
+    ContentHash hash;
+    hash.Add(sceneHash);
+    hash.Add(camera.position);
+    hash.Add(camera.vpHorizontal);
+    hash.Add(camera.vpVertical);
+    hash.Add(camera.vpLowerLeftCorner);
+    result.samplesPerPixel = (u32)settings.samplesPerPixel;
+    result.samplesPerPass = (u32)settings.samplesPerPass;
+    result.maxDepth = (u32)settings.maxDepth;
+    result.seed = settings.seed;
+    result.renderHash = hash.value;
+    return true;
+}
+
+void RenderJob::RunPasses()
+{
+    // NOTE(mevex): A scene without a stable identity could resume the samples of another one, it gets no checkpoints
+    CheckpointKey checkpointKey = {};
+    bool checkpointing = settings.checkpointFile && MakeCheckpointKey(checkpointKey);
+    if(settings.checkpointFile && !checkpointing)
+        printf("WARN: the scene can't be hashed, the render is not checkpointed\n");
+    if(checkpointing && canvas.LoadCheckpoint(settings.checkpointFile, checkpointKey, passesDone))
+    {
+        printf("Resuming from checkpoint: %u/%u passes already rendered\n", passesDone, passCount);
+        resumedPasses = passesDone;
+        for(Tile& tile : tiles)
+            tile.passes = passesDone;
+    }
+
+    // NOTE(mevex): The cached tiles are done before the first pass, the passes only render the others
+    TileCache cache;
+    u64 sceneHash = 0;
+    vector<u64> keys;
+    bool caching = settings.tileCacheDirectory && !settings.radianceCache && !settings.pathGuiding && passesDone == 0 &&
+                   scene.HashContent(sceneHash) && cache.Open(settings.tileCacheDirectory, (u64)settings.tileCacheMB * 1024 * 1024);
+    if(caching)
+    {
+        keys.resize(tiles.size());
+        std::atomic<u32> loaded(0);
+        pool.ParallelFor((i32)tiles.size(), [&](i32 i)
+        {
+            Tile& tile = tiles[i];
+            keys[i] = TileKey(sceneHash, tile);
+            if(cache.Load(keys[i], canvas, tile.minX, tile.minY, tile.maxX, tile.maxY))
+            {
+                tile.passes = passCount;
+                ++loaded;
+                if(onTile)
+                    onTile(*this, tile);
+            }
+        }, settings.priority);
+        tilesFromCache = loaded;
+    }
+
+    vector<Tile *> allTiles;
+    for(Tile& tile : tiles)
+    {
+        if(tile.passes < passCount)
+            allTiles.push_back(&tile);
+    }
+
+    time_point lastCheckpoint = std::chrono::high_resolution_clock::now();
+    for(u32 pass = passesDone; pass < passCount && !cancelled; pass++)
+    {
+        i32 passSamples = Min(settings.samplesPerPass, settings.samplesPerPixel - (i32)pass*settings.samplesPerPass);
+        RenderTiles(allTiles, passSamples);
+        if(cancelled)
+            break;
+        if(settings.pathGuiding && guiding.learning)
+            guiding.Refine(pass + 1 < GuidingPassCount(settings));
+
+        passesDone = pass + 1;
+        if(passesDone == passCount)
+            break;
+
+        if(settings.intermediateOutputFile)
+        {
+            canvas.Resolve(&pool);
+            canvas.Write(settings.intermediateOutputFile, &pool);
+        }
+
+        time_point now = std::chrono::high_resolution_clock::now();
+        if(checkpointing && MillisecondsBetween(lastCheckpoint, now) >= settings.checkpointIntervalSeconds * 1000.0f)
+        {
+            if(!canvas.SaveCheckpoint(settings.checkpointFile, passesDone, checkpointKey))
+                printf("WARN: could not write checkpoint %s\n", settings.checkpointFile);
+            lastCheckpoint = now;
+        }
+    }
+
+    if(checkpointing)
+    {
+        // NOTE(mevex): The render is complete, the checkpoint is not needed anymore.
+        // A cancelled render keeps it up to date instead, so it can be resumed.
+        if(passesDone == passCount)
+            remove(settings.checkpointFile);
+        else if(passesDone > 0)
+            canvas.SaveCheckpoint(settings.checkpointFile, passesDone, checkpointKey);
+    }
+
+    if(caching && passesDone == passCount)
+    {
+        pool.ParallelFor((i32)allTiles.size(), [&](i32 i)
+        {
+            Tile& tile = *allTiles[i];
+            cache.Store(keys[tile.index], canvas, tile.minX, tile.minY, tile.maxX, tile.maxY);
+        }, settings.priority);
+        cache.Trim();
+    }
+}
+
+// NOTE(mevex): Renders until the deadline, keeping a slice of the budget to resolve and encode
+// the final image. The first pass covers the whole image if the budget allows it and gives the cost
+// of a sample. Until then there is no cost to predict, so it stops at the deadline and the tiles it
+// didn't reach stay empty. The second pass feeds the half buffer so that every tile gets an error
+// estimate. After that the tiles with the highest estimated error get the next passes, one batch
+// per round, as long as their predicted cost still fits before the deadline.
+void RenderJob::RunTimeBudgeted()
+{
+    time_point begin = std::chrono::high_resolution_clock::now();
+    f32 encodeReserveMs = Max(settings.timeBudgetMs * 0.05f, 1.0f);
+    time_point deadline = begin + std::chrono::microseconds((i64)((settings.timeBudgetMs - encodeReserveMs) * 1000.0f));
+
+    i32 samples = settings.samplesPerPass;
+    i32 threadCount = pool.ThreadCount();
+    time_point now = begin;
+
+    vector<Tile *> selection;
+    for(Tile& tile : tiles)
+        selection.push_back(&tile);
+
+    // NOTE(mevex): Running estimate of the wall time of one sample for one pixel, with all the threads
+    // busy. 0 until the first tiles are done.
+    f32 sampleCost = 0;
+
+    auto tileCost = [&](Tile& tile)
+    {
+        f32 result = sampleCost * (tile.maxX - tile.minX) * (tile.maxY - tile.minY) * samples;
+        return result;
+    };
+
+    // NOTE(mevex): Renders the batch skipping the tiles that would end past the deadline.
+    // The prediction assumes the threads share the batch evenly.
+    auto renderBatch = [&](vector<Tile *>& batch)
+    {
+        time_point batchBegin = std::chrono::high_resolution_clock::now();
+        std::atomic<i64> pixelSamples(0);
+        pool.ParallelFor((i32)batch.size(), [&](i32 i)
+        {
+            Tile& tile = *batch[i];
+            time_point tileBegin = std::chrono::high_resolution_clock::now();
+            if(MillisecondsBetween(tileBegin, deadline) < tileCost(tile) * threadCount)
+                return;
+
+            RenderTileTask(tile, samples);
+            tile.error = canvas.EstimateError(tile.minX, tile.minY, tile.maxX, tile.maxY);
+            pixelSamples += (tile.maxX - tile.minX) * (tile.maxY - tile.minY) * samples;
+        }, settings.priority);
+
+        now = std::chrono::high_resolution_clock::now();
+        if(pixelSamples > 0)
+        {
+            f32 measured = MillisecondsBetween(batchBegin, now) / pixelSamples;
+            sampleCost = (sampleCost > 0) ? Lerp(sampleCost, measured, 0.5f) : measured;
+        }
+        return pixelSamples > 0;
+    };
+
+    renderBatch(selection);
+    if(settings.pathGuiding)
+        guiding.Refine(true);
+
+    renderBatch(selection);
+    if(settings.pathGuiding)
+        guiding.Refine(false);
+
+    i32 batchSize = Max(threadCount * 2, 1);
+    while(!cancelled && now < deadline)
+    {
+        std::sort(selection.begin(), selection.end(), [](Tile *a, Tile *b) { return a->error > b->error; });
+
+        vector<Tile *> batch(selection.begin(), selection.begin() + Min((size_t)batchSize, selection.size()));
+        if(batch.empty() || batch[0]->error <= 0 || !renderBatch(batch))
+            break;
+    }
+
+    u32 minPasses = 0xFFFFFFFF;
+    for(Tile& tile : tiles)
+        minPasses = Min(minPasses, tile.passes);
+    passesDone = minPasses;
+}
+
+MultiViewJob::MultiViewJob(Scene& scene, vector<Camera>& cameras, RenderSettings& settings, TileCallback onTile, WorkerPool& pool)
+    : settings(settings), cancelled(false), done(false), scene(scene), pool(pool)
+{
+    for(u32 view = 0; view < cameras.size(); view++)
+    {
+        // NOTE(mevex): View 0 gets the image a RenderJob with the same camera renders, the others their own noise
+        RenderSettings viewSettings = settings;
+        viewSettings.seed = settings.seed + view;
+        viewSettings.timeBudgetMs = 0;
+        viewSettings.intermediateOutputFile = 0;
+        viewSettings.checkpointFile = 0;
+        views.emplace_back(new RenderJob(scene, cameras[view], viewSettings, onTile, pool));
+    }
+}
+
+MultiViewJob::~MultiViewJob()
+{
+    Cancel();
+    Wait();
+}
+
+void MultiViewJob::Start()
+{
+    driver = std::thread([this] { Run(); });
+}
+
+void MultiViewJob::Cancel()
+{
+    cancelled = true;
+    for(auto& view : views)
+        view->Cancel();
+}
+
+void MultiViewJob::Wait()
+{
+    if(driver.joinable())
+        driver.join();
+}
+
+bool MultiViewJob::IsDone()
+{
+    return done;
+}
+
+// NOTE(mevex): The passes of RenderJob::RunPasses, each one over the tiles of all the views. The tiles
+// go to the pool one of each view in turn, so the views finish a pass together and the costly tiles
+// of one view (the ones on the model) are spread between the cheap ones of the others.
+void MultiViewJob::Run()
+{
+    time_point begin = std::chrono::high_resolution_clock::now();
+    if(settings.radianceCache)
+    {
+        StartRadianceCache(radianceCache, scene, settings);
+        for(auto& view : views)
+            view->radiance = &radianceCache;
+    }
+    if(settings.pathGuiding)
+    {
+        guiding.Reset(scene.bounds, settings.guidingFraction);
+        for(auto& view : views)
+            view->guidingTree = &guiding;
+    }
+    size_t tileCount = 0;
+    for(auto& view : views)
+    {
+        if(view->settings.rasterPrimary)
+            view->visibility.Build(scene, view->camera, view->canvas.width, view->canvas.height, &pool);
+        tileCount = Max(tileCount, view->tiles.size());
+    }
+
+    vector<RenderJob *> tileViews;
+    vector<Tile *> selection;
+    for(size_t t = 0; t < tileCount; t++)
+    {
+        for(auto& view : views)
+        {
+            if(t >= view->tiles.size())
+                continue;
+            tileViews.push_back(view.get());
+            selection.push_back(&view->tiles[t]);
+        }
+    }
+
+    u32 passCount = PassCount(settings);
+    for(u32 pass = 0; pass < passCount && !cancelled; pass++)
+    {
+        i32 passSamples = Min(settings.samplesPerPass, settings.samplesPerPixel - (i32)pass*settings.samplesPerPass);
+        pool.ParallelFor((i32)selection.size(), [&](i32 i)
+        {
+            tileViews[i]->RenderTileTask(*selection[i], passSamples);
+        }, settings.priority);
+        if(cancelled)
+            break;
+        if(settings.pathGuiding && guiding.learning)
+            guiding.Refine(pass + 1 < GuidingPassCount(settings));
+
+        for(auto& view : views)
+            view->passesDone = pass + 1;
+    }
+
+    renderTimeMs = MillisecondsBetween(begin, std::chrono::high_resolution_clock::now());
+    for(auto& view : views)
+    {
+        view->renderTimeMs = renderTimeMs;
+        view->done = true;
+    }
+    done = true;
+}
+
+void ReportAccelerationStructures(Scene& scene, Camera& camera, i32 width, i32 height, WorkerPool *pool)
+{
+    scene.Prepare(pool, &camera);
+
+    for(Hittable *obj : scene.objects)
+    {
+        Mesh *mesh = dynamic_cast<Mesh *>(obj);
+        if(!mesh || mesh->bvh.Empty())
+            continue;
+
+        printf("Mesh: %zu triangles\n", mesh->triangles.size());
+        for(BVHBuildMode mode : {BVHBuild_SAH, BVHBuild_LBVH})
+        {
+            mesh->BuildBVH(pool, mode);
+            BVH& bvh = mesh->bvh;
+            printf("%s build: %.2fms, SAH cost: %.2f\n", (mode == BVHBuild_SAH) ? "Binned SAH" : "LBVH",
+                   bvh.buildStats.milliseconds, bvh.buildStats.sahCost);
+            printf("  Binary BVH: %zu nodes, %zu bytes\n", bvh.nodes.size(), bvh.nodes.size() * sizeof(BVHNode));
+            printf("  BVH4:       %zu nodes, %zu bytes\n", bvh.wideNodes.size(), bvh.wideNodes.size() * sizeof(BVH4Node));
+
+            // NOTE(mevex): One primary ray through the center of every pixel, through both trees
+            BVHStats stats[2] = {};
+            f32 milliseconds[2] = {};
+            u32 hits[2] = {};
+            for(i32 tree = 0; tree < 2; tree++)
+            {
+                time_point begin = std::chrono::high_resolution_clock::now();
+                for(i32 y = 0; y < height; y++)
+                {
+                    for(i32 x = 0; x < width; x++)
+                    {
+                        Ray r = camera.GetRay(((f32)x + 0.5f) / (f32)(width - 1), ((f32)y + 0.5f) / (f32)(height - 1));
+                        f32 tMax = INFINITY;
+                        HitRecord rec;
+                        auto intersect = [&](u32 i, f32 t0, f32& t1)
+                        {
+                            if(!mesh->triangles[i].Hit(r, t0, t1, rec))
+                                return false;
+                            t1 = rec.t;
+                            return true;
+                        };
+
+                        bool hit = (tree == 0) ? bvh.IntersectBinary(r, ZERO, tMax, intersect, &stats[0])
+                                               : bvh.Intersect(r, ZERO, tMax, intersect, &stats[1]);
+                        hits[tree] += hit ? 1 : 0;
+                    }
+                }
+                milliseconds[tree] = MillisecondsBetween(begin, std::chrono::high_resolution_clock::now());
+            }
+
+            const char *names[2] = {"Binary BVH", "BVH4      "};
+            for(i32 tree = 0; tree < 2; tree++)
+            {
+                f32 rays = (f32)Max(stats[tree].rays, 1);
+                printf("  %s: %.2f nodes/ray, %.2f triangles/ray, %u hits, %.2f Mrays/s\n", names[tree],
+                       stats[tree].nodesVisited / rays, stats[tree].primitivesTested / rays, hits[tree],
+                       rays / (milliseconds[tree] * 1000.0f));
+            }
+        }
+
+        mesh->BuildBVH(pool, mesh->buildMode);
+    }
+}
+
+void ReportInterleavedTraversal(Scene& scene, Camera& camera, i32 width, i32 height, WorkerPool *pool)
+{
+    scene.Prepare(pool, &camera);
+
+    for(Hittable *obj : scene.objects)
+    {
+        Mesh *mesh = dynamic_cast<Mesh *>(obj);
+        if(!mesh || mesh->accel || mesh->bvh.IsLazy() || mesh->bvh.Empty())
+            continue;
+
+        // NOTE(mevex): Diffuse-like bounces: from where the camera ray through every pixel center hits
+        // the mesh, towards a random direction. They go all over the tree, unlike camera rays.
+        BVH& bvh = mesh->bvh;
+        vector<Ray> rays;
+        for(i32 y = 0; y < height; y++)
+        {
+            for(i32 x = 0; x < width; x++)
+            {
+                Ray r = camera.GetRay(((f32)x + 0.5f) / (f32)(width - 1), ((f32)y + 0.5f) / (f32)(height - 1));
+                r.origin = r.origin - mesh->translation;
+                f32 tMax = INFINITY;
+                HitRecord rec;
+                bool hit = bvh.Intersect(r, ZERO, tMax, [&](u32 i, f32 t0, f32& t1)
+                {
+                    if(!mesh->triangles[i].Hit(r, t0, t1, rec))
+                        return false;
+                    t1 = rec.t;
+                    return true;
+                });
+                if(!hit)
+                    continue;
+
+                u32 seed = HashCombine((u32)x, (u32)y);
+                auto hashFloat = [&](u32 k) { return (HashCombine(seed, k) >> 8) * (1.0f / 16777216.0f) * 2.0f - 1.0f; };
+                v3 direction = Unit(rec.normal) + Unit(v3(hashFloat(0), hashFloat(1), hashFloat(2)));
+                rays.push_back(Ray(rec.p, direction));
+            }
+        }
+        if(rays.empty())
+            continue;
+
+        // NOTE(mevex): Shuffled, neighbours in the stream have nothing in common like after a few bounces
+        for(u32 i = (u32)rays.size() - 1; i > 0; i--)
+            std::swap(rays[i], rays[HashCombine(i, 0) % (i + 1)]);
+
+        size_t bytes = mesh->triangles.size() * sizeof(Triangle) + bvh.wideNodes.size() * sizeof(BVH4Node);
+        printf("Mesh: %zu triangles, %.1fMB of triangles and wide nodes, %zu bounce rays\n",
+               mesh->triangles.size(), bytes / (1024.0f * 1024.0f), rays.size());
+
+        // NOTE(mevex): The same rays one after the other and interleaved, the hits must be the same
+        u32 count = (u32)rays.size();
+        vector<f32> tMax[2];
+        f32 milliseconds[2];
+        BVHStats stats[2] = {};
+        for(i32 interleaved = 0; interleaved < 2; interleaved++)
+        {
+            tMax[interleaved].assign(count, INFINITY);
+            f32 *rayTMax = tMax[interleaved].data();
+            HitRecord rec;
+            auto intersect = [&](u32 ray, u32 i, f32 t0, f32& t1)
+            {
+                if(!mesh->triangles[i].Hit(rays[ray], t0, t1, rec))
+                    return false;
+                t1 = rec.t;
+                return true;
+            };
+
+            time_point begin = std::chrono::high_resolution_clock::now();
+            if(interleaved)
+            {
+                auto prefetch = [&](u32 first, u32 primitiveCount)
+                {
+                    u8 *end = (u8 *)(mesh->triangles.data() + first + primitiveCount);
+                    for(u8 *line = (u8 *)(mesh->triangles.data() + first); line < end; line += 64)
+                        Prefetch(line);
+                };
+                bvh.IntersectInterleaved(rays.data(), count, 1e-3f, rayTMax, intersect, prefetch, &stats[1]);
+            }
+            else
+            {
+                for(u32 ray = 0; ray < count; ray++)
+                    bvh.Intersect(rays[ray], 1e-3f, rayTMax[ray], [&](u32 i, f32 t0, f32& t1) { return intersect(ray, i, t0, t1); }, &stats[0]);
+            }
+            milliseconds[interleaved] = MillisecondsBetween(begin, std::chrono::high_resolution_clock::now());
+        }
+
+        const char *names[2] = {"One ray at a time", "Interleaved      "};
+        for(i32 interleaved = 0; interleaved < 2; interleaved++)
+        {
+            printf("  %s: %.2fms, %.2f Mrays/s, %.2f nodes/ray\n", names[interleaved], milliseconds[interleaved],
+                   count / (milliseconds[interleaved] * 1000.0f), (f32)stats[interleaved].nodesVisited / count);
+        }
+        bool same = memcmp(tMax[0].data(), tMax[1].data(), count * sizeof(f32)) == 0;
+        printf("  Hits: %s\n", same ? "identical" : "DIFFERENT");
+    }
+}
+
+void ReportPrimaryRaster(Scene& scene, Camera& camera, i32 width, i32 height, WorkerPool *pool)
+{
+    scene.Prepare(pool, &camera);
+
+    VisibilityBuffer visibility;
+    visibility.Build(scene, camera, width, height, pool);
+    size_t triangleCount = 0;
+    for(Mesh *mesh : visibility.meshes)
+        triangleCount += mesh->triangles.size();
+    printf("Visibility buffer: %zu meshes rastered (%zu triangles), %zu traced, %zu bin entries, built in %.2fms\n",
+           visibility.meshes.size(), triangleCount, visibility.tracedMeshes.size(), visibility.binTriangles.size(), visibility.buildMs);
+
+    // NOTE(mevex): Every tile is seeded the same way for both, so they find the hits of the same rays
+    Canvas canvas(width, height, 4);
+    vector<Tile> tiles = MakeTiles(canvas, RenderSettings().tileSize);
+    RenderSettings settings;
+    TileWave wave;
+    vector<HitRecord> traced;
+    f32 milliseconds[2] = {};
+    u32 ambiguous = 0, different = 0, ties = 0;
+    for(i32 raster = 0; raster < 2; raster++)
+    {
+        size_t path = 0;
+        for(Tile& tile : tiles)
+        {
+            SeedRandom(HashCombine(settings.seed, tile.index));
+            StartTileWave(camera, tile, wave, width, height);
+            time_point begin = std::chrono::high_resolution_clock::now();
+            TraceCameraRays(camera, scene, tile, wave, width, height, settings, raster ? &visibility : 0);
+            milliseconds[raster] += MillisecondsBetween(begin, std::chrono::high_resolution_clock::now());
+
+            for(u32 i = 0; i < wave.hits.size(); i++, path++)
+            {
+                HitRecord& rec = wave.hits[i];
+                if(!raster)
+                {
+                    traced.push_back(rec);
+                    continue;
+                }
+
+                HitRecord& expected = traced[path];
+                // NOTE(mevex): Only t is set on a miss
+                bool same = rec.t == expected.t && (rec.t == INFINITY || (rec.material == expected.material && rec.normal.x == expected.normal.x &&
+                                                                          rec.normal.y == expected.normal.y && rec.normal.z == expected.normal.z));
+                different += same ? 0 : 1;
+                ties += (!same && rec.t == expected.t) ? 1 : 0;
+                ambiguous += (wave.triangleIds[i] == VisibilityBuffer::Ambiguous) ? 1 : 0;
+            }
+        }
+    }
+
+    u32 count = (u32)traced.size();
+    printf("  Packets traced:    %.2fms, %.2f Mrays/s\n", milliseconds[0], count / (milliseconds[0] * 1000.0f));
+    printf("  Visibility buffer: %.2fms, %.2f Mrays/s, %.2fms with the build, %.2f%% of the rays traced again\n",
+           milliseconds[1], count / (milliseconds[1] * 1000.0f), milliseconds[1] + visibility.buildMs, 100.0f * ambiguous / count);
+    // NOTE(mevex): A ray through the edge two triangles share hits both at the same t, which one it gets
+    // depends on the order they are tested in, as between packets and single rays
+    printf("  Hits: %s (%u of %u differ, %u of them ties between triangles at the same t)\n", (different > ties) ? "DIFFERENT" : "identical",
+           different, count, ties);
+}
+
+// NOTE(mevex): Nanoseconds per call of what the loop does count times, the sum keeps the calls from being optimized out
+template<typename Function>
+shared_function f64 NanosecondsPerCall(u32 count, f32& sum, Function function)
+{
+    time_point begin = std::chrono::high_resolution_clock::now();
+    for(u32 i = 0; i < count; i++)
+        sum += function(i);
+    f64 result = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - begin).count() / (f64)count;
+    return result;
+}
+
+void ReportVectorMath(Scene& scene, Camera& camera, i32 width, i32 height)
+{
+    scene.Prepare(0, &camera);
+
+    // NOTE(mevex): The rays of the pixel centers and their first hits, hitting the objects and materials
+    // the way a render does
+    u32 count = (u32)width * height;
+    vector<Ray> rays(count);
+    vector<HitRecord> hits;
+    vector<Ray> hitRays;
+    for(u32 i = 0; i < count; i++)
+    {
+        rays[i] = camera.GetRay(((f32)(i % width) + 0.5f) / (f32)(width - 1), ((f32)(i / width) + 0.5f) / (f32)(height - 1));
+        HitRecord rec;
+        if(scene.Hit(rays[i], ZERO, INFINITY, rec))
+        {
+            hits.push_back(rec);
+            hitRays.push_back(rays[i]);
+        }
+    }
+    if(hits.empty())
+        return;
+
+    Lambertian lambertian(Color(0.5f, 0.5f, 0.5f));
+    Metal metal(Color(0.8f, 0.8f, 0.8f), 0.3f);
+    Sphere sphere(p3(1, 4, -1), 3.0f, &lambertian);
+    Plane plane(p3(0, 0, 0), v3(0, 1, 0), &lambertian);
+    Triangle triangle(p3(-4, 0, -4), p3(6, 8, -2), p3(4, 0, 2), &lambertian);
+
+    SeedRandom(1);
+    u32 hitCount = (u32)hits.size();
+    f32 sum = 0;
+    struct Measure
+    {
+        const char *name;
+        f64 nanoseconds;
+    };
+    Measure measures[] =
+    {
+        {"Camera::GetRay", NanosecondsPerCall(count, sum, [&](u32 i)
+        {
+            Ray r = camera.GetRay((f32)(i % width) / (f32)(width - 1), (f32)(i / width) / (f32)(height - 1));
+            return r.direction.x;
+        })},
+        {"Lambertian::Scatter", NanosecondsPerCall(hitCount, sum, [&](u32 i)
+        {
+            Color attenuation;
+            Ray scattered;
+            lambertian.Scatter(hitRays[i], hits[i], attenuation, scattered);
+            return scattered.direction.x;
+        })},
+        {"Metal::Scatter", NanosecondsPerCall(hitCount, sum, [&](u32 i)
+        {
+            Color attenuation;
+            Ray scattered;
+            metal.Scatter(hitRays[i], hits[i], attenuation, scattered);
+            return scattered.direction.x;
+        })},
+        {"Sphere::Hit", NanosecondsPerCall(count, sum, [&](u32 i)
+        {
+            HitRecord rec;
+            return sphere.Hit(rays[i], ZERO, INFINITY, rec) ? rec.normal.x : 0.0f;
+        })},
+        {"Plane::Hit", NanosecondsPerCall(count, sum, [&](u32 i)
+        {
+            HitRecord rec;
+            return plane.Hit(rays[i], ZERO, INFINITY, rec) ? rec.normal.x : 0.0f;
+        })},
+        {"Triangle::Hit", NanosecondsPerCall(count, sum, [&](u32 i)
+        {
+            HitRecord rec;
+            return triangle.Hit(rays[i], ZERO, INFINITY, rec) ? rec.normal.x : 0.0f;
+        })},
+        {"Scene::Hit", NanosecondsPerCall(count, sum, [&](u32 i)
+        {
+            HitRecord rec;
+            return scene.Hit(rays[i], ZERO, INFINITY, rec) ? rec.t : 0.0f;
+        })},
+    };
+
+    printf("Vector math, %u camera rays, %u hits (checksum %g):\n", count, hitCount, sum);
+    for(Measure& measure : measures)
+        printf("  %-20s %7.2fns\n", measure.name, measure.nanoseconds);
+}
+
+void ReportRaySorting(Renderer& renderer, Scene& scene, Camera& camera, RenderSettings settings)
+{
+    settings.intermediateOutputFile = 0;
+    settings.checkpointFile = 0;
+    settings.timeBudgetMs = 0;
+    settings.measureRays = true;
+
+    // NOTE(mevex): The order never changes the hits, so both renders must accumulate the same values
+    std::unique_ptr<RenderJob> jobs[2];
+    for(i32 sorted = 0; sorted < 2; sorted++)
+    {
+        settings.sortRays = (sorted == 1);
+        PerfCounters before = GetPerfCounters();
+        jobs[sorted] = renderer.Render(scene, camera, settings);
+        PerfCounters after = GetPerfCounters();
+
+        u64 rays = after.secondaryRays - before.secondaryRays;
+        f64 seconds = (after.secondaryNanoseconds - before.secondaryNanoseconds) * 1e-9;
+        printf("%s: %llu secondary rays, %.2f Mrays/s, ", sorted ? "Sorted rays  " : "Unsorted rays",
+               (unsigned long long)rays, seconds > 0 ? rays / seconds * 1e-6 : 0.0);
+        if(after.cacheMissesCounted)
+            printf("%.2f cache misses/ray, ", (f64)(after.secondaryCacheMisses - before.secondaryCacheMisses) / Max(rays, (u64)1));
+        else
+            printf("cache misses n/a, ");
+        printf("render time %.2fms\n", jobs[sorted]->renderTimeMs);
+    }
+
+    Canvas& a = jobs[0]->canvas;
+    Canvas& b = jobs[1]->canvas;
+    bool same = memcmp(a.accum, b.accum, (size_t)a.width * a.height * sizeof(AccumPixel)) == 0;
+    printf("Images: %s\n", same ? "identical" : "DIFFERENT");
+}
+
+void ReportCheckpointResume(Renderer& renderer, Scene& scene, Camera& camera, RenderSettings settings, const char *filename)
+{
+    settings.width = 160;
+    settings.height = 90;
+    settings.samplesPerPixel = 16;
+    settings.samplesPerPass = 4;
+    settings.timeBudgetMs = 0;
+    settings.intermediateOutputFile = 0;
+    settings.tileCacheDirectory = 0;
+    settings.checkpointFile = filename;
+    settings.checkpointIntervalSeconds = 3600;
+    remove(filename);
+
+    // NOTE(mevex): Cancelled in its second pass, the first one is left in the checkpoint
+    RenderSettings base = settings;
+    auto checkpoint = [&]()
+    {
+        renderer.Render(scene, camera, base, [](RenderJob& job, Tile& tile)
+        {
+            if(job.tilePassesRendered > job.tiles.size())
+                job.Cancel();
+        });
+    };
+
+    // NOTE(mevex): Cancelled on its first tile, it only shows whether the checkpoint was resumed
+    auto resumes = [&](Camera& variantCamera, RenderSettings& variant)
+    {
+        std::unique_ptr<RenderJob> job = renderer.Render(scene, variantCamera, variant, [](RenderJob& job, Tile& tile) { job.Cancel(); });
+        return job->resumedPasses > 0;
+    };
+
+    bool passed = true;
+    auto report = [&](const char *name, bool resumed, bool expected)
+    {
+        printf("  %-16s %s (%s)\n", name, resumed ? "resumed" : "not resumed", (resumed == expected) ? "ok" : "WRONG");
+        passed = passed && (resumed == expected);
+    };
+
+    printf("Checkpoint resume, %dx%d, %d spp in passes of %d:\n", settings.width, settings.height, settings.samplesPerPixel, settings.samplesPerPass);
+    RenderSettings variant = settings;
+    variant.seed = settings.seed + 1;
+    checkpoint();
+    report("Other seed", resumes(camera, variant), false);
+
+    variant = settings;
+    variant.samplesPerPass = settings.samplesPerPass / 2;
+    report("Other pass size", resumes(camera, variant), false);
+
+    Camera moved = camera;
+    moved.position = moved.position + v3(0.5f, 0, 0);
+    moved.vpLowerLeftCorner = moved.vpLowerLeftCorner + v3(0.5f, 0, 0);
+    report("Other camera", resumes(moved, settings), false);
+
+    Sphere *sphere = 0;
+    for(Hittable *obj : scene.objects)
+    {
+        if(!sphere)
+            sphere = dynamic_cast<Sphere *>(obj);
+    }
+    if(sphere)
+    {
+        p3 center = sphere->center;
+        sphere->center = center + v3(0, 0.5f, 0);
+        report("Other scene", resumes(camera, settings), false);
+        sphere->center = center;
+    }
+
+    report("Same render", resumes(camera, settings), true);
+    remove(filename);
+    printf("Checkpoints: %s\n", passed ? "ok" : "WRONG");
+}
+
+bool MappedFile::Open(const char *filename)
+{
+    Close();
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if(fileHandle == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(fileHandle, &fileSize);
+    HANDLE mappingHandle = fileSize.QuadPart ? CreateFileMappingA(fileHandle, 0, PAGE_READONLY, 0, 0, 0) : 0;
+    void *view = mappingHandle ? MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0) : 0;
+    file = (intptr_t)fileHandle;
+    mapping = (intptr_t)mappingHandle;
+    if(!view)
+    {
+        Close();
+        return false;
+    }
+    size = (size_t)fileSize.QuadPart;
+#else
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return false;
+    file = fd;
+    struct stat info;
+    void *view = (fstat(fd, &info) == 0 && info.st_size > 0) ? mmap(0, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if(view == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    size = (size_t)info.st_size;
+#endif
+    data = (u8 *)view;
+    return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+    if(data)
+        UnmapViewOfFile(data);
+    if(mapping)
+        CloseHandle((HANDLE)mapping);
+    if(file != -1)
+        CloseHandle((HANDLE)file);
+#else
+    if(data)
+        munmap(data, size);
+    if(file != -1)
+        close((int)file);
+#endif
+    data = 0;
+    size = 0;
+    file = -1;
+    mapping = 0;
+}
+
+void MappedFile::Release(u64 offset, u64 bytes)
+{
+    // NOTE(mevex): Only whole pages inside the range, the clusters are page aligned
+    const u64 pageSize = ClusteredMesh::ClusterPageSize;
+    u64 first = (offset + pageSize - 1) / pageSize * pageSize;
+    u64 last = (offset + bytes) / pageSize * pageSize;
+    if(!data || last <= first)
+        return;
+#ifdef _WIN32
+    // NOTE(mevex): Unlocking pages that aren't locked takes them out of the working set
+    VirtualUnlock(data + first, (size_t)(last - first));
+#else
+    madvise(data + first, (size_t)(last - first), MADV_DONTNEED);
+#endif
+}
+
+// NOTE(mevex): Cuts the BVH where subtrees have at most clusterSize triangles. Gives the range of the
+// subtree, pending is true if it can still become part of a bigger cluster. roots gets the node of every cluster.
+shared_function void CollectClusters(BVH& bvh, u32 nodeIndex, u32 clusterSize, vector<u32>& roots, vector<u32>& firsts, vector<u32>& counts,
+                                     u32& first, u32& count, bool& pending)
+{
+    BVHNode& node = bvh.nodes[nodeIndex];
+    if(node.count)
+    {
+        first = node.leftFirst;
+        count = node.count;
+        pending = true;
+        return;
+    }
+
+    u32 childFirst[2], childCount[2];
+    bool childPending[2];
+    for(u32 side = 0; side < 2; side++)
+        CollectClusters(bvh, node.leftFirst + side, clusterSize, roots, firsts, counts, childFirst[side], childCount[side], childPending[side]);
+
+    first = Min(childFirst[0], childFirst[1]);
+    count = childCount[0] + childCount[1];
+    pending = childPending[0] && childPending[1] && count <= clusterSize;
+    if(!pending)
+    {
+        for(u32 side = 0; side < 2; side++)
+        {
+            if(childPending[side])
+            {
+                roots.push_back(node.leftFirst + side);
+                firsts.push_back(childFirst[side]);
+                counts.push_back(childCount[side]);
+            }
+        }
+    }
+}
+
+// NOTE(mevex): Copies the subtree under source into out, in mesh space and with the primitive indices
+// relative to the cluster
+shared_function void CopySubtree(BVH& bvh, u32 source, u32 firstPrimitive, p3 position, vector<BVHNode>& out, u32 destination)
+{
+    BVHNode node = bvh.nodes[source];
+    AABB bounds = node.Bounds();
+    bounds.min = bounds.min - position;
+    bounds.max = bounds.max - position;
+    node.SetBounds(bounds);
+    if(node.count)
+        node.leftFirst -= firstPrimitive;
+    else
+    {
+        u32 left = (u32)out.size();
+        out.resize(left + 2);
+        CopySubtree(bvh, node.leftFirst, firstPrimitive, position, out, left);
+        CopySubtree(bvh, node.leftFirst + 1, firstPrimitive, position, out, left + 1);
+        node.leftFirst = left;
+    }
+    out[destination] = node;
+}
+
+bool WriteClusterFile(Mesh& mesh, const char *filename, u32 clusterSize)
+{
+    if(mesh.bvh.Empty() || mesh.bvh.IsLazy())
+        mesh.BuildBVH(0, BVHBuild_SAH);
+
+    vector<u32> roots, firsts, counts;
+    u32 first, count;
+    bool pending;
+    CollectClusters(mesh.bvh, 0, clusterSize, roots, firsts, counts, first, count, pending);
+    if(pending)
+    {
+        roots.push_back(0);
+        firsts.push_back(first);
+        counts.push_back(count);
+    }
+
+    FILE *file = fopen(filename, "wb");
+    if(!file)
+        return false;
+
+    u32 clusterCount = (u32)firsts.size();
+    u32 materialCount = (u32)mesh.materials.size();
+    const u64 pageSize = ClusteredMesh::ClusterPageSize;
+    ClusterFileHeader header = {};
+    memcpy(header.magic, CLUSTER_FILE_MAGIC, sizeof(header.magic));
+    header.clusterCount = clusterCount;
+    header.materialCount = materialCount;
+    header.tableOffset = sizeof(ClusterFileHeader);
+    header.materialOffset = header.tableOffset + clusterCount * sizeof(ClusterInfo);
+
+    vector<ClusterInfo> table(clusterCount);
+    vector<vector<BVHNode>> clusterNodes(clusterCount);
+    u64 offset = header.materialOffset + materialCount * 3 * sizeof(f32);
+    for(u32 c = 0; c < clusterCount; c++)
+    {
+        clusterNodes[c].resize(1);
+        CopySubtree(mesh.bvh, roots[c], firsts[c], mesh.position, clusterNodes[c], 0);
+
+        offset = (offset + pageSize - 1) / pageSize * pageSize;
+        AABB bounds;
+        for(u32 i = firsts[c]; i < firsts[c] + counts[c]; i++)
+            bounds.Grow(mesh.TriangleBounds(i));
+
+        ClusterInfo& info = table[c];
+        info.offset = offset;
+        info.triangleCount = counts[c];
+        info.nodeCount = (u32)clusterNodes[c].size();
+        for(i32 axis = 0; axis < 3; axis++)
+        {
+            info.min[axis] = bounds.min.e[axis] - mesh.position.e[axis];
+            info.max[axis] = bounds.max.e[axis] - mesh.position.e[axis];
+        }
+        offset += info.nodeCount * sizeof(BVHNode) + counts[c] * sizeof(ClusterTriangle);
+    }
+
+    bool result = fwrite(&header, sizeof(header), 1, file) == 1;
+    result = result && fwrite(table.data(), sizeof(ClusterInfo), clusterCount, file) == clusterCount;
+    for(Lambertian& m : mesh.materials)
+    {
+        f32 albedo[3] = {m.albedo.x, m.albedo.y, m.albedo.z};
+        result = result && fwrite(albedo, sizeof(albedo), 1, file) == 1;
+    }
+
+    vector<ClusterTriangle> triangles;
+    char zeros[ClusteredMesh::ClusterPageSize] = {};
+    u64 written = header.materialOffset + materialCount * 3 * sizeof(f32);
+    for(u32 c = 0; c < clusterCount && result; c++)
+    {
+        // NOTE(mevex): Zero padding up to the page the cluster starts on
+        size_t padding = (size_t)(table[c].offset - written);
+        result = fwrite(zeros, 1, padding, file) == padding;
+        result = result && fwrite(clusterNodes[c].data(), sizeof(BVHNode), table[c].nodeCount, file) == table[c].nodeCount;
+
+        triangles.resize(counts[c]);
+        for(u32 i = 0; i < counts[c]; i++)
+        {
+            Triangle& t = mesh.triangles[firsts[c] + i];
+            ClusterTriangle& out = triangles[i];
+            p3 *vertices[3] = {&t.a, &t.b, &t.c};
+            f32 *outVertices[3] = {out.a, out.b, out.c};
+            for(i32 v = 0; v < 3; v++)
+            {
+                for(i32 axis = 0; axis < 3; axis++)
+                    outVertices[v][axis] = vertices[v]->e[axis] - mesh.position.e[axis];
+            }
+
+            Lambertian *material = (Lambertian *)t.material;
+            bool known = !mesh.materials.empty() && material >= mesh.materials.data() && material < mesh.materials.data() + materialCount;
+            out.material = known ? (u32)(material - mesh.materials.data()) : (u32)ClusteredMesh::NoMaterial;
+        }
+        result = result && fwrite(triangles.data(), sizeof(ClusterTriangle), counts[c], file) == counts[c];
+        written = table[c].offset + table[c].nodeCount * sizeof(BVHNode) + counts[c] * sizeof(ClusterTriangle);
+    }
+
+    result = (fclose(file) == 0) && result;
+    return result;
+}
+
+bool BuildDefaultScene(Scene& scene, const char *modelFile)
+{
+    // NOTE(mevex): Materials
+    Lambertian *ground = scene.Create<Lambertian>(Color(0.8f, 0.8f, 0.0f));
+    Metal *right = scene.Create<Metal>(Color(0.05f, 0.6f, 0.73f), 0.0f);
+
+    // NOTE(mevex): Objects
+    scene.Create<Plane>(p3(0,-0.5f,0), v3(0,1,0), ground);
+    scene.Create<Sphere>(p3(-5 ,1.5f, 1), 2.0f, right);
+    // NOTE(mevex): .clusters files come from WriteClusterFile and are streamed from disk
+    size_t length = strlen(modelFile);
+    bool clustered = length > 9 && !strcmp(modelFile + length - 9, ".clusters");
+    bool result = clustered ? scene.LoadClusteredMesh(modelFile, p3(0,3.65f,0)) != 0 : scene.LoadMesh(modelFile, p3(0,3.65f,0)) != 0;
+
+    // NOTE(mevex): Lights
+    scene.Create<PointLight>(p3(-0.5f,10,5), 0.7f);
+    scene.Create<AmbientLight>(0.3f);
+
+    return result;
+}
+
+Camera DefaultCamera(f32 aspectRatio, f32 turnDegrees)
+{
+    //Camera result(p3(3,9,12), p3(0.5f,3.7f,0), v3(0,1,0), 55, aspectRatio);
+    p3 lookAt(1,4,-1);
+    v3 offset = p3(0,5,12) - lookAt;
+    f32 angle = DegreesToRadians(turnDegrees);
+    v3 turned(offset.x * cosf(angle) + offset.z * sinf(angle), offset.y, offset.z * cosf(angle) - offset.x * sinf(angle));
+    Camera result(lookAt + turned, lookAt, v3(0,1,0), 50, aspectRatio);
+    return result;
+}
+
+// NOTE(mevex): Everything the scene needs before a render, for all the jobs that share it. What depends on
+// the settings of a render (the radiance cache, path guiding) belongs to its job.
+shared_function void PrepareScene(Scene& scene, Camera& camera, WorkerPool& pool)
+{
+    scene.Prepare(&pool, &camera);
+}
+
+std::unique_ptr<RenderJob> Renderer::RenderAsync(Scene& scene, Camera& camera, RenderSettings& settings, TileCallback onTile)
+{
+    PrepareScene(scene, camera, pool);
+
+    std::unique_ptr<RenderJob> job(new RenderJob(scene, camera, settings, onTile, pool));
+    job->Start();
+    return job;
+}
+
+std::unique_ptr<MultiViewJob> Renderer::RenderViewsAsync(Scene& scene, vector<Camera>& cameras, RenderSettings& settings, TileCallback onTile)
+{
+    if(!cameras.empty())
+        PrepareScene(scene, cameras[0], pool);
+
+    std::unique_ptr<MultiViewJob> job(new MultiViewJob(scene, cameras, settings, onTile, pool));
+    job->Start();
+    return job;
+}
+
+std::unique_ptr<MultiViewJob> Renderer::RenderViews(Scene& scene, vector<Camera>& cameras, RenderSettings& settings, TileCallback onTile)
+{
+    std::unique_ptr<MultiViewJob> job = RenderViewsAsync(scene, cameras, settings, onTile);
+    job->Wait();
+    return job;
+}
+
+std::unique_ptr<RenderJob> Renderer::Render(Scene& scene, Camera& camera, RenderSettings& settings, TileCallback onTile)
+{
+    std::unique_ptr<RenderJob> job = RenderAsync(scene, camera, settings, onTile);
+    job->Wait();
+    return job;
+}
@@ -0,0 +1,323 @@
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+// NOTE(mevex): Public interface of the renderer library (raytracer.cpp).
+// Typical use:
+//
+//     Renderer renderer;
+//     Scene scene;
+//     Lambertian *red = scene.Create<Lambertian>(Color(0.8f, 0.1f, 0.1f));
+//     scene.Create<Sphere>(p3(0,1,0), 1.0f, red);
+//     scene.LoadMesh("../models/fox2.obj", p3(0,0,0));
+//     scene.Create<AmbientLight>(0.3f);
+//
+//     RenderSettings settings;
+//     Camera camera(p3(0,5,12), p3(0,0,0), v3(0,1,0), 50, (f32)settings.width / settings.height);
+//     auto job = renderer.RenderAsync(scene, camera, settings, onTile);
+//     job->Wait();
+//     job->canvas.Write("render.png");
+//
+// The scene is prepared (acceleration structures and so on) on the first render and stays
+// resident, every following render of the same Scene object reuses it. Objects can be moved
+// between renders, see Scene::Update.
+
+#include "main.h"
+#include "raster.h"
+#include "temporal.h"
+#include "tilecache.h"
+
+struct RenderSettings
+{
+    i32 width = 1280;
+    i32 height = 720;
+    i32 samplesPerPixel = 8;
+    i32 samplesPerPass = 4;
+    i32 maxDepth = 4;
+    i32 tileSize = 32;
+
+    // NOTE(mevex): Camera rays are traced in packets of 8x8 pixels that are culled as a whole
+    // through the mesh BVHs, the image is the same either way
+    bool primaryPackets = true;
+
+    // NOTE(mevex): The triangles of the meshes are rastered once per render into a visibility buffer
+    // (see raster.h) and the camera rays take their first hit from it instead of tracing the meshes.
+    // The hits are the traced ones, so the image is the same either way. See ReportPrimaryRaster.
+    bool rasterPrimary = false;
+
+    // NOTE(mevex): Bounces are shaded by a kernel made for the materials and lights of the scene (see
+    // SceneFeature), the image is the same either way. False always uses the generic one, to compare.
+    bool specializedKernels = true;
+
+    // NOTE(mevex): Bounce and shadow rays are sorted by the octant of their direction and the cell of
+    // their origin before they are traced, so that close rays go through the scene together.
+    // measureRays also counts the cache misses of the threads while they trace them (Linux only).
+    // Off by default: the bounces of a tile are coherent enough that sorting them did not pay back
+    // on the default scene, see ReportRaySorting.
+    bool sortRays = false;
+    bool measureRays = false;
+
+    // NOTE(mevex): Bounce rays walk the mesh BVHs several at a time, each one prefetching its next node
+    // while the others work, see BVH::IntersectInterleaved. The image is the same either way. Off by
+    // default: it only pays when the meshes miss the last level cache (see ReportInterleavedTraversal).
+    bool interleaveRays = false;
+
+    // NOTE(mevex): Paths stop at their second diffuse hit and later ones when the radiance cache of the job
+    // knows what follows there (see radiance.h), which cuts the samples indirect light needs.
+    // The cache is filled while rendering, so the image depends on the order of the tiles and the same
+    // settings no longer give the exact same image. Cell size 0 is 1/64 of the size of the scene.
+    bool radianceCache = false;
+    f32 radianceCacheCellSize = 0;
+    i32 radianceCacheMB = 32;
+
+    // NOTE(mevex): Path guiding (see guiding.h): the first guidingPasses passes learn where the light of
+    // the scene comes from, after the first one guidingFraction of the diffuse bounces follow it. 0 passes
+    // is a third of them. Time budgeted renders learn on their first two passes, the ones over the whole
+    // image. The guided paths are not the usual ones: a miss only stops its own path, not the ones after
+    // it in the pixel, and the diffuse bounces that don't follow the learned light use a true cosine lobe
+    // (see GuidingTree::GuideBounce). guidingFraction 0 renders the same image unguided, to compare.
+    bool pathGuiding = false;
+    i32 guidingPasses = 0;
+    f32 guidingFraction = 0.5f;
+
+    // NOTE(mevex): Tiles of jobs with a higher priority get the worker threads first
+    i32 priority = 0;
+
+    // NOTE(mevex): Every tile pass is seeded from this, the tile and the pass index,
+    // so the same settings always give the same image
+    u32 seed = 0;
+
+    // NOTE(mevex): If greater than zero samplesPerPixel is ignored and the renderer uses as
+    // many passes as fit in this many milliseconds, see RenderJob::RunTimeBudgeted. A budget shorter
+    // than one pass over the image leaves the tiles the first pass didn't reach empty.
+    f32 timeBudgetMs = 0;
+
+    // NOTE(mevex): Optional progressive output: an image written after every pass and a
+    // checkpoint of the accumulation buffer written every checkpointIntervalSeconds.
+    // A checkpoint is resumed when the render starts if it was made with the same scene, camera,
+    // size, sampling settings and seed (see CheckpointKey), and deleted when the render ends.
+    const char *intermediateOutputFile = 0;
+    const char *checkpointFile = 0;
+    i32 checkpointIntervalSeconds = 60;
+
+    // NOTE(mevex): Optional cache of finished tiles on disk, shared by every render that uses the same
+    // directory (see tilecache.h). A tile rendered before with the same scene, camera, sampling settings
+    // and seed is loaded instead of rendered, the image is the same either way. The least recently used
+    // tiles are removed once it grows past tileCacheMB. Only for renders of samplesPerPixel without a
+    // radiance cache or path guiding, which make a tile depend on the others, and not for the ones
+    // resumed from a checkpoint. Any change to the scene misses every tile, see RenderJob::TileKey.
+    const char *tileCacheDirectory = 0;
+    i32 tileCacheMB = 256;
+};
+
+struct Tile
+{
+    // NOTE(mevex): Pixels in [minX, maxX)x[minY, maxY)
+    i32 minX, minY;
+    i32 maxX, maxY;
+
+    u32 index;
+    u32 passes;
+    f32 error;
+};
+
+struct PerfCounters
+{
+    u64 getRayColorCycles;
+    u64 hitCycles;
+    u64 scatterCycles;
+
+    u64 getRayColorCount;
+    u64 hitCount;
+    u64 scatterCount;
+
+    // NOTE(mevex): Bounce and shadow rays, the time spent sorting and tracing them and the cache
+    // misses meanwhile, cacheMissesCounted is false if they could not be counted
+    u64 secondaryRays;
+    u64 secondaryNanoseconds;
+    u64 secondaryCacheMisses;
+    bool cacheMissesCounted;
+};
+
+// NOTE(mevex): Totals of the profiling counters of all the threads
+PerfCounters GetPerfCounters();
+
+// NOTE(mevex): The scene main.cpp always rendered: a ground plane, a metal sphere and the
+// given model, lit by a point light and an ambient light. Returns false if the model can't be loaded.
+bool BuildDefaultScene(Scene& scene, const char *modelFile);
+// NOTE(mevex): turnDegrees turns the camera around the vertical axis through the point it looks at
+Camera DefaultCamera(f32 aspectRatio, f32 turnDegrees = 0);
+
+// NOTE(mevex): Splits the canvas in tiles of tileSize pixels, the tile index is part of the seed
+// of its samples. Rows of tiles go top to bottom, every row left to right.
+vector<Tile> MakeTiles(Canvas& canvas, i32 tileSize);
+
+// NOTE(mevex): Number of passes a RenderJob without a time budget renders
+u32 PassCount(RenderSettings& settings);
+
+// NOTE(mevex): Number of passes that learn for path guiding, see RenderSettings::pathGuiding
+u32 GuidingPassCount(RenderSettings& settings);
+
+// NOTE(mevex): Renders on the calling thread the passes of the tile from tile.passes to the last one,
+// with the same seeds and in the same order as a RenderJob. The accumulated values are bit-identical
+// to the ones of a full render, so tiles can be rendered anywhere and merged (see coordinator.cpp).
+// Not with path guiding, that learns from the whole image between passes.
+void RenderTilePasses(Canvas& canvas, Camera& camera, Scene& scene, Tile& tile, RenderSettings& settings);
+
+// NOTE(mevex): Prints, for every mesh of the scene and for both builders, the build time and SAH cost,
+// the memory of the binary and of the compressed 4-wide BVH and how many nodes and triangles a
+// primary ray visits on average in each of them
+void ReportAccelerationStructures(Scene& scene, Camera& camera, i32 width, i32 height, WorkerPool *pool = 0);
+
+// NOTE(mevex): Traces, for every mesh, diffuse bounces from the primary hits through its BVH one ray at a
+// time and interleaved (see BVH::IntersectInterleaved) and prints the throughput of both
+void ReportInterleavedTraversal(Scene& scene, Camera& camera, i32 width, i32 height, WorkerPool *pool = 0);
+
+// NOTE(mevex): Finds the first hits of the camera rays of every tile, 4 jittered samples per pixel, by
+// tracing them in packets and through the visibility buffer (see raster.h), and prints the time of both,
+// the build of the buffer apart, and how many hits differ
+void ReportPrimaryRaster(Scene& scene, Camera& camera, i32 width, i32 height, WorkerPool *pool = 0);
+
+// NOTE(mevex): Times on the calling thread, in nanoseconds per call, the v3 math of the hot paths: camera
+// rays, the scatter of the materials on the first hits of the scene and single ray hits on each shape
+void ReportVectorMath(Scene& scene, Camera& camera, i32 width, i32 height);
+
+class Renderer;
+
+// NOTE(mevex): Renders the scene with the secondary rays in the order they are made and then sorted,
+// and prints for both the rays traced per second and the cache misses per ray
+void ReportRaySorting(Renderer& renderer, Scene& scene, Camera& camera, RenderSettings settings);
+
+// NOTE(mevex): Checks, on a small render of the scene, that a checkpoint written in filename is only
+// resumed by the same render and not after the seed, the pass size, the camera or the scene changed
+void ReportCheckpointResume(Renderer& renderer, Scene& scene, Camera& camera, RenderSettings settings, const char *filename);
+
+class RenderJob;
+class MultiViewJob;
+
+// NOTE(mevex): Called every time a tile finishes a pass (tile.passes is the number of passes
+// done so far). It runs on the worker threads, possibly several at the same time. Tiles loaded
+// from the tile cache get it once, with all their passes done, before the first pass renders.
+typedef std::function<void(RenderJob& job, Tile& tile)> TileCallback;
+
+class RenderJob
+{
+    public:
+
+    RenderSettings settings;
+    Camera camera;
+    Canvas canvas;
+    vector<Tile> tiles;
+
+    std::atomic<bool> cancelled;
+    std::atomic<bool> done;
+
+    // NOTE(mevex): Number of tile passes rendered so far
+    std::atomic<u32> tilePassesRendered;
+    u32 passesDone = 0;
+    u32 passCount = 0;
+    f32 renderTimeMs = 0;
+
+    // NOTE(mevex): Tiles loaded from settings.tileCacheDirectory instead of rendered
+    u32 tilesFromCache = 0;
+    // NOTE(mevex): Passes taken from settings.checkpointFile instead of rendered
+    u32 resumedPasses = 0;
+
+    // NOTE(mevex): Built when the job starts if settings.rasterPrimary
+    VisibilityBuffer visibility;
+
+    // NOTE(mevex): Filled by the job if settings.radianceCache and learned if settings.pathGuiding, every
+    // job starts with empty ones of its own, so jobs that share a scene don't see each other's
+    RadianceCache radianceCache;
+    GuidingTree guiding;
+
+    RenderJob(Scene& scene, Camera& camera, RenderSettings& settings, TileCallback onTile, WorkerPool& pool);
+    ~RenderJob();
+
+    // NOTE(mevex): Stops the render as soon as the tiles in flight are done, the canvas
+    // keeps whatever was accumulated until then
+    void Cancel();
+    void Wait();
+    bool IsDone();
+
+    void Start();
+
+    private:
+
+    friend class MultiViewJob;
+
+    Scene& scene;
+    TileCallback onTile;
+    WorkerPool& pool;
+    std::thread driver;
+
+    // NOTE(mevex): The cache and the tree the tiles use: the ones above, the ones of the MultiViewJob for
+    // its views, 0 without settings.radianceCache or settings.pathGuiding
+    RadianceCache *radiance = 0;
+    GuidingTree *guidingTree = 0;
+
+    void Run();
+    void RunPasses();
+    void RunTimeBudgeted();
+    void RenderTiles(vector<Tile *>& selection, i32 samples);
+    void RenderTileTask(Tile& tile, i32 samples);
+    u64 TileKey(u64 sceneHash, Tile& tile);
+    bool MakeCheckpointKey(CheckpointKey& result);
+};
+
+// NOTE(mevex): The same scene seen by several cameras (turntables, stereo pairs, cube maps) in one job.
+// Every view is a RenderJob of its own with its canvas, tiles and visibility buffer, but only the
+// MultiViewJob runs: the scene is prepared once and every pass renders the tiles of all the views
+// together, see Run. The views render samplesPerPixel each, time budgets, checkpoints and the tile cache
+// are not supported. The view jobs get the tile callback and are done when the MultiViewJob is.
+class MultiViewJob
+{
+    public:
+
+    RenderSettings settings;
+    vector<std::unique_ptr<RenderJob>> views;
+
+    std::atomic<bool> cancelled;
+    std::atomic<bool> done;
+    f32 renderTimeMs = 0;
+
+    // NOTE(mevex): The radiance cache and the guiding tree of all the views, see RenderJob::radianceCache
+    RadianceCache radianceCache;
+    GuidingTree guiding;
+
+    MultiViewJob(Scene& scene, vector<Camera>& cameras, RenderSettings& settings, TileCallback onTile, WorkerPool& pool);
+    ~MultiViewJob();
+
+    void Cancel();
+    void Wait();
+    bool IsDone();
+
+    void Start();
+
+    private:
+
+    Scene& scene;
+    WorkerPool& pool;
+    std::thread driver;
+
+    void Run();
+};
+
+class Renderer
+{
+    public:
+
+    WorkerPool pool;
+
+    // NOTE(mevex): threadCount 0 uses all the available cores
+    Renderer(i32 threadCount = 0) : pool(threadCount) {}
+
+    // NOTE(mevex): The scene must outlive the job. Camera and settings are copied.
+    std::unique_ptr<RenderJob> RenderAsync(Scene& scene, Camera& camera, RenderSettings& settings, TileCallback onTile = 0);
+    std::unique_ptr<RenderJob> Render(Scene& scene, Camera& camera, RenderSettings& settings, TileCallback onTile = 0);
+
+    // NOTE(mevex): The scene is prepared for the first camera (see Scene::Prepare)
+    std::unique_ptr<MultiViewJob> RenderViewsAsync(Scene& scene, vector<Camera>& cameras, RenderSettings& settings, TileCallback onTile = 0);
+    std::unique_ptr<MultiViewJob> RenderViews(Scene& scene, vector<Camera>& cameras, RenderSettings& settings, TileCallback onTile = 0);
+};
+
+#endif //RAYTRACER_H
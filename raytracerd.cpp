@@ -0,0 +1,508 @@
+// NOTE(mevex): Render daemon (Linux only). Keeps the renderer, its worker pool and the
+// loaded scenes resident, and accepts render jobs over a Unix domain socket.
+//
+// Usage: raytracerd [-socket path] [-cache-mb n] [-threads n]
+//
+// Protocol: every request is one text line, a client can send any number of them.
+//
+//   RENDER scene=<file.obj> [width=n] [height=n] [spp=n] [depth=n] [seed=n] [priority=n]
+//          [camera=px,py,pz,tx,ty,tz,fov] [output=<file>] [stream=0|1]
+//     -> ACCEPTED <job> <width> <height>
+//     -> TILE <job> <minX> <minY> <maxX> <maxY> <passes> <bytes>   (stream=1 only, once per tile pass)
+//        followed by <bytes> bytes of RGBA8 pixels of the tile, top row first. A client that reads
+//        slower than the tiles finish skips passes: it always gets the latest one of every tile.
+//     -> DONE <job> <renderMs> <cached 0|1> <loadMs> <written 0|1>
+//   STATS
+//     -> STATS scenes=<n> bytes=<n> budget=<n> hits=<n> misses=<n>
+//   SHUTDOWN
+//     -> BYE
+//
+// Errors are reported as a single "ERROR <message>" line. The scene is the default scene of
+// the library (BuildDefaultScene) built around the given model. Scenes are kept in an LRU
+// cache bounded by -cache-mb and keyed by the real path and modification time of the model,
+// so a job for an asset that is already resident starts rendering right away.
+
+#include "raytracer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+class SceneCache
+{
+    public:
+
+    struct Entry
+    {
+        std::string key;
+        std::shared_future<std::shared_ptr<Scene>> scene;
+        size_t bytes;
+    };
+
+    // NOTE(mevex): Most recently used first
+    std::list<Entry> entries;
+    std::mutex mutex;
+    size_t budget;
+    size_t used = 0;
+    u64 hits = 0;
+    u64 misses = 0;
+
+    // NOTE(mevex): Acceleration structures of new scenes are built here
+    WorkerPool *pool;
+
+    SceneCache(size_t budgetBytes, WorkerPool *pool) : budget(budgetBytes), pool(pool) {}
+
+    // NOTE(mevex): Returns the prepared scene for the model, loading it if needed. Concurrent
+    // requests for a model that is being loaded wait for that load instead of repeating it.
+    // Evicted scenes stay alive until the last job using them is done.
+    std::shared_ptr<Scene> Get(const char *modelFile, bool& cached, f32& loadMs)
+    {
+        cached = false;
+        loadMs = 0;
+
+        char realPath[PATH_MAX];
+        struct stat info;
+        if(!realpath(modelFile, realPath) || stat(realPath, &info) != 0)
+            return 0;
+
+        char key[PATH_MAX + 32];
+        snprintf(key, sizeof(key), "%s@%lld", realPath, (long long)info.st_mtime);
+
+        std::promise<std::shared_ptr<Scene>> promise;
+        std::shared_future<std::shared_ptr<Scene>> future;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(auto it = entries.begin(); it != entries.end(); ++it)
+            {
+                if(it->key == key)
+                {
+                    entries.splice(entries.begin(), entries, it);
+                    hits++;
+                    cached = true;
+                    future = it->scene;
+                    break;
+                }
+            }
+
+            if(!cached)
+            {
+                misses++;
+                future = promise.get_future().share();
+                entries.push_front({key, future, 0});
+            }
+        }
+
+        if(cached)
+            return future.get();
+
+        auto begin = std::chrono::high_resolution_clock::now();
+        std::shared_ptr<Scene> scene = std::make_shared<Scene>();
+        if(BuildDefaultScene(*scene, realPath))
+            scene->Prepare(pool);
+        else
+            scene = 0;
+        auto end = std::chrono::high_resolution_clock::now();
+        loadMs = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000.0f;
+
+        promise.set_value(scene);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto it = entries.begin(); it != entries.end(); ++it)
+        {
+            if(it->key == key)
+            {
+                if(scene)
+                {
+                    it->bytes = scene->MemorySize();
+                    used += it->bytes;
+                }
+                else
+                    entries.erase(it);
+                break;
+            }
+        }
+        Evict(key);
+
+        return scene;
+    }
+
+    private:
+
+    // NOTE(mevex): Drops least recently used scenes until the cache fits the budget,
+    // never the one that was just loaded and never one that is still loading
+    void Evict(const char *keep)
+    {
+        auto it = entries.end();
+        while(used > budget && it != entries.begin())
+        {
+            --it;
+            if(it->key != keep && it->bytes > 0)
+            {
+                used -= it->bytes;
+                it = entries.erase(it);
+            }
+        }
+    }
+};
+
+global_variable std::atomic<bool> Running(true);
+global_variable int ServerSocket = -1;
+global_variable std::atomic<u32> NextJobId(1);
+
+struct Connection
+{
+    int socket;
+    std::mutex sendMutex;
+
+    bool Send(const void *data, size_t size)
+    {
+        const u8 *at = (const u8 *)data;
+        while(size > 0)
+        {
+            ssize_t sent = send(socket, at, size, MSG_NOSIGNAL);
+            if(sent <= 0)
+                return false;
+            at += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    bool SendLine(const char *line)
+    {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        return Send(line, strlen(line));
+    }
+
+    // NOTE(mevex): Reads up to the next newline, false when the client is gone
+    bool ReadLine(std::string& line, std::string& pending)
+    {
+        for(;;)
+        {
+            size_t newline = pending.find('\n');
+            if(newline != std::string::npos)
+            {
+                line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                if(!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                return true;
+            }
+
+            char buffer[4096];
+            ssize_t received = recv(socket, buffer, sizeof(buffer), 0);
+            if(received <= 0)
+                return false;
+            pending.append(buffer, received);
+        }
+    }
+};
+
+inline const char *FindValue(std::map<std::string, std::string>& values, const char *key, const char *fallback)
+{
+    auto it = values.find(key);
+    return (it == values.end()) ? fallback : it->second.c_str();
+}
+
+void HandleRender(Connection& connection, Renderer& renderer, SceneCache& cache, char *arguments)
+{
+    std::map<std::string, std::string> values;
+    for(char *token = strtok(arguments, " "); token; token = strtok(0, " "))
+    {
+        char *equals = strchr(token, '=');
+        if(equals)
+        {
+            *equals = 0;
+            values[token] = equals + 1;
+        }
+    }
+
+    const char *modelFile = FindValue(values, "scene", 0);
+    if(!modelFile)
+    {
+        connection.SendLine("ERROR missing scene\n");
+        return;
+    }
+
+    RenderSettings settings;
+    settings.width = atoi(FindValue(values, "width", "1280"));
+    settings.height = atoi(FindValue(values, "height", "720"));
+    settings.samplesPerPixel = atoi(FindValue(values, "spp", "8"));
+    settings.maxDepth = atoi(FindValue(values, "depth", "4"));
+    settings.seed = (u32)strtoul(FindValue(values, "seed", "0"), 0, 10);
+    settings.priority = atoi(FindValue(values, "priority", "0"));
+    const char *outputFile = FindValue(values, "output", 0);
+    bool stream = atoi(FindValue(values, "stream", "1")) != 0;
+
+    if(settings.width <= 0 || settings.height <= 0 || settings.samplesPerPixel <= 0 || settings.maxDepth < 0)
+    {
+        connection.SendLine("ERROR invalid render settings\n");
+        return;
+    }
+
+    f32 ratio = (f32)settings.width / (f32)settings.height;
+    Camera camera = DefaultCamera(ratio);
+    const char *cameraValue = FindValue(values, "camera", 0);
+    if(cameraValue)
+    {
+        f32 c[7];
+        if(sscanf(cameraValue, "%f,%f,%f,%f,%f,%f,%f", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5], &c[6]) != 7)
+        {
+            connection.SendLine("ERROR invalid camera, expected px,py,pz,tx,ty,tz,fov\n");
+            return;
+        }
+        camera = Camera(p3(c[0], c[1], c[2]), p3(c[3], c[4], c[5]), v3(0,1,0), c[6], ratio);
+    }
+
+    bool cached;
+    f32 loadMs;
+    std::shared_ptr<Scene> scene = cache.Get(modelFile, cached, loadMs);
+    if(!scene)
+    {
+        connection.SendLine("ERROR could not load scene\n");
+        return;
+    }
+
+    u32 jobId = NextJobId++;
+    char line[256];
+    snprintf(line, sizeof(line), "ACCEPTED %u %d %d\n", jobId, settings.width, settings.height);
+    if(!connection.SendLine(line))
+        return;
+
+    // NOTE(mevex): The workers only resolve the finished tiles and queue them, this thread sends them,
+    // so a slow client never holds up the pool. A tile queued again before it was sent is replaced:
+    // the queue never has more than one entry per tile.
+    struct TileMessage
+    {
+        std::string header;
+        vector<u32> pixels;
+        bool queued = false;
+    };
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    vector<TileMessage> latest;
+    std::deque<u32> queue;
+
+    std::atomic<bool> clientGone(false);
+    TileCallback onTile = 0;
+    if(stream)
+    {
+        onTile = [&](RenderJob& job, Tile& tile)
+        {
+            if(clientGone)
+                return;
+
+            i32 tileWidth = tile.maxX - tile.minX;
+            i32 tileHeight = tile.maxY - tile.minY;
+            job.canvas.ResolveRect(tile.minX, tile.minY, tile.maxX, tile.maxY);
+
+            vector<u32> pixels(tileWidth * tileHeight);
+            for(i32 y = tile.maxY - 1, row = 0; y >= tile.minY; y--, row++)
+            {
+                u32 *src = (u32 *)job.canvas.memory + job.canvas.PixelIndex(tile.minX, y);
+                memcpy(pixels.data() + row * tileWidth, src, tileWidth * sizeof(u32));
+            }
+
+            char header[128];
+            snprintf(header, sizeof(header), "TILE %u %d %d %d %d %u %zu\n", jobId,
+                     tile.minX, tile.minY, tile.maxX, tile.maxY, tile.passes, pixels.size() * sizeof(u32));
+
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if(latest.size() <= tile.index)
+                latest.resize(job.tiles.size());
+            TileMessage& message = latest[tile.index];
+            message.header = header;
+            message.pixels.swap(pixels);
+            if(!message.queued)
+            {
+                message.queued = true;
+                queue.push_back(tile.index);
+            }
+            queueReady.notify_one();
+        };
+    }
+
+    std::unique_ptr<RenderJob> job = renderer.RenderAsync(*scene, camera, settings, onTile);
+    for(;;)
+    {
+        std::unique_lock<std::mutex> lock(queueMutex);
+        // NOTE(mevex): The job doesn't signal when it is done, the timeout notices it
+        queueReady.wait_for(lock, std::chrono::milliseconds(20), [&] { return !queue.empty() || job->IsDone(); });
+        if(queue.empty())
+        {
+            if(job->IsDone())
+                break;
+            continue;
+        }
+
+        TileMessage message;
+        TileMessage& next = latest[queue.front()];
+        queue.pop_front();
+        message.header.swap(next.header);
+        message.pixels.swap(next.pixels);
+        next.queued = false;
+        lock.unlock();
+
+        if(clientGone)
+            continue;
+        std::lock_guard<std::mutex> sendLock(connection.sendMutex);
+        if(!connection.Send(message.header.data(), message.header.size()) || !connection.Send(message.pixels.data(), message.pixels.size() * sizeof(u32)))
+        {
+            // NOTE(mevex): Nobody is listening anymore, stop wasting the workers on this job
+            clientGone = true;
+            job->Cancel();
+        }
+    }
+    job->Wait();
+    if(clientGone)
+        return;
+
+    bool written = false;
+    if(outputFile)
+    {
+        job->canvas.Resolve(&renderer.pool);
+        written = job->canvas.Write(outputFile, &renderer.pool);
+    }
+
+    snprintf(line, sizeof(line), "DONE %u %.2f %d %.2f %d\n", jobId, job->renderTimeMs, cached ? 1 : 0, loadMs, written ? 1 : 0);
+    connection.SendLine(line);
+}
+
+// NOTE(mevex): finished is set when the client is gone, the main thread joins the thread then
+void HandleClient(int clientSocket, Renderer *renderer, SceneCache *cache, std::atomic<bool> *finished)
+{
+    Connection connection;
+    connection.socket = clientSocket;
+
+    std::string pending;
+    std::string line;
+    while(Running && connection.ReadLine(line, pending))
+    {
+        vector<char> command(line.begin(), line.end());
+        command.push_back(0);
+
+        if(!strncmp(command.data(), "RENDER", 6))
+        {
+            HandleRender(connection, *renderer, *cache, command.data() + 6);
+        }
+        else if(!strcmp(command.data(), "STATS"))
+        {
+            char reply[256];
+            {
+                std::lock_guard<std::mutex> lock(cache->mutex);
+                snprintf(reply, sizeof(reply), "STATS scenes=%zu bytes=%zu budget=%zu hits=%llu misses=%llu\n",
+                         cache->entries.size(), cache->used, cache->budget,
+                         (unsigned long long)cache->hits, (unsigned long long)cache->misses);
+            }
+            connection.SendLine(reply);
+        }
+        else if(!strcmp(command.data(), "SHUTDOWN"))
+        {
+            connection.SendLine("BYE\n");
+            Running = false;
+            shutdown(ServerSocket, SHUT_RDWR);
+            break;
+        }
+        else if(!line.empty())
+        {
+            connection.SendLine("ERROR unknown command\n");
+        }
+    }
+
+    close(clientSocket);
+    *finished = true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *socketPath = "/tmp/raytracer.sock";
+    size_t cacheBytes = (size_t)1024 * 1024 * 1024;
+    i32 threadCount = 0;
+
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i], "-socket"))
+            socketPath = argv[i+1];
+        else if(!strcmp(argv[i], "-cache-mb"))
+            cacheBytes = (size_t)atoll(argv[i+1]) * 1024 * 1024;
+        else if(!strcmp(argv[i], "-threads"))
+            threadCount = atoi(argv[i+1]);
+        else
+            printf("WARN: unknown option %s\n", argv[i]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        printf("ERR: socket path too long\n");
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    ServerSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if(ServerSocket < 0 || bind(ServerSocket, (sockaddr *)&address, sizeof(address)) != 0 || listen(ServerSocket, 16) != 0)
+    {
+        printf("ERR: could not listen on %s\n", socketPath);
+        return 1;
+    }
+
+    Renderer renderer(threadCount);
+    SceneCache cache(cacheBytes, &renderer.pool);
+    printf("Listening on %s, %d threads, scene cache %zuMB\n", socketPath, renderer.pool.ThreadCount(), cacheBytes / (1024 * 1024));
+    fflush(stdout);
+
+    // NOTE(mevex): A list, the threads keep a pointer to their finished flag
+    struct Client
+    {
+        std::thread thread;
+        std::atomic<bool> finished{false};
+    };
+    std::list<Client> clients;
+    while(Running)
+    {
+        int client = accept(ServerSocket, 0, 0);
+        if(client < 0)
+            break;
+
+        // NOTE(mevex): The threads of the clients that hung up are joined on every new connection, so
+        // only the ones still connected are kept
+        for(auto it = clients.begin(); it != clients.end();)
+        {
+            if(it->finished)
+            {
+                it->thread.join();
+                it = clients.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        clients.emplace_back();
+        Client& entry = clients.back();
+        entry.thread = std::thread(HandleClient, client, &renderer, &cache, &entry.finished);
+    }
+
+    // NOTE(mevex): Clients still connected are done when they hang up
+    for(Client& entry : clients)
+        entry.thread.join();
+
+    close(ServerSocket);
+    unlink(socketPath);
+    return 0;
+}
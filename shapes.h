@@ -0,0 +1,392 @@
+#ifndef SHAPES_H
+#define SHAPES_H
+
+#include <algorithm>
+
+// NOTE(mevex): The spheres and planes of a scene compiled into structure of arrays lists, so that one
+// ray is tested against LANE_WIDTH of them at a time (see simd.h) instead of making a virtual call
+// on a different cache line for each. The lists keep pointers to the objects they were made from,
+// Refresh copies the ones that moved.
+//
+// Spheres are sorted along a Morton curve and cut in blocks of BlockSize with a box each, a block is
+// only streamed through the kernel if the ray reaches its box. With many spheres the blocks are the
+// primitives of the scene accelerator (see Scene::BuildAccelerator). Planes are unbounded and usually
+// few, they are all tested.
+
+struct SphereList
+{
+    enum
+    {
+        BlockSize = 2 * LANE_WIDTH,
+        NoHit = 0xFFFFFFFF,
+    };
+
+    vector<Sphere *> source;
+    // NOTE(mevex): One entry per sphere, padded to a multiple of LANE_WIDTH
+    vector<f32> centerX, centerY, centerZ, radius, radiusSquared;
+    vector<Material *> materials;
+    vector<AABB> blockBounds;
+
+    inline u32 Count() { return (u32)source.size(); }
+    inline u32 Padded() { return (Count() + LANE_WIDTH - 1) / LANE_WIDTH * LANE_WIDTH; }
+
+    inline bool EntryChanged(u32 i)
+    {
+        Sphere *s = source[i];
+        bool result = centerX[i] != s->center.x || centerY[i] != s->center.y || centerZ[i] != s->center.z ||
+                      radius[i] != s->radius || materials[i] != s->material;
+        return result;
+    }
+
+    void Build(vector<Sphere *>& spheres)
+    {
+        source.clear();
+        u32 count = (u32)spheres.size();
+        if(count)
+        {
+            AABB centerBounds;
+            for(Sphere *s : spheres)
+                centerBounds.Grow(s->center);
+
+            v3 extent = centerBounds.max - centerBounds.min;
+            v3 scale(extent.x > 0 ? 1023.0f / extent.x : 0, extent.y > 0 ? 1023.0f / extent.y : 0, extent.z > 0 ? 1023.0f / extent.z : 0);
+            vector<std::pair<u32, u32>> keys(count);
+            for(u32 i = 0; i < count; i++)
+            {
+                v3 p = spheres[i]->center - centerBounds.min;
+                u32 x = (u32)(p.x * scale.x), y = (u32)(p.y * scale.y), z = (u32)(p.z * scale.z);
+                keys[i] = std::make_pair((ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z), i);
+            }
+            std::sort(keys.begin(), keys.end());
+            for(auto& key : keys)
+                source.push_back(spheres[key.second]);
+        }
+        Refresh();
+    }
+
+    // NOTE(mevex): True if a sphere moved, changed size or material since the last Refresh
+    bool Changed()
+    {
+        if(centerX.size() != Padded())
+            return true;
+        for(u32 i = 0; i < Count(); i++)
+        {
+            if(EntryChanged(i))
+                return true;
+        }
+        return false;
+    }
+
+    // NOTE(mevex): Copies the spheres that changed. The entries of the others are not written, so a
+    // list that didn't change can be refreshed while other renders trace it. Returns Changed().
+    bool Refresh()
+    {
+        u32 count = Count();
+        u32 padded = Padded();
+        bool resized = centerX.size() != padded;
+        if(resized)
+        {
+            centerX.assign(padded, 0);
+            centerY.assign(padded, 0);
+            centerZ.assign(padded, 0);
+            radius.assign(padded, 0);
+            radiusSquared.assign(padded, 0);
+            materials.assign(padded, 0);
+        }
+        bool result = resized;
+        for(u32 i = 0; i < count; i++)
+        {
+            if(!resized && !EntryChanged(i))
+                continue;
+            Sphere *s = source[i];
+            centerX[i] = s->center.x;
+            centerY[i] = s->center.y;
+            centerZ[i] = s->center.z;
+            radius[i] = s->radius;
+            radiusSquared[i] = s->radius * s->radius;
+            materials[i] = s->material;
+            result = true;
+        }
+        if(!result)
+            return result;
+
+        vector<AABB> bounds((count + BlockSize - 1) / BlockSize, AABB());
+        for(u32 i = 0; i < count; i++)
+        {
+            Sphere *s = source[i];
+            v3 extent(s->radius, s->radius, s->radius);
+            bounds[i / BlockSize].Grow(s->center - extent);
+            bounds[i / BlockSize].Grow(s->center + extent);
+        }
+        blockBounds.swap(bounds);
+        return result;
+    }
+
+    // NOTE(mevex): Index of the nearest sphere hit in [tMin, tMax], tMax is lowered to it.
+    // With anyHit it stops at the first one.
+    u32 Intersect(Ray& r, f32 tMin, f32& tMax, bool anyHit)
+    {
+        u32 result = NoHit;
+        if(!Count())
+            return result;
+
+        v3 invDir = SafeInverse(r.direction);
+        for(u32 block = 0; block < (u32)blockBounds.size(); block++)
+        {
+            f32 tEnter = tMin, tExit = tMax;
+            if(!ClipRay(blockBounds[block], r, invDir, tEnter, tExit))
+                continue;
+
+            u32 hit = IntersectBlock(block, r, tMin, tMax, anyHit);
+            if(hit != NoHit)
+            {
+                result = hit;
+                if(anyHit)
+                    return result;
+            }
+        }
+        return result;
+    }
+
+    // NOTE(mevex): Same as Intersect for the spheres of one block. The near root always faces
+    // the ray, so unlike planes there is no front face test to make.
+    u32 IntersectBlock(u32 block, Ray& r, f32 tMin, f32& tMax, bool anyHit)
+    {
+        u32 result = NoHit;
+        lane_f32 originX = LaneFloatSetAll(r.origin.x);
+        lane_f32 originY = LaneFloatSetAll(r.origin.y);
+        lane_f32 originZ = LaneFloatSetAll(r.origin.z);
+        lane_f32 directionX = LaneFloatSetAll(r.direction.x);
+        lane_f32 directionY = LaneFloatSetAll(r.direction.y);
+        lane_f32 directionZ = LaneFloatSetAll(r.direction.z);
+        lane_f32 a = LaneFloatSetAll(r.direction.LengthSquared());
+        lane_f32 zero = LaneFloatSetAll(0.0f);
+        lane_f32 wideTMin = LaneFloatSetAll(tMin);
+        lane_f32 wideTMax = LaneFloatSetAll(tMax);
+
+        u32 first = block * BlockSize;
+        u32 last = Min(first + BlockSize, Count());
+        for(u32 i = first; i < last; i += LANE_WIDTH)
+        {
+            // NOTE(mevex): Same math as Sphere::Hit, LANE_WIDTH spheres at a time
+            lane_f32 coX = LaneFloatSubtract(originX, LaneFloatLoad(&centerX[i]));
+            lane_f32 coY = LaneFloatSubtract(originY, LaneFloatLoad(&centerY[i]));
+            lane_f32 coZ = LaneFloatSubtract(originZ, LaneFloatLoad(&centerZ[i]));
+            lane_f32 halfB = LaneFloatAdd(LaneFloatMultiply(coX, directionX), LaneFloatAdd(LaneFloatMultiply(coY, directionY), LaneFloatMultiply(coZ, directionZ)));
+            lane_f32 coLengthSquared = LaneFloatAdd(LaneFloatMultiply(coX, coX), LaneFloatAdd(LaneFloatMultiply(coY, coY), LaneFloatMultiply(coZ, coZ)));
+            lane_f32 c = LaneFloatSubtract(coLengthSquared, LaneFloatLoad(&radiusSquared[i]));
+            lane_f32 discriminant = LaneFloatSubtract(LaneFloatMultiply(halfB, halfB), LaneFloatMultiply(a, c));
+
+            // NOTE(mevex): Most rays miss every sphere of a block, the square root and the division are skipped then
+            lane_mask crossed = LaneFloatGreater(discriminant, zero);
+            if(!LaneMaskBits(crossed))
+                continue;
+            lane_f32 root = LaneFloatDivide(LaneFloatSubtract(LaneFloatSubtract(zero, halfB), LaneFloatSqrt(discriminant)), a);
+
+            lane_mask valid = LaneMaskAnd(crossed, LaneMaskAnd(LaneFloatGreaterEqual(root, wideTMin), LaneFloatLessEqual(root, wideTMax)));
+            u32 bits = LaneMaskBits(valid);
+            if(last - i < LANE_WIDTH)
+                bits &= (1u << (last - i)) - 1;
+            if(!bits)
+                continue;
+
+            f32 roots[LANE_WIDTH];
+            LaneFloatStore(roots, root);
+            while(bits)
+            {
+                u32 lane = LowestBitIndex(bits);
+                bits &= bits - 1;
+                if(roots[lane] <= tMax)
+                {
+                    tMax = roots[lane];
+                    result = i + lane;
+                    if(anyHit)
+                        return result;
+                }
+            }
+            wideTMax = LaneFloatSetAll(tMax);
+        }
+        return result;
+    }
+
+    bool Hit(Ray& r, f32 tMin, f32& tMax, HitRecord& rec, Hittable **object = 0)
+    {
+        u32 i = Intersect(r, tMin, tMax, false);
+        if(i == NoHit)
+            return false;
+
+        SetRecord(i, r, tMax, rec);
+        if(object)
+            *object = source[i];
+        return true;
+    }
+
+    inline void SetRecord(u32 i, Ray& r, f32 t, HitRecord& rec)
+    {
+        p3 center(centerX[i], centerY[i], centerZ[i]);
+        rec.p = r.At(t);
+        rec.t = t;
+        v3 outNormal = (rec.p - center) / radius[i];
+        rec.SetFaceNormal(r, outNormal);
+        rec.material = materials[i];
+    }
+
+    size_t MemorySize()
+    {
+        size_t result = source.capacity() * sizeof(Sphere *) + centerX.capacity() * 5 * sizeof(f32) +
+                        materials.capacity() * sizeof(Material *) + blockBounds.capacity() * sizeof(AABB);
+        return result;
+    }
+};
+
+struct PlaneList
+{
+    enum
+    {
+        NoHit = 0xFFFFFFFF,
+    };
+
+    vector<Plane *> source;
+    // NOTE(mevex): One entry per plane, padded to a multiple of LANE_WIDTH
+    vector<f32> pointX, pointY, pointZ, normalX, normalY, normalZ;
+    vector<Material *> materials;
+
+    inline u32 Count() { return (u32)source.size(); }
+    inline u32 Padded() { return (Count() + LANE_WIDTH - 1) / LANE_WIDTH * LANE_WIDTH; }
+
+    inline bool EntryChanged(u32 i)
+    {
+        Plane *p = source[i];
+        bool result = pointX[i] != p->point.x || pointY[i] != p->point.y || pointZ[i] != p->point.z ||
+                      normalX[i] != p->normal.x || normalY[i] != p->normal.y || normalZ[i] != p->normal.z || materials[i] != p->material;
+        return result;
+    }
+
+    void Build(vector<Plane *>& planes)
+    {
+        source = planes;
+        Refresh();
+    }
+
+    // NOTE(mevex): True if a plane moved or changed material since the last Refresh
+    bool Changed()
+    {
+        if(pointX.size() != Padded())
+            return true;
+        for(u32 i = 0; i < Count(); i++)
+        {
+            if(EntryChanged(i))
+                return true;
+        }
+        return false;
+    }
+
+    // NOTE(mevex): Copies the planes that changed, see SphereList::Refresh. Returns Changed().
+    bool Refresh()
+    {
+        u32 count = Count();
+        u32 padded = Padded();
+        bool resized = pointX.size() != padded;
+        if(resized)
+        {
+            pointX.assign(padded, 0);
+            pointY.assign(padded, 0);
+            pointZ.assign(padded, 0);
+            normalX.assign(padded, 0);
+            normalY.assign(padded, 0);
+            normalZ.assign(padded, 0);
+            materials.assign(padded, 0);
+        }
+        bool result = resized;
+        for(u32 i = 0; i < count; i++)
+        {
+            if(!resized && !EntryChanged(i))
+                continue;
+            Plane *p = source[i];
+            pointX[i] = p->point.x;
+            pointY[i] = p->point.y;
+            pointZ[i] = p->point.z;
+            normalX[i] = p->normal.x;
+            normalY[i] = p->normal.y;
+            normalZ[i] = p->normal.z;
+            materials[i] = p->material;
+            result = true;
+        }
+        return result;
+    }
+
+    // NOTE(mevex): Index of the nearest plane hit in [tMin, tMax], tMax is lowered to it.
+    // frontOnly skips the planes seen from behind, like Scene::Hit does with every object.
+    u32 Intersect(Ray& r, f32 tMin, f32& tMax, bool anyHit, bool frontOnly)
+    {
+        u32 result = NoHit;
+        u32 count = Count();
+        lane_f32 originX = LaneFloatSetAll(r.origin.x);
+        lane_f32 originY = LaneFloatSetAll(r.origin.y);
+        lane_f32 originZ = LaneFloatSetAll(r.origin.z);
+        lane_f32 directionX = LaneFloatSetAll(r.direction.x);
+        lane_f32 directionY = LaneFloatSetAll(r.direction.y);
+        lane_f32 directionZ = LaneFloatSetAll(r.direction.z);
+        lane_f32 zero = LaneFloatSetAll(ZERO);
+        lane_f32 zeroNegated = LaneFloatSetAll(-ZERO);
+        lane_f32 wideTMin = LaneFloatSetAll(tMin);
+        for(u32 i = 0; i < count; i += LANE_WIDTH)
+        {
+            lane_f32 nX = LaneFloatLoad(&normalX[i]);
+            lane_f32 nY = LaneFloatLoad(&normalY[i]);
+            lane_f32 nZ = LaneFloatLoad(&normalZ[i]);
+            lane_f32 denom = LaneFloatAdd(LaneFloatMultiply(directionX, nX), LaneFloatAdd(LaneFloatMultiply(directionY, nY), LaneFloatMultiply(directionZ, nZ)));
+            lane_f32 poX = LaneFloatSubtract(LaneFloatLoad(&pointX[i]), originX);
+            lane_f32 poY = LaneFloatSubtract(LaneFloatLoad(&pointY[i]), originY);
+            lane_f32 poZ = LaneFloatSubtract(LaneFloatLoad(&pointZ[i]), originZ);
+            lane_f32 num = LaneFloatAdd(LaneFloatMultiply(poX, nX), LaneFloatAdd(LaneFloatMultiply(poY, nY), LaneFloatMultiply(poZ, nZ)));
+            lane_f32 t = LaneFloatDivide(num, denom);
+
+            lane_mask facing = frontOnly ? LaneFloatLess(denom, zeroNegated) : LaneMaskOr(LaneFloatLess(denom, zeroNegated), LaneFloatGreater(denom, zero));
+            lane_mask valid = LaneMaskAnd(facing, LaneMaskAnd(LaneFloatGreaterEqual(t, wideTMin), LaneFloatLessEqual(t, LaneFloatSetAll(tMax))));
+            u32 bits = LaneMaskBits(valid);
+            if(count - i < LANE_WIDTH)
+                bits &= (1u << (count - i)) - 1;
+
+            f32 ts[LANE_WIDTH];
+            LaneFloatStore(ts, t);
+            while(bits)
+            {
+                u32 lane = LowestBitIndex(bits);
+                bits &= bits - 1;
+                if(ts[lane] <= tMax)
+                {
+                    tMax = ts[lane];
+                    result = i + lane;
+                    if(anyHit)
+                        return result;
+                }
+            }
+        }
+        return result;
+    }
+
+    bool Hit(Ray& r, f32 tMin, f32& tMax, HitRecord& rec, bool frontOnly, Hittable **object = 0)
+    {
+        u32 i = Intersect(r, tMin, tMax, false, frontOnly);
+        if(i == NoHit)
+            return false;
+
+        v3 normal(normalX[i], normalY[i], normalZ[i]);
+        rec.p = r.At(tMax);
+        rec.t = tMax;
+        rec.SetFaceNormal(r, normal);
+        rec.material = materials[i];
+        if(object)
+            *object = source[i];
+        return true;
+    }
+
+    size_t MemorySize()
+    {
+        size_t result = source.capacity() * sizeof(Plane *) + pointX.capacity() * 6 * sizeof(f32) + materials.capacity() * sizeof(Material *);
+        return result;
+    }
+};
+
+#endif //SHAPES_H
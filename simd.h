@@ -12,6 +12,23 @@
 
 // Type casting
 #define WideCastFloatToInt(a) _mm_castps_si128(a)
+#define WideCastIntToFloat(a) _mm_castsi128_ps(a)
+
+// Conversion
+#define WideConvertIntToFloat(a) _mm_cvtepi32_ps(a)
+#define WideTruncateFloatToInt(a) _mm_cvttps_epi32(a)
+#define WideIntPackToI16(a, b) _mm_packs_epi32((a), (b))
+#define WideIntPackToU8(a, b) _mm_packus_epi16((a), (b))
+
+// Memory
+#define WideFloatLoad(ptr) _mm_loadu_ps(ptr)
+#define WideFloatStore(ptr, a) _mm_storeu_ps((ptr), (a))
+#define WideIntLoad(ptr) _mm_loadu_si128((__m128i *)(ptr))
+#define WideIntStore(ptr, a) _mm_storeu_si128((__m128i *)(ptr), (a))
+// NOTE(mevex): Four consecutive bytes zero extended to four 32-bit lanes
+#define WideIntLoadU8x4(ptr) _mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(i32 *)(ptr)))
+// NOTE(mevex): Asks for the cache line of ptr without waiting for it
+#define Prefetch(ptr) _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
 
 // Math
 #define WideFloatAdd(a, b) _mm_add_ps((a), (b))
@@ -22,6 +39,30 @@
 #define WideFloatSqrt(a) _mm_sqrt_ps(a)
 #define WideFloatInvertSign(a) _mm_sub_ps(_mm_set1_ps(0.0f),a)
 #define WideFloatSquare(a) WideFloatMultiply(a, a)
+#define WideFloatMin(a, b) _mm_min_ps((a), (b))
+#define WideFloatMax(a, b) _mm_max_ps((a), (b))
+// NOTE(mevex): Flips the sign bit, -0 for 0 like the scalar minus
+#define WideFloatNegate(a) _mm_xor_ps((a), _mm_set1_ps(-0.0f))
+#define WideFloatAbs(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), (a))
+
+// NOTE(mevex): 12 bit approximations of 1/a and 1/sqrt(a), see WideFloatReciprocalFast in v3.h
+#define WideFloatReciprocalApprox(a) _mm_rcp_ps(a)
+#define WideFloatRSqrtApprox(a) _mm_rsqrt_ps(a)
+
+// NOTE(mevex): Lane 0 only, the other lanes are the ones of a
+#define WideFloatFirst(a) _mm_cvtss_f32(a)
+#define WideFloatSetFirst(a) _mm_set_ss(a)
+#define WideFloatAddFirst(a, b) _mm_add_ss((a), (b))
+#define WideFloatSqrtFirst(a) _mm_sqrt_ss(a)
+
+// Shuffle
+#define WideFloatBroadcastLane(a, lane) _mm_shuffle_ps((a), (a), _MM_SHUFFLE((lane), (lane), (lane), (lane)))
+// NOTE(mevex): Lanes x, y, z and w of a, in this order
+#define WideFloatShuffle(a, x, y, z, w) _mm_shuffle_ps((a), (a), _MM_SHUFFLE((w), (z), (y), (x)))
+// NOTE(mevex): Lanes 2 and 3 of a in lanes 0 and 1
+#define WideFloatMoveHighToLow(a) _mm_movehl_ps((a), (a))
+// NOTE(mevex): Lane i of a, b, c and d goes to the i-th of them, in place
+#define WideFloatTranspose(a, b, c, d) _MM_TRANSPOSE4_PS((a), (b), (c), (d))
 
 // Set
 #define WideFloatSetAll(a) _mm_set1_ps(a)
@@ -36,6 +77,8 @@
 #define WideFloatNotLess(a, b) _mm_cmpnlt_ps((a), (b))
 #define WideIntTestAllZeros(mask, a) _mm_test_all_zeros((mask), (a))
 #define WideIntTestAllOnes(a) _mm_test_all_ones(a)
+// NOTE(mevex): Sign bit of every lane, lane 0 in bit 0
+#define WideFloatMoveMask(a) _mm_movemask_ps(a)
 
 // Boolean
 #define WideFloatOr(a, b) _mm_or_ps((a), (b))
@@ -44,4 +87,141 @@
 #define WideIntOr(a, b) _mm_or_si128((a), (b))
 #define WideIntAnd(a, b) _mm_and_si128((a), (b))
 
+// NOTE(mevex): a in the lanes where mask is set, b in the others
+#define WideFloatSelect(mask, a, b) _mm_blendv_ps((b), (a), (mask))
+#define WideIntSelect(mask, a, b) _mm_castps_si128(_mm_blendv_ps(_mm_castsi128_ps(b), _mm_castsi128_ps(a), (mask)))
+
+// NOTE(mevex): 8 floats in one AVX register, or in two SSE ones without AVX. Used by v3x8 (see v3.h).
+#if defined(__AVX__)
+#include <immintrin.h>
+#define wide8_f32 __m256
+
+#define Wide8FloatCombine(low, high) _mm256_set_m128((high), (low))
+#define Wide8FloatLow(a) _mm256_castps256_ps128(a)
+#define Wide8FloatHigh(a) _mm256_extractf128_ps((a), 1)
+#define Wide8FloatSetAll(a) _mm256_set1_ps(a)
+#define Wide8FloatAdd(a, b) _mm256_add_ps((a), (b))
+#define Wide8FloatSubtract(a, b) _mm256_sub_ps((a), (b))
+#define Wide8FloatMultiply(a, b) _mm256_mul_ps((a), (b))
+#define Wide8FloatDivide(a, b) _mm256_div_ps((a), (b))
+#define Wide8FloatSqrt(a) _mm256_sqrt_ps(a)
+#define Wide8FloatNegate(a) _mm256_xor_ps((a), _mm256_set1_ps(-0.0f))
+#define Wide8FloatReciprocalApprox(a) _mm256_rcp_ps(a)
+#define Wide8FloatRSqrtApprox(a) _mm256_rsqrt_ps(a)
+#define Wide8FloatGreater(a, b) _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
+#define Wide8FloatLess(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define Wide8FloatSelect(mask, a, b) _mm256_blendv_ps((b), (a), (mask))
+#define Wide8FloatMoveMask(a) (u32)_mm256_movemask_ps(a)
+#else
+struct wide8_f32
+{
+    __m128 low, high;
+};
+
+#define WIDE8_UNARY(name, operation) inline wide8_f32 name(wide8_f32 a) { return {operation(a.low), operation(a.high)}; }
+#define WIDE8_BINARY(name, operation) inline wide8_f32 name(wide8_f32 a, wide8_f32 b) { return {operation(a.low, b.low), operation(a.high, b.high)}; }
+
+inline wide8_f32 Wide8FloatCombine(__m128 low, __m128 high) { return {low, high}; }
+inline __m128 Wide8FloatLow(wide8_f32 a) { return a.low; }
+inline __m128 Wide8FloatHigh(wide8_f32 a) { return a.high; }
+inline wide8_f32 Wide8FloatSetAll(float a) { return {_mm_set1_ps(a), _mm_set1_ps(a)}; }
+WIDE8_BINARY(Wide8FloatAdd, _mm_add_ps)
+WIDE8_BINARY(Wide8FloatSubtract, _mm_sub_ps)
+WIDE8_BINARY(Wide8FloatMultiply, _mm_mul_ps)
+WIDE8_BINARY(Wide8FloatDivide, _mm_div_ps)
+WIDE8_UNARY(Wide8FloatSqrt, _mm_sqrt_ps)
+WIDE8_UNARY(Wide8FloatNegate, WideFloatNegate)
+WIDE8_UNARY(Wide8FloatReciprocalApprox, _mm_rcp_ps)
+WIDE8_UNARY(Wide8FloatRSqrtApprox, _mm_rsqrt_ps)
+WIDE8_BINARY(Wide8FloatGreater, _mm_cmpgt_ps)
+WIDE8_BINARY(Wide8FloatLess, _mm_cmplt_ps)
+inline wide8_f32 Wide8FloatSelect(wide8_f32 mask, wide8_f32 a, wide8_f32 b)
+{
+    return {_mm_blendv_ps(b.low, a.low, mask.low), _mm_blendv_ps(b.high, a.high, mask.high)};
+}
+inline unsigned Wide8FloatMoveMask(wide8_f32 a) { return (unsigned)(_mm_movemask_ps(a.low) | (_mm_movemask_ps(a.high) << 4)); }
+
+#undef WIDE8_UNARY
+#undef WIDE8_BINARY
+#endif
+
+// NOTE(mevex): Lanes of the structure of arrays kernels (see shapes.h), as wide as the instruction
+// set the build targets: 16 with AVX-512, 8 with AVX and 4 with SSE. Comparisons give a lane_mask,
+// LaneMaskBits turns it into one bit per lane with lane 0 in bit 0.
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define LANE_WIDTH 16
+#define lane_f32 __m512
+#define lane_mask __mmask16
+
+#define LaneFloatLoad(ptr) _mm512_loadu_ps(ptr)
+#define LaneFloatStore(ptr, a) _mm512_storeu_ps((ptr), (a))
+#define LaneFloatSetAll(a) _mm512_set1_ps(a)
+#define LaneFloatAdd(a, b) _mm512_add_ps((a), (b))
+#define LaneFloatSubtract(a, b) _mm512_sub_ps((a), (b))
+#define LaneFloatMultiply(a, b) _mm512_mul_ps((a), (b))
+#define LaneFloatDivide(a, b) _mm512_div_ps((a), (b))
+#define LaneFloatSqrt(a) _mm512_sqrt_ps(a)
+#define LaneFloatGreater(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GT_OQ)
+#define LaneFloatLess(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_LT_OQ)
+#define LaneFloatGreaterEqual(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GE_OQ)
+#define LaneFloatLessEqual(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_LE_OQ)
+#define LaneMaskAnd(a, b) (lane_mask)((a) & (b))
+#define LaneMaskOr(a, b) (lane_mask)((a) | (b))
+#define LaneMaskBits(a) (u32)(a)
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define LANE_WIDTH 8
+#define lane_f32 __m256
+#define lane_mask __m256
+
+#define LaneFloatLoad(ptr) _mm256_loadu_ps(ptr)
+#define LaneFloatStore(ptr, a) _mm256_storeu_ps((ptr), (a))
+#define LaneFloatSetAll(a) _mm256_set1_ps(a)
+#define LaneFloatAdd(a, b) _mm256_add_ps((a), (b))
+#define LaneFloatSubtract(a, b) _mm256_sub_ps((a), (b))
+#define LaneFloatMultiply(a, b) _mm256_mul_ps((a), (b))
+#define LaneFloatDivide(a, b) _mm256_div_ps((a), (b))
+#define LaneFloatSqrt(a) _mm256_sqrt_ps(a)
+#define LaneFloatGreater(a, b) _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
+#define LaneFloatLess(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define LaneFloatGreaterEqual(a, b) _mm256_cmp_ps((a), (b), _CMP_GE_OQ)
+#define LaneFloatLessEqual(a, b) _mm256_cmp_ps((a), (b), _CMP_LE_OQ)
+#define LaneMaskAnd(a, b) _mm256_and_ps((a), (b))
+#define LaneMaskOr(a, b) _mm256_or_ps((a), (b))
+#define LaneMaskBits(a) (u32)_mm256_movemask_ps(a)
+#else
+#define LANE_WIDTH 4
+#define lane_f32 __m128
+#define lane_mask __m128
+
+#define LaneFloatLoad(ptr) _mm_loadu_ps(ptr)
+#define LaneFloatStore(ptr, a) _mm_storeu_ps((ptr), (a))
+#define LaneFloatSetAll(a) _mm_set1_ps(a)
+#define LaneFloatAdd(a, b) _mm_add_ps((a), (b))
+#define LaneFloatSubtract(a, b) _mm_sub_ps((a), (b))
+#define LaneFloatMultiply(a, b) _mm_mul_ps((a), (b))
+#define LaneFloatDivide(a, b) _mm_div_ps((a), (b))
+#define LaneFloatSqrt(a) _mm_sqrt_ps(a)
+#define LaneFloatGreater(a, b) _mm_cmpgt_ps((a), (b))
+#define LaneFloatLess(a, b) _mm_cmplt_ps((a), (b))
+#define LaneFloatGreaterEqual(a, b) _mm_cmpge_ps((a), (b))
+#define LaneFloatLessEqual(a, b) _mm_cmple_ps((a), (b))
+#define LaneMaskAnd(a, b) _mm_and_ps((a), (b))
+#define LaneMaskOr(a, b) _mm_or_ps((a), (b))
+#define LaneMaskBits(a) (u32)_mm_movemask_ps(a)
+#endif
+
+// NOTE(mevex): Index of the lowest set bit, bits must not be 0
+inline u32 LowestBitIndex(u32 bits)
+{
+#ifdef _MSC_VER
+    unsigned long result;
+    _BitScanForward(&result, bits);
+    return (u32)result;
+#else
+    return (u32)__builtin_ctz(bits);
+#endif
+}
+
 #endif //SIMD_H
\ No newline at end of file
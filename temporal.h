@@ -0,0 +1,249 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include "main.h"
+#include <unordered_map>
+
+// NOTE(mevex): Reuse of the samples of the previous frame of an animation. After a frame is rendered
+// the first hit through the center of every pixel is found again (Capture) and moved back to where it
+// was in the previous frame: the objects only move by translation here, so the hit moves back with its
+// object, and the camera of the previous frame says which of its pixels saw it. What those pixels had
+// accumulated is added to the new samples of the pixel (Reuse), as long as they saw the same object, the
+// same surface (the hit is on the plane of theirs) and the same side of it (their normals agree).
+// Only diffuse surfaces are reused, what the others show changes with the direction they are seen from.
+// Disoccluded pixels, the ones that see something the previous frame didn't, start from their new
+// samples only. The history is also clipped to the mean and deviation of the new samples around the
+// pixel (ClipSigmas of them): the shadows and the light that move with the objects would trail
+// behind them otherwise.
+//
+// The history of a pixel counts as at most maxSamples samples, so old light fades out: a pixel with f
+// new samples per frame keeps f / (f + maxSamples) of new light every frame.
+class TemporalHistory
+{
+    public:
+
+    // NOTE(mevex): A hit of the previous frame is the same surface if the new one is closer to its
+    // plane than PlaneTolerance times the depth and their normals are less than ~25 degrees apart
+    static constexpr f32 PlaneTolerance = 0.01f;
+    static constexpr f32 NormalTolerance = 0.9f;
+    static constexpr f32 ClipSigmas = 1.5f;
+
+    struct FirstHit
+    {
+        p3 p;
+        v3 normal;
+        // NOTE(mevex): 0 for a miss or a surface that can't be reused
+        Hittable *object;
+    };
+
+    i32 maxSamples = 8;
+
+    inline bool Empty()
+    {
+        return previousHits.empty();
+    }
+
+    // NOTE(mevex): First hits of the frame just rendered with camera, through the scene accelerators like
+    // the camera rays, Scene::Update must have run
+    void Capture(Scene& scene, Camera& camera, i32 newWidth, i32 newHeight, WorkerPool *pool)
+    {
+        width = newWidth;
+        height = newHeight;
+        hits.resize((size_t)width * height);
+        f32 invWidth = 1.0f / (f32)(width - 1);
+        f32 invHeight = 1.0f / (f32)(height - 1);
+        auto captureRow = [&](i32 y)
+        {
+            for(i32 x = 0; x < width; x++)
+            {
+                Ray r = camera.GetRay(((f32)x + 0.5f) * invWidth, ((f32)y + 0.5f) * invHeight);
+                FirstHit& hit = hits[(size_t)y * width + x];
+                hit.object = 0;
+                HitRecord rec;
+                Hittable *obj = 0;
+                if(scene.Hit(r, ZERO, INFINITY, rec, &obj))
+                {
+                    hit.p = rec.p;
+                    hit.normal = Unit(rec.normal);
+                    hit.object = (rec.material && rec.material->IsDiffuse()) ? obj : 0;
+                }
+            }
+        };
+        if(pool)
+            pool->ParallelFor(height, captureRow);
+        else
+        {
+            for(i32 y = 0; y < height; y++)
+                captureRow(y);
+        }
+
+        offsets.clear();
+        for(Hittable *obj : scene.objects)
+            offsets.push_back({obj, Offset(obj)});
+    }
+
+    // NOTE(mevex): Adds to the canvas the history of the previous frame for every pixel that can take
+    // it, Capture must have run for this frame. Returns how many pixels took it.
+    u32 Reuse(Canvas& canvas, WorkerPool *pool)
+    {
+        if(Empty() || canvas.width != width || canvas.height != height)
+            return 0;
+
+        p3 position = previousCamera.position;
+        v3 forward = previousCamera.vpLowerLeftCorner + 0.5f * previousCamera.vpHorizontal + 0.5f * previousCamera.vpVertical - position;
+        v3 horizontal = previousCamera.vpHorizontal * (1.0f / previousCamera.vpHorizontal.LengthSquared());
+        v3 vertical = previousCamera.vpVertical * (1.0f / previousCamera.vpVertical.LengthSquared());
+
+        // NOTE(mevex): How much every object that was already there moved since the previous frame
+        std::unordered_map<Hittable *, v3> previousOffset(previousOffsets.begin(), previousOffsets.end());
+        std::unordered_map<Hittable *, v3> motions;
+        for(auto& current : offsets)
+        {
+            auto found = previousOffset.find(current.first);
+            if(found != previousOffset.end())
+                motions[current.first] = current.second - found->second;
+        }
+
+        // NOTE(mevex): The new samples alone, before any history goes in the canvas
+        freshColors.resize(hits.size());
+        for(i32 y = 0; y < height; y++)
+        {
+            for(i32 x = 0; x < width; x++)
+            {
+                AccumPixel& pixel = canvas.accum[canvas.PixelIndex(x, y)];
+                f32 scale = pixel.samples ? 1.0f / pixel.samples : 0;
+                freshColors[(size_t)y * width + x] = Color(pixel.r, pixel.g, pixel.b) * scale;
+            }
+        }
+
+        std::atomic<u32> reused(0);
+        auto reuseRow = [&](i32 y)
+        {
+            u32 rowReused = 0;
+            for(i32 x = 0; x < width; x++)
+            {
+                FirstHit& hit = hits[(size_t)y * width + x];
+                auto found = hit.object ? motions.find(hit.object) : motions.end();
+                if(found == motions.end())
+                    continue;
+                v3 motion = found->second;
+
+                // NOTE(mevex): Where the previous camera saw the hit, in pixels with the centers on integers
+                p3 p = hit.p - motion;
+                v3 q = p - position;
+                f32 z = Dot(q, forward);
+                if(z <= 0)
+                    continue;
+                f32 px = (Dot(q, horizontal) / z + 0.5f) * (f32)(width - 1) - 0.5f;
+                f32 py = (Dot(q, vertical) / z + 0.5f) * (f32)(height - 1) - 0.5f;
+                i32 x0 = (i32)floorf(px), y0 = (i32)floorf(py);
+                f32 fx = px - (f32)x0, fy = py - (f32)y0;
+
+                // NOTE(mevex): Bilinear over the pixels that saw the same surface
+                Color color(0, 0, 0);
+                f32 samples = 0;
+                f32 weights = 0;
+                for(i32 tap = 0; tap < 4; tap++)
+                {
+                    i32 tx = x0 + (tap & 1), ty = y0 + (tap >> 1);
+                    if(tx < 0 || ty < 0 || tx >= width || ty >= height)
+                        continue;
+                    FirstHit& previous = previousHits[(size_t)ty * width + tx];
+                    if(previous.object != hit.object || Dot(previous.normal, hit.normal) < NormalTolerance ||
+                       Abs(Dot(previous.normal, p - previous.p)) > PlaneTolerance * z)
+                        continue;
+
+                    f32 weight = ((tap & 1) ? fx : 1.0f - fx) * ((tap >> 1) ? fy : 1.0f - fy);
+                    size_t index = (size_t)ty * width + tx;
+                    color += weight * previousColors[index];
+                    samples += weight * previousSamples[index];
+                    weights += weight;
+                }
+                if(weights <= 0)
+                    continue;
+
+                u32 count = (u32)Min(samples / weights, (f32)maxSamples);
+                if(!count)
+                    continue;
+
+                // NOTE(mevex): Mean and deviation of the new samples of the 3x3 pixels around
+                Color sum(0, 0, 0), squares(0, 0, 0);
+                f32 neighbours = 0;
+                for(i32 ny = Max(y - 1, 0); ny <= Min(y + 1, height - 1); ny++)
+                {
+                    for(i32 nx = Max(x - 1, 0); nx <= Min(x + 1, width - 1); nx++)
+                    {
+                        Color mean = freshColors[(size_t)ny * width + nx];
+                        sum += mean;
+                        squares += mean * mean;
+                        neighbours++;
+                    }
+                }
+                color = color * (1.0f / weights);
+                Color mean = sum * (1.0f / neighbours);
+                for(u32 c = 0; c < 3; c++)
+                {
+                    f32 deviation = sqrtf(Max(squares.e[c] / neighbours - mean.e[c] * mean.e[c], 0.0f));
+                    color.e[c] = Clamp(color.e[c], mean.e[c] - ClipSigmas * deviation, mean.e[c] + ClipSigmas * deviation);
+                }
+                canvas.AddSamples(x, y, color * (f32)count, count);
+                rowReused++;
+            }
+            reused += rowReused;
+        };
+        if(pool)
+            pool->ParallelFor(height, reuseRow);
+        else
+        {
+            for(i32 y = 0; y < height; y++)
+                reuseRow(y);
+        }
+        return reused;
+    }
+
+    // NOTE(mevex): Keeps the canvas, the first hits and the camera of the frame as the history of the next one
+    void Store(Canvas& canvas, Camera& camera)
+    {
+        previousColors.resize(hits.size());
+        previousSamples.resize(hits.size());
+        for(i32 y = 0; y < height; y++)
+        {
+            for(i32 x = 0; x < width; x++)
+            {
+                AccumPixel& pixel = canvas.accum[canvas.PixelIndex(x, y)];
+                f32 scale = pixel.samples ? 1.0f / pixel.samples : 0;
+                previousColors[(size_t)y * width + x] = Color(pixel.r, pixel.g, pixel.b) * scale;
+                previousSamples[(size_t)y * width + x] = pixel.samples;
+            }
+        }
+        previousHits.swap(hits);
+        previousOffsets.swap(offsets);
+        previousCamera = camera;
+    }
+
+    private:
+
+    i32 width = 0, height = 0;
+    vector<FirstHit> hits;
+    vector<FirstHit> previousHits;
+    vector<Color> previousColors;
+    vector<Color> freshColors;
+    vector<u32> previousSamples;
+    // NOTE(mevex): Where every object was moved to, see Offset
+    vector<std::pair<Hittable *, v3>> offsets;
+    vector<std::pair<Hittable *, v3>> previousOffsets;
+    Camera previousCamera = Camera(p3(0, 0, 0), v3(0, 0, -1), v3(0, 1, 0), 90, 1);
+
+    // NOTE(mevex): Meshes are moved by translation (see Mesh::Move), spheres by their center,
+    // the rest doesn't move
+    static v3 Offset(Hittable *obj)
+    {
+        if(Mesh *mesh = dynamic_cast<Mesh *>(obj))
+            return mesh->translation;
+        if(Sphere *sphere = dynamic_cast<Sphere *>(obj))
+            return sphere->center;
+        return v3(0, 0, 0);
+    }
+};
+
+#endif //TEMPORAL_H
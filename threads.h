@@ -0,0 +1,159 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+// NOTE(mevex): A fixed pool of worker threads that pull jobs from a shared queue.
+// The thread that waits for a batch of work helps executing it, so it is safe
+// to start a ParallelFor from inside another job.
+// Jobs with a higher priority are always picked first, jobs with the same
+// priority run in the order they were added.
+class WorkerPool
+{
+    public:
+
+    typedef std::function<void()> Job;
+
+    struct QueuedJob
+    {
+        i32 priority;
+        u64 sequence;
+        Job job;
+
+        bool operator<(const QueuedJob& other) const
+        {
+            if(priority != other.priority)
+                return priority < other.priority;
+            return sequence > other.sequence;
+        }
+    };
+
+    vector<std::thread> threads;
+    std::priority_queue<QueuedJob> queue;
+    u64 nextSequence = 0;
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    bool quit = false;
+
+    WorkerPool(i32 threadCount = 0)
+    {
+        if(threadCount <= 0)
+            threadCount = Max((i32)std::thread::hardware_concurrency(), 1);
+
+        for(i32 i = 0; i < threadCount; i++)
+            threads.emplace_back([this] { WorkerLoop(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wakeUp.notify_all();
+        for(auto& t : threads)
+            t.join();
+    }
+
+    inline i32 ThreadCount()
+    {
+        return (i32)threads.size();
+    }
+
+    void Add(Job job, i32 priority = 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push({priority, nextSequence++, std::move(job)});
+        }
+        wakeUp.notify_one();
+    }
+
+    // NOTE(mevex): Runs one queued job on the calling thread, returns false if the queue was empty
+    bool RunOne()
+    {
+        Job job;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(queue.empty())
+                return false;
+            job = std::move(const_cast<QueuedJob&>(queue.top()).job);
+            queue.pop();
+        }
+        job();
+        return true;
+    }
+
+    // NOTE(mevex): Calls func(i) for every i in [0, count) and returns when all the calls are done.
+    // Indices are handed out one at a time, so uneven work balances itself. After every index a
+    // helper goes back in the queue, so a batch with a higher priority takes over the threads
+    // as soon as the calls in flight are done.
+    void ParallelFor(i32 count, const std::function<void(i32)>& func, i32 priority = 0)
+    {
+        if(count <= 0)
+            return;
+
+        std::atomic<i32> nextIndex(0);
+        std::atomic<i32> remaining(count);
+
+        i32 helpers = Min(count, ThreadCount()) - 1;
+        std::atomic<i32> activeHelpers(helpers);
+
+        Job helper;
+        helper = [&]
+        {
+            i32 i = nextIndex++;
+            if(i < count)
+            {
+                func(i);
+                --remaining;
+                Add(helper, priority);
+            }
+            else
+                --activeHelpers;
+        };
+
+        for(i32 i = 0; i < helpers; i++)
+            Add(helper, priority);
+
+        for(i32 i = nextIndex++; i < count; i = nextIndex++)
+        {
+            func(i);
+            --remaining;
+        }
+
+        // NOTE(mevex): The helpers reference this stack frame, so wait until all
+        // of them have started and finished, running other jobs in the meantime
+        while(remaining > 0 || activeHelpers > 0)
+        {
+            if(!RunOne())
+                std::this_thread::yield();
+        }
+    }
+
+    private:
+
+    void WorkerLoop()
+    {
+        for(;;)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeUp.wait(lock, [this] { return quit || !queue.empty(); });
+                if(quit && queue.empty())
+                    return;
+                job = std::move(const_cast<QueuedJob&>(queue.top()).job);
+                queue.pop();
+            }
+            job();
+        }
+    }
+};
+
+#endif //THREADS_H
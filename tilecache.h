@@ -0,0 +1,173 @@
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include "main.h"
+#include <algorithm>
+#include <filesystem>
+
+// NOTE(mevex): Finished tiles kept on disk across runs. A tile is stored under a key that hashes
+// everything its accumulated samples depend on (the scene, the camera, the rect of the tile, the
+// sampling settings and the seed, see RenderJob::TileKey), so a later render that asks for the same
+// key gets back the exact values it would have rendered: the accum and halfAccum rows of the tile.
+// The key has the whole scene in it, so any change to the scene misses every tile, even the tiles
+// where the change doesn't show: the bounces can carry it anywhere, and only the whole scene is exact.
+// One file per tile, named after the key. Load touches the file, so Trim evicts the tiles that were
+// used the longest time ago until the cache fits in maxBytes.
+class TileCache
+{
+    public:
+
+    enum
+    {
+        Magic = 0x43545452, // "RTTC"
+        // NOTE(mevex): Part of the keys, bump it when what a render gives for the same settings changes
+        Version = 1,
+    };
+
+    struct Header
+    {
+        u32 magic;
+        u32 version;
+        u64 key;
+        i32 width;
+        i32 height;
+    };
+
+    std::filesystem::path directory;
+    u64 maxBytes = 0;
+
+    // NOTE(mevex): Returns false if the directory can't be made, nothing is cached then
+    bool Open(const char *path, u64 newMaxBytes)
+    {
+        std::error_code error;
+        directory = path;
+        maxBytes = newMaxBytes;
+        std::filesystem::create_directories(directory, error);
+        return std::filesystem::is_directory(directory, error);
+    }
+
+    // NOTE(mevex): Fills the pixels in [minX, maxX)x[minY, maxY) of the canvas if the key is cached,
+    // otherwise they are untouched
+    bool Load(u64 key, Canvas& canvas, i32 minX, i32 minY, i32 maxX, i32 maxY)
+    {
+        std::filesystem::path path = FilePath(key);
+        FILE *file = fopen(path.string().c_str(), "rb");
+        if(!file)
+            return false;
+
+        i32 width = maxX - minX;
+        i32 height = maxY - minY;
+        Header header = {};
+        bool result = fread(&header, sizeof(header), 1, file) == 1 &&
+            header.magic == Magic && header.version == Version && header.key == key &&
+            header.width == width && header.height == height;
+
+        vector<AccumPixel> pixels;
+        if(result)
+        {
+            size_t count = 2 * (size_t)width * height;
+            pixels.resize(count);
+            result = fread(pixels.data(), sizeof(AccumPixel), count, file) == count;
+        }
+        fclose(file);
+        if(!result)
+            return false;
+
+        AccumPixel *half = pixels.data() + (size_t)width * height;
+        for(i32 y = 0; y < height; y++)
+        {
+            i32 row = canvas.PixelIndex(minX, minY + y);
+            memcpy(canvas.accum + row, pixels.data() + (size_t)y * width, width * sizeof(AccumPixel));
+            memcpy(canvas.halfAccum + row, half + (size_t)y * width, width * sizeof(AccumPixel));
+        }
+
+        std::error_code error;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+        return true;
+    }
+
+    // NOTE(mevex): Written to a temporary file and renamed, like the checkpoints, so a render killed
+    // while storing never leaves a broken tile. Several threads can store different keys at once.
+    bool Store(u64 key, Canvas& canvas, i32 minX, i32 minY, i32 maxX, i32 maxY)
+    {
+        i32 width = maxX - minX;
+        i32 height = maxY - minY;
+        Header header = {Magic, Version, key, width, height};
+
+        std::filesystem::path path = FilePath(key);
+        std::filesystem::path tmpPath = path;
+        tmpPath += ".tmp";
+        FILE *file = fopen(tmpPath.string().c_str(), "wb");
+        if(!file)
+            return false;
+
+        bool result = fwrite(&header, sizeof(header), 1, file) == 1;
+        for(i32 y = 0; result && y < height; y++)
+            result = fwrite(canvas.accum + canvas.PixelIndex(minX, minY + y), sizeof(AccumPixel), width, file) == (size_t)width;
+        for(i32 y = 0; result && y < height; y++)
+            result = fwrite(canvas.halfAccum + canvas.PixelIndex(minX, minY + y), sizeof(AccumPixel), width, file) == (size_t)width;
+        result = (fclose(file) == 0) && result;
+
+        std::error_code error;
+        if(result)
+            std::filesystem::rename(tmpPath, path, error);
+        if(!result || error)
+        {
+            std::filesystem::remove(tmpPath, error);
+            return false;
+        }
+        return true;
+    }
+
+    // NOTE(mevex): Removes the least recently used tiles until the cache is not bigger than maxBytes.
+    // Returns how many were removed.
+    u32 Trim()
+    {
+        struct Entry
+        {
+            std::filesystem::path path;
+            std::filesystem::file_time_type time;
+            u64 size;
+        };
+        vector<Entry> entries;
+        u64 total = 0;
+
+        std::error_code error;
+        for(auto& item : std::filesystem::directory_iterator(directory, error))
+        {
+            if(item.path().extension() != ".tile")
+                continue;
+            std::error_code itemError;
+            Entry entry = {item.path(), item.last_write_time(itemError), (u64)item.file_size(itemError)};
+            if(itemError)
+                continue;
+            entries.push_back(entry);
+            total += entry.size;
+        }
+
+        std::sort(entries.begin(), entries.end(), [](Entry& a, Entry& b) { return a.time < b.time; });
+        u32 result = 0;
+        for(Entry& entry : entries)
+        {
+            if(total <= maxBytes)
+                break;
+            if(std::filesystem::remove(entry.path, error))
+            {
+                total -= entry.size;
+                result++;
+            }
+        }
+        return result;
+    }
+
+    private:
+
+    std::filesystem::path FilePath(u64 key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.tile", (unsigned long long)key);
+        return directory / name;
+    }
+};
+
+#endif //TILECACHE_H
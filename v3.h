@@ -4,6 +4,9 @@
 #include "simd.h"
 #include <cmath>
 
+// NOTE(mevex): Every operation works on the whole register, the fourth lane is kept at zero.
+// Each lane does the same float operations the scalar code did, in the same order (Dot adds x and y
+// first, then z), so the results are the same bits. The Fast functions are the exception, see below.
 class v3
 {
     public:
@@ -20,34 +23,25 @@ class v3
             f32 r, g, b;
         };
     };
-    
-    v3(f32 e0 = 0, f32 e1 = 0, f32 e2 = 0) : e{e0, e1, e2} {}
-    
-    inline f32 LengthSquared()
-    {
-        // NOTE(mevex): Dot product of the vector with itself
-        f32 result = e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
-        return result;
-    }
-    
-    inline f32 Length()
-    {
-        f32 result = sqrt(LengthSquared());
-        return result;
-    }
-    
+
+    v3(f32 e0 = 0, f32 e1 = 0, f32 e2 = 0) : packedArray(WideFloatSetIndividual(0.0f, e2, e1, e0)) {}
+    explicit v3(wide_f32 packed) : packedArray(packed) {}
+
+    inline f32 LengthSquared() const;
+    inline f32 Length() const;
+
     inline shared_function v3 Random()
     {
         v3 result = {RandomFloat(), RandomFloat(), RandomFloat()};
         return result;
     }
-    
+
     inline shared_function v3 Random(f32 min, f32 max)
     {
         v3 result = {RandomFloat(min,max), RandomFloat(min,max), RandomFloat(min,max)};
         return result;
     }
-    
+
     shared_function v3 RandomInUnitSphere()
     {
         // NOTE(mevex): This MUST be a sphere to achieve the correct distribution
@@ -58,60 +52,56 @@ class v3
                 return p;
         }
     }
-    
+
     inline shared_function v3 RandomUnitVector();
-    
-    inline bool NearZero() 
+
+    inline bool NearZero() const
     {
-        bool result = (fabs(e[0]) < ZERO) && (fabs(e[1]) < ZERO) && (fabs(e[2]) < ZERO);
+        wide_f32 near = WideFloatLess(WideFloatAbs(packedArray), WideFloatSetAll(ZERO));
+        bool result = (WideFloatMoveMask(near) & 7) == 7;
         return result;
     }
-    
-    inline v3& operator+= (v3& v)
+
+    inline v3& operator+= (const v3& v)
     {
-        e[0] += v.e[0];
-        e[1] += v.e[1];
-        e[2] += v.e[2];
+        packedArray = WideFloatAdd(packedArray, v.packedArray);
         return *this;
     }
-    
+
     inline v3& operator*= (f32 t)
     {
-        e[0] *= t;
-        e[1] *= t;
-        e[2] *= t;
+        packedArray = WideFloatMultiply(packedArray, WideFloatSetAll(t));
         return *this;
     }
 };
 
-inline v3 operator+ (v3& v, v3& w)
+inline v3 operator+ (const v3& v, const v3& w)
 {
-    v3 result;
-    result.packedArray = WideFloatAdd(v.packedArray, w.packedArray);
+    v3 result(WideFloatAdd(v.packedArray, w.packedArray));
     return result;
 }
 
-inline v3 operator- (v3& v, v3& w)
+inline v3 operator- (const v3& v, const v3& w)
 {
-    v3 result = v3(v.e[0] - w.e[0], v.e[1] - w.e[1], v.e[2] - w.e[2]);
+    v3 result(WideFloatSubtract(v.packedArray, w.packedArray));
     return result;
 }
 
-inline v3 operator- (v3& v)
+inline v3 operator- (const v3& v)
 {
-    v3 result = v3(-v.e[0], -v.e[1], -v.e[2]);
+    v3 result(WideFloatNegate(v.packedArray));
     return result;
 }
 
 inline v3 operator* (v3 v, f32 t)
 {
-    v3 result = v3(v.e[0] * t, v.e[1] * t, v.e[2] * t);
+    v3 result(WideFloatMultiply(v.packedArray, WideFloatSetAll(t)));
     return result;
 }
 
 inline v3 operator* (v3 v, v3 u)
 {
-    v3 result = v3(v.e[0] * u.e[0], v.e[1] * u.e[1], v.e[2] * u.e[2]);
+    v3 result(WideFloatMultiply(v.packedArray, u.packedArray));
     return result;
 }
 
@@ -128,39 +118,307 @@ inline v3 operator/ (v3 v, f32 t)
     return result;
 }
 
-inline f32 Dot(v3& v, v3&w)
+inline f32 Dot(const v3& v, const v3& w)
 {
-    f32 result = v.e[0] * w.e[0] + v.e[1] * w.e[1] + v.e[2] * w.e[2];
+    wide_f32 products = WideFloatMultiply(v.packedArray, w.packedArray);
+    wide_f32 sum = WideFloatAddFirst(products, WideFloatShuffle(products, 1, 1, 1, 1));
+    f32 result = WideFloatFirst(WideFloatAddFirst(sum, WideFloatMoveHighToLow(products)));
     return result;
 }
 
-inline v3 Cross(v3& v, v3& w) 
+inline v3 Cross(const v3& v, const v3& w)
 {
-    v3 result = {v.e[1] * w.e[2] - v.e[2] * w.e[1],
-        v.e[2] * w.e[0] - v.e[0] * w.e[2],
-        v.e[0] * w.e[1] - v.e[1] * w.e[0]};
+    // NOTE(mevex): (v.y*w.z - v.z*w.y, v.z*w.x - v.x*w.z, v.x*w.y - v.y*w.x)
+    wide_f32 a = WideFloatMultiply(WideFloatShuffle(v.packedArray, 1, 2, 0, 3), WideFloatShuffle(w.packedArray, 2, 0, 1, 3));
+    wide_f32 b = WideFloatMultiply(WideFloatShuffle(v.packedArray, 2, 0, 1, 3), WideFloatShuffle(w.packedArray, 1, 2, 0, 3));
+    v3 result(WideFloatSubtract(a, b));
     return result;
 }
 
-inline v3  Unit(v3& v)
+inline f32 v3::LengthSquared() const
+{
+    // NOTE(mevex): Dot product of the vector with itself
+    f32 result = Dot(*this, *this);
+    return result;
+}
+
+inline f32 v3::Length() const
+{
+    f32 result = WideFloatFirst(WideFloatSqrtFirst(WideFloatSetFirst(LengthSquared())));
+    return result;
+}
+
+inline v3 Unit(const v3& v)
 {
     v3 result = v / v.Length();
     return result;
 }
 
-inline v3 Reflect(v3& v, v3& n)
+inline v3 Reflect(const v3& v, const v3& n)
 {
     v3 result = v -2.0f*Dot(n, v)*n;
     return result;
 }
 
+// NOTE(mevex): 1/a and 1/sqrt(a) from the 12 bit approximations of the hardware refined by a Newton
+// step, which gets them within a few ulps of the exact ones for less than the cost of a divide or a
+// square root. For what only needs to be about right, like the length of a scatter direction, not for
+// the hit tests.
+inline wide_f32 WideFloatReciprocalFast(wide_f32 a)
+{
+    wide_f32 estimate = WideFloatReciprocalApprox(a);
+    // NOTE(mevex): y + y*(1 - a*y)
+    wide_f32 error = WideFloatSubtract(WideFloatSetAll(1.0f), WideFloatMultiply(a, estimate));
+    wide_f32 result = WideFloatAdd(estimate, WideFloatMultiply(estimate, error));
+    return result;
+}
+
+inline wide_f32 WideFloatRSqrtFast(wide_f32 a)
+{
+    wide_f32 estimate = WideFloatRSqrtApprox(a);
+    // NOTE(mevex): y*(1.5 - 0.5*a*y*y)
+    wide_f32 halfA = WideFloatMultiply(WideFloatSetAll(0.5f), a);
+    wide_f32 result = WideFloatMultiply(estimate, WideFloatSubtract(WideFloatSetAll(1.5f), WideFloatMultiply(halfA, WideFloatSquare(estimate))));
+    return result;
+}
+
+inline f32 ReciprocalFast(f32 a)
+{
+    f32 result = WideFloatFirst(WideFloatReciprocalFast(WideFloatSetAll(a)));
+    return result;
+}
+
+inline f32 RSqrtFast(f32 a)
+{
+    f32 result = WideFloatFirst(WideFloatRSqrtFast(WideFloatSetAll(a)));
+    return result;
+}
+
+inline v3 UnitFast(const v3& v)
+{
+    v3 result = v * RSqrtFast(v.LengthSquared());
+    return result;
+}
+
 inline v3 v3::RandomUnitVector()
 {
-    v3 result = Unit(Random());
+    v3 result = UnitFast(Random());
     return result;
 }
 
 typedef v3 p3;
 typedef v3 Color;
 
+// NOTE(mevex): Four vectors as a structure of arrays, lane i of x, y and z is the i-th vector. The
+// operations are the ones of v3 done lane by lane in the same order, so every lane gives the bits v3
+// would give for its vector.
+class v3x4
+{
+    public:
+
+    wide_f32 x, y, z;
+
+    v3x4() : x(WideFloatSetAll(0.0f)), y(x), z(x) {}
+    v3x4(wide_f32 X, wide_f32 Y, wide_f32 Z) : x(X), y(Y), z(Z) {}
+
+    // NOTE(mevex): The same vector in every lane
+    explicit v3x4(const v3& v) : x(WideFloatSetAll(v.x)), y(WideFloatSetAll(v.y)), z(WideFloatSetAll(v.z)) {}
+
+    inline shared_function v3x4 Gather(const v3& a, const v3& b, const v3& c, const v3& d)
+    {
+        wide_f32 x = a.packedArray, y = b.packedArray, z = c.packedArray, w = d.packedArray;
+        WideFloatTranspose(x, y, z, w);
+        v3x4 result(x, y, z);
+        return result;
+    }
+
+    inline v3 Lane(u32 i) const
+    {
+        v3 result(ExtractFloat(x, i), ExtractFloat(y, i), ExtractFloat(z, i));
+        return result;
+    }
+};
+
+inline v3x4 operator+ (const v3x4& v, const v3x4& w)
+{
+    v3x4 result(WideFloatAdd(v.x, w.x), WideFloatAdd(v.y, w.y), WideFloatAdd(v.z, w.z));
+    return result;
+}
+
+inline v3x4 operator- (const v3x4& v, const v3x4& w)
+{
+    v3x4 result(WideFloatSubtract(v.x, w.x), WideFloatSubtract(v.y, w.y), WideFloatSubtract(v.z, w.z));
+    return result;
+}
+
+inline v3x4 operator- (const v3x4& v)
+{
+    v3x4 result(WideFloatNegate(v.x), WideFloatNegate(v.y), WideFloatNegate(v.z));
+    return result;
+}
+
+inline v3x4 operator* (const v3x4& v, wide_f32 t)
+{
+    v3x4 result(WideFloatMultiply(v.x, t), WideFloatMultiply(v.y, t), WideFloatMultiply(v.z, t));
+    return result;
+}
+
+inline v3x4 operator* (wide_f32 t, const v3x4& v)
+{
+    v3x4 result = v * t;
+    return result;
+}
+
+inline v3x4 operator* (const v3x4& v, const v3x4& w)
+{
+    v3x4 result(WideFloatMultiply(v.x, w.x), WideFloatMultiply(v.y, w.y), WideFloatMultiply(v.z, w.z));
+    return result;
+}
+
+inline wide_f32 Dot(const v3x4& v, const v3x4& w)
+{
+    wide_f32 result = WideFloatAdd(WideFloatAdd(WideFloatMultiply(v.x, w.x), WideFloatMultiply(v.y, w.y)), WideFloatMultiply(v.z, w.z));
+    return result;
+}
+
+inline v3x4 Cross(const v3x4& v, const v3x4& w)
+{
+    v3x4 result(WideFloatSubtract(WideFloatMultiply(v.y, w.z), WideFloatMultiply(v.z, w.y)),
+                WideFloatSubtract(WideFloatMultiply(v.z, w.x), WideFloatMultiply(v.x, w.z)),
+                WideFloatSubtract(WideFloatMultiply(v.x, w.y), WideFloatMultiply(v.y, w.x)));
+    return result;
+}
+
+inline v3x4 Unit(const v3x4& v)
+{
+    v3x4 result = v * WideFloatDivide(WideFloatSetAll(1.0f), WideFloatSqrt(Dot(v, v)));
+    return result;
+}
+
+inline v3x4 UnitFast(const v3x4& v)
+{
+    v3x4 result = v * WideFloatRSqrtFast(Dot(v, v));
+    return result;
+}
+
+// NOTE(mevex): v in the lanes where mask is set, w in the others
+inline v3x4 Select(wide_f32 mask, const v3x4& v, const v3x4& w)
+{
+    v3x4 result(WideFloatSelect(mask, v.x, w.x), WideFloatSelect(mask, v.y, w.y), WideFloatSelect(mask, v.z, w.z));
+    return result;
+}
+
+// NOTE(mevex): Eight vectors, like v3x4. One AVX register per component when the build has AVX.
+class v3x8
+{
+    public:
+
+    wide8_f32 x, y, z;
+
+    v3x8() : x(Wide8FloatSetAll(0.0f)), y(x), z(x) {}
+    v3x8(wide8_f32 X, wide8_f32 Y, wide8_f32 Z) : x(X), y(Y), z(Z) {}
+    explicit v3x8(const v3& v) : x(Wide8FloatSetAll(v.x)), y(Wide8FloatSetAll(v.y)), z(Wide8FloatSetAll(v.z)) {}
+
+    // NOTE(mevex): low in lanes 0 to 3, high in 4 to 7
+    v3x8(const v3x4& low, const v3x4& high)
+        : x(Wide8FloatCombine(low.x, high.x)), y(Wide8FloatCombine(low.y, high.y)), z(Wide8FloatCombine(low.z, high.z)) {}
+
+    inline shared_function v3x8 Gather(const v3 *v)
+    {
+        v3x8 result(v3x4::Gather(v[0], v[1], v[2], v[3]), v3x4::Gather(v[4], v[5], v[6], v[7]));
+        return result;
+    }
+
+    inline v3x4 Low() const
+    {
+        v3x4 result(Wide8FloatLow(x), Wide8FloatLow(y), Wide8FloatLow(z));
+        return result;
+    }
+
+    inline v3x4 High() const
+    {
+        v3x4 result(Wide8FloatHigh(x), Wide8FloatHigh(y), Wide8FloatHigh(z));
+        return result;
+    }
+
+    inline v3 Lane(u32 i) const
+    {
+        v3 result = (i < 4) ? Low().Lane(i) : High().Lane(i - 4);
+        return result;
+    }
+};
+
+inline v3x8 operator+ (const v3x8& v, const v3x8& w)
+{
+    v3x8 result(Wide8FloatAdd(v.x, w.x), Wide8FloatAdd(v.y, w.y), Wide8FloatAdd(v.z, w.z));
+    return result;
+}
+
+inline v3x8 operator- (const v3x8& v, const v3x8& w)
+{
+    v3x8 result(Wide8FloatSubtract(v.x, w.x), Wide8FloatSubtract(v.y, w.y), Wide8FloatSubtract(v.z, w.z));
+    return result;
+}
+
+inline v3x8 operator- (const v3x8& v)
+{
+    v3x8 result(Wide8FloatNegate(v.x), Wide8FloatNegate(v.y), Wide8FloatNegate(v.z));
+    return result;
+}
+
+inline v3x8 operator* (const v3x8& v, wide8_f32 t)
+{
+    v3x8 result(Wide8FloatMultiply(v.x, t), Wide8FloatMultiply(v.y, t), Wide8FloatMultiply(v.z, t));
+    return result;
+}
+
+inline v3x8 operator* (wide8_f32 t, const v3x8& v)
+{
+    v3x8 result = v * t;
+    return result;
+}
+
+inline v3x8 operator* (const v3x8& v, const v3x8& w)
+{
+    v3x8 result(Wide8FloatMultiply(v.x, w.x), Wide8FloatMultiply(v.y, w.y), Wide8FloatMultiply(v.z, w.z));
+    return result;
+}
+
+inline wide8_f32 Dot(const v3x8& v, const v3x8& w)
+{
+    wide8_f32 result = Wide8FloatAdd(Wide8FloatAdd(Wide8FloatMultiply(v.x, w.x), Wide8FloatMultiply(v.y, w.y)), Wide8FloatMultiply(v.z, w.z));
+    return result;
+}
+
+inline v3x8 Cross(const v3x8& v, const v3x8& w)
+{
+    v3x8 result(Wide8FloatSubtract(Wide8FloatMultiply(v.y, w.z), Wide8FloatMultiply(v.z, w.y)),
+                Wide8FloatSubtract(Wide8FloatMultiply(v.z, w.x), Wide8FloatMultiply(v.x, w.z)),
+                Wide8FloatSubtract(Wide8FloatMultiply(v.x, w.y), Wide8FloatMultiply(v.y, w.x)));
+    return result;
+}
+
+inline v3x8 Unit(const v3x8& v)
+{
+    v3x8 result = v * Wide8FloatDivide(Wide8FloatSetAll(1.0f), Wide8FloatSqrt(Dot(v, v)));
+    return result;
+}
+
+inline v3x8 UnitFast(const v3x8& v)
+{
+    // NOTE(mevex): Same Newton step as WideFloatRSqrtFast
+    wide8_f32 a = Dot(v, v);
+    wide8_f32 estimate = Wide8FloatRSqrtApprox(a);
+    wide8_f32 halfA = Wide8FloatMultiply(Wide8FloatSetAll(0.5f), a);
+    wide8_f32 scale = Wide8FloatMultiply(estimate, Wide8FloatSubtract(Wide8FloatSetAll(1.5f), Wide8FloatMultiply(halfA, Wide8FloatMultiply(estimate, estimate))));
+    v3x8 result = v * scale;
+    return result;
+}
+
+inline v3x8 Select(wide8_f32 mask, const v3x8& v, const v3x8& w)
+{
+    v3x8 result(Wide8FloatSelect(mask, v.x, w.x), Wide8FloatSelect(mask, v.y, w.y), Wide8FloatSelect(mask, v.z, w.z));
+    return result;
+}
+
 #endif //V3_H